@@ -33,7 +33,9 @@
 
 #include <WiFi.h>
 #include <ETH.h>
-#include <WebServer.h>
+#include <AsyncTCP.h>
+#include <AsyncUDP.h>
+#include <ESPAsyncWebServer.h>
 #include <WebSocketsServer.h>
 #include <ESPmDNS.h>
 #include <Update.h>
@@ -43,16 +45,34 @@
 #include <time.h>
 #include <FS.h>
 #include <SPIFFS.h>
+#include <Preferences.h>
 #include <HardwareSerial.h>
 #include <RCSwitch.h>
 #include <RTClib.h>
 #include <DNSServer.h>
 #include <PCF8574.h>  // Using Renzo Mischianti's library
 #include <esp_intr_alloc.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#if CONFIG_HEAP_TRACING_STANDALONE
+#include <esp_heap_trace.h>
+#endif
 // Add these includes at the top of the file with other includes
 #include <OneWire.h>
 #include <DallasTemperature.h>
 #include <DHT.h>
+#include "src/CommandDispatcher.h"
+#include "src/MqttClient.h"
+
+// Web UI source: 0 serves the files in SPIFFS (data/), 1 compiles them into
+// the firmware from web_assets.h, generated with
+// "python3 tools/build_web_assets.py --embed"
+#define WEB_ASSETS_EMBEDDED   0
+#if WEB_ASSETS_EMBEDDED
+#include "web_assets.h"
+#endif
 
 // I2C PCF8574 addresses
 #define PCF8574_INPUTS_1_8    0x22
@@ -70,6 +90,7 @@
 #define RF_TX_PIN             15
 #define RS485_TX_PIN          13
 #define RS485_RX_PIN          16
+#define RS485_DE_PIN          -1      // Driver enable on the UART's RTS; -1 for a self-switching transceiver
 #define ANALOG_PIN_1          36
 #define ANALOG_PIN_2          34
 #define ANALOG_PIN_3          35
@@ -124,6 +145,18 @@
 #define SENSOR_TYPE_DHT22    2  // DHT22/AM2302 temperature/humidity sensor
 #define SENSOR_TYPE_DS18B20  3  // DS18B20 temperature sensor
 
+// Sensor read health tracking
+#define SENSOR_BACKOFF_MAX_INTERVAL  60000  // Longest retry interval for a failing sensor (ms)
+#define SENSOR_STALE_FAILURES        3      // Consecutive failures before a reading is stale
+#define SENSOR_STALE_TIMEOUT         30000  // Age of last good reading before it is stale (ms)
+
+// Sensor threshold-crossing events for sensor-based schedules
+#define MAX_SENSOR_THRESHOLDS        (MAX_SCHEDULES * 2) // An Equal schedule watches both edges of its band
+#define SENSOR_MEASURE_TEMPERATURE   0      // Threshold watches temperature
+#define SENSOR_MEASURE_HUMIDITY      1      // Threshold watches humidity
+#define SENSOR_HYSTERESIS_TEMPERATURE 0.5f  // Temperature hysteresis (C)
+#define SENSOR_HYSTERESIS_HUMIDITY    2.0f  // Humidity hysteresis (%)
+
 // Default WiFi credentials (can be changed via web interface)
 const char* default_ssid = "KC868-A16";
 const char* default_password = "12345678";
@@ -140,12 +173,540 @@ PCF8574 outputIC4(PCF8574_OUTPUTS_1_8);  // Digital Outputs 1-8
 // DNS server
 DNSServer dnsServer;
 
-// Web server port
-WebServer server(80);
+// Web server: AsyncWebServer accepts and parses connections in the AsyncTCP
+// task and streams the static files itself, so page loads never run on loop().
+// API requests are queued; loop() runs their handlers through 'server', which
+// keeps the WebServer-style calls (arg, hasArg, send ...) the handlers use and
+// answers the queued request. HTTP STATUS reports the device-side counters;
+// tools/http_load.py measures request rate and latency from a host.
+#define HTTP_QUEUE_DEPTH        8     // API requests waiting for loop()
+#define HTTP_MAX_ROUTES         32    // Entries of apiRoutes (checked at compile time)
+#define HTTP_MAX_BODY           8192  // Largest accepted request body (bytes)
+#define HTTP_MAX_HEADERS        4     // Extra headers per response (sendHeader)
+#define HTTP_REQUESTS_PER_LOOP  2     // API requests handled per loop() pass
+#define HTTP_LATENCY_SAMPLES    128   // Recent request latencies kept for HTTP STATUS
+#define HTTP_RESPONSE_SLOTS     2     // send_P bodies held until they are sent
+#define HTTP_RESPONSE_SLOT_SIZE 4096  // Largest body a slot holds (JSON_OUT_BUFFER_SIZE)
+AsyncWebServer httpServer(80);
+
+// Static web assets, registered at boot from the SPIFFS listing or, with
+// WEB_ASSETS_EMBEDDED, from the table compiled into the firmware.
+// tools/build_web_assets.py packs data/ into gzipped files; a .gz file is
+// served in place of the plain one with Content-Encoding: gzip. Content-hashed
+// names (script.<hash>.js) never change and are cached for a year, everything
+// else (index.html) is revalidated by ETag and answered with 304. Only the
+// pipeline's own files are served - the firmware keeps private state files
+// (/mqtt.json, /udp.json, ...) on the same SPIFFS root.
+#define WEB_MAX_ASSETS          16
+#define WEB_HASH_LENGTH         8
+#define WEB_IMMUTABLE_CACHE     "public, max-age=31536000, immutable"
+#define WEB_REVALIDATE_CACHE    "no-cache"
+struct WebAsset {
+    String url;                     // Request path
+    String file;                    // SPIFFS path, ".gz" when precompressed
+    const uint8_t* data;            // Embedded gzip data in flash (NULL for SPIFFS files)
+    size_t length;
+    const char* contentType;
+    bool gzipped;
+    bool immutable;                 // Content-hashed name
+    String etag;
+};
+WebAsset webAssets[WEB_MAX_ASSETS];
+const char* const webAssetNames[] = { "/index.html", "/script.js", "/style.css" };
+uint8_t webAssetCount = 0;
+unsigned long webAssetSentCount = 0;
+unsigned long webAssetNotModifiedCount = 0;
+
+// Config revisions: every save bumps its domain and the GET endpoints send the
+// revision as their ETag, so a UI that already holds the data gets a 304
+// before any JSON is built. The boot id keeps ETags from before a restart
+// (when the counters start over) from ever matching.
+#define CONFIG_DOMAIN_SCHEDULES      0
+#define CONFIG_DOMAIN_TRIGGERS       1
+#define CONFIG_DOMAIN_CONFIG         2  // Device name, debug mode, addressing, SSID
+#define CONFIG_DOMAIN_INTERRUPTS     3
+#define CONFIG_DOMAIN_COMMUNICATION  4
+#define CONFIG_DOMAIN_MQTT           5
+#define CONFIG_DOMAIN_UDP            6
+#define CONFIG_DOMAIN_COUNT          7
+uint32_t configRevisions[CONFIG_DOMAIN_COUNT] = { 0 };
+uint32_t configBootId = 0;
+unsigned long configNotModifiedCount = 0;
+
+typedef void (*ApiHandler)();
+
+struct ApiRoute {
+    const char* uri;
+    WebRequestMethodComposite method;
+    ApiHandler handler;
+};
+
+struct QueuedRequest {
+    AsyncWebServerRequest* request;
+    bool abandoned;                 // Client disconnected - the request object is gone
+    unsigned long queuedAt;         // micros() when the request was complete
+};
+
+// Body of a send_P response: the caller's buffer is reused by the next
+// loop() pass, so the AsyncTCP task reads a copy from here until the last
+// byte is out or the client goes away
+struct HttpResponseSlot {
+    AsyncWebServerRequest* owner;   // NULL when free
+    size_t length;
+    char body[HTTP_RESPONSE_SLOT_SIZE];
+};
+
+class DeferredApiServer {
+public:
+    DeferredApiServer();
+
+    // Routes are matched exactly on path and method, in loop() context
+    void on(const char* uri, WebRequestMethodComposite method, ApiHandler handler);
+    void onNotFound(ApiHandler handler) { _notFoundHandler = handler; }
+    void begin();
+
+    // Run queued API requests - call from loop()
+    void handleClient();
+
+    // AsyncTCP task side: request bodies, complete requests, disconnects
+    void collectBody(AsyncWebServerRequest* request, uint8_t* data, size_t length, size_t index, size_t total);
+    void enqueue(AsyncWebServerRequest* request);
+    void abandon(AsyncWebServerRequest* request);
+
+    // WebServer-style access to the request being handled; the body of a
+    // JSON request is the "plain" argument
+    bool hasArg(const String& name);
+    String arg(const String& name);
+    String arg(int i);
+    String argName(int i);
+    int args();
+    String uri();
+    String hostHeader();
+    bool hasHeader(const String& name);
+    String header(const String& name);
+    WebRequestMethodComposite method();
+    void sendHeader(const String& name, const String& value, bool first = false);
+    void send(int code, const char* contentType, const String& content);
+    void send_P(int code, const char* contentType, const char* content, size_t length);
+    void sendChunked(int code, const char* contentType, AwsResponseFiller filler);
+
+    // Statistics
+    unsigned long getHandledCount() { return _handledCount; }
+    unsigned long getRejectedCount() { return _rejectedCount; }
+    unsigned long getAbandonedCount() { return _abandonedCount; }
+    unsigned long getCopiedCount() { return _copiedCount; }
+    uint8_t getMaxQueueDepth() { return _maxDepth; }
+    unsigned long getMaxHandlerTime() { return _maxHandlerTime; }
+    float getRequestRate() { return _requestRate; }
+    unsigned long getLatencyPercentile(uint8_t percent);  // Over the recent samples (us)
+
+private:
+    ApiRoute _routes[HTTP_MAX_ROUTES];
+    uint8_t _routeCount;
+    ApiHandler _notFoundHandler;
+
+    // Ring buffer of complete requests, filled by the AsyncTCP task
+    QueuedRequest _queue[HTTP_QUEUE_DEPTH];
+    uint8_t _head;
+    uint8_t _count;
+
+    // Held around every use of _current, never across a whole handler: a
+    // disconnect clears _current under it before the AsyncTCP task frees the
+    // request, and waits for at most one accessor call
+    SemaphoreHandle_t _mutex;
+    AsyncWebServerRequest* _current;
+    bool _responded;
+    HttpResponseSlot _slots[HTTP_RESPONSE_SLOTS];
+    String _headerNames[HTTP_MAX_HEADERS];
+    String _headerValues[HTTP_MAX_HEADERS];
+    uint8_t _headerCount;
+
+    // Statistics
+    unsigned long _handledCount;
+    unsigned long _rejectedCount;
+    unsigned long _abandonedCount;
+    unsigned long _copiedCount;     // send_P bodies copied to the heap, every slot busy
+    uint8_t _maxDepth;
+    unsigned long _maxHandlerTime;
+    unsigned long _latencies[HTTP_LATENCY_SAMPLES];
+    uint8_t _latencyIndex;
+    uint8_t _latencyCount;
+    unsigned long _rateWindowStart;
+    unsigned long _rateWindowCount;
+    float _requestRate;
+
+    ApiHandler findHandler(const String& url, WebRequestMethodComposite method);
+    bool lockCurrent();
+    void sendResponse(AsyncWebServerResponse* response);
+    void reject(AsyncWebServerRequest* request, int code, const char* message);
+};
+DeferredApiServer server;
 
 // WebSocket server
 WebSocketsServer webSocket = WebSocketsServer(81);
-bool webSocketClients[WEBSOCKETS_SERVER_CLIENT_MAX];
+// Binary WebSocket format, chosen per client with
+// {"command":"subscribe","format":"binary"}; everything is little-endian.
+// State frame (WS_BIN_STATE_SIZE bytes):
+//   0 type  1 version  2 seq(u32)  6 outputs mask(u16)  8 inputs mask(u16)
+//   10 HT1-HT3 mask  11 link flags (bit0 WiFi, bit1 Ethernet)
+//   12 analog 1-4: raw(u16) + millivolts(u16) each
+//   28 HT sensors 1-3: type, flags (bit0 stale), failures, temp x10 (i16), humidity x10 (u16)
+//   49 local time: year-2000, month, day, hour, minute, second
+//   55 uptime s(u32)  59 free heap(u32)  63 RSSI(i8)  64 I2C errors(u16)
+#define WS_FORMAT_JSON         0
+#define WS_FORMAT_BINARY       1
+#define WS_BIN_VERSION         1
+#define WS_BIN_STATE           0x01  // Device -> client: full state frame
+#define WS_BIN_ERROR           0x7F  // Device -> client: [type, error code]
+#define WS_BIN_CMD_SET_RELAY   0x10  // Client -> device: [type, relay, state]
+#define WS_BIN_CMD_SET_MASK    0x11  // Client -> device: [type, mask(u16), states(u16)]
+#define WS_BIN_CMD_SNAPSHOT    0x12  // Client -> device: [type]
+#define WS_BIN_ERR_FRAME       1     // Malformed or unknown frame
+#define WS_BIN_ERR_RELAY       2     // Relay index out of range
+#define WS_BIN_ERR_WRITE       3     // Output expander write failed
+#define WS_BIN_STATE_SIZE      66
+
+// Delta stream: changes are detected once against wsLastSent, then merged into
+// each subscribed client's pending set; a client gets one update per interval
+// carrying the latest values of everything pending, with its own sequence number
+#define WS_SYSTEM_REFRESH_INTERVAL 5000  // Uptime, heap and RSSI refresh (ms)
+struct BroadcastState {
+    bool outputs[16];
+    bool inputs[16];
+    bool directInputs[3];
+    int analogValues[4];
+    uint8_t htSensorType[3];
+    float htTemperature[3];
+    float htHumidity[3];
+    bool htStale[3];
+    uint8_t htFailures[3];
+    bool wifiConnected;
+    bool ethConnected;
+    unsigned long i2cErrors;
+    String lastError;
+};
+BroadcastState wsLastSent;
+unsigned long wsLastSystemRefresh = 0;
+
+// Topics a client can subscribe to
+#define WS_TOPIC_OUTPUTS   0x01
+#define WS_TOPIC_INPUTS    0x02  // Digital inputs and HT1-HT3
+#define WS_TOPIC_ANALOG    0x04
+#define WS_TOPIC_SENSORS   0x08
+#define WS_TOPIC_SYSTEM    0x10  // Network links, uptime, heap, errors
+#define WS_TOPIC_ALL       0x1F
+
+// System change flags
+#define WS_CHANGE_LINK     0x01
+#define WS_CHANGE_HEALTH   0x02
+
+// Per-client flow control: the pending set is the client's whole send queue
+// (one merged state, so it can never grow), and a client whose sends stall
+// gets its interval stretched instead of holding up the loop
+#define WS_SLOW_SEND_TIME      50     // A send taking longer than this means the link is backed up (ms)
+#define WS_MAX_CLIENT_INTERVAL 5000   // Longest interval a slow client is backed off to (ms)
+#define WS_MAX_SEND_FAILURES   5      // Consecutive failed sends before the client is dropped
+
+// Elements changed since a client's last update (bit per element)
+struct PendingChanges {
+    uint16_t outputs;
+    uint16_t inputs;
+    uint8_t directInputs;
+    uint8_t analog;
+    uint8_t sensors;
+    uint8_t system;
+};
+
+struct WebSocketClientState {
+    bool subscribed;
+    uint8_t format;                 // WS_FORMAT_JSON or WS_FORMAT_BINARY
+    uint8_t topics;                 // WS_TOPIC_* mask
+    uint16_t requestedInterval;     // From the client's requested rate (ms)
+    uint16_t interval;              // Current interval, stretched while the link is slow (ms)
+    unsigned long lastSendTime;
+    uint32_t sequence;              // Sequence number of the last message sent to this client
+    PendingChanges pending;
+    uint8_t sendFailures;
+    unsigned long mergedUpdates;    // Changes folded into an update that was still pending
+    unsigned long slowSends;
+};
+WebSocketClientState webSocketClients[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+// Broadcast coalescing: producers only mark the state dirty with
+// requestBroadcast(), loop() sends at most wsMaxUpdateRate updates per second
+#define WS_BROADCAST_MAX_RATE  10    // Default maximum broadcasts per second
+#define WS_BROADCAST_HOLDOFF   10    // Delay after the first change so a burst goes out as one update (ms)
+#define WS_BROADCAST_IDLE_TICK 1000  // Broadcast check when nothing was marked dirty (ms)
+volatile bool broadcastDirty = false;
+unsigned long broadcastDirtySince = 0;
+unsigned long lastBroadcastTime = 0;
+uint8_t wsMaxUpdateRate = WS_BROADCAST_MAX_RATE;
+unsigned long broadcastRequestCount = 0;
+unsigned long broadcastSentCount = 0;
+
+// Status serializer: JSON is written straight into one preallocated buffer, so
+// building a broadcast or a status response never touches the heap. The buffer
+// keeps WEBSOCKETS_MAX_HEADER_SIZE spare bytes in front of the JSON where the
+// WebSocket library writes the frame header, instead of allocating a copy with
+// header and payload together. Everything that serializes runs from loop(), so
+// one buffer serves the web server, WebSocket events and broadcasts.
+#define JSON_OUT_BUFFER_SIZE   4096
+#define JSON_OUT_PAYLOAD       (jsonOutBuffer + WEBSOCKETS_MAX_HEADER_SIZE)
+#define WS_BENCH_ITERATIONS    100   // Serializations per WS BENCH run
+#define WS_BENCH_TRACE_RECORDS 32    // Heap trace records (only with CONFIG_HEAP_TRACING_STANDALONE)
+char jsonOutBuffer[WEBSOCKETS_MAX_HEADER_SIZE + JSON_OUT_BUFFER_SIZE];
+uint8_t wsBinaryFrame[WEBSOCKETS_MAX_HEADER_SIZE + WS_BIN_STATE_SIZE];
+unsigned long jsonOverflowCount = 0;
+unsigned long jsonStreamOverflowCount = 0;  // Collection elements cut off (AsyncTCP task only)
+#if CONFIG_HEAP_TRACING_STANDALONE
+heap_trace_record_t benchTraceRecords[WS_BENCH_TRACE_RECORDS];
+#endif
+
+// Appends JSON to a fixed buffer. Numbers are formatted with integer math
+// (printf and dtoa allocate for floats); output that does not fit sets
+// 'overflow' and is never sent.
+struct JsonWriter {
+    char* buffer;
+    size_t size;
+    size_t length;
+    bool overflow;
+    bool needComma;
+
+    JsonWriter(char* out, size_t outSize) : buffer(out), size(outSize), length(0), overflow(false), needComma(false) {
+        buffer[0] = '\0';
+    }
+
+    void put(char c) {
+        if (length + 1 < size) {
+            buffer[length++] = c;
+            buffer[length] = '\0';
+        }
+        else {
+            overflow = true;
+        }
+    }
+
+    void put(const char* text) {
+        while (*text) put(*text++);
+    }
+
+    void putUnsigned(unsigned long value) {
+        char digits[10];
+        uint8_t count = 0;
+        do {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while (value > 0);
+        while (count > 0) put(digits[--count]);
+    }
+
+    void putString(const char* text) {
+        put('"');
+        for (; *text; text++) {
+            if (*text == '"' || *text == '\\') put('\\');
+            // Control characters are not allowed inside a JSON string
+            put((uint8_t)*text < 0x20 ? ' ' : *text);
+        }
+        put('"');
+    }
+
+    // Member name inside an object (NULL inside an array), after a separator
+    void key(const char* name) {
+        if (needComma) put(',');
+        needComma = false;
+        if (name != NULL) {
+            putString(name);
+            put(':');
+        }
+    }
+
+    void beginObject(const char* name = NULL) { key(name); put('{'); }
+    void endObject() { put('}'); needComma = true; }
+    void beginArray(const char* name = NULL) { key(name); put('['); }
+    void endArray() { put(']'); needComma = true; }
+
+    void addString(const char* name, const char* value) {
+        key(name);
+        putString(value);
+        needComma = true;
+    }
+
+    void addBool(const char* name, bool value) {
+        key(name);
+        put(value ? "true" : "false");
+        needComma = true;
+    }
+
+    void addUInt(const char* name, unsigned long value) {
+        key(name);
+        putUnsigned(value);
+        needComma = true;
+    }
+
+    void addInt(const char* name, long value) {
+        key(name);
+        if (value < 0) {
+            put('-');
+            putUnsigned(0UL - (unsigned long)value);
+        }
+        else {
+            putUnsigned(value);
+        }
+        needComma = true;
+    }
+
+    // Fixed number of decimals; NaN (a failed sensor read) becomes null
+    void addFloat(const char* name, float value, uint8_t decimals) {
+        unsigned long scale = 1;
+        for (uint8_t d = 0; d < decimals; d++) scale *= 10;
+
+        key(name);
+        if (isnan(value) || isinf(value) || fabsf(value) * scale >= 4.0e9f) {
+            put("null");
+        }
+        else {
+            if (value < 0) {
+                put('-');
+                value = -value;
+            }
+            unsigned long scaled = (unsigned long)(value * scale + 0.5f);
+            putUnsigned(scaled / scale);
+            if (decimals > 0) {
+                put('.');
+                for (unsigned long digit = scale / 10; digit > 0; digit /= 10) {
+                    put('0' + (scaled % scale / digit) % 10);
+                }
+            }
+        }
+        needComma = true;
+    }
+
+    void addIP(const char* name, const IPAddress& ip) {
+        key(name);
+        put('"');
+        for (int i = 0; i < 4; i++) {
+            if (i > 0) put('.');
+            putUnsigned(ip[i]);
+        }
+        put('"');
+        needComma = true;
+    }
+
+    // Same format as WiFi.macAddress(): AA:BB:CC:DD:EE:FF
+    void addMac(const char* name, const uint8_t* mac) {
+        const char* hex = "0123456789ABCDEF";
+        key(name);
+        put('"');
+        for (int i = 0; i < 6; i++) {
+            if (i > 0) put(':');
+            put(hex[mac[i] >> 4]);
+            put(hex[mac[i] & 0x0F]);
+        }
+        put('"');
+        needComma = true;
+    }
+};
+
+// Collections (schedules, triggers, interrupts) are streamed with chunked
+// transfer encoding one element at a time, so a response takes the same
+// memory whatever the number of entries; ?offset= and ?limit= select a page.
+// The AsyncTCP task serializes each element under configArraysMutex, which
+// loop() holds while it edits schedules[], analogTriggers[] or
+// interruptConfigs[], so an element is never read half-updated
+#define JSON_STREAM_ELEMENT_SIZE  512  // Largest single collection element
+
+SemaphoreHandle_t configArraysMutex = NULL;    // Created first thing in setup()
+
+void lockConfigArrays() {
+    xSemaphoreTake(configArraysMutex, portMAX_DELAY);
+}
+
+void unlockConfigArrays() {
+    xSemaphoreGive(configArraysMutex);
+}
+
+#define JSON_STREAM_HEADER     0
+#define JSON_STREAM_ELEMENTS   1
+#define JSON_STREAM_FOOTER     2
+#define JSON_STREAM_DONE       3
+
+// Appends collection entry 'index' as one JSON object
+typedef void (*JsonElementWriter)(JsonWriter& json, int index);
+
+// One streamed collection response. The header, each element of the page
+// and the footer are staged in turn and copied out as the TCP stack asks
+// for data (AsyncTCP task)
+struct JsonCollectionStream {
+    const char* key;
+    JsonElementWriter writer;
+    int total;
+    int offset;
+    int end;
+    int next;
+    uint8_t phase;
+    char staged[JSON_STREAM_ELEMENT_SIZE];
+    size_t stagedLength;
+    size_t stagedSent;
+
+    // Stage the next piece; false once everything has been sent
+    bool stageNext() {
+        JsonWriter json(staged, sizeof(staged));
+
+        if (phase == JSON_STREAM_HEADER) {
+            json.beginObject();
+            json.addUInt("total", total);
+            json.addUInt("offset", offset);
+            json.addUInt("count", end - offset);
+            json.beginArray(key);
+            phase = (end > offset) ? JSON_STREAM_ELEMENTS : JSON_STREAM_FOOTER;
+        }
+        else if (phase == JSON_STREAM_ELEMENTS) {
+            if (next > offset) json.put(',');
+            size_t start = json.length;
+
+            // A consistent snapshot of this one element
+            lockConfigArrays();
+            writer(json, next++);
+            unlockConfigArrays();
+
+            if (json.overflow) {
+                // Never send a cut-off object - the page stays valid JSON
+                jsonStreamOverflowCount++;
+                json.length = start;
+                json.buffer[start] = '\0';
+                json.overflow = false;
+                json.put("null");
+            }
+            if (next >= end) phase = JSON_STREAM_FOOTER;
+        }
+        else if (phase == JSON_STREAM_FOOTER) {
+            json.put("]}");
+            phase = JSON_STREAM_DONE;
+        }
+        else {
+            return false;
+        }
+
+        stagedLength = json.length;
+        stagedSent = 0;
+        return true;
+    }
+
+    // Chunked response filler: as much as fits, 0 at the end
+    size_t fill(uint8_t* buffer, size_t maxLen) {
+        size_t written = 0;
+        while (written < maxLen) {
+            if (stagedSent == stagedLength && !stageNext()) {
+                break;
+            }
+            size_t chunk = std::min(maxLen - written, stagedLength - stagedSent);
+            memcpy(buffer + written, staged + stagedSent, chunk);
+            written += chunk;
+            stagedSent += chunk;
+        }
+        return written;
+    }
+};
 
 // RS485 serial
 HardwareSerial rs485(1);
@@ -248,6 +809,500 @@ int rs485DeviceAddress = 1;            // Device address
 bool rs485FlowControl = false;         // Flow control
 bool rs485NightMode = false;           // Night communication settings
 
+// Text command lines from USB and RS485. Bytes are taken from the UART as they
+// arrive and collected in a fixed buffer per port, so a slow sender never
+// stalls loop() and reading a command allocates nothing. Reading stops at the
+// end of a line; later lines wait in the UART driver's ring buffer.
+#define COMMAND_LINE_SIZE     128     // Longest command line, longer ones are discarded
+#define COMMAND_READ_BUDGET   64      // Bytes taken from a port per loop() pass
+#define COMMAND_RESPONSE_SIZE 3072    // Response buffer for the web API and WebSocket console
+
+struct CommandLineReader {
+    char line[COMMAND_LINE_SIZE];     // Text line, or binary frame while binary is set
+    uint16_t length;                  // Bytes of the line collected so far
+    bool overflow;                    // Line is too long, skip to its end
+    bool binary;                      // Collecting a binary frame
+    uint16_t frameLength;             // Size of the binary frame, once its length byte is in
+    unsigned long lastByteAt;         // millis() of the last frame byte
+    unsigned long lines;              // Complete lines received
+    unsigned long overflows;          // Lines discarded for length
+    unsigned long frames;             // Binary frames received
+    unsigned long frameErrors;        // Binary frames dropped (CRC, length, cut off)
+};
+
+// readCommandPort() results
+#define COMMAND_PORT_IDLE     0
+#define COMMAND_PORT_LINE     1       // Text line in reader.line
+#define COMMAND_PORT_FRAME    2       // Binary frame in reader.line, reader.frameLength bytes
+
+// Binary control protocol for host software, on the same ports as the text
+// commands. A frame starts with BINARY_FRAME_START where a text line would
+// begin, so both can be mixed on one connection:
+//   0       0xA5
+//   1       Body length: id + opcode + payload (2-122)
+//   2       Request id, echoed in the response so requests can be pipelined
+//   3       Opcode
+//   4...    Payload, multi-byte values little-endian
+//   last 2  CRC-16/MODBUS of bytes 1 to the end of the payload, low byte first
+// The response carries the request's id and opcode; its payload starts with
+// a status byte. Frames with a bad CRC or length are dropped unanswered.
+// Frames that arrive together are handled in one pass: their relay changes
+// share a single expander write, and the responses go out after it in one
+// write to the port.
+#define BINARY_FRAME_START        0xA5
+#define BINARY_MAX_BODY           (COMMAND_LINE_SIZE - 6)
+#define BINARY_FRAME_GAP          50      // A partial frame is dropped after this silence (ms)
+#define BINARY_FRAMES_PER_PASS    16      // Frames handled per port per loop() pass
+#define BINARY_MAX_RESPONSE       23      // Start, length, id, opcode, status, 16 data bytes, CRC
+#define BINARY_PROTOCOL_VERSION   1
+
+#define BINARY_OP_PING            0x01    // -> u8 protocol version
+#define BINARY_OP_SET_RELAYS      0x10    // u16 relays to turn on -> u16 relay mask
+#define BINARY_OP_CLEAR_RELAYS    0x11    // u16 relays to turn off -> u16 relay mask
+#define BINARY_OP_TOGGLE_RELAYS   0x12    // u16 relays to toggle -> u16 relay mask
+#define BINARY_OP_WRITE_RELAYS    0x13    // u16 state of every relay -> u16 relay mask
+#define BINARY_OP_READ_RELAYS     0x14    // -> u16 relay mask
+#define BINARY_OP_READ_INPUTS     0x20    // -> u16 inputs 1-16, u8 HT1-HT3
+#define BINARY_OP_READ_ANALOG     0x21    // -> 4 x u16 raw (0-4095), 4 x u16 mV
+#define BINARY_OP_BATCH           0x30    // n x (relay opcode 0x10-0x13, u16), applied together -> u16 relay mask
+
+#define BINARY_STATUS_OK          0
+#define BINARY_STATUS_BAD_OPCODE  1
+#define BINARY_STATUS_BAD_LENGTH  2
+#define BINARY_STATUS_IO_ERROR    3       // Relay expander write failed (the mask is still returned)
+
+// Responses collected during one pass over a port
+struct BinaryPass {
+    uint8_t responses[BINARY_FRAMES_PER_PASS * BINARY_MAX_RESPONSE];
+    uint16_t length;
+    uint16_t relayResponses[BINARY_FRAMES_PER_PASS];  // Offsets of responses that changed relays
+    uint8_t relayResponseCount;
+    bool relaysChanged;                                // outputStates not yet written
+};
+BinaryPass binaryPass = {};
+
+// Command channels. Every enabled transport is served on each loop() pass
+// through the one dispatcher below, so a command on RS485 no longer waits for
+// USB to be deselected. The serial ports are event driven: the UART driver's
+// receive event sets dataPending, and a quiet channel costs loop() a flag
+// test. The network channel counts commands from /api/debug and the WebSocket
+// console, which are always available; the MQTT and UDP channels count
+// commands from the broker and the UDP control port while those are enabled.
+#define COMM_CHANNEL_USB      0
+#define COMM_CHANNEL_RS485    1
+#define COMM_CHANNEL_NETWORK  2
+#define COMM_CHANNEL_MQTT     3
+#define COMM_CHANNEL_UDP      4
+#define COMM_CHANNEL_COUNT    5
+
+struct CommChannel {
+    const char* name;
+    bool enabled;                     // Served by loop(); USB and RS485 can be switched off
+    volatile bool dataPending;        // Set from the UART event task, cleared by loop()
+    CommandLineReader reader;         // Line and frame assembly (serial channels)
+    unsigned long commands;           // Text commands and binary frames handled
+    unsigned long rejected;           // Unknown commands and bad arguments
+};
+
+// dataPending starts set so bytes received before the first event are read
+CommChannel commChannels[COMM_CHANNEL_COUNT] = {
+    { "usb", true, true },
+    { "rs485", true, true },
+    { "network", true, false },
+    { "mqtt", false, false },
+    { "udp", false, false },
+};
+
+// Every transport (USB, RS485, /api/debug, WebSocket) runs commands through one
+// dispatcher; the table is defined with the command handlers
+extern const CommandEntry commandTable[];
+extern const uint8_t commandTableSize;
+CommandDispatcher commandDispatcher(commandTable, commandTableSize);
+char commandResponse[COMMAND_RESPONSE_SIZE];
+
+// RS485 runs in the UART's hardware half-duplex mode: the driver raises DE
+// (RTS) for each transmission and drops it from the transmit-done interrupt
+// once the last stop bit has left the shift register, and the receiver
+// ignores the echo of our own transmission. Reception is event driven - the
+// UART driver's receive events reach the HardwareSerial event task, which
+// wakes the RS485 comm task (Modbus RTU) or flags loop() (text and binary
+// commands), so nothing polls the port while the bus is quiet.
+#define RS485_TASK_STACK      4096
+#define RS485_TASK_PRIORITY   3       // Above loop() so bus turnaround does not wait for it
+#define RS485_RX_TIMEOUT      2       // Command mode: receive event after this many idle characters
+
+TaskHandle_t rs485TaskHandle = NULL;
+
+// Modbus RTU slave on RS485, active while rs485Protocol is "Modbus RTU".
+// Frames are delimited by line silence: the UART receive timeout fires once
+// the line has been idle for t1.5 and hands the bytes over, a frame is
+// complete when the line then stays quiet up to t3.5, and a frame with a
+// gap between t1.5 and t3.5 inside it is dropped as the spec requires.
+// The comm task completes frames at t3.5 and answers reads from the
+// register image at once; writes are handed to loop(), which owns the
+// relays and the settings.
+// Register map (0-based protocol addresses):
+//   Coils              0-15   Relays 1-16
+//   Discrete inputs    0-15   Inputs 1-16         16-18  HT1-HT3
+//   Input registers    0-3    Analog raw (0-4095) 4-7    Analog mV
+//                      8-10   HT temperature x10 (signed)
+//                      11-13  HT humidity x10
+//                      14     Inputs mask         15     HT inputs mask
+//                      16-17  Uptime s (high word first)
+//                      18     Free heap (KB)      19     I2C errors
+//   Holding registers  0      Relay mask (a write sets all 16 relays)
+//                      1      Slave address (1-247)
+//                      2      Baud rate / 100
+//                      3      Parity (0 none, 1 odd, 2 even)
+//                      4      Stop bits (1-2)
+//                      5      Debug mode (0/1)
+// Serial settings written over Modbus are saved and take effect once the
+// response has gone out.
+#define MODBUS_MAX_FRAME                256
+#define MODBUS_MAX_PDU                  253
+#define MODBUS_RX_BUFFER                1024  // UART driver receive buffer
+#define MODBUS_BROADCAST_ADDRESS        0
+
+#define MODBUS_FC_READ_COILS            0x01
+#define MODBUS_FC_READ_DISCRETE_INPUTS  0x02
+#define MODBUS_FC_READ_HOLDING          0x03
+#define MODBUS_FC_READ_INPUT            0x04
+#define MODBUS_FC_WRITE_COIL            0x05
+#define MODBUS_FC_WRITE_REGISTER        0x06
+#define MODBUS_FC_WRITE_COILS           0x0F
+#define MODBUS_FC_WRITE_REGISTERS       0x10
+
+#define MODBUS_EX_ILLEGAL_FUNCTION      0x01
+#define MODBUS_EX_ILLEGAL_ADDRESS       0x02
+#define MODBUS_EX_ILLEGAL_VALUE         0x03
+#define MODBUS_EX_DEVICE_FAILURE        0x04
+
+#define MODBUS_COIL_COUNT               16
+#define MODBUS_DISCRETE_INPUT_COUNT     19
+
+#define MODBUS_IR_ANALOG_RAW            0
+#define MODBUS_IR_ANALOG_MV             4
+#define MODBUS_IR_HT_TEMPERATURE        8
+#define MODBUS_IR_HT_HUMIDITY           11
+#define MODBUS_IR_INPUTS                14
+#define MODBUS_IR_HT_INPUTS             15
+#define MODBUS_IR_UPTIME                16
+#define MODBUS_IR_FREE_HEAP             18
+#define MODBUS_IR_I2C_ERRORS            19
+#define MODBUS_INPUT_REGISTER_COUNT     20
+
+#define MODBUS_HR_RELAY_MASK            0
+#define MODBUS_HR_ADDRESS               1
+#define MODBUS_HR_BAUD                  2
+#define MODBUS_HR_PARITY                3
+#define MODBUS_HR_STOP_BITS             4
+#define MODBUS_HR_DEBUG                 5
+#define MODBUS_HOLDING_REGISTER_COUNT   6
+
+// The receive side is filled by the UART event task, complete frames are
+// handled by the comm task (reads) or loop() (writes)
+struct ModbusRtuState {
+    bool active;
+
+    // Timers for the current line settings (us)
+    unsigned long charTime;
+    unsigned long t15;
+    unsigned long t35;
+    unsigned long quietAfterTimeout;  // Silence still needed after the receive timeout to reach t3.5
+
+    // Frame being received
+    uint8_t rx[MODBUS_MAX_FRAME];
+    uint16_t rxLength;
+    bool rxDiscard;                   // Gap or overflow - drop everything until the line goes quiet
+    unsigned long lastChunkAt;        // micros() of the last receive timeout
+
+    // Complete frame waiting to be answered
+    uint8_t frame[MODBUS_MAX_FRAME];
+    uint16_t frameLength;
+    bool frameReady;
+    volatile bool loopFrame;          // The frame is a write, loop() answers it
+    unsigned long frameEndAt;         // micros() of the receive timeout that ended the frame
+
+    // Settings written over Modbus, applied after the response
+    bool savePending;
+    bool reinitPending;
+
+    // Statistics
+    unsigned long requests;
+    unsigned long crcErrors;
+    unsigned long framingErrors;
+    unsigned long overruns;
+    unsigned long exceptions;
+    unsigned long otherAddress;
+    unsigned long broadcasts;
+    unsigned long maxServiceTime;     // us
+    unsigned long taskAnswers;        // Reads answered by the comm task
+    unsigned long maxTurnaround;      // Frame end to response queued (us)
+    unsigned long rateWindowStart;
+    unsigned long rateWindowCount;
+    float requestRate;
+};
+ModbusRtuState modbusRtu;
+portMUX_TYPE modbusRxMux = portMUX_INITIALIZER_UNLOCKED;
+
+// CRC-16/MODBUS (polynomial 0xA001 reflected, init 0xFFFF), one entry per byte value
+static const uint16_t modbusCrcTable[256] = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+// Register image shared by the RTU and TCP sides. loop() refreshes it from
+// the live state (and right after every Modbus write); reads on either side
+// are answered from it, so the AsyncTCP task never touches I2C or globals
+// that loop() is changing.
+#define MODBUS_IMAGE_INTERVAL      20   // Image refresh period (ms)
+
+struct ModbusImage {
+    uint16_t coils;                                           // Relay mask
+    uint32_t discreteInputs;                                  // Inputs (bits 0-15), HT1-HT3 (16-18)
+    uint16_t inputRegisters[MODBUS_INPUT_REGISTER_COUNT];
+    uint16_t holdingRegisters[MODBUS_HOLDING_REGISTER_COUNT];
+};
+ModbusImage modbusImage;
+portMUX_TYPE modbusImageMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long lastModbusImageRefresh = 0;
+
+// Modbus TCP server on port 502 (Ethernet or WiFi) with the register map
+// above. It is off by default - anyone on the LAN could switch relays - and
+// enabled with MODBUS TCP ON or the modbus_tcp communication config, which
+// keeps the setting with the rest of the comm config in EEPROM. Reads are
+// answered straight from the AsyncTCP task out of the register image;
+// writes are queued for loop(), which owns the relays and the settings,
+// and answered from there. A read that arrives while the same connection
+// still has requests queued goes into the queue behind them, so every
+// master gets its replies in request order and sees its own writes.
+// The unit id is not checked - the server is the device itself.
+#define MODBUS_TCP_PORT            502
+#define MODBUS_TCP_MAX_CLIENTS     4     // Concurrent masters
+#define MODBUS_TCP_QUEUE_DEPTH     8     // Requests waiting for loop()
+#define MODBUS_TCP_IDLE_TIMEOUT    120   // Drop masters silent for this long (s)
+#define MODBUS_MBAP_SIZE           7     // Transaction, protocol, length, unit id
+#define MODBUS_TCP_MAX_ADU         (MODBUS_MBAP_SIZE + MODBUS_MAX_PDU)
+#define MODBUS_EX_DEVICE_BUSY      0x06
+
+struct ModbusTcpClient {
+    AsyncClient* client;
+    uint32_t generation;            // Changes with every connection in this slot
+    uint8_t rx[MODBUS_TCP_MAX_ADU]; // Partial ADU carried over between packets
+    uint16_t rxLength;
+    uint8_t queued;                 // Requests in the queue, not yet answered (modbusTcpQueueMux)
+};
+
+struct ModbusTcpRequest {
+    uint8_t slot;
+    uint32_t generation;
+    unsigned long queuedAt;         // micros()
+    uint16_t length;
+    uint8_t adu[MODBUS_TCP_MAX_ADU];
+};
+
+AsyncServer modbusTcpServer(MODBUS_TCP_PORT);
+bool modbusTcpEnabled = false;
+bool modbusTcpListening = false;
+ModbusTcpClient modbusTcpClients[MODBUS_TCP_MAX_CLIENTS];
+ModbusTcpRequest modbusTcpQueue[MODBUS_TCP_QUEUE_DEPTH];
+uint8_t modbusTcpQueueHead = 0;
+uint8_t modbusTcpQueueCount = 0;
+portMUX_TYPE modbusTcpQueueMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Held around every write to a client and while a slot is torn down, so a
+// disconnect cannot free the client under loop()
+SemaphoreHandle_t modbusTcpMutex = NULL;
+
+// Statistics
+unsigned long modbusTcpConnections = 0;
+unsigned long modbusTcpRejected = 0;     // No free client slot
+unsigned long modbusTcpReads = 0;        // Answered in the AsyncTCP task
+unsigned long modbusTcpOrderedReads = 0; // Queued behind a write, answered from loop()
+unsigned long modbusTcpWrites = 0;       // Answered from loop()
+unsigned long modbusTcpBusy = 0;         // Queue full (busy reply, or dropped if it would reorder)
+unsigned long modbusTcpBadFrames = 0;
+unsigned long modbusTcpMaxWriteLatency = 0;  // Queue to response (us)
+unsigned long modbusTcpWriteLatencyTotal = 0;
+
+// MQTT client. Topics live under a base topic (default kc868-a16/<last three
+// MAC bytes>):
+//   relay/<1-16>/set   ON, OFF, TOGGLE (or 1, 0, TRUE, FALSE) switches a relay
+//   relays/set         Relay mask (decimal or 0x hex), applied in one write
+//   command            Text command line, answered on command/result
+//   relay/<n>, input/<n>, ht/<n>     ON / OFF, retained
+//   analog/<n>                       Volts, retained
+//   sensor/<n>/temperature|humidity  HT1-HT3 DHT / DS18B20 readings, retained
+//   state              Optional batch of every change in one JSON or binary message
+//   status             online / offline (the retained last will)
+// State is published when it changes: relays at once, everything else at most
+// every batchInterval, with analog and sensor values held back until they
+// move by more than their deadband. The client never blocks loop(); messages
+// are queued and leave in as few TCP segments as the window allows.
+#define MQTT_CONFIG_FILE       "/cfg/mqtt.json"  // SPIFFS (EEPROM map is full), never served
+#define MQTT_LEGACY_CONFIG_FILE "/mqtt.json"     // Older firmware, migrated on boot
+#define MQTT_SECRET_NAMESPACE  "mqtt"            // NVS: broker password, kept off SPIFFS
+#define MQTT_MAX_BASE_TOPIC    64
+#define MQTT_BATCH_NONE        0
+#define MQTT_BATCH_JSON        1     // writeStatusJson() delta, as the WebSocket sends it
+#define MQTT_BATCH_BINARY      2     // WS_BIN_STATE_SIZE state frame
+
+struct MqttConfig {
+    bool enabled;
+    char host[MQTT_MAX_HOST];
+    uint16_t port;
+    char clientId[MQTT_MAX_CREDENTIAL];      // Empty: derived from the base topic
+    char user[MQTT_MAX_CREDENTIAL];
+    char password[MQTT_MAX_CREDENTIAL];
+    char baseTopic[MQTT_MAX_BASE_TOPIC];     // Empty: kc868-a16/<mac>
+    uint16_t keepAlive;                      // Seconds
+    bool valueTopics;                        // One retained topic per element
+    uint8_t batchFormat;                     // MQTT_BATCH_*
+    uint16_t batchInterval;                  // Shortest time between input/analog/sensor publishes (ms)
+    uint16_t analogDeadband;                 // mV
+    float temperatureDeadband;               // Degrees C
+    float humidityDeadband;                  // % RH
+};
+MqttConfig mqttConfig = { false, "", 1883, "", "", "", "", 30, true, MQTT_BATCH_NONE, 100, 50, 0.2f, 1.0f };
+
+// Values as last published; changes are measured against these
+struct MqttPublishedState {
+    uint16_t outputs;
+    uint16_t inputs;
+    uint8_t directInputs;
+    long analogMillivolts[4];
+    float temperature[3];
+    float humidity[3];
+};
+MqttPublishedState mqttPublished;
+
+MqttClient mqtt;
+char mqttBase[MQTT_MAX_BASE_TOPIC];
+unsigned long mqttLastPublish = 0;
+uint32_t mqttSequence = 0;              // Batch messages published
+bool mqttFullPending = false;           // Whole state still to publish for this session
+
+// UDP control port for low-latency LAN control. Every datagram holds one
+// binary protocol frame (the BINARY_OP_* requests above, same layout and
+// CRC) and is answered with its response frame from the same port. Clients
+// retry an unanswered request with the same request id: each peer's last
+// UDP_REPLAY_DEPTH responses are kept, and a request matching one of them
+// by id and CRC is answered from there instead of being carried out again,
+// so even a TOGGLE is safe to retry. Datagrams are checked in the AsyncUDP
+// task and queued for loop(), which owns the relays; the requests of one
+// pass share a single expander write.
+// The optional beacon multicasts the WS_BIN_STATE_SIZE state frame, with its
+// sequence number, as soon as relays or inputs change and every
+// beaconInterval otherwise.
+#define UDP_CONFIG_FILE        "/udp.json"    // SPIFFS (EEPROM map is full)
+#define UDP_DEFAULT_PORT       5020
+#define UDP_DEFAULT_GROUP      "239.255.68.16"
+#define UDP_DEFAULT_BEACON_PORT 5021
+#define UDP_MAX_DATAGRAM       (BINARY_MAX_BODY + 4)
+#define UDP_QUEUE_DEPTH        8     // Requests waiting for loop()
+#define UDP_MAX_PEERS          4     // Clients with a replay cache
+#define UDP_REPLAY_DEPTH       8     // Responses kept per client (at least UDP_QUEUE_DEPTH)
+#define UDP_BEACON_MIN_GAP     5     // Shortest time between change beacons (ms)
+
+struct UdpConfig {
+    bool enabled;                    // Command port
+    uint16_t port;
+    bool beacon;
+    char group[16];                  // Beacon multicast address
+    uint16_t beaconPort;
+    uint16_t beaconInterval;         // Heartbeat when nothing changes (ms)
+};
+UdpConfig udpConfig = { false, UDP_DEFAULT_PORT, false, UDP_DEFAULT_GROUP, UDP_DEFAULT_BEACON_PORT, 1000 };
+
+struct UdpRequest {
+    uint32_t address;
+    uint16_t port;
+    unsigned long receivedAt;        // micros()
+    uint8_t length;
+    uint8_t frame[UDP_MAX_DATAGRAM];
+};
+
+struct UdpReplay {
+    bool valid;
+    uint8_t id;
+    uint16_t crc;                    // Request CRC, so a reused id is not taken for a retry
+    uint8_t length;                  // 0 until the pass that claimed the entry ends
+    uint16_t offset;                 // Response in binaryPass while length is 0
+    uint8_t response[BINARY_MAX_RESPONSE];
+};
+
+struct UdpPeer {
+    uint32_t address;                // 0 = free slot
+    uint16_t port;
+    unsigned long lastSeen;
+    uint32_t pass;                   // Last serviceUdpCommands() pass that used the peer
+    uint8_t next;
+    UdpReplay replays[UDP_REPLAY_DEPTH];
+};
+
+// One pass claims a cache entry per new request and copies every response,
+// new or cached, into binaryPass
+static_assert(UDP_REPLAY_DEPTH >= UDP_QUEUE_DEPTH, "a pass must not reuse a cache entry it claimed");
+static_assert(UDP_QUEUE_DEPTH <= BINARY_FRAMES_PER_PASS, "binaryPass must hold a response per queued request");
+
+AsyncUDP udp;
+bool udpListening = false;
+IPAddress udpBeaconGroup;
+UdpRequest udpQueue[UDP_QUEUE_DEPTH];
+UdpRequest udpBatch[UDP_QUEUE_DEPTH];    // Requests taken by the current pass
+uint8_t udpQueueHead = 0;
+uint8_t udpQueueCount = 0;
+portMUX_TYPE udpQueueMux = portMUX_INITIALIZER_UNLOCKED;
+UdpPeer udpPeers[UDP_MAX_PEERS];
+uint32_t udpPass = 0;
+
+// State in the last beacon
+uint32_t udpBeaconSequence = 0;
+unsigned long udpLastBeacon = 0;
+uint16_t udpBeaconRelays = 0;
+uint16_t udpBeaconInputs = 0;
+uint8_t udpBeaconDirect = 0;
+
+// Statistics
+unsigned long udpDatagrams = 0;
+unsigned long udpBadDatagrams = 0;   // Not a single valid frame
+unsigned long udpBusy = 0;           // Queue full, left to the client's retry
+unsigned long udpRetries = 0;        // Answered from the replay cache
+unsigned long udpAnswered = 0;
+unsigned long udpMaxLatency = 0;     // Datagram in to response out (us)
+unsigned long udpLatencyTotal = 0;
+unsigned long udpBeacons = 0;
+
 // DHCP or static IP mode
 bool dhcpMode = true;
 
@@ -265,13 +1320,17 @@ struct HTSensorConfig {
     float humidity;         // Last humidity reading (% - only for DHT sensors)
     bool configured;        // Whether sensor has been configured
     unsigned long lastReadTime; // Last time sensor was read
+    uint8_t consecutiveFailures;    // Failed reads since the last good one
+    unsigned long lastGoodReadTime; // Last time a valid reading was taken
+    unsigned long retryInterval;    // Current back-off interval (0 = normal rate)
+    bool stale;                     // Reading is too old to be trusted
 };
 
 // Initialize sensor configuration for HT1-HT3 pins
 HTSensorConfig htSensorConfig[3] = {
-  {SENSOR_TYPE_DIGITAL, 0, 0, false, 0},
-  {SENSOR_TYPE_DIGITAL, 0, 0, false, 0},
-  {SENSOR_TYPE_DIGITAL, 0, 0, false, 0}
+  {SENSOR_TYPE_DIGITAL, 0, 0, false, 0, 0, 0, 0, false},
+  {SENSOR_TYPE_DIGITAL, 0, 0, false, 0, 0, 0, 0, false},
+  {SENSOR_TYPE_DIGITAL, 0, 0, false, 0, 0, 0, 0, false}
 };
 
 
@@ -301,6 +1360,25 @@ struct TimeSchedule {
 
 TimeSchedule schedules[MAX_SCHEDULES];
 
+// Threshold of a sensor-based schedule, checked on every good reading of
+// its sensor. The state goes high when the value rises above riseLevel and
+// low when it falls below fallLevel, so the gap between the two is the
+// hysteresis band. Built from the schedules by registerSensorThresholds();
+// loop() owns the table (sensor reads and schedule edits both run there).
+struct SensorThreshold {
+    bool active;            // Slot in use
+    uint8_t scheduleIndex;  // Schedule evaluated on a crossing
+    uint8_t sensorIndex;    // HT sensor index (0-2)
+    uint8_t measurement;    // SENSOR_MEASURE_TEMPERATURE or SENSOR_MEASURE_HUMIDITY
+    float riseLevel;        // Crossing upwards above this goes high
+    float fallLevel;        // Crossing downwards below this goes low
+    bool known;             // A reading has set the state yet
+    bool above;             // Last state
+};
+
+SensorThreshold sensorThresholds[MAX_SENSOR_THRESHOLDS];
+unsigned long sensorThresholdCrossings = 0;
+
 // Analog trigger structure
 struct AnalogTrigger {
     bool enabled;
@@ -318,6 +1396,27 @@ AnalogTrigger analogTriggers[MAX_ANALOG_TRIGGERS];
 // Diagnostics
 unsigned long i2cErrorCount = 0;
 unsigned long lastSystemUptime = 0;
+
+// Background I2C bus scan - a few addresses are probed per loop() pass
+#define I2C_SCAN_BATCH 4
+bool i2cScanRunning = false;
+uint16_t i2cScanJobId = 0;
+uint8_t i2cScanNextAddress = 1;
+unsigned long i2cLastScanTime = 0;
+uint32_t i2cPresenceMap[4] = { 0, 0, 0, 0 };  // One bit per 7-bit address
+
+// Expander back-off: after I2C_FAIL_LIMIT failed transfers a device drops
+// out of the presence map and is skipped until its retry time, doubling the
+// delay on every further failure, so a missing expander costs no bus
+// timeouts. Relay ports that could not be written stay owed and are re-sent
+// from loop() once the expander is available again.
+#define I2C_FAIL_LIMIT     3      // Consecutive failures before a device counts as absent
+#define I2C_BACKOFF_BASE   1000   // First retry delay (ms)
+#define I2C_BACKOFF_MAX    30000  // Longest retry delay (ms)
+uint8_t i2cFailures[128];
+unsigned long i2cRetryAt[128];
+unsigned long i2cSkippedCount = 0;        // Accesses skipped during back-off
+bool relayPortsPending[2] = { false, false };  // Outputs 1-8 (IC4), 9-16 (IC3)
 String lastErrorMessage = "";
 
 // Function prototypes
@@ -328,6 +1427,30 @@ void initRTC();
 void setupWebServer();
 void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t length);
 void broadcastUpdate();
+void requestBroadcast();
+void serviceBroadcasts();
+void sendFullSnapshot(uint8_t num);
+void writeStatusJson(JsonWriter& json, uint8_t topics, const PendingChanges* changes);
+bool collectChanges(PendingChanges& changes, unsigned long now);
+bool mergePendingChanges(WebSocketClientState& client, const PendingChanges& changes);
+void resetWebSocketClient(uint8_t num);
+void flushClientUpdates(unsigned long now);
+void sendClientUpdate(uint8_t num, unsigned long now);
+bool sendJsonFrame(uint8_t num, const JsonWriter& json);
+void sendJsonResponse(const JsonWriter& json);
+void writeStateArray(JsonWriter& json, const char* name, const bool* states, int count, uint16_t mask);
+void writeHTSensorJson(JsonWriter& json, int i);
+void writeAnalogJson(JsonWriter& json, int i, int percentage);
+void writeConnectionJson(JsonWriter& json);
+void writeSystemHealthJson(JsonWriter& json);
+String runSerializerBenchmark();
+void formatTimeString(char* out, size_t size);
+void formatUptime(char* out, size_t size);
+const char* getActiveProtocolLabel();
+void rememberBroadcastState();
+void buildBinaryState(uint8_t* frame, uint32_t sequence);
+void handleBinaryCommand(uint8_t num, uint8_t* payload, size_t length);
+void sendBinaryError(uint8_t num, uint8_t code);
 void initRS485();
 void initRF();
 void saveConfiguration();
@@ -340,12 +1463,23 @@ void saveCommunicationConfig();
 void loadCommunicationConfig();
 bool readInputs();
 bool writeOutputs();
-void handleWebRoot();
 void handleNotFound();
-void handleFileUpload();
+void registerWebAssets();
+void addWebAsset(const String& file);
+const char* getContentType(const String& path);
+String computeFileETag(const String& path);
+void serveWebAsset(AsyncWebServerRequest* request, const WebAsset& asset);
+void bumpConfigRevision(uint8_t domain);
+bool respondNotModified(uint8_t domain, uint32_t live = 0);
+uint32_t getLinkSignature();
+void handleFileUpload(AsyncWebServerRequest* request, String filename, size_t index, uint8_t* data, size_t length, bool final);
 void handleRelayControl();
 void handleSystemStatus();
 void handleSchedules();
+void sendJsonCollection(const char* key, int total, JsonElementWriter writer);
+void writeScheduleJson(JsonWriter& json, int index);
+void writeAnalogTriggerJson(JsonWriter& json, int index);
+void writeInterruptJson(JsonWriter& json, int index);
 void handleUpdateSchedule();
 void handleConfig();
 void handleUpdateConfig();
@@ -361,17 +1495,101 @@ void handleUpdateCommunicationConfig();
 void handleGetTime();
 void handleSetTime();
 void handleI2CScan();
+uint16_t startI2CScan();
+void processI2CScan();
+bool isI2CDevicePresent(uint8_t address);
+bool isI2CDeviceAvailable(uint8_t address);
+void recordI2CResult(uint8_t address, bool success);
+bool readExpanderPort(uint8_t address, uint8_t& value);
+bool writeExpanderPort(uint8_t address, uint8_t value);
+bool flushRelayPorts();
+void serviceOwedRelayPorts();
+String getI2CDeviceName(uint8_t address);
 void checkSchedules();
 void checkAnalogTriggers();
 void processRS485Commands();
+uint16_t modbusCrc16(const uint8_t* data, size_t length);
+void beginModbusRtu();
+void endModbusRtu();
+void completeModbusFrameLocked();
+void onModbusReceive();
+void serviceModbusRtu();
+void rs485Task(void* parameter);
+void onRs485CommandReceive();
+void onUsbCommandReceive();
+void handleModbusRtuFrame(const uint8_t* frame, uint16_t length, const ModbusImage& image);
+void answerModbusRtuFrame();
+void recordModbusRtuService(unsigned long start);
+size_t modbusException(uint8_t* response, uint8_t function, uint8_t code);
+bool getModbusDiscreteInput(uint16_t address);
+uint16_t getModbusInputRegister(uint16_t address);
+uint16_t getModbusHoldingRegister(uint16_t address);
+uint8_t checkModbusHoldingRegister(uint16_t address, uint16_t value);
+uint8_t setModbusHoldingRegister(uint16_t address, uint16_t value);
+size_t processModbusPdu(const uint8_t* request, size_t length, uint8_t* response, const ModbusImage& image);
+void applyModbusSettings();
+void refreshModbusImage();
+void copyModbusImage(ModbusImage& image);
+bool isModbusReadFunction(uint8_t function);
+void beginModbusTcp();
+void applyModbusTcpConfig();
+void onModbusTcpClient(void* arg, AsyncClient* client);
+void onModbusTcpDisconnect(void* arg, AsyncClient* client);
+void onModbusTcpData(void* arg, AsyncClient* client, void* data, size_t length);
+void handleModbusTcpAdu(uint8_t slot, const uint8_t* adu, size_t length);
+void sendModbusTcpResponse(uint8_t slot, uint32_t generation, const uint8_t* request, uint8_t* response, size_t pduLength);
+void serviceModbusTcp();
+uint8_t getModbusTcpClientCount();
+void beginMqtt();
+void applyMqttConfig();
+void serviceMqtt();
+bool publishMqttChanges(bool full);
+bool mqttValueMoved(float value, float published, float deadband);
+void publishMqttValues(PendingChanges& changes);
+bool publishMqttBatch(const PendingChanges& changes, bool full);
+void formatFixed(char* out, size_t size, long scaled, uint8_t decimals);
+int parseMqttSwitch(const char* text);
+void onMqttMessage(const char* topic, const uint8_t* payload, size_t length, void* context);
+void loadMqttConfig();
+void saveMqttConfig();
+bool updateMqttConfig(JsonObject settings);
+void mqttConfigToJson(JsonDocument& doc);
+void handleMqttConfig();
+void handleUpdateMqttConfig();
+void handleMqttStatus();
+void beginUdp();
+void applyUdpConfig();
+void onUdpPacket(void* arg, AsyncUDPPacket& packet);
+void serviceUdp();
+void serviceUdpCommands();
+void serviceUdpBeacon();
+UdpPeer* findUdpPeer(uint32_t address, uint16_t port);
+UdpReplay* findUdpReplay(UdpPeer& peer, const uint8_t* frame, uint8_t length);
+UdpReplay* addUdpReplay(UdpPeer& peer, const uint8_t* frame, uint8_t length, uint16_t offset);
+void udpConfigToJson(JsonDocument& doc);
+bool updateUdpConfig(JsonObject settings);
+void saveUdpConfig();
+void loadUdpConfig();
+void handleUdpConfig();
+void handleUpdateUdpConfig();
+void handleUdpStatus();
 void processSerialCommands();
+void serviceCommandChannel(Stream& port, CommChannel& channel);
+void serviceCommandPort(Stream& port, CommChannel& channel);
+void setCommChannelEnabled(uint8_t channel, bool enabled);
+uint8_t readCommandPort(Stream& port, CommandLineReader& reader);
+void handleBinaryFrame(const uint8_t* frame, BinaryPass& pass);
+void applyBinaryRelays(BinaryPass& pass);
+void finishBinaryPass(Stream& port, BinaryPass& pass);
+uint16_t getRelayMask();
+bool stageRelayMask(uint16_t mask);
+const char* executeCommandToBuffer(const char* command);
 void WiFiEvent(WiFiEvent_t event);
 void EthEvent(WiFiEvent_t event);
 void debugPrintln(String message);
 void syncTimeFromNTP();
 void syncTimeFromClient(int year, int month, int day, int hour, int minute, int second);
 String getTimeString();
-String processCommand(String command);
 int readAnalogInput(uint8_t index);
 float convertAnalogToVoltage(int analogValue);
 int calculatePercentage(float voltage);
@@ -390,6 +1608,12 @@ void handleInterrupts();
 void handleUpdateInterrupts();
 
 void checkInputBasedSchedules(int changedInputIndex, bool newState);
+bool evaluateSensorCondition(int scheduleIndex);
+void registerSensorThresholds();
+void addSensorThreshold(int scheduleIndex, uint8_t measurement, float riseLevel, float fallLevel);
+void resetSensorThresholds(int htIndex);
+void checkSensorThresholds(int htIndex);
+void checkSensorSchedule(int scheduleIndex);
 void executeSchedule(int scheduleIndex);
 void handleEvaluateInputSchedules();
 
@@ -399,6 +1623,12 @@ void setup() {
     Serial.begin(115200);
     Serial.println("\nKC868-A16 Controller starting up...");
 
+    // Before anything edits or streams the configuration arrays
+    configArraysMutex = xSemaphoreCreateMutex();
+
+    // USB commands: loop() reads the port once an event says there is something to read
+    Serial.onReceive(onUsbCommandReceive, false);
+
     // Initialize EEPROM
     EEPROM.begin(EEPROM_SIZE);
 
@@ -417,6 +1647,9 @@ void setup() {
     // Initialize PCF8574 expanders
     initI2C();
 
+    // Populate the I2C presence map in the background
+    startI2CScan();
+
     // Initialize direct GPIO inputs
     pinMode(HT1_PIN, INPUT_PULLUP);
     pinMode(HT2_PIN, INPUT_PULLUP);
@@ -446,8 +1679,10 @@ void setup() {
         initWiFi();
     }
 
-    // Initialize RS485 serial with current configuration
-    initRS485();
+    // Initialize RS485 serial with current configuration, unless the channel is off
+    if (commChannels[COMM_CHANNEL_RS485].enabled) {
+        initRS485();
+    }
 
     // Initialize RF receiver and transmitter
     initRF();
@@ -465,6 +1700,15 @@ void setup() {
     // Setup web server endpoints
     setupWebServer();
 
+    // Modbus TCP on port 502, if enabled
+    beginModbusTcp();
+
+    // MQTT client; connects in the background once a broker is configured
+    beginMqtt();
+
+    // UDP control port and state beacon
+    beginUdp();
+
     // Initialize output states (All relays OFF)
     writeOutputs();
 
@@ -479,7 +1723,8 @@ void setup() {
 
     // Initialize WebSocket client array
     for (int i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
-        webSocketClients[i] = false;
+        resetWebSocketClient(i);
+        webSocketClients[i].subscribed = false;
     }
 
     // Initialize interrupt configurations
@@ -520,14 +1765,14 @@ void loop() {
     }
 
     // Rest of the original loop function...
-    // Handle web server clients
+    // Run queued web API requests (connections and static files are served
+    // by the AsyncTCP task)
     server.handleClient();
 
     // Handle WebSocket events
     webSocket.loop();
 
     // Static variables to track last updates
-    static unsigned long lastWebSocketUpdate = 0;
     static unsigned long lastInputsCheck = 0;
     static unsigned long lastAnalogCheck = 0;
     static unsigned long lastSensorCheck = 0;
@@ -540,15 +1785,20 @@ void loop() {
     // Poll any non-interrupt inputs
     pollNonInterruptInputs();
 
+    // Advance a running I2C bus scan
+    processI2CScan();
+
+    // Re-send relay states owed to an output expander that has come back
+    serviceOwedRelayPorts();
+
     // Read digital inputs more frequently (every 100ms) if interrupts are not enabled
     if (!inputInterruptsEnabled && (currentMillis - lastInputsCheck >= 100)) {
         lastInputsCheck = currentMillis;
         bool inputsChanged = readInputs();
 
-        // If inputs changed, broadcast immediately
+        // If inputs changed, broadcast as soon as the rate limit allows
         if (inputsChanged) {
-            broadcastUpdate();
-            lastWebSocketUpdate = currentMillis;
+            requestBroadcast();
         }
     }
 
@@ -580,9 +1830,8 @@ void loop() {
         if (analogChanged) {
             checkAnalogTriggers();
 
-            // Broadcast immediately if analog values changed
-            broadcastUpdate();
-            lastWebSocketUpdate = currentMillis;
+            // Broadcast as soon as the rate limit allows
+            requestBroadcast();
         }
     }
 
@@ -615,20 +1864,27 @@ void loop() {
         }
     }
 
-    // Broadcast periodic updates every 1 second even if no changes (reduced from 2 seconds)
-    if (currentMillis - lastWebSocketUpdate >= 1000) {
-        broadcastUpdate();
-        lastWebSocketUpdate = currentMillis;
-    }
+    // Send the coalesced WebSocket update, or the idle tick
+    serviceBroadcasts();
 
-    // Process commands based on active communication protocol
-    if (currentCommunicationProtocol == "usb") {
+    // Serve every enabled command channel; a channel whose UART has reported
+    // nothing since the last pass returns at once
+    if (commChannels[COMM_CHANNEL_USB].enabled) {
         processSerialCommands();
     }
-    else if (currentCommunicationProtocol == "rs485") {
+    if (commChannels[COMM_CHANNEL_RS485].enabled) {
         processRS485Commands();
     }
 
+    // Modbus TCP writes and the shared register image
+    serviceModbusTcp();
+
+    // MQTT session, commands from the broker and state publishing
+    serviceMqtt();
+
+    // UDP control requests and the state beacon
+    serviceUdp();
+
     // Check RF receiver for any signals
     if (rfReceiver.available()) {
         unsigned long rfCode = rfReceiver.getReceivedValue();
@@ -651,6 +1907,8 @@ void loop() {
 
 // Initialize interrupt configurations with default values
 void initInterruptConfigs() {
+    // The web server is already running
+    lockConfigArrays();
     for (int i = 0; i < 16; i++) {
         interruptConfigs[i].enabled = false;
         interruptConfigs[i].priority = INPUT_PRIORITY_MEDIUM;  // Default medium priority
@@ -658,6 +1916,7 @@ void initInterruptConfigs() {
         interruptConfigs[i].triggerType = INTERRUPT_TRIGGER_CHANGE;  // Default to change (both edges)
         snprintf(interruptConfigs[i].name, 32, "Input %d", i + 1);
     }
+    unlockConfigArrays();
 
     // Load any saved configurations from EEPROM
     loadInterruptConfigs();
@@ -693,6 +1952,7 @@ void saveInterruptConfigs() {
     EEPROM.commit();
 
     debugPrintln("Interrupt configurations saved");
+    bumpConfigRevision(CONFIG_DOMAIN_INTERRUPTS);
 }
 
 
@@ -721,6 +1981,7 @@ void loadInterruptConfigs() {
             JsonArray configArray = doc["interrupts"];
 
             int index = 0;
+            lockConfigArrays();
             for (JsonObject config : configArray) {
                 if (index >= 16) break;
 
@@ -736,6 +1997,7 @@ void loadInterruptConfigs() {
 
                 index++;
             }
+            unlockConfigArrays();
 
             debugPrintln("Interrupt configurations loaded");
         }
@@ -809,98 +2071,66 @@ void processInputInterrupts() {
     bool currentInputs[16];
     bool anyChange = false;
 
+    // One port read per expander; an unavailable expander is skipped and its
+    // 8 inputs keep their last states, the other one is still handled
+    const uint8_t inputAddresses[2] = { PCF8574_INPUTS_1_8, PCF8574_INPUTS_9_16 };
+
     // Read inputs from I2C expanders
     try {
-        // Read inputs 1-8
-        for (int i = 0; i < 8; i++) {
-            bool newState = !inputIC1.digitalRead(i);  // Inverted because of pull-up
-            currentInputs[i] = newState;
-
-            // Determine if this input should be processed based on its trigger type
-            bool shouldProcess = false;
-
-            if (interruptConfigs[i].enabled) {
-                switch (interruptConfigs[i].triggerType) {
-                case INTERRUPT_TRIGGER_RISING:
-                    // Process on rising edge (LOW to HIGH)
-                    shouldProcess = !prevInputStates[i] && newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_FALLING:
-                    // Process on falling edge (HIGH to LOW)
-                    shouldProcess = prevInputStates[i] && !newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_CHANGE:
-                    // Process on any edge (change)
-                    shouldProcess = prevInputStates[i] != newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_HIGH_LEVEL:
-                    // Process when the input is HIGH
-                    shouldProcess = newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_LOW_LEVEL:
-                    // Process when the input is LOW
-                    shouldProcess = !newState;
-                    break;
+        for (int ic = 0; ic < 2; ic++) {
+            uint8_t portValue;
+            bool portRead = readExpanderPort(inputAddresses[ic], portValue);
+
+            for (int bit = 0; bit < 8; bit++) {
+                int i = ic * 8 + bit;
+                if (!portRead) {
+                    currentInputs[i] = prevInputStates[i];
+                    continue;
                 }
 
-                if (shouldProcess) {
-                    anyChange = true;
-                    inputStateChanged[i] = true;
-                }
-            }
+                bool newState = !(portValue & (1 << bit));  // Inverted because of pull-up
+                currentInputs[i] = newState;
 
-            // Update previous state for next iteration
-            prevInputStates[i] = newState;
-        }
+                // Determine if this input should be processed based on its trigger type
+                bool shouldProcess = false;
 
-        // Read inputs 9-16
-        for (int i = 0; i < 8; i++) {
-            bool newState = !inputIC2.digitalRead(i);  // Inverted because of pull-up
-            currentInputs[i + 8] = newState;
-
-            // Determine if this input should be processed based on its trigger type
-            bool shouldProcess = false;
-
-            if (interruptConfigs[i + 8].enabled) {
-                switch (interruptConfigs[i + 8].triggerType) {
-                case INTERRUPT_TRIGGER_RISING:
-                    // Process on rising edge (LOW to HIGH)
-                    shouldProcess = !prevInputStates[i + 8] && newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_FALLING:
-                    // Process on falling edge (HIGH to LOW)
-                    shouldProcess = prevInputStates[i + 8] && !newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_CHANGE:
-                    // Process on any edge (change)
-                    shouldProcess = prevInputStates[i + 8] != newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_HIGH_LEVEL:
-                    // Process when the input is HIGH
-                    shouldProcess = newState;
-                    break;
-
-                case INTERRUPT_TRIGGER_LOW_LEVEL:
-                    // Process when the input is LOW
-                    shouldProcess = !newState;
-                    break;
-                }
+                if (interruptConfigs[i].enabled) {
+                    switch (interruptConfigs[i].triggerType) {
+                    case INTERRUPT_TRIGGER_RISING:
+                        // Process on rising edge (LOW to HIGH)
+                        shouldProcess = !prevInputStates[i] && newState;
+                        break;
+
+                    case INTERRUPT_TRIGGER_FALLING:
+                        // Process on falling edge (HIGH to LOW)
+                        shouldProcess = prevInputStates[i] && !newState;
+                        break;
+
+                    case INTERRUPT_TRIGGER_CHANGE:
+                        // Process on any edge (change)
+                        shouldProcess = prevInputStates[i] != newState;
+                        break;
+
+                    case INTERRUPT_TRIGGER_HIGH_LEVEL:
+                        // Process when the input is HIGH
+                        shouldProcess = newState;
+                        break;
+
+                    case INTERRUPT_TRIGGER_LOW_LEVEL:
+                        // Process when the input is LOW
+                        shouldProcess = !newState;
+                        break;
+                    }
 
-                if (shouldProcess) {
-                    anyChange = true;
-                    inputStateChanged[i + 8] = true;
+                    if (shouldProcess) {
+                        anyChange = true;
+                        inputStateChanged[i] = true;
+                    }
                 }
-            }
 
-            // Update previous state for next iteration
-            prevInputStates[i + 8] = newState;
+                // Update previous state for next iteration
+                prevInputStates[i] = newState;
+            }
         }
     }
     catch (const std::exception& e) {
@@ -956,7 +2186,7 @@ void processInputInterrupts() {
     }
 
     // Broadcast the update after processing
-    broadcastUpdate();
+    requestBroadcast();
 }
 
 // Process a specific input change - Modified to properly handle scheduled actions
@@ -970,7 +2200,7 @@ void processInputChange(int inputIndex, bool newState) {
     checkInputBasedSchedules();
 
     // Broadcast update to ensure UI reflects current state
-    broadcastUpdate();
+    requestBroadcast();
 }
 
 // Function to check and execute input-based schedules
@@ -1053,45 +2283,10 @@ void checkInputBasedSchedules() {
             // Skip if sensor is configured as digital input
             if (htSensorConfig[sensorIndex].sensorType == SENSOR_TYPE_DIGITAL) continue;
 
-            bool sensorConditionMet = false;
-
-            // Check temperature threshold
-            if (schedules[i].sensorTriggerType == 0) { // Temperature
-                float currentTemp = htSensorConfig[sensorIndex].temperature;
-                float threshold = schedules[i].sensorThreshold;
-
-                switch (schedules[i].sensorCondition) {
-                case 0: // Above
-                    sensorConditionMet = (currentTemp > threshold);
-                    break;
-                case 1: // Below
-                    sensorConditionMet = (currentTemp < threshold);
-                    break;
-                case 2: // Equal (with tolerance)
-                    sensorConditionMet = (abs(currentTemp - threshold) < 0.5f);
-                    break;
-                }
-            }
-            // Check humidity threshold (only for DHT sensors)
-            else if (schedules[i].sensorTriggerType == 1 &&
-                (htSensorConfig[sensorIndex].sensorType == SENSOR_TYPE_DHT11 ||
-                    htSensorConfig[sensorIndex].sensorType == SENSOR_TYPE_DHT22)) {
-
-                float currentHumidity = htSensorConfig[sensorIndex].humidity;
-                float threshold = schedules[i].sensorThreshold;
-
-                switch (schedules[i].sensorCondition) {
-                case 0: // Above
-                    sensorConditionMet = (currentHumidity > threshold);
-                    break;
-                case 1: // Below
-                    sensorConditionMet = (currentHumidity < threshold);
-                    break;
-                case 2: // Equal (with tolerance)
-                    sensorConditionMet = (abs(currentHumidity - threshold) < 2.0f);
-                    break;
-                }
-            }
+            // Skip if the last reading is stale - never act on old data
+            if (isSensorStale(sensorIndex)) continue;
+
+            bool sensorConditionMet = evaluateSensorCondition(i);
 
             conditionMet = sensorConditionMet;
 
@@ -1179,6 +2374,169 @@ void checkInputBasedSchedules() {
     }
 }
 
+// Whether a sensor-based schedule's condition holds for the last reading
+bool evaluateSensorCondition(int scheduleIndex) {
+    const TimeSchedule& schedule = schedules[scheduleIndex];
+    uint8_t sensorIndex = schedule.sensorIndex;
+
+    // Invalid index, digital input or stale reading never meets a condition
+    if (sensorIndex >= 3) return false;
+    if (htSensorConfig[sensorIndex].sensorType == SENSOR_TYPE_DIGITAL) return false;
+    if (isSensorStale(sensorIndex)) return false;
+
+    bool sensorConditionMet = false;
+
+    // Check temperature threshold
+    if (schedule.sensorTriggerType == 0) { // Temperature
+        float currentTemp = htSensorConfig[sensorIndex].temperature;
+        float threshold = schedule.sensorThreshold;
+
+        switch (schedule.sensorCondition) {
+        case 0: // Above
+            sensorConditionMet = (currentTemp > threshold);
+            break;
+        case 1: // Below
+            sensorConditionMet = (currentTemp < threshold);
+            break;
+        case 2: // Equal (with tolerance)
+            sensorConditionMet = (abs(currentTemp - threshold) < 0.5f);
+            break;
+        }
+    }
+    // Check humidity threshold (only for DHT sensors)
+    else if (schedule.sensorTriggerType == 1 &&
+        (htSensorConfig[sensorIndex].sensorType == SENSOR_TYPE_DHT11 ||
+            htSensorConfig[sensorIndex].sensorType == SENSOR_TYPE_DHT22)) {
+
+        float currentHumidity = htSensorConfig[sensorIndex].humidity;
+        float threshold = schedule.sensorThreshold;
+
+        switch (schedule.sensorCondition) {
+        case 0: // Above
+            sensorConditionMet = (currentHumidity > threshold);
+            break;
+        case 1: // Below
+            sensorConditionMet = (currentHumidity < threshold);
+            break;
+        case 2: // Equal (with tolerance)
+            sensorConditionMet = (abs(currentHumidity - threshold) < 2.0f);
+            break;
+        }
+    }
+
+    return sensorConditionMet;
+}
+
+// Rebuild the threshold table from the enabled sensor-based schedules.
+// Called whenever the schedules change; every threshold starts unknown, so
+// the next reading of its sensor evaluates the schedule once
+void registerSensorThresholds() {
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        sensorThresholds[i].active = false;
+    }
+
+    for (int i = 0; i < MAX_SCHEDULES; i++) {
+        if (!schedules[i].enabled || schedules[i].triggerType != 3) continue;
+        if (schedules[i].sensorIndex >= 3) continue;
+
+        bool humidity = (schedules[i].sensorTriggerType == 1);
+        uint8_t measurement = humidity ? SENSOR_MEASURE_HUMIDITY : SENSOR_MEASURE_TEMPERATURE;
+        float hysteresis = humidity ? SENSOR_HYSTERESIS_HUMIDITY : SENSOR_HYSTERESIS_TEMPERATURE;
+        float threshold = schedules[i].sensorThreshold;
+
+        // Put the hysteresis on the side the condition does not care about,
+        // so the crossing into the condition happens exactly at the threshold
+        switch (schedules[i].sensorCondition) {
+        case 0: // Above
+            addSensorThreshold(i, measurement, threshold, threshold - hysteresis);
+            break;
+        case 1: // Below
+            addSensorThreshold(i, measurement, threshold + hysteresis, threshold);
+            break;
+        case 2: { // Equal - watch both edges of the tolerance band
+            float tolerance = humidity ? 2.0f : 0.5f;
+            addSensorThreshold(i, measurement, threshold - tolerance, threshold - tolerance - hysteresis);
+            addSensorThreshold(i, measurement, threshold + tolerance + hysteresis, threshold + tolerance);
+            break;
+        }
+        }
+    }
+}
+
+void addSensorThreshold(int scheduleIndex, uint8_t measurement, float riseLevel, float fallLevel) {
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        if (!sensorThresholds[i].active) {
+            sensorThresholds[i].active = true;
+            sensorThresholds[i].scheduleIndex = scheduleIndex;
+            sensorThresholds[i].sensorIndex = schedules[scheduleIndex].sensorIndex;
+            sensorThresholds[i].measurement = measurement;
+            sensorThresholds[i].riseLevel = riseLevel;
+            sensorThresholds[i].fallLevel = fallLevel;
+            sensorThresholds[i].known = false;
+            sensorThresholds[i].above = false;
+            return;
+        }
+    }
+    debugPrintln("No free sensor threshold slot for schedule " + String(scheduleIndex));
+}
+
+// Forget the state of an HT sensor's thresholds (its type was changed)
+void resetSensorThresholds(int htIndex) {
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        if (sensorThresholds[i].active && sensorThresholds[i].sensorIndex == htIndex) {
+            sensorThresholds[i].known = false;
+        }
+    }
+}
+
+// A good reading of an HT sensor: evaluate the schedules whose threshold it
+// crossed, instead of waiting for an input to change
+void checkSensorThresholds(int htIndex) {
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        SensorThreshold& t = sensorThresholds[i];
+        if (!t.active || t.sensorIndex != htIndex) continue;
+
+        float value = (t.measurement == SENSOR_MEASURE_HUMIDITY) ?
+            htSensorConfig[htIndex].humidity : htSensorConfig[htIndex].temperature;
+
+        bool crossed = false;
+        if (!t.known) {
+            // First good reading establishes the side and is evaluated once
+            t.above = (value > t.riseLevel);
+            t.known = true;
+            crossed = true;
+        }
+        else if (!t.above && value > t.riseLevel) {
+            t.above = true;
+            crossed = true;
+        }
+        else if (t.above && value < t.fallLevel) {
+            t.above = false;
+            crossed = true;
+        }
+
+        if (crossed) {
+            sensorThresholdCrossings++;
+            checkSensorSchedule(t.scheduleIndex);
+        }
+    }
+}
+
+// Evaluate one sensor-based schedule after a threshold crossing
+void checkSensorSchedule(int scheduleIndex) {
+    if (scheduleIndex < 0 || scheduleIndex >= MAX_SCHEDULES) return;
+    if (!schedules[scheduleIndex].enabled || schedules[scheduleIndex].triggerType != 3) return;
+
+    if (evaluateSensorCondition(scheduleIndex)) {
+        debugPrintln("Sensor threshold crossed for schedule " + String(scheduleIndex) + ": " +
+            String(schedules[scheduleIndex].name));
+
+        if (schedules[scheduleIndex].targetId > 0) {
+            executeScheduleAction(scheduleIndex, schedules[scheduleIndex].targetId);
+        }
+    }
+}
+
 // Modified function to execute a schedule action with a specific target
 void executeScheduleAction(int scheduleIndex, uint16_t targetId) {
     if (scheduleIndex < 0 || scheduleIndex >= MAX_SCHEDULES) return;
@@ -1234,7 +2592,7 @@ void executeScheduleAction(int scheduleIndex, uint16_t targetId) {
     }
 
     // Broadcast update to UI
-    broadcastUpdate();
+    requestBroadcast();
 }
 
 // Original executeScheduleAction for backward compatibility
@@ -1418,7 +2776,7 @@ void checkInputBasedSchedules(int changedInputIndex, bool newState) {
             }
 
             // Broadcast update
-            broadcastUpdate();
+            requestBroadcast();
         }
     }
 }
@@ -1450,12 +2808,18 @@ void pollNonInterruptInputs() {
     // If no inputs need polling, exit
     if (!anyNeedPolling) return;
 
+    // One port read per expander; an unavailable expander is skipped
+    uint8_t inputPorts[2];
+    bool portRead[2];
+    portRead[0] = readExpanderPort(PCF8574_INPUTS_1_8, inputPorts[0]);
+    portRead[1] = readExpanderPort(PCF8574_INPUTS_9_16, inputPorts[1]);
+
     // Poll only the required inputs
     try {
         // Poll inputs 1-8 if needed
         for (int i = 0; i < 8; i++) {
-            if (needsPolling[i]) {
-                bool newState = !inputIC1.digitalRead(i); // Inverted because of pull-up
+            if (needsPolling[i] && portRead[0]) {
+                bool newState = !(inputPorts[0] & (1 << i)); // Inverted because of pull-up
                 if (newState != inputStates[i]) {
                     inputStates[i] = newState;
                     anyChanged = true;
@@ -1469,8 +2833,8 @@ void pollNonInterruptInputs() {
 
         // Poll inputs 9-16 if needed
         for (int i = 0; i < 8; i++) {
-            if (needsPolling[i + 8]) {
-                bool newState = !inputIC2.digitalRead(i); // Inverted because of pull-up
+            if (needsPolling[i + 8] && portRead[1]) {
+                bool newState = !(inputPorts[1] & (1 << i)); // Inverted because of pull-up
                 if (newState != inputStates[i + 8]) {
                     inputStates[i + 8] = newState;
                     anyChanged = true;
@@ -1494,22 +2858,24 @@ void pollNonInterruptInputs() {
 
 // Handle GET request for interrupts configuration
 void handleInterrupts() {
-    DynamicJsonDocument doc(4096);
-    JsonArray interruptsArray = doc.createNestedArray("interrupts");
-
-    for (int i = 0; i < 16; i++) {
-        JsonObject interrupt = interruptsArray.createNestedObject();
-        interrupt["id"] = i;
-        interrupt["enabled"] = interruptConfigs[i].enabled;
-        interrupt["name"] = interruptConfigs[i].name;
-        interrupt["priority"] = interruptConfigs[i].priority;
-        interrupt["inputIndex"] = interruptConfigs[i].inputIndex;
-        interrupt["triggerType"] = interruptConfigs[i].triggerType;
+    if (respondNotModified(CONFIG_DOMAIN_INTERRUPTS)) {
+        return;
     }
 
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response);
+    sendJsonCollection("interrupts", 16, writeInterruptJson);
+}
+
+void writeInterruptJson(JsonWriter& json, int index) {
+    const InterruptConfig& config = interruptConfigs[index];
+
+    json.beginObject();
+    json.addInt("id", index);
+    json.addBool("enabled", config.enabled);
+    json.addString("name", config.name);
+    json.addUInt("priority", config.priority);
+    json.addUInt("inputIndex", config.inputIndex);
+    json.addUInt("triggerType", config.triggerType);
+    json.endObject();
 }
 
 // Handle POST request to update interrupts configuration
@@ -1528,10 +2894,12 @@ void handleUpdateInterrupts() {
             int id = interruptJson.containsKey("id") ? interruptJson["id"].as<int>() : -1;
 
             if (id >= 0 && id < 16) {
+                lockConfigArrays();
                 interruptConfigs[id].enabled = interruptJson["enabled"];
                 strlcpy(interruptConfigs[id].name, interruptJson["name"] | "Input", 32);
                 interruptConfigs[id].priority = interruptJson["priority"] | INPUT_PRIORITY_MEDIUM;
                 interruptConfigs[id].triggerType = interruptJson["triggerType"] | INTERRUPT_TRIGGER_CHANGE;
+                unlockConfigArrays();
 
                 // Save configurations
                 saveInterruptConfigs();
@@ -1550,7 +2918,9 @@ void handleUpdateInterrupts() {
             bool enabled = doc["enabled"];
 
             if (id >= 0 && id < 16) {
+                lockConfigArrays();
                 interruptConfigs[id].enabled = enabled;
+                unlockConfigArrays();
                 saveInterruptConfigs();
 
                 // Reconfigure interrupts if needed
@@ -1566,18 +2936,22 @@ void handleUpdateInterrupts() {
 
             if (action == "enable_all") {
                 // Enable all interrupts
+                lockConfigArrays();
                 for (int i = 0; i < 16; i++) {
                     interruptConfigs[i].enabled = true;
                 }
+                unlockConfigArrays();
                 saveInterruptConfigs();
                 setupInputInterrupts();
                 response = "{\"status\":\"success\",\"message\":\"All interrupts enabled\"}";
             }
             else if (action == "disable_all") {
                 // Disable all interrupts
+                lockConfigArrays();
                 for (int i = 0; i < 16; i++) {
                     interruptConfigs[i].enabled = false;
                 }
+                unlockConfigArrays();
                 saveInterruptConfigs();
                 disableInputInterrupts();
                 response = "{\"status\":\"success\",\"message\":\"All interrupts disabled\"}";
@@ -1844,7 +3218,7 @@ void EthEvent(WiFiEvent_t event) {
         mac = ETH.macAddress();
 
         // Broadcast update to UI
-        broadcastUpdate();
+        requestBroadcast();
         break;
     case ARDUINO_EVENT_ETH_DISCONNECTED:
         debugPrintln("ETH Disconnected");
@@ -1858,7 +3232,7 @@ void EthEvent(WiFiEvent_t event) {
         }
 
         // Broadcast update to UI
-        broadcastUpdate();
+        requestBroadcast();
         break;
     case ARDUINO_EVENT_ETH_STOP:
         debugPrintln("ETH Stopped");
@@ -1866,7 +3240,7 @@ void EthEvent(WiFiEvent_t event) {
         wiredMode = false;
 
         // Broadcast update to UI
-        broadcastUpdate();
+        requestBroadcast();
         break;
     default:
         break;
@@ -2019,6 +3393,8 @@ void saveNetworkSettings() {
     EEPROM.commit();
 
     debugPrintln("Network settings saved to EEPROM");
+    bumpConfigRevision(CONFIG_DOMAIN_CONFIG);
+    bumpConfigRevision(CONFIG_DOMAIN_COMMUNICATION);
 }
 
 // Load network settings
@@ -2164,13 +3540,18 @@ void syncTimeFromClient(int year, int month, int day, int hour, int minute, int
 
 // Get current time as formatted string
 String getTimeString() {
+    char timeString[30];
+    formatTimeString(timeString, sizeof(timeString));
+    return String(timeString);
+}
+
+// Local time as "yyyy-mm-dd hh:mm:ss" into a caller buffer
+void formatTimeString(char* out, size_t size) {
     time_t now;
     struct tm timeinfo;
     time(&now);
     localtime_r(&now, &timeinfo);
-    char timeString[30];
-    strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", &timeinfo);
-    return String(timeString);
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", &timeinfo);
 }
 
 // Initialize RS485
@@ -2208,8 +3589,36 @@ void initRS485() {
         }
     }
 
+    // Whole Modbus frames fit the driver buffers in both directions, so
+    // neither the UART task nor loop() waits on the FIFO. The buffer sizes
+    // can only be set while the port is closed.
+    rs485.end();
+    rs485.setRxBufferSize(MODBUS_RX_BUFFER);
+    rs485.setTxBufferSize(MODBUS_MAX_FRAME);
     rs485.begin(rs485BaudRate, configParity, RS485_RX_PIN, RS485_TX_PIN);
+    rs485.setPins(RS485_RX_PIN, RS485_TX_PIN, -1, RS485_DE_PIN);
+    if (!rs485.setMode(UART_MODE_RS485_HALF_DUPLEX)) {
+        debugPrintln("ERROR: RS485 half-duplex mode not available");
+    }
     debugPrintln("RS485 initialized with baud rate: " + String(rs485BaudRate));
+
+    if (rs485TaskHandle == NULL) {
+        xTaskCreatePinnedToCore(rs485Task, "rs485", RS485_TASK_STACK, NULL, RS485_TASK_PRIORITY,
+            &rs485TaskHandle, ARDUINO_RUNNING_CORE);
+    }
+
+    if (rs485Protocol == "Modbus RTU") {
+        beginModbusRtu();
+    }
+    else {
+        endModbusRtu();
+
+        // Text and binary commands: loop() reads the port once an event says
+        // there is something to read
+        rs485.setRxTimeout(RS485_RX_TIMEOUT);
+        rs485.onReceive(onRs485CommandReceive, false);
+        commChannels[COMM_CHANNEL_RS485].dataPending = true;
+    }
 }
 
 // Initialize RF receiver and transmitter
@@ -2220,55 +3629,72 @@ void initRF() {
 }
 
 // Setup web server endpoints
-void setupWebServer() {
-    // Serve static files from SPIFFS
-    server.serveStatic("/", SPIFFS, "/index.html");
-    server.serveStatic("/style.css", SPIFFS, "/style.css");
-    server.serveStatic("/script.js", SPIFFS, "/script.js");
-
-    // API endpoints
-    server.on("/", HTTP_GET, handleWebRoot);
-    server.on("/api/status", HTTP_GET, handleSystemStatus);
-    server.on("/api/relay", HTTP_POST, handleRelayControl);
-    server.on("/api/schedules", HTTP_GET, handleSchedules);
-    server.on("/api/schedules", HTTP_POST, handleUpdateSchedule);
-    server.on("/api/evaluate-input-schedules", HTTP_GET, handleEvaluateInputSchedules);
-    server.on("/api/analog-triggers", HTTP_GET, handleAnalogTriggers);
-    server.on("/api/analog-triggers", HTTP_POST, handleUpdateAnalogTriggers);
-    server.on("/api/ht-sensors", HTTP_GET, handleHTSensors);
-    server.on("/api/ht-sensors", HTTP_POST, handleUpdateHTSensor);
-    server.on("/api/config", HTTP_GET, handleConfig);
-    server.on("/api/config", HTTP_POST, handleUpdateConfig);
-    server.on("/api/debug", HTTP_GET, handleDebug);
-    server.on("/api/debug", HTTP_POST, handleDebugCommand);
-    server.on("/api/reboot", HTTP_POST, handleReboot);
+// API endpoints (handlers run from loop()). The route table of 'server' is
+// sized by HTTP_MAX_ROUTES; the build fails if this list outgrows it
+const ApiRoute apiRoutes[] = {
+    { "/api/status", HTTP_GET, handleSystemStatus },
+    { "/api/relay", HTTP_POST, handleRelayControl },
+    { "/api/schedules", HTTP_GET, handleSchedules },
+    { "/api/schedules", HTTP_POST, handleUpdateSchedule },
+    { "/api/evaluate-input-schedules", HTTP_GET, handleEvaluateInputSchedules },
+    { "/api/analog-triggers", HTTP_GET, handleAnalogTriggers },
+    { "/api/analog-triggers", HTTP_POST, handleUpdateAnalogTriggers },
+    { "/api/ht-sensors", HTTP_GET, handleHTSensors },
+    { "/api/ht-sensors", HTTP_POST, handleUpdateHTSensor },
+    { "/api/config", HTTP_GET, handleConfig },
+    { "/api/config", HTTP_POST, handleUpdateConfig },
+    { "/api/debug", HTTP_GET, handleDebug },
+    { "/api/debug", HTTP_POST, handleDebugCommand },
+    { "/api/reboot", HTTP_POST, handleReboot },
 
     // Communication endpoints
-    server.on("/api/communication", HTTP_GET, handleCommunicationStatus);
-    server.on("/api/communication", HTTP_POST, handleSetCommunication);
-    server.on("/api/communication/config", HTTP_GET, handleCommunicationConfig);
-    server.on("/api/communication/config", HTTP_POST, handleUpdateCommunicationConfig);
+    { "/api/communication", HTTP_GET, handleCommunicationStatus },
+    { "/api/communication", HTTP_POST, handleSetCommunication },
+    { "/api/communication/config", HTTP_GET, handleCommunicationConfig },
+    { "/api/communication/config", HTTP_POST, handleUpdateCommunicationConfig },
+    { "/api/mqtt", HTTP_GET, handleMqttConfig },
+    { "/api/mqtt", HTTP_POST, handleUpdateMqttConfig },
+    { "/api/mqtt/status", HTTP_GET, handleMqttStatus },
+    { "/api/udp", HTTP_GET, handleUdpConfig },
+    { "/api/udp", HTTP_POST, handleUpdateUdpConfig },
+    { "/api/udp/status", HTTP_GET, handleUdpStatus },
 
     // Time endpoints
-    server.on("/api/time", HTTP_GET, handleGetTime);
-    server.on("/api/time", HTTP_POST, handleSetTime);
+    { "/api/time", HTTP_GET, handleGetTime },
+    { "/api/time", HTTP_POST, handleSetTime },
 
     // Diagnostic endpoints
-    server.on("/api/i2c/scan", HTTP_GET, handleI2CScan);
+    { "/api/i2c/scan", HTTP_GET, handleI2CScan },
 
     // Network settings endpoints
-    server.on("/api/network/settings", HTTP_GET, handleNetworkSettings);
-    server.on("/api/network/settings", HTTP_POST, handleUpdateNetworkSettings);
+    { "/api/network/settings", HTTP_GET, handleNetworkSettings },
+    { "/api/network/settings", HTTP_POST, handleUpdateNetworkSettings },
 
     // Add interrupt configuration endpoint
-    server.on("/api/interrupts", HTTP_GET, handleInterrupts);
-    server.on("/api/interrupts", HTTP_POST, handleUpdateInterrupts);
+    { "/api/interrupts", HTTP_GET, handleInterrupts },
+    { "/api/interrupts", HTTP_POST, handleUpdateInterrupts }
+};
+static_assert(sizeof(apiRoutes) / sizeof(apiRoutes[0]) <= HTTP_MAX_ROUTES,
+    "apiRoutes has more entries than HTTP_MAX_ROUTES - raise the limit");
+
+void setupWebServer() {
+    // Config ETags from an earlier boot must not match the restarted counters
+    configBootId = esp_random();
+
+    // Static files are streamed from SPIFFS by the AsyncTCP task, gzipped
+    // and cacheable when packed by tools/build_web_assets.py
+    registerWebAssets();
 
-    // File upload handler
-    server.on("/api/upload", HTTP_POST, []() {
-        server.send(200, "text/plain", "File upload complete");
+    // File upload handler - writes straight to SPIFFS from the AsyncTCP task
+    httpServer.on("/api/upload", HTTP_POST, [](AsyncWebServerRequest* request) {
+        request->send(200, "text/plain", "File upload complete");
         }, handleFileUpload);
 
+    // API endpoints (handlers run from loop())
+    for (size_t i = 0; i < sizeof(apiRoutes) / sizeof(apiRoutes[0]); i++) {
+        server.on(apiRoutes[i].uri, apiRoutes[i].method, apiRoutes[i].handler);
+    }
+
     // Not found handler
     server.onNotFound(handleNotFound);
 
@@ -2277,34 +3703,688 @@ void setupWebServer() {
     debugPrintln("Web server started");
 }
 
-// Handle WebSocket events
-void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t length) {
-    switch (type) {
-    case WStype_DISCONNECTED:
-        debugPrintln("WebSocket client disconnected");
-        webSocketClients[num] = false;
-        break;
-    case WStype_CONNECTED:
-    {
-        IPAddress ip = webSocket.remoteIP(num);
-        debugPrintln("WebSocket client connected: " + ip.toString());
+// Register every web asset in SPIFFS with the async server
+void registerWebAssets() {
+    webAssetCount = 0;
+
+#if WEB_ASSETS_EMBEDDED
+    // Compiled-in UI: sent from memory-mapped flash, SPIFFS is not consulted
+    for (size_t i = 0; i < EMBEDDED_WEB_ASSET_COUNT && webAssetCount < WEB_MAX_ASSETS; i++) {
+        const EmbeddedWebAsset& embedded = embeddedWebAssets[i];
+        WebAsset& asset = webAssets[webAssetCount++];
+        asset.url = embedded.url;
+        asset.file = "";
+        asset.data = embedded.data;
+        asset.length = embedded.length;
+        asset.contentType = embedded.contentType;
+        asset.gzipped = true;
+        asset.immutable = embedded.immutable;
+        asset.etag = embedded.etag;
+    }
+#else
+    File root = SPIFFS.open("/");
+    File file = root.openNextFile();
+    while (file) {
+        String name = file.name();
+        file.close();
+
+        // Newer cores list names without the leading slash
+        if (!name.startsWith("/")) {
+            name = "/" + name;
+        }
+        addWebAsset(name);
+
+        file = root.openNextFile();
+    }
+    root.close();
+#endif
 
-        // Mark client as subscribed
-        webSocketClients[num] = true;
+    for (uint8_t i = 0; i < webAssetCount; i++) {
+        httpServer.on(webAssets[i].url.c_str(), HTTP_GET, [i](AsyncWebServerRequest* request) {
+            serveWebAsset(request, webAssets[i]);
+            });
 
-        // Send initial status update
-        DynamicJsonDocument doc(1024);
-        doc["type"] = "status";
-        doc["connected"] = true;
+        if (webAssets[i].url == "/index.html") {
+            httpServer.on("/", HTTP_GET, [i](AsyncWebServerRequest* request) {
+                serveWebAsset(request, webAssets[i]);
+                });
+        }
 
-        String message;
-        serializeJson(doc, message);
-        webSocket.sendTXT(num, message);
+        // Content-hashed assets carry their ETag in the name - only hash the rest
+        if (webAssets[i].etag.length() == 0) {
+            webAssets[i].etag = computeFileETag(webAssets[i].file);
+        }
 
-        // Send current state of all relays and inputs
-        broadcastUpdate();
+        debugPrintln("Web asset " + webAssets[i].url + (webAssets[i].data != NULL ? " (embedded" : webAssets[i].gzipped ? " (gzip" : " (plain") +
+            (webAssets[i].immutable ? ", immutable)" : ")"));
     }
-    break;
+}
+
+// Add a SPIFFS file to the asset table; a precompressed copy wins over the plain file.
+// Only the pipeline's files (webAssetNames, optionally hashed) are accepted.
+void addWebAsset(const String& file) {
+    bool gzipped = file.endsWith(".gz");
+    String url = gzipped ? file.substring(0, file.length() - 3) : file;
+
+    // name.<8 hex>.ext
+    String hash = "";
+    String name = url;
+    int extDot = url.lastIndexOf('.');
+    int hashDot = extDot > 0 ? url.lastIndexOf('.', extDot - 1) : -1;
+    if (hashDot >= 0 && extDot - hashDot - 1 == WEB_HASH_LENGTH) {
+        hash = url.substring(hashDot + 1, extDot);
+        for (int i = 0; i < WEB_HASH_LENGTH; i++) {
+            if (!isxdigit(hash[i])) {
+                hash = "";
+                break;
+            }
+        }
+        if (hash.length() > 0) {
+            name = url.substring(0, hashDot) + url.substring(extDot);
+        }
+    }
+
+    bool allowed = false;
+    for (size_t i = 0; i < sizeof(webAssetNames) / sizeof(webAssetNames[0]); i++) {
+        if (name == webAssetNames[i]) allowed = true;
+    }
+    if (!allowed) return;
+
+    const char* contentType = getContentType(url);
+    if (contentType == NULL) return;
+
+    int slot = -1;
+    for (uint8_t i = 0; i < webAssetCount; i++) {
+        if (webAssets[i].url == url) {
+            if (webAssets[i].gzipped || !gzipped) return;
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        if (webAssetCount >= WEB_MAX_ASSETS) {
+            debugPrintln("ERROR: Too many web assets, ignoring " + file);
+            return;
+        }
+        slot = webAssetCount++;
+    }
+
+    WebAsset& asset = webAssets[slot];
+    asset.url = url;
+    asset.file = file;
+    asset.data = NULL;
+    asset.length = 0;
+    asset.contentType = contentType;
+    asset.gzipped = gzipped;
+    asset.immutable = hash.length() > 0;
+    asset.etag = "";
+    if (asset.immutable) {
+        asset.etag = "\"" + hash + "\"";
+    }
+}
+
+const char* getContentType(const String& path) {
+    if (path.endsWith(".html")) return "text/html";
+    if (path.endsWith(".js")) return "application/javascript";
+    if (path.endsWith(".css")) return "text/css";
+    return NULL;
+}
+
+// FNV-1a over the file contents, read once at boot
+String computeFileETag(const String& path) {
+    File file = SPIFFS.open(path, "r");
+    if (!file) return "";
+
+    uint32_t hash = 2166136261UL;
+    uint8_t buffer[256];
+    size_t length;
+    while ((length = file.read(buffer, sizeof(buffer))) > 0) {
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ buffer[i]) * 16777619UL;
+        }
+    }
+    file.close();
+
+    char etag[12];
+    snprintf(etag, sizeof(etag), "\"%08lx\"", (unsigned long)hash);
+    return String(etag);
+}
+
+// Answer from the browser cache when the ETag still matches, otherwise stream
+// the file (AsyncTCP task - SPIFFS only)
+void serveWebAsset(AsyncWebServerRequest* request, const WebAsset& asset) {
+    AsyncWebServerResponse* response;
+
+    if (asset.etag.length() > 0 && request->hasHeader("If-None-Match") &&
+        request->header("If-None-Match") == asset.etag) {
+        response = request->beginResponse(304);
+        webAssetNotModifiedCount++;
+    }
+    else if (asset.data != NULL) {
+        // Streamed from the flash mapping in TCP-window sized pieces, no copy in RAM
+        response = request->beginResponse_P(200, asset.contentType, asset.data, asset.length);
+        response->addHeader("Content-Encoding", "gzip");
+        webAssetSentCount++;
+    }
+    else {
+        response = request->beginResponse(SPIFFS, asset.file, asset.contentType);
+        if (asset.gzipped) {
+            response->addHeader("Content-Encoding", "gzip");
+        }
+        webAssetSentCount++;
+    }
+
+    response->addHeader("Cache-Control", asset.immutable ? WEB_IMMUTABLE_CACHE : WEB_REVALIDATE_CACHE);
+    if (asset.etag.length() > 0) {
+        response->addHeader("ETag", asset.etag);
+    }
+    request->send(response);
+}
+
+// Mark a config domain as changed - cached copies in browsers become stale
+void bumpConfigRevision(uint8_t domain) {
+    if (domain < CONFIG_DOMAIN_COUNT) {
+        configRevisions[domain]++;
+    }
+}
+
+// Attach the domain's ETag to the response, or answer 304 when the client
+// already has this revision. 'live' folds in status values that a response
+// reports next to its settings, so those are never served stale.
+bool respondNotModified(uint8_t domain, uint32_t live) {
+    char etag[40];
+    snprintf(etag, sizeof(etag), "\"%08lx-%u-%lu-%08lx\"", (unsigned long)configBootId, domain,
+        (unsigned long)configRevisions[domain], (unsigned long)live);
+
+    server.sendHeader("ETag", etag);
+    server.sendHeader("Cache-Control", WEB_REVALIDATE_CACHE);
+
+    if (server.hasHeader("If-None-Match") && server.header("If-None-Match") == etag) {
+        configNotModifiedCount++;
+        server.send(304, "text/plain", "");
+        return true;
+    }
+    return false;
+}
+
+// Stream a collection as {"total":n,"offset":o,"count":c,"<key>":[...]}
+// honouring the ?offset= and ?limit= page parameters (default: everything)
+void sendJsonCollection(const char* key, int total, JsonElementWriter writer) {
+    int offset = server.hasArg("offset") ? server.arg("offset").toInt() : 0;
+    int limit = server.hasArg("limit") ? server.arg("limit").toInt() : total;
+    offset = constrain(offset, 0, total);
+    if (limit < 0 || limit > total - offset) {
+        limit = total - offset;
+    }
+
+    std::shared_ptr<JsonCollectionStream> stream(new (std::nothrow) JsonCollectionStream());
+    if (!stream) {
+        server.send(503, "application/json", "{\"status\":\"error\",\"message\":\"Out of memory\"}");
+        return;
+    }
+    stream->key = key;
+    stream->writer = writer;
+    stream->total = total;
+    stream->offset = offset;
+    stream->end = offset + limit;
+    stream->next = offset;
+    stream->phase = JSON_STREAM_HEADER;
+    stream->stagedLength = 0;
+    stream->stagedSent = 0;
+
+    // Entries are read as they are sent, each under configArraysMutex; the
+    // stream is freed together with the response, also when the client goes
+    // away part way through
+    server.sendChunked(200, "application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+        return stream->fill(buffer, maxLen);
+    });
+}
+
+// Link state reported by the communication endpoints (FNV-1a of the values)
+uint32_t getLinkSignature() {
+    uint32_t values[] = {
+        (uint32_t)wifiConnected, (uint32_t)ethConnected, (uint32_t)WiFi.RSSI(),
+        (uint32_t)WiFi.localIP(), (uint32_t)ETH.localIP(), (uint32_t)i2cErrorCount
+    };
+    uint32_t signature = 2166136261UL;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        signature = (signature ^ values[i]) * 16777619UL;
+    }
+    return signature;
+}
+
+// Guards the API request queue (short critical sections only)
+portMUX_TYPE httpQueueMux = portMUX_INITIALIZER_UNLOCKED;
+
+DeferredApiServer::DeferredApiServer() :
+    _routeCount(0),
+    _notFoundHandler(NULL),
+    _head(0),
+    _count(0),
+    _mutex(NULL),
+    _current(NULL),
+    _responded(false),
+    _headerCount(0),
+    _handledCount(0),
+    _rejectedCount(0),
+    _abandonedCount(0),
+    _copiedCount(0),
+    _maxDepth(0),
+    _maxHandlerTime(0),
+    _latencyIndex(0),
+    _latencyCount(0),
+    _rateWindowStart(0),
+    _rateWindowCount(0),
+    _requestRate(0)
+{
+    for (uint8_t i = 0; i < HTTP_RESPONSE_SLOTS; i++) {
+        _slots[i].owner = NULL;
+    }
+}
+
+void DeferredApiServer::on(const char* uri, WebRequestMethodComposite method, ApiHandler handler) {
+    if (_routeCount >= HTTP_MAX_ROUTES) {
+        // Not debug-only: a missing route is a firmware bug
+        Serial.println("ERROR: Too many API routes, ignoring " + String(uri));
+        return;
+    }
+    _routes[_routeCount].uri = uri;
+    _routes[_routeCount].method = method;
+    _routes[_routeCount].handler = handler;
+    _routeCount++;
+}
+
+void DeferredApiServer::begin() {
+    if (_mutex == NULL) {
+        _mutex = xSemaphoreCreateMutex();
+    }
+
+    // Everything the static handlers did not take arrives here, body first
+    httpServer.onRequestBody([](AsyncWebServerRequest* request, uint8_t* data, size_t length, size_t index, size_t total) {
+        server.collectBody(request, data, length, index, total);
+        });
+    httpServer.onNotFound([](AsyncWebServerRequest* request) {
+        server.enqueue(request);
+        });
+
+    httpServer.begin();
+}
+
+void DeferredApiServer::collectBody(AsyncWebServerRequest* request, uint8_t* data, size_t length, size_t index, size_t total) {
+    // Oversized bodies are dropped here and refused once the request completes
+    if (total > HTTP_MAX_BODY) return;
+
+    if (index == 0) {
+        request->_tempObject = malloc(total + 1);  // Freed with the request
+    }
+
+    char* body = (char*)request->_tempObject;
+    if (body == NULL || index + length > total) return;
+
+    memcpy(body + index, data, length);
+    body[index + length] = '\0';
+}
+
+void DeferredApiServer::enqueue(AsyncWebServerRequest* request) {
+    if (request->contentLength() > HTTP_MAX_BODY) {
+        reject(request, 413, "Request body too large");
+        return;
+    }
+
+    bool queued = false;
+
+    portENTER_CRITICAL(&httpQueueMux);
+    if (_count < HTTP_QUEUE_DEPTH) {
+        QueuedRequest& entry = _queue[(_head + _count) % HTTP_QUEUE_DEPTH];
+        entry.request = request;
+        entry.abandoned = false;
+        entry.queuedAt = micros();
+        _count++;
+        if (_count > _maxDepth) _maxDepth = _count;
+        queued = true;
+    }
+    portEXIT_CRITICAL(&httpQueueMux);
+
+    if (!queued) {
+        reject(request, 503, "Server busy");
+        return;
+    }
+
+    request->onDisconnect([request]() {
+        server.abandon(request);
+        });
+}
+
+// Called by the AsyncTCP task just before it frees a request. loop() holds
+// _mutex only for a dequeue or a single accessor call, so this never waits
+// for a handler to finish
+void DeferredApiServer::abandon(AsyncWebServerRequest* request) {
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+
+    portENTER_CRITICAL(&httpQueueMux);
+    for (uint8_t i = 0; i < _count; i++) {
+        QueuedRequest& entry = _queue[(_head + i) % HTTP_QUEUE_DEPTH];
+        if (entry.request == request) {
+            entry.abandoned = true;
+        }
+    }
+    for (uint8_t i = 0; i < HTTP_RESPONSE_SLOTS; i++) {
+        if (_slots[i].owner == request) {
+            _slots[i].owner = NULL;
+        }
+    }
+    portEXIT_CRITICAL(&httpQueueMux);
+
+    // The handler running for it carries on; its calls see no request
+    if (_current == request) {
+        _current = NULL;
+    }
+
+    xSemaphoreGive(_mutex);
+}
+
+void DeferredApiServer::reject(AsyncWebServerRequest* request, int code, const char* message) {
+    _rejectedCount++;
+    AsyncWebServerResponse* response = request->beginResponse(code, "text/plain", message);
+    if (code == 503) {
+        response->addHeader("Retry-After", "1");
+    }
+    request->send(response);
+}
+
+void DeferredApiServer::handleClient() {
+    unsigned long now = millis();
+
+    // Requests per second over the last full second
+    if (now - _rateWindowStart >= 1000) {
+        _requestRate = _rateWindowCount * 1000.0f / (now - _rateWindowStart);
+        _rateWindowStart = now;
+        _rateWindowCount = 0;
+    }
+
+    for (uint8_t n = 0; n < HTTP_REQUESTS_PER_LOOP && _count > 0; n++) {
+        QueuedRequest entry;
+        bool found = false;
+        ApiHandler handler = NULL;
+
+        // Dequeue and claim the request in one step, so a disconnect either
+        // marks it in the queue or clears _current
+        xSemaphoreTake(_mutex, portMAX_DELAY);
+        portENTER_CRITICAL(&httpQueueMux);
+        if (_count > 0) {
+            entry = _queue[_head];
+            _head = (_head + 1) % HTTP_QUEUE_DEPTH;
+            _count--;
+            found = true;
+        }
+        portEXIT_CRITICAL(&httpQueueMux);
+
+        if (found && !entry.abandoned) {
+            _current = entry.request;
+            handler = findHandler(_current->url(), _current->method());
+        }
+        xSemaphoreGive(_mutex);
+
+        if (!found) break;
+
+        if (entry.abandoned) {
+            _abandonedCount++;
+        }
+        else {
+            unsigned long start = micros();
+
+            _responded = false;
+            _headerCount = 0;
+
+            if (handler != NULL) {
+                handler();
+            }
+            if (!_responded) {
+                send(500, "text/plain", "No response");
+            }
+
+            xSemaphoreTake(_mutex, portMAX_DELAY);
+            _current = NULL;
+            xSemaphoreGive(_mutex);
+
+            unsigned long end = micros();
+            if (end - start > _maxHandlerTime) _maxHandlerTime = end - start;
+            _latencies[_latencyIndex] = end - entry.queuedAt;
+            _latencyIndex = (_latencyIndex + 1) % HTTP_LATENCY_SAMPLES;
+            if (_latencyCount < HTTP_LATENCY_SAMPLES) _latencyCount++;
+            _handledCount++;
+            _rateWindowCount++;
+        }
+    }
+}
+
+ApiHandler DeferredApiServer::findHandler(const String& url, WebRequestMethodComposite method) {
+    for (uint8_t i = 0; i < _routeCount; i++) {
+        if ((_routes[i].method & method) && url.equals(_routes[i].uri)) {
+            return _routes[i].handler;
+        }
+    }
+    return _notFoundHandler;
+}
+
+unsigned long DeferredApiServer::getLatencyPercentile(uint8_t percent) {
+    unsigned long sorted[HTTP_LATENCY_SAMPLES];
+    uint8_t count = _latencyCount;
+    if (count == 0) return 0;
+
+    memcpy(sorted, _latencies, count * sizeof(unsigned long));
+    std::sort(sorted, sorted + count);
+
+    uint8_t index = (uint8_t)((count * (uint16_t)percent + 99) / 100);
+    return sorted[index > 0 ? index - 1 : 0];
+}
+
+// Take _mutex for one use of the request; false (and not held) once the
+// client has gone
+bool DeferredApiServer::lockCurrent() {
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    if (_current == NULL) {
+        xSemaphoreGive(_mutex);
+        return false;
+    }
+    return true;
+}
+
+bool DeferredApiServer::hasArg(const String& name) {
+    if (!lockCurrent()) return false;
+    bool found = (name == "plain") ? _current->_tempObject != NULL : _current->hasArg(name.c_str());
+    xSemaphoreGive(_mutex);
+    return found;
+}
+
+String DeferredApiServer::arg(const String& name) {
+    if (!lockCurrent()) return String();
+    String value;
+    if (name == "plain") {
+        if (_current->_tempObject != NULL) value = (const char*)_current->_tempObject;
+    }
+    else {
+        value = _current->arg(name);
+    }
+    xSemaphoreGive(_mutex);
+    return value;
+}
+
+String DeferredApiServer::arg(int i) {
+    if (!lockCurrent()) return String();
+    String value = _current->arg((size_t)i);
+    xSemaphoreGive(_mutex);
+    return value;
+}
+
+String DeferredApiServer::argName(int i) {
+    if (!lockCurrent()) return String();
+    String name = _current->argName((size_t)i);
+    xSemaphoreGive(_mutex);
+    return name;
+}
+
+int DeferredApiServer::args() {
+    if (!lockCurrent()) return 0;
+    int count = _current->args();
+    xSemaphoreGive(_mutex);
+    return count;
+}
+
+String DeferredApiServer::uri() {
+    if (!lockCurrent()) return String();
+    String url = _current->url();
+    xSemaphoreGive(_mutex);
+    return url;
+}
+
+String DeferredApiServer::hostHeader() {
+    if (!lockCurrent()) return String();
+    String host = _current->host();
+    xSemaphoreGive(_mutex);
+    return host;
+}
+
+bool DeferredApiServer::hasHeader(const String& name) {
+    if (!lockCurrent()) return false;
+    bool found = _current->hasHeader(name);
+    xSemaphoreGive(_mutex);
+    return found;
+}
+
+String DeferredApiServer::header(const String& name) {
+    if (!lockCurrent()) return String();
+    String value = _current->header(name);
+    xSemaphoreGive(_mutex);
+    return value;
+}
+
+WebRequestMethodComposite DeferredApiServer::method() {
+    if (!lockCurrent()) return HTTP_ANY;
+    WebRequestMethodComposite requestMethod = _current->method();
+    xSemaphoreGive(_mutex);
+    return requestMethod;
+}
+
+void DeferredApiServer::sendHeader(const String& name, const String& value, bool first) {
+    if (_headerCount >= HTTP_MAX_HEADERS) return;
+
+    // Header order does not matter to AsyncWebServer; 'first' is accepted for
+    // compatibility with WebServer
+    _headerNames[_headerCount] = name;
+    _headerValues[_headerCount] = value;
+    _headerCount++;
+}
+
+void DeferredApiServer::send(int code, const char* contentType, const String& content) {
+    if (_responded || !lockCurrent()) return;
+
+    sendResponse(_current->beginResponse(code, contentType, content));
+    xSemaphoreGive(_mutex);
+}
+
+// Body produced piece by piece by the filler, sent with chunked encoding
+void DeferredApiServer::sendChunked(int code, const char* contentType, AwsResponseFiller filler) {
+    if (_responded || !lockCurrent()) return;
+
+    AsyncWebServerResponse* response = _current->beginChunkedResponse(contentType, filler);
+    response->setCode(code);
+    sendResponse(response);
+    xSemaphoreGive(_mutex);
+}
+
+// Called with _mutex held
+void DeferredApiServer::sendResponse(AsyncWebServerResponse* response) {
+    for (uint8_t i = 0; i < _headerCount; i++) {
+        response->addHeader(_headerNames[i], _headerValues[i]);
+    }
+    _current->send(response);
+    _responded = true;
+}
+
+// The caller's buffer (jsonOutBuffer) is reused long before the AsyncTCP task
+// has finished sending, so the body goes into a free response slot and the
+// response reads it from there; only when every slot is still being sent is
+// it copied to the heap
+void DeferredApiServer::send_P(int code, const char* contentType, const char* content, size_t length) {
+    if (_responded || !lockCurrent()) return;
+
+    int slot = -1;
+    if (length > 0 && length <= HTTP_RESPONSE_SLOT_SIZE) {
+        portENTER_CRITICAL(&httpQueueMux);
+        for (uint8_t i = 0; i < HTTP_RESPONSE_SLOTS; i++) {
+            if (_slots[i].owner == NULL) {
+                _slots[i].owner = _current;
+                slot = i;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&httpQueueMux);
+    }
+
+    if (slot < 0) {
+        if (length > 0) _copiedCount++;
+        sendResponse(_current->beginResponse(code, contentType, String(content, length)));
+        xSemaphoreGive(_mutex);
+        return;
+    }
+
+    // The AsyncTCP task only reads an owned slot; abandon() frees it if the
+    // client goes away first
+    HttpResponseSlot& body = _slots[slot];
+    memcpy(body.body, content, length);
+    body.length = length;
+
+    AsyncWebServerResponse* response = _current->beginResponse(contentType, length,
+        [this, slot](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+            HttpResponseSlot& body = _slots[slot];
+            size_t chunk = std::min(maxLen, body.length - index);
+            memcpy(buffer, body.body + index, chunk);
+            if (index + chunk >= body.length) {
+                portENTER_CRITICAL(&httpQueueMux);
+                body.owner = NULL;
+                portEXIT_CRITICAL(&httpQueueMux);
+            }
+            return chunk;
+        });
+    response->setCode(code);
+    sendResponse(response);
+    xSemaphoreGive(_mutex);
+}
+
+// Handle WebSocket events
+void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t length) {
+    switch (type) {
+    case WStype_DISCONNECTED:
+        debugPrintln("WebSocket client disconnected");
+        resetWebSocketClient(num);
+        webSocketClients[num].subscribed = false;
+        break;
+    case WStype_BIN:
+        handleBinaryCommand(num, payload, length);
+        break;
+    case WStype_CONNECTED:
+    {
+        IPAddress ip = webSocket.remoteIP(num);
+        debugPrintln("WebSocket client connected: " + ip.toString());
+
+        // Mark client as subscribed to everything at the default rate
+        resetWebSocketClient(num);
+
+        // Send initial status update
+        DynamicJsonDocument doc(1024);
+        doc["type"] = "status";
+        doc["connected"] = true;
+
+        String message;
+        serializeJson(doc, message);
+        webSocket.sendTXT(num, message);
+
+        // Full snapshot for the newcomer; everyone else keeps getting deltas
+        sendFullSnapshot(num);
+    }
+    break;
     case WStype_TEXT:
     {
         String text = String((char*)payload);
@@ -2318,15 +4398,58 @@ void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t l
             String cmd = doc["command"];
 
             if (cmd == "subscribe") {
-                // Subscribe to real-time updates
-                webSocketClients[num] = true;
-                debugPrintln("Client subscribed to updates");
+                // Subscribe to real-time updates, optionally limited to some
+                // topics and a maximum rate:
+                // {"command":"subscribe","topics":["outputs","inputs"],"rate":5}
+                WebSocketClientState& client = webSocketClients[num];
+                client.subscribed = true;
+
+                if (doc.containsKey("rate")) {
+                    int rate = doc["rate"];
+                    if (rate < 1) rate = 1;
+                    if (rate > 50) rate = 50;
+                    client.requestedInterval = 1000 / rate;
+                    client.interval = client.requestedInterval;
+                }
+
+                bool topicsChanged = false;
+                if (doc.containsKey("topics")) {
+                    const char* topicNames[] = { "outputs", "inputs", "analog", "sensors", "system" };
+                    uint8_t topics = 0;
+                    for (JsonVariant topic : doc["topics"].as<JsonArray>()) {
+                        for (int t = 0; t < 5; t++) {
+                            if (topic == topicNames[t]) topics |= (1 << t);
+                        }
+                    }
+                    topicsChanged = topics != client.topics;
+                    client.topics = topics;
+                }
+                debugPrintln("Client " + String(num) + " subscribed (topics 0x" + String(client.topics, HEX) +
+                    ", every " + String(client.requestedInterval) + " ms)");
+
+                // Optional compact binary stream; confirmed by the first state frame
+                if (doc["format"] == "binary") {
+                    client.format = WS_FORMAT_BINARY;
+
+                    uint8_t frame[WS_BIN_STATE_SIZE];
+                    buildBinaryState(frame, ++client.sequence);
+                    webSocket.sendBIN(num, frame, WS_BIN_STATE_SIZE);
+                }
+                else if (topicsChanged) {
+                    // Newly added topics need their current values
+                    sendFullSnapshot(num);
+                }
             }
             else if (cmd == "unsubscribe") {
                 // Unsubscribe from updates
-                webSocketClients[num] = false;
+                webSocketClients[num].subscribed = false;
                 debugPrintln("Client unsubscribed from updates");
             }
+            else if (cmd == "resync") {
+                // Client saw a gap in the sequence numbers
+                debugPrintln("WebSocket client " + String(num) + " requested resync");
+                sendFullSnapshot(num);
+            }
             else if (cmd == "toggle_relay") {
                 // Toggle relay command
                 int relay = doc["relay"];
@@ -2351,7 +4474,7 @@ void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t l
                         webSocket.sendTXT(num, response);
 
                         // Broadcast update to all subscribed clients
-                        broadcastUpdate();
+                        requestBroadcast();
                     }
                     else {
                         // Send error response
@@ -2370,6 +4493,16 @@ void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t l
                     debugPrintln("ERROR: Invalid relay index: " + String(relay));
                 }
             }
+            else if (cmd == "execute") {
+                // Console command, same table as the serial ports
+                DynamicJsonDocument responseDoc(256);
+                responseDoc["type"] = "command_response";
+                responseDoc["response"] = executeCommandToBuffer(doc["line"] | "");
+
+                String response;
+                serializeJson(responseDoc, response);
+                webSocket.sendTXT(num, response);
+            }
             else if (cmd == "get_protocol_config") {
                 // Get protocol-specific configuration
                 String protocol = doc["protocol"];
@@ -2407,6 +4540,7 @@ void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t l
                     }
                 }
                 else if (protocol == "usb") {
+                    responseDoc["enabled"] = commChannels[COMM_CHANNEL_USB].enabled;
                     responseDoc["com_port"] = usbComPort;
                     responseDoc["baud_rate"] = usbBaudRate;
                     responseDoc["data_bits"] = usbDataBits;
@@ -2414,6 +4548,7 @@ void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t l
                     responseDoc["stop_bits"] = usbStopBits;
                 }
                 else if (protocol == "rs485") {
+                    responseDoc["enabled"] = commChannels[COMM_CHANNEL_RS485].enabled;
                     responseDoc["baud_rate"] = rs485BaudRate;
                     responseDoc["parity"] = rs485Parity;
                     responseDoc["data_bits"] = rs485DataBits;
@@ -2438,107 +4573,603 @@ void handleWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t l
     }
 }
 
-// Modify broadcastUpdate() function to include sensor data
-void broadcastUpdate() {
-    DynamicJsonDocument doc(4096);
-    doc["type"] = "status_update";
-    doc["time"] = getTimeString();
-    doc["timestamp"] = millis(); // Add timestamp for freshness checking
+// Write the controller state as members of the open object: every element of
+// the given topics, or only the elements flagged in 'changes' when it is not NULL
+void writeStatusJson(JsonWriter& json, uint8_t topics, const PendingChanges* changes) {
+    if (changes == NULL) {
+        json.addUInt("timestamp", millis()); // Add timestamp for freshness checking
+        json.addString("device", deviceName.c_str());
+        json.addString("firmware_version", firmwareVersion.c_str());
+        json.addUInt("cpu_freq", ESP.getCpuFreqMHz());
+    }
 
     // Add output states
-    JsonArray outputs = doc.createNestedArray("outputs");
-    for (int i = 0; i < 16; i++) {
-        JsonObject output = outputs.createNestedObject();
-        output["id"] = i;
-        output["state"] = outputStates[i];
+    uint16_t outputMask = changes ? changes->outputs : 0xFFFF;
+    if ((topics & WS_TOPIC_OUTPUTS) && outputMask) {
+        writeStateArray(json, "outputs", outputStates, 16, outputMask);
     }
 
-    // Add input states
-    JsonArray inputs = doc.createNestedArray("inputs");
-    for (int i = 0; i < 16; i++) {
-        JsonObject input = inputs.createNestedObject();
-        input["id"] = i;
-        input["state"] = inputStates[i];
+    // Add input states and direct input states (HT1-HT3)
+    uint16_t inputMask = changes ? changes->inputs : 0xFFFF;
+    uint8_t directMask = changes ? changes->directInputs : 0x07;
+    if ((topics & WS_TOPIC_INPUTS) && inputMask) {
+        writeStateArray(json, "inputs", inputStates, 16, inputMask);
     }
-
-    // Add direct input states (HT1-HT3)
-    JsonArray directInputs = doc.createNestedArray("direct_inputs");
-    for (int i = 0; i < 3; i++) {
-        JsonObject input = directInputs.createNestedObject();
-        input["id"] = i;
-        input["state"] = directInputStates[i];
+    if ((topics & WS_TOPIC_INPUTS) && directMask) {
+        writeStateArray(json, "direct_inputs", directInputStates, 3, directMask);
     }
 
     // Add HT sensors data
-    JsonArray htSensors = doc.createNestedArray("htSensors");
-    for (int i = 0; i < 3; i++) {
-        JsonObject sensor = htSensors.createNestedObject();
-        sensor["index"] = i;
-        sensor["pin"] = "HT" + String(i + 1);
-        sensor["sensorType"] = htSensorConfig[i].sensorType;
-
-        const char* sensorTypeNames[] = {
-            "Digital Input", "DHT11", "DHT22", "DS18B20"
-        };
-        sensor["sensorTypeName"] = sensorTypeNames[htSensorConfig[i].sensorType];
-
-        switch (htSensorConfig[i].sensorType) {
-        case SENSOR_TYPE_DIGITAL:
-            sensor["value"] = directInputStates[i] ? "HIGH" : "LOW";
-            break;
-
-        case SENSOR_TYPE_DHT11:
-        case SENSOR_TYPE_DHT22:
-            sensor["temperature"] = htSensorConfig[i].temperature;
-            sensor["humidity"] = htSensorConfig[i].humidity;
-            break;
-
-        case SENSOR_TYPE_DS18B20:
-            sensor["temperature"] = htSensorConfig[i].temperature;
-            break;
+    uint8_t sensorMask = changes ? changes->sensors : 0x07;
+    if ((topics & WS_TOPIC_SENSORS) && sensorMask) {
+        json.beginArray("htSensors");
+        for (int i = 0; i < 3; i++) {
+            if (sensorMask & (1 << i)) {
+                writeHTSensorJson(json, i);
+            }
         }
+        json.endArray();
     }
 
     // Add analog inputs
-    JsonArray analog = doc.createNestedArray("analog");
-    for (int i = 0; i < 4; i++) {
-        JsonObject analogInput = analog.createNestedObject();
-        analogInput["id"] = i;
-        analogInput["value"] = analogValues[i];
-        analogInput["voltage"] = analogVoltages[i];
-        analogInput["percentage"] = map(analogValues[i], 0, 4095, 0, 100);
+    uint8_t analogMask = changes ? changes->analog : 0x0F;
+    if ((topics & WS_TOPIC_ANALOG) && analogMask) {
+        json.beginArray("analog");
+        for (int i = 0; i < 4; i++) {
+            if (analogMask & (1 << i)) {
+                writeAnalogJson(json, i, map(analogValues[i], 0, 4095, 0, 100));
+            }
+        }
+        json.endArray();
     }
 
     // Add system information
-    doc["device"] = deviceName;
-    doc["wifi_connected"] = WiFi.status() == WL_CONNECTED;
-    doc["wifi_rssi"] = WiFi.RSSI();
-    doc["wifi_ip"] = WiFi.localIP().toString();
-    doc["eth_connected"] = ETH.linkUp();
-    doc["eth_ip"] = ETH.localIP().toString();
-    doc["mac"] = ETH.linkUp() ? ETH.macAddress() : WiFi.macAddress();
-    doc["uptime"] = getUptimeString();
-    doc["active_protocol"] = getActiveProtocolName();
-    doc["firmware_version"] = FIRMWARE_VERSION;
-    doc["i2c_errors"] = i2cErrorCount;
-    doc["free_heap"] = ESP.getFreeHeap();
-    doc["cpu_freq"] = ESP.getCpuFreqMHz();
-    doc["last_error"] = lastErrorMessage;
-
-    String jsonString;
-    serializeJson(doc, jsonString);
-
-    // Send to all WebSocket clients
-    webSocket.broadcastTXT(jsonString);
+    uint8_t systemMask = changes ? changes->system : (WS_CHANGE_LINK | WS_CHANGE_HEALTH);
+    if (topics & WS_TOPIC_SYSTEM) {
+        if (systemMask & WS_CHANGE_LINK) writeConnectionJson(json);
+        if (systemMask & WS_CHANGE_HEALTH) writeSystemHealthJson(json);
+    }
 }
 
-// Save WiFi credentials to EEPROM
-void saveWiFiCredentials(String ssid, String password) {
-    // Store SSID
-    for (int i = 0; i < 64; i++) {
-        if (i < ssid.length()) {
-            EEPROM.write(EEPROM_WIFI_SSID_ADDR + i, ssid[i]);
-        }
+// Array of {id, state} objects for the elements set in 'mask'
+void writeStateArray(JsonWriter& json, const char* name, const bool* states, int count, uint16_t mask) {
+    json.beginArray(name);
+    for (int i = 0; i < count; i++) {
+        if (!(mask & (1 << i))) continue;
+        json.beginObject();
+        json.addInt("id", i);
+        json.addBool("state", states[i]);
+        json.endObject();
+    }
+    json.endArray();
+}
+
+void writeHTSensorJson(JsonWriter& json, int i) {
+    const char* sensorTypeNames[] = {
+        "Digital Input", "DHT11", "DHT22", "DS18B20"
+    };
+    char pin[4] = { 'H', 'T', (char)('1' + i), '\0' };
+
+    json.beginObject();
+    json.addInt("index", i);
+    json.addString("pin", pin);
+    json.addInt("sensorType", htSensorConfig[i].sensorType);
+    json.addString("sensorTypeName", sensorTypeNames[htSensorConfig[i].sensorType]);
+    json.addBool("stale", htSensorConfig[i].stale);
+    json.addUInt("failures", htSensorConfig[i].consecutiveFailures);
+
+    switch (htSensorConfig[i].sensorType) {
+    case SENSOR_TYPE_DIGITAL:
+        json.addString("value", directInputStates[i] ? "HIGH" : "LOW");
+        break;
+
+    case SENSOR_TYPE_DHT11:
+    case SENSOR_TYPE_DHT22:
+        json.addFloat("temperature", htSensorConfig[i].temperature, 2);
+        json.addFloat("humidity", htSensorConfig[i].humidity, 2);
+        break;
+
+    case SENSOR_TYPE_DS18B20:
+        json.addFloat("temperature", htSensorConfig[i].temperature, 2);
+        break;
+    }
+    json.endObject();
+}
+
+void writeAnalogJson(JsonWriter& json, int i, int percentage) {
+    json.beginObject();
+    json.addInt("id", i);
+    json.addInt("value", analogValues[i]);
+    json.addFloat("voltage", analogVoltages[i], 3);
+    json.addInt("percentage", percentage);
+    json.endObject();
+}
+
+// Network link state - changes rarely
+void writeConnectionJson(JsonWriter& json) {
+    uint8_t mac[6];
+    bool ethUp = ETH.linkUp();
+
+    json.addBool("wifi_connected", WiFi.status() == WL_CONNECTED);
+    json.addIP("wifi_ip", WiFi.localIP());
+    json.addBool("eth_connected", ethUp);
+    json.addIP("eth_ip", ETH.localIP());
+    if (ethUp) {
+        ETH.macAddress(mac);
+    }
+    else {
+        WiFi.macAddress(mac);
+    }
+    json.addMac("mac", mac);
+    json.addString("active_protocol", getActiveProtocolLabel());
+}
+
+// Slowly drifting values - refreshed on a timer in the delta stream
+void writeSystemHealthJson(JsonWriter& json) {
+    char text[32];
+
+    formatTimeString(text, sizeof(text));
+    json.addString("time", text);
+    formatUptime(text, sizeof(text));
+    json.addString("uptime", text);
+    json.addInt("wifi_rssi", WiFi.RSSI());
+    json.addUInt("free_heap", ESP.getFreeHeap());
+    json.addUInt("i2c_errors", i2cErrorCount);
+    json.addString("last_error", lastErrorMessage.c_str());
+}
+
+// Send a document built in jsonOutBuffer; the library writes the frame header
+// into the spare bytes in front of it, so nothing is copied or allocated
+bool sendJsonFrame(uint8_t num, const JsonWriter& json) {
+    if (json.overflow) {
+        jsonOverflowCount++;
+        return false;
+    }
+    return webSocket.sendTXT(num, jsonOutBuffer, json.length, true);
+}
+
+// HTTP response from a document built in jsonOutBuffer
+void sendJsonResponse(const JsonWriter& json) {
+    if (json.overflow) {
+        jsonOverflowCount++;
+        server.send(500, "application/json", "{\"status\":\"error\",\"message\":\"Response too large\"}");
+        return;
+    }
+    server.send_P(200, "application/json", JSON_OUT_PAYLOAD, json.length);
+}
+
+// Remember what the last broadcast carried
+void rememberBroadcastState() {
+    for (int i = 0; i < 16; i++) {
+        wsLastSent.outputs[i] = outputStates[i];
+        wsLastSent.inputs[i] = inputStates[i];
+    }
+    for (int i = 0; i < 3; i++) {
+        wsLastSent.directInputs[i] = directInputStates[i];
+        wsLastSent.htSensorType[i] = htSensorConfig[i].sensorType;
+        wsLastSent.htTemperature[i] = htSensorConfig[i].temperature;
+        wsLastSent.htHumidity[i] = htSensorConfig[i].humidity;
+        wsLastSent.htStale[i] = htSensorConfig[i].stale;
+        wsLastSent.htFailures[i] = htSensorConfig[i].consecutiveFailures;
+    }
+    for (int i = 0; i < 4; i++) {
+        wsLastSent.analogValues[i] = analogValues[i];
+    }
+    wsLastSent.wifiConnected = WiFi.status() == WL_CONNECTED;
+    wsLastSent.ethConnected = ETH.linkUp();
+    wsLastSent.i2cErrors = i2cErrorCount;
+    // Only copy on change so an unchanged message costs no reallocation
+    if (wsLastSent.lastError != lastErrorMessage) {
+        wsLastSent.lastError = lastErrorMessage;
+    }
+}
+
+// Compare the live state with the previous pass and flag what changed
+bool collectChanges(PendingChanges& changes, unsigned long now) {
+    memset(&changes, 0, sizeof(changes));
+
+    for (int i = 0; i < 16; i++) {
+        if (outputStates[i] != wsLastSent.outputs[i]) changes.outputs |= (1 << i);
+        if (inputStates[i] != wsLastSent.inputs[i]) changes.inputs |= (1 << i);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (directInputStates[i] != wsLastSent.directInputs[i]) changes.directInputs |= (1 << i);
+
+        // A digital HT pin shows its level in the sensor card as well
+        bool sensorChanged = htSensorConfig[i].sensorType != wsLastSent.htSensorType[i] ||
+            htSensorConfig[i].temperature != wsLastSent.htTemperature[i] ||
+            htSensorConfig[i].humidity != wsLastSent.htHumidity[i] ||
+            htSensorConfig[i].stale != wsLastSent.htStale[i] ||
+            htSensorConfig[i].consecutiveFailures != wsLastSent.htFailures[i] ||
+            (htSensorConfig[i].sensorType == SENSOR_TYPE_DIGITAL && directInputStates[i] != wsLastSent.directInputs[i]);
+        if (sensorChanged) changes.sensors |= (1 << i);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (analogValues[i] != wsLastSent.analogValues[i]) changes.analog |= (1 << i);
+    }
+
+    if ((WiFi.status() == WL_CONNECTED) != wsLastSent.wifiConnected || ETH.linkUp() != wsLastSent.ethConnected) {
+        changes.system |= WS_CHANGE_LINK;
+    }
+
+    // Uptime, heap and RSSI drift constantly; send them on a timer (which also
+    // serves as the keep-alive) or together with a new error
+    if (now - wsLastSystemRefresh >= WS_SYSTEM_REFRESH_INTERVAL ||
+        i2cErrorCount != wsLastSent.i2cErrors || lastErrorMessage != wsLastSent.lastError) {
+        changes.system |= WS_CHANGE_HEALTH;
+        wsLastSystemRefresh = now;
+    }
+
+    return changes.outputs || changes.inputs || changes.directInputs ||
+        changes.sensors || changes.analog || changes.system;
+}
+
+bool hasPendingChanges(const PendingChanges& pending) {
+    return pending.outputs || pending.inputs || pending.directInputs ||
+        pending.sensors || pending.analog || pending.system;
+}
+
+// Fold new changes into a client's pending set, keeping only its topics;
+// returns true if an unsent update was still waiting (the two are merged)
+bool mergePendingChanges(WebSocketClientState& client, const PendingChanges& changes) {
+    bool waiting = hasPendingChanges(client.pending);
+
+    if (client.topics & WS_TOPIC_OUTPUTS) client.pending.outputs |= changes.outputs;
+    if (client.topics & WS_TOPIC_INPUTS) {
+        client.pending.inputs |= changes.inputs;
+        client.pending.directInputs |= changes.directInputs;
+    }
+    if (client.topics & WS_TOPIC_SENSORS) client.pending.sensors |= changes.sensors;
+    if (client.topics & WS_TOPIC_ANALOG) client.pending.analog |= changes.analog;
+    if (client.topics & WS_TOPIC_SYSTEM) client.pending.system |= changes.system;
+
+    return waiting;
+}
+
+// Default subscription: everything, JSON, at the global maximum rate
+void resetWebSocketClient(uint8_t num) {
+    WebSocketClientState& client = webSocketClients[num];
+    client.subscribed = true;
+    client.format = WS_FORMAT_JSON;
+    client.topics = WS_TOPIC_ALL;
+    client.requestedInterval = 1000 / (wsMaxUpdateRate > 0 ? wsMaxUpdateRate : 1);
+    client.interval = client.requestedInterval;
+    client.lastSendTime = 0;
+    client.sequence = 0;
+    memset(&client.pending, 0, sizeof(client.pending));
+    client.sendFailures = 0;
+    client.mergedUpdates = 0;
+    client.slowSends = 0;
+}
+
+// Send the client's subscribed state, tagged with its current sequence number
+// so the deltas that follow apply on top of it
+void sendFullSnapshot(uint8_t num) {
+    WebSocketClientState& client = webSocketClients[num];
+
+    JsonWriter json(JSON_OUT_PAYLOAD, JSON_OUT_BUFFER_SIZE);
+    json.beginObject();
+    json.addString("type", "status_update");
+    json.addBool("full", true);
+    json.addUInt("seq", client.sequence);
+    writeStatusJson(json, client.topics, NULL);
+    json.endObject();
+    sendJsonFrame(num, json);
+
+    // The snapshot already carries everything that was pending
+    memset(&client.pending, 0, sizeof(client.pending));
+}
+
+// Mark the live state as changed; the next serviceBroadcasts() pass that the
+// rate limit allows sends one update for everything changed since the last one
+void requestBroadcast() {
+    broadcastRequestCount++;
+    if (!broadcastDirty) {
+        broadcastDirtySince = millis();
+        broadcastDirty = true;
+    }
+}
+
+void serviceBroadcasts() {
+    unsigned long now = millis();
+    unsigned long minInterval = 1000 / (wsMaxUpdateRate > 0 ? wsMaxUpdateRate : 1);
+
+    if (broadcastDirty) {
+        // Hold briefly so changes from the same input edge coalesce, then
+        // respect the maximum rate
+        if (now - broadcastDirtySince >= WS_BROADCAST_HOLDOFF && now - lastBroadcastTime >= minInterval) {
+            broadcastDirty = false;
+            lastBroadcastTime = now;
+            broadcastSentCount++;
+            broadcastUpdate();
+        }
+    }
+    else if (now - lastBroadcastTime >= WS_BROADCAST_IDLE_TICK) {
+        // Picks up sensor changes nobody announced and lets the delta stream
+        // send its periodic system refresh
+        lastBroadcastTime = now;
+        broadcastUpdate();
+    }
+
+    // Each client is sent its merged pending changes when its own interval allows
+    flushClientUpdates(now);
+}
+
+// Detect what changed since the previous pass and queue it for every
+// subscribed client; the clients are sent their updates by flushClientUpdates()
+void broadcastUpdate() {
+    PendingChanges changes;
+    bool changed = collectChanges(changes, millis());
+    rememberBroadcastState();
+
+    if (!changed) {
+        return;
+    }
+
+    for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+        if (webSocketClients[num].subscribed && mergePendingChanges(webSocketClients[num], changes)) {
+            webSocketClients[num].mergedUpdates++;
+        }
+    }
+}
+
+void flushClientUpdates(unsigned long now) {
+    for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+        WebSocketClientState& client = webSocketClients[num];
+
+        if (!client.subscribed || !hasPendingChanges(client.pending)) continue;
+        if (now - client.lastSendTime < client.interval) continue;
+
+        if (!webSocket.clientIsConnected(num)) {
+            client.subscribed = false;
+            continue;
+        }
+
+        sendClientUpdate(num, now);
+    }
+}
+
+// Serialize only the client's pending elements and send them; every message
+// carries the client's next sequence number so it can detect a gap and resync
+void sendClientUpdate(uint8_t num, unsigned long now) {
+    WebSocketClientState& client = webSocketClients[num];
+    unsigned long start = millis();
+    bool sent;
+
+    client.lastSendTime = now;
+
+    if (client.format == WS_FORMAT_BINARY) {
+        // The binary frame always carries the full state; like the JSON
+        // buffer it keeps room for the frame header in front
+        buildBinaryState(wsBinaryFrame + WEBSOCKETS_MAX_HEADER_SIZE, client.sequence + 1);
+        sent = webSocket.sendBIN(num, wsBinaryFrame, WS_BIN_STATE_SIZE, true);
+    }
+    else {
+        JsonWriter json(JSON_OUT_PAYLOAD, JSON_OUT_BUFFER_SIZE);
+        json.beginObject();
+        json.addString("type", "delta");
+        json.addUInt("seq", client.sequence + 1);
+        writeStatusJson(json, client.topics, &client.pending);
+        json.endObject();
+        sent = sendJsonFrame(num, json);
+    }
+
+    if (sent) {
+        client.sequence++;
+        memset(&client.pending, 0, sizeof(client.pending));
+        client.sendFailures = 0;
+    }
+    else if (++client.sendFailures >= WS_MAX_SEND_FAILURES) {
+        // Pending changes stay merged for the retry; give up on a dead link
+        debugPrintln("WebSocket client " + String(num) + " not accepting data, disconnecting");
+        webSocket.disconnect(num);
+        client.subscribed = false;
+        return;
+    }
+
+    // A send that blocked means the client's TCP window is full - stretch its
+    // interval, and ease back towards the requested rate once it keeps up
+    if (millis() - start > WS_SLOW_SEND_TIME) {
+        client.slowSends++;
+        client.interval = (client.interval * 2 > WS_MAX_CLIENT_INTERVAL) ? WS_MAX_CLIENT_INTERVAL : client.interval * 2;
+    }
+    else if (client.interval > client.requestedInterval) {
+        client.interval = (client.interval / 2 < client.requestedInterval) ? client.requestedInterval : client.interval / 2;
+    }
+}
+
+// Serialize a full-state delta WS_BENCH_ITERATIONS times and report the time
+// taken and what the heap saw meanwhile. With CONFIG_HEAP_TRACING_STANDALONE
+// every allocation is counted (other tasks included); otherwise the heap's
+// block and byte totals before and after are compared.
+String runSerializerBenchmark() {
+    PendingChanges everything;
+    memset(&everything, 0xFF, sizeof(everything));
+    size_t length = 0;
+    bool overflow = false;
+
+#if CONFIG_HEAP_TRACING_STANDALONE
+    heap_trace_init_standalone(benchTraceRecords, WS_BENCH_TRACE_RECORDS);
+    heap_trace_start(HEAP_TRACE_ALL);
+#endif
+    multi_heap_info_t before;
+    heap_caps_get_info(&before, MALLOC_CAP_8BIT);
+    unsigned long start = micros();
+
+    for (uint32_t i = 0; i < WS_BENCH_ITERATIONS; i++) {
+        JsonWriter json(JSON_OUT_PAYLOAD, JSON_OUT_BUFFER_SIZE);
+        json.beginObject();
+        json.addString("type", "delta");
+        json.addUInt("seq", i);
+        writeStatusJson(json, WS_TOPIC_ALL, &everything);
+        json.endObject();
+        length = json.length;
+        overflow = overflow || json.overflow;
+    }
+
+    unsigned long elapsed = micros() - start;
+    multi_heap_info_t after;
+    heap_caps_get_info(&after, MALLOC_CAP_8BIT);
+#if CONFIG_HEAP_TRACING_STANDALONE
+    heap_trace_stop();
+    size_t traced = heap_trace_get_count();
+#endif
+
+    String response = "SERIALIZER BENCHMARK:\n";
+    response += "Iterations: " + String(WS_BENCH_ITERATIONS) + "\n";
+    response += "Message size: " + String(length) + " bytes" + (overflow ? " (overflow)" : "") + "\n";
+    response += "Time per message: " + String(elapsed / WS_BENCH_ITERATIONS) + " us\n";
+#if CONFIG_HEAP_TRACING_STANDALONE
+    response += "Allocations traced: " + String(traced) + " (" + String((float)traced / WS_BENCH_ITERATIONS, 2) + " per message)\n";
+#endif
+    response += "Heap blocks change: " + String((long)after.allocated_blocks - (long)before.allocated_blocks) + "\n";
+    response += "Heap bytes change: " + String((long)after.total_allocated_bytes - (long)before.total_allocated_bytes) + "\n";
+    response += "Free heap: " + String(ESP.getFreeHeap()) + "\n";
+    return response;
+}
+
+void putUint16LE(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+void putUint32LE(uint8_t* p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+// Pack the full state into a binary state frame (layout next to WS_BIN_STATE)
+void buildBinaryState(uint8_t* frame, uint32_t sequence) {
+    memset(frame, 0, WS_BIN_STATE_SIZE);
+    frame[0] = WS_BIN_STATE;
+    frame[1] = WS_BIN_VERSION;
+    putUint32LE(frame + 2, sequence);
+
+    uint16_t outputsMask = 0;
+    uint16_t inputsMask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (outputStates[i]) outputsMask |= (1 << i);
+        if (inputStates[i]) inputsMask |= (1 << i);
+    }
+    putUint16LE(frame + 6, outputsMask);
+    putUint16LE(frame + 8, inputsMask);
+
+    for (int i = 0; i < 3; i++) {
+        if (directInputStates[i]) frame[10] |= (1 << i);
+    }
+    if (WiFi.status() == WL_CONNECTED) frame[11] |= 0x01;
+    if (ETH.linkUp()) frame[11] |= 0x02;
+
+    for (int i = 0; i < 4; i++) {
+        putUint16LE(frame + 12 + i * 4, (uint16_t)analogValues[i]);
+        putUint16LE(frame + 14 + i * 4, (uint16_t)(analogVoltages[i] * 1000.0f + 0.5f));
+    }
+
+    for (int i = 0; i < 3; i++) {
+        uint8_t* sensor = frame + 28 + i * 7;
+        sensor[0] = htSensorConfig[i].sensorType;
+        sensor[1] = htSensorConfig[i].stale ? 0x01 : 0x00;
+        sensor[2] = htSensorConfig[i].consecutiveFailures;
+        putUint16LE(sensor + 3, (uint16_t)(int16_t)lroundf(htSensorConfig[i].temperature * 10.0f));
+        putUint16LE(sensor + 5, (uint16_t)lroundf(htSensorConfig[i].humidity * 10.0f));
+    }
+
+    time_t now;
+    struct tm timeinfo;
+    time(&now);
+    localtime_r(&now, &timeinfo);
+    frame[49] = (timeinfo.tm_year >= 100) ? (uint8_t)(timeinfo.tm_year - 100) : 0;
+    frame[50] = timeinfo.tm_mon + 1;
+    frame[51] = timeinfo.tm_mday;
+    frame[52] = timeinfo.tm_hour;
+    frame[53] = timeinfo.tm_min;
+    frame[54] = timeinfo.tm_sec;
+
+    putUint32LE(frame + 55, millis() / 1000);
+    putUint32LE(frame + 59, ESP.getFreeHeap());
+    frame[63] = (uint8_t)(int8_t)WiFi.RSSI();
+    putUint16LE(frame + 64, i2cErrorCount > 0xFFFF ? 0xFFFF : (uint16_t)i2cErrorCount);
+}
+
+void sendBinaryError(uint8_t num, uint8_t code) {
+    uint8_t frame[2] = { WS_BIN_ERROR, code };
+    webSocket.sendBIN(num, frame, sizeof(frame));
+}
+
+// Binary command frames - fixed layouts, no parsing beyond a length check
+void handleBinaryCommand(uint8_t num, uint8_t* payload, size_t length) {
+    if (length == 0) {
+        sendBinaryError(num, WS_BIN_ERR_FRAME);
+        return;
+    }
+
+    switch (payload[0]) {
+    case WS_BIN_CMD_SET_RELAY:
+        if (length != 3) {
+            sendBinaryError(num, WS_BIN_ERR_FRAME);
+            return;
+        }
+        if (payload[1] >= 16) {
+            sendBinaryError(num, WS_BIN_ERR_RELAY);
+            return;
+        }
+
+        outputStates[payload[1]] = payload[2] != 0;
+        if (!writeOutputs()) {
+            sendBinaryError(num, WS_BIN_ERR_WRITE);
+            debugPrintln("ERROR: Failed to toggle relay via WebSocket");
+        }
+        requestBroadcast();
+        break;
+
+    case WS_BIN_CMD_SET_MASK:
+    {
+        if (length != 5) {
+            sendBinaryError(num, WS_BIN_ERR_FRAME);
+            return;
+        }
+
+        uint16_t mask = payload[1] | (payload[2] << 8);
+        uint16_t states = payload[3] | (payload[4] << 8);
+        for (int i = 0; i < 16; i++) {
+            if (mask & (1 << i)) {
+                outputStates[i] = (states & (1 << i)) != 0;
+            }
+        }
+
+        if (!writeOutputs()) {
+            sendBinaryError(num, WS_BIN_ERR_WRITE);
+            debugPrintln("ERROR: Failed to write relays via WebSocket");
+        }
+        requestBroadcast();
+    }
+    break;
+
+    case WS_BIN_CMD_SNAPSHOT:
+    {
+        uint8_t frame[WS_BIN_STATE_SIZE];
+        buildBinaryState(frame, ++webSocketClients[num].sequence);
+        webSocket.sendBIN(num, frame, WS_BIN_STATE_SIZE);
+    }
+    break;
+
+    default:
+        sendBinaryError(num, WS_BIN_ERR_FRAME);
+        break;
+    }
+}
+
+// Save WiFi credentials to EEPROM
+void saveWiFiCredentials(String ssid, String password) {
+    // Store SSID
+    for (int i = 0; i < 64; i++) {
+        if (i < ssid.length()) {
+            EEPROM.write(EEPROM_WIFI_SSID_ADDR + i, ssid[i]);
+        }
 
         else {
             EEPROM.write(EEPROM_WIFI_SSID_ADDR + i, 0);
@@ -2560,6 +5191,8 @@ void saveWiFiCredentials(String ssid, String password) {
     // Update global variables
     wifiSSID = ssid;
     wifiPassword = password;
+    bumpConfigRevision(CONFIG_DOMAIN_CONFIG);
+    bumpConfigRevision(CONFIG_DOMAIN_COMMUNICATION);
 }
 
 // Load WiFi credentials from EEPROM
@@ -2606,6 +5239,7 @@ void saveCommunicationSettings() {
 
     EEPROM.commit();
     debugPrintln("Saved communication protocol: " + currentCommunicationProtocol);
+    bumpConfigRevision(CONFIG_DOMAIN_COMMUNICATION);
 }
 
 // Load communication protocol setting
@@ -2658,9 +5292,11 @@ void saveCommunicationConfig() {
     usb["data_bits"] = usbDataBits;
     usb["parity"] = usbParity;
     usb["stop_bits"] = usbStopBits;
+    usb["enabled"] = commChannels[COMM_CHANNEL_USB].enabled;
 
     // RS485 config
     JsonObject rs485Config = doc.createNestedObject("rs485");
+    rs485Config["enabled"] = commChannels[COMM_CHANNEL_RS485].enabled;
     rs485Config["baud_rate"] = rs485BaudRate;
     rs485Config["parity"] = rs485Parity;
     rs485Config["data_bits"] = rs485DataBits;
@@ -2671,6 +5307,10 @@ void saveCommunicationConfig() {
     rs485Config["flow_control"] = rs485FlowControl;
     rs485Config["night_mode"] = rs485NightMode;
 
+    // Modbus TCP server
+    JsonObject modbusTcpConfig = doc.createNestedObject("modbus_tcp");
+    modbusTcpConfig["enabled"] = modbusTcpEnabled;
+
     // Serialize JSON to a buffer
     char jsonBuffer[2048];
     size_t n = serializeJson(doc, jsonBuffer);
@@ -2687,6 +5327,7 @@ void saveCommunicationConfig() {
     EEPROM.commit();
 
     debugPrintln("Saved communication protocol configuration");
+    bumpConfigRevision(CONFIG_DOMAIN_COMMUNICATION);
 }
 
 // Load communication protocol specific configuration
@@ -2731,6 +5372,7 @@ void loadCommunicationConfig() {
                 usbDataBits = doc["usb"]["data_bits"] | 8;
                 usbParity = doc["usb"]["parity"] | 0;
                 usbStopBits = doc["usb"]["stop_bits"] | 1;
+                commChannels[COMM_CHANNEL_USB].enabled = doc["usb"]["enabled"] | true;
             }
 
             // RS485 config
@@ -2744,8 +5386,12 @@ void loadCommunicationConfig() {
                 rs485DeviceAddress = doc["rs485"]["device_address"] | 1;
                 rs485FlowControl = doc["rs485"]["flow_control"] | false;
                 rs485NightMode = doc["rs485"]["night_mode"] | false;
+                commChannels[COMM_CHANNEL_RS485].enabled = doc["rs485"]["enabled"] | true;
             }
 
+            // Modbus TCP server (off unless it was switched on)
+            modbusTcpEnabled = doc["modbus_tcp"]["enabled"] | false;
+
             debugPrintln("Communication configuration loaded from EEPROM");
         }
         else {
@@ -2776,61 +5422,30 @@ bool readInputs() {
         prevDirectInputStates[i] = directInputStates[i];
     }
 
-    // Read from PCF8574 input expanders using the PCF8574 library
-    // Inputs 1-8 (IC1)
-    for (int i = 0; i < 8; i++) {
-        bool newState = false;
-        try {
-            newState = inputIC1.digitalRead(i);
-        }
-        catch (const std::exception& e) {
-            i2cErrorCount++;
-            lastErrorMessage = "Error reading from Input IC1";
-            success = false;
-            debugPrintln("Error reading from Input IC1: " + String(e.what()));
-            continue;
-        }
-
-        // Invert because of the pull-up configuration (LOW = active/true)
-        newState = !newState;
-
-        if (inputStates[i] != newState) {
-            inputStates[i] = newState;
-            anyChanged = true;
-            debugPrintln("Input " + String(i + 1) + " changed to " + String(newState ? "HIGH" : "LOW"));
-
-            // Process this specific input change
-            if (inputInterruptsEnabled && interruptConfigs[i].enabled) {
-                processInputChange(i, newState);
-            }
-        }
-    }
-
-    // Inputs 9-16 (IC2)
-    for (int i = 0; i < 8; i++) {
-        bool newState = false;
-        try {
-            newState = inputIC2.digitalRead(i);
-        }
-        catch (const std::exception& e) {
-            i2cErrorCount++;
-            lastErrorMessage = "Error reading from Input IC2";
+    // Read each PCF8574 input expander with a single one-byte transfer;
+    // an expander in back-off is skipped and keeps its last states
+    const uint8_t inputAddresses[2] = { PCF8574_INPUTS_1_8, PCF8574_INPUTS_9_16 };
+    for (int ic = 0; ic < 2; ic++) {
+        uint8_t portValue;
+        if (!readExpanderPort(inputAddresses[ic], portValue)) {
             success = false;
-            debugPrintln("Error reading from Input IC2: " + String(e.what()));
             continue;
         }
 
-        // Invert because of the pull-up configuration (LOW = active/true)
-        newState = !newState;
-
-        if (inputStates[i + 8] != newState) {
-            inputStates[i + 8] = newState;
-            anyChanged = true;
-            debugPrintln("Input " + String(i + 9) + " changed to " + String(newState ? "HIGH" : "LOW"));
-
-            // Process this specific input change
-            if (inputInterruptsEnabled && interruptConfigs[i + 8].enabled) {
-                processInputChange(i + 8, newState);
+        for (int i = 0; i < 8; i++) {
+            // Invert because of the pull-up configuration (LOW = active/true)
+            bool newState = !(portValue & (1 << i));
+            int index = ic * 8 + i;
+
+            if (inputStates[index] != newState) {
+                inputStates[index] = newState;
+                anyChanged = true;
+                debugPrintln("Input " + String(index + 1) + " changed to " + String(newState ? "HIGH" : "LOW"));
+
+                // Process this specific input change
+                if (inputInterruptsEnabled && interruptConfigs[index].enabled) {
+                    processInputChange(index, newState);
+                }
             }
         }
     }
@@ -2872,37 +5487,13 @@ bool readInputs() {
     return anyChanged;
 }
 
-// Write outputs to PCF8574 chips using the PCF8574 library
+// Write outputs to PCF8574 chips, one port byte per expander
 bool writeOutputs() {
-    bool success = true;
-
-    // Set outputs 1-8 (IC4)
-    for (int i = 0; i < 8; i++) {
-        try {
-            // Write HIGH when output state is false (relays are active LOW)
-            outputIC4.digitalWrite(i, outputStates[i] ? LOW : HIGH);
-        }
-        catch (const std::exception& e) {
-            i2cErrorCount++;
-            lastErrorMessage = "Failed to write to Output IC4";
-            success = false;
-            debugPrintln("Error writing to Output IC4: " + String(e.what()));
-        }
-    }
+    // Both ports are owed until they have been written
+    relayPortsPending[0] = true;
+    relayPortsPending[1] = true;
 
-    // Set outputs 9-16 (IC3)
-    for (int i = 0; i < 8; i++) {
-        try {
-            // Write HIGH when output state is false (relays are active LOW)
-            outputIC3.digitalWrite(i, outputStates[i + 8] ? LOW : HIGH);
-        }
-        catch (const std::exception& e) {
-            i2cErrorCount++;
-            lastErrorMessage = "Failed to write to Output IC3";
-            success = false;
-            debugPrintln("Error writing to Output IC3: " + String(e.what()));
-        }
-    }
+    bool success = flushRelayPorts();
 
     if (success) {
         debugPrintln("Successfully updated all relays");
@@ -2912,14 +5503,48 @@ bool writeOutputs() {
     }
     else {
         debugPrintln("ERROR: Failed to write to some output expanders");
-        // Try to recover I2C bus
-        Wire.flush();
-        delay(50);
     }
 
     return success;
 }
 
+// Write every owed relay port; false if any is still owed. A port whose
+// expander is backing off stays pending for serviceOwedRelayPorts()
+bool flushRelayPorts() {
+    const uint8_t outputAddresses[2] = { PCF8574_OUTPUTS_1_8, PCF8574_OUTPUTS_9_16 };
+    bool success = true;
+
+    for (int ic = 0; ic < 2; ic++) {
+        if (!relayPortsPending[ic]) continue;
+
+        // A bit is LOW when the relay is on (relays are active LOW)
+        uint8_t portValue = 0xFF;
+        for (int i = 0; i < 8; i++) {
+            if (outputStates[ic * 8 + i]) portValue &= ~(1 << i);
+        }
+
+        if (writeExpanderPort(outputAddresses[ic], portValue)) {
+            relayPortsPending[ic] = false;
+        }
+        else {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+// Called from loop(): an owed port is retried once its expander's back-off
+// has elapsed, whether or not another relay command arrives
+void serviceOwedRelayPorts() {
+    if ((relayPortsPending[0] && isI2CDeviceAvailable(PCF8574_OUTPUTS_1_8)) ||
+        (relayPortsPending[1] && isI2CDeviceAvailable(PCF8574_OUTPUTS_9_16))) {
+        if (flushRelayPorts()) {
+            debugPrintln("Relay states re-sent to recovered output expander");
+        }
+    }
+}
+
 // Read analog input with improved noise reduction
 int readAnalogInput(uint8_t index) {
     int pinMapping[] = { ANALOG_PIN_1, ANALOG_PIN_2, ANALOG_PIN_3, ANALOG_PIN_4 };
@@ -2973,6 +5598,7 @@ void saveConfiguration() {
 
     // Commit changes
     EEPROM.commit();
+    bumpConfigRevision(CONFIG_DOMAIN_CONFIG);
 
     debugPrintln("Configuration saved to EEPROM");
 }
@@ -3026,7 +5652,8 @@ void loadConfiguration() {
         initializeDefaultConfig();
     }
 
-    // Initialize default schedules
+    // Initialize default schedules (setup() runs this before the web server
+    // starts, so nothing streams the arrays yet and configArraysMutex is not taken)
     for (int i = 0; i < MAX_SCHEDULES; i++) {
         schedules[i].enabled = false;
         schedules[i].triggerType = 0;     // Default to time-based
@@ -3039,8 +5666,13 @@ void loadConfiguration() {
         schedules[i].action = 0;
         schedules[i].targetType = 0;
         schedules[i].targetId = 0;
+        schedules[i].sensorIndex = 0;
+        schedules[i].sensorTriggerType = 0;
+        schedules[i].sensorCondition = 0;
+        schedules[i].sensorThreshold = 25.0f;
         snprintf(schedules[i].name, 32, "Schedule %d", i + 1);
     }
+    registerSensorThresholds();
 
     // Initialize default analog triggers
     for (int i = 0; i < MAX_ANALOG_TRIGGERS; i++) {
@@ -3065,11 +5697,6 @@ void initializeDefaultConfig() {
 }
 
 // Web server root handler
-void handleWebRoot() {
-    server.sendHeader("Location", "/index.html", true);
-    server.send(302, "text/plain", "");
-}
-
 // Handle 404 not found
 void handleNotFound() {
     // If in captive portal mode and request is for a domain, redirect to configuration page
@@ -3095,28 +5722,23 @@ void handleNotFound() {
     server.send(404, "text/plain", message);
 }
 
-// Handle file upload
-void handleFileUpload() {
-    HTTPUpload& upload = server.upload();
-
-    if (upload.status == UPLOAD_FILE_START) {
-        String filename = upload.filename;
+// Handle file upload (AsyncTCP task - touches nothing but SPIFFS)
+void handleFileUpload(AsyncWebServerRequest* request, String filename, size_t index, uint8_t* data, size_t length, bool final) {
+    if (index == 0) {
         if (!filename.startsWith("/")) {
             filename = "/" + filename;
         }
         debugPrintln("File upload start: " + filename);
         fsUploadFile = SPIFFS.open(filename, FILE_WRITE);
     }
-    else if (upload.status == UPLOAD_FILE_WRITE) {
-        if (fsUploadFile) {
-            fsUploadFile.write(upload.buf, upload.currentSize);
-        }
+
+    if (fsUploadFile && length > 0) {
+        fsUploadFile.write(data, length);
     }
-    else if (upload.status == UPLOAD_FILE_END) {
-        if (fsUploadFile) {
-            fsUploadFile.close();
-            debugPrintln("File upload complete: " + String(upload.totalSize) + " bytes");
-        }
+
+    if (final && fsUploadFile) {
+        fsUploadFile.close();
+        debugPrintln("File upload complete: " + String(index + length) + " bytes");
     }
 }
 
@@ -3146,7 +5768,7 @@ void handleRelayControl() {
                             ",\"state\":" + String(state ? "true" : "false") + "}";
 
                         // Broadcast update
-                        broadcastUpdate();
+                        requestBroadcast();
                     }
                     else {
                         debugPrintln("Failed to write to relay");
@@ -3164,7 +5786,7 @@ void handleRelayControl() {
                             String(state ? "true" : "false") + "}";
 
                         // Broadcast update
-                        broadcastUpdate();
+                        requestBroadcast();
                     }
                     else {
                         debugPrintln("Failed to write to relays");
@@ -3192,134 +5814,103 @@ void handleRelayControl() {
 
 // Enhanced handleSystemStatus to include network details
 void handleSystemStatus() {
-    DynamicJsonDocument doc(4096);
+    JsonWriter json(JSON_OUT_PAYLOAD, JSON_OUT_BUFFER_SIZE);
+    uint8_t mac[6];
+    char text[32];
 
-    // Add output states
-    JsonArray outputs = doc.createNestedArray("outputs");
-    for (int i = 0; i < 16; i++) {
-        JsonObject output = outputs.createNestedObject();
-        output["id"] = i;
-        output["state"] = outputStates[i];
-    }
+    json.beginObject();
 
-    // Add input states
-    JsonArray inputs = doc.createNestedArray("inputs");
-    for (int i = 0; i < 16; i++) {
-        JsonObject input = inputs.createNestedObject();
-        input["id"] = i;
-        input["state"] = inputStates[i];
-    }
+    // Add output, input and direct input (HT1-HT3) states
+    writeStateArray(json, "outputs", outputStates, 16, 0xFFFF);
+    writeStateArray(json, "inputs", inputStates, 16, 0xFFFF);
+    writeStateArray(json, "direct_inputs", directInputStates, 3, 0x07);
 
-    // Add direct input states (HT1-HT3)
-    JsonArray directInputs = doc.createNestedArray("direct_inputs");
+    // Add HT sensors data
+    json.beginArray("htSensors");
     for (int i = 0; i < 3; i++) {
-        JsonObject input = directInputs.createNestedObject();
-        input["id"] = i;
-        input["state"] = directInputStates[i];
+        writeHTSensorJson(json, i);
     }
+    json.endArray();
 
-    // Add HT sensors data
-    JsonArray htSensorsData = doc.createNestedArray("htSensors");
-    for (int i = 0; i < 3; i++) {
-        JsonObject sensor = htSensorsData.createNestedObject();
-        sensor["index"] = i;
-        sensor["pin"] = "HT" + String(i + 1);
-        sensor["sensorType"] = htSensorConfig[i].sensorType;
+    // Add analog inputs
+    json.beginArray("analog");
+    for (int i = 0; i < 4; i++) {
+        writeAnalogJson(json, i, calculatePercentage(analogVoltages[i]));
+    }
+    json.endArray();
 
-        const char* sensorTypeNames[] = {
-            "Digital Input", "DHT11", "DHT22", "DS18B20"
-        };
-        sensor["sensorTypeName"] = sensorTypeNames[htSensorConfig[i].sensorType];
-
-        switch (htSensorConfig[i].sensorType) {
-        case SENSOR_TYPE_DIGITAL:
-            sensor["value"] = directInputStates[i] ? "HIGH" : "LOW";
-            break;
-
-        case SENSOR_TYPE_DHT11:
-        case SENSOR_TYPE_DHT22:
-            sensor["temperature"] = htSensorConfig[i].temperature;
-            sensor["humidity"] = htSensorConfig[i].humidity;
-            break;
-
-        case SENSOR_TYPE_DS18B20:
-            sensor["temperature"] = htSensorConfig[i].temperature;
-            break;
-        }
-    }
-
-    // Add analog inputs
-    JsonArray analog = doc.createNestedArray("analog");
-    for (int i = 0; i < 4; i++) {
-        JsonObject analogInput = analog.createNestedObject();
-        analogInput["id"] = i;
-        analogInput["value"] = analogValues[i];
-        analogInput["voltage"] = analogVoltages[i];
-        analogInput["percentage"] = calculatePercentage(analogVoltages[i]);
-    }
-
-    // Add system information
-    doc["device"] = deviceName;
+    // Add system information
+    json.addString("device", deviceName.c_str());
 
     // Add detailed network information
-    doc["wifi_connected"] = wifiConnected;
-    doc["wifi_client_mode"] = wifiClientMode;
-    doc["wifi_ap_mode"] = apMode;
-    doc["eth_connected"] = ethConnected;
+    json.addBool("wifi_connected", wifiConnected);
+    json.addBool("wifi_client_mode", wifiClientMode);
+    json.addBool("wifi_ap_mode", apMode);
+    json.addBool("eth_connected", ethConnected);
 
     // Network details
-    JsonObject networkDetails = doc.createNestedObject("network");
-    networkDetails["dhcp_mode"] = dhcpMode;
+    json.beginObject("network");
+    json.addBool("dhcp_mode", dhcpMode);
 
     // WiFi details
     if (wifiConnected) {
         if (wifiClientMode) {
-            networkDetails["wifi_ip"] = WiFi.localIP().toString();
-            networkDetails["wifi_gateway"] = WiFi.gatewayIP().toString();
-            networkDetails["wifi_subnet"] = WiFi.subnetMask().toString();
-            networkDetails["wifi_dns1"] = WiFi.dnsIP(0).toString();
-            networkDetails["wifi_dns2"] = WiFi.dnsIP(1).toString();
-            networkDetails["wifi_rssi"] = WiFi.RSSI();
-            networkDetails["wifi_mac"] = WiFi.macAddress();
-            networkDetails["wifi_ssid"] = wifiSSID;
+            json.addIP("wifi_ip", WiFi.localIP());
+            json.addIP("wifi_gateway", WiFi.gatewayIP());
+            json.addIP("wifi_subnet", WiFi.subnetMask());
+            json.addIP("wifi_dns1", WiFi.dnsIP(0));
+            json.addIP("wifi_dns2", WiFi.dnsIP(1));
+            json.addInt("wifi_rssi", WiFi.RSSI());
+            WiFi.macAddress(mac);
+            json.addMac("wifi_mac", mac);
+            json.addString("wifi_ssid", wifiSSID.c_str());
         }
         else if (apMode) {
-            networkDetails["wifi_mode"] = "Access Point";
-            networkDetails["wifi_ap_ip"] = WiFi.softAPIP().toString();
-            networkDetails["wifi_ap_mac"] = WiFi.softAPmacAddress();
-            networkDetails["wifi_ap_ssid"] = ap_ssid;
+            json.addString("wifi_mode", "Access Point");
+            json.addIP("wifi_ap_ip", WiFi.softAPIP());
+            WiFi.softAPmacAddress(mac);
+            json.addMac("wifi_ap_mac", mac);
+            json.addString("wifi_ap_ssid", ap_ssid);
         }
     }
 
     // Ethernet details
     if (ethConnected) {
-        networkDetails["eth_ip"] = ETH.localIP().toString();
-        networkDetails["eth_gateway"] = ETH.gatewayIP().toString();
-        networkDetails["eth_subnet"] = ETH.subnetMask().toString();
-        networkDetails["eth_dns1"] = ETH.dnsIP(0).toString();
-        networkDetails["eth_dns2"] = ETH.dnsIP(1).toString();
-        networkDetails["eth_mac"] = ETH.macAddress();
-        networkDetails["eth_speed"] = String(ETH.linkSpeed()) + " Mbps";
-        networkDetails["eth_duplex"] = ETH.fullDuplex() ? "Full" : "Half";
-    }
+        json.addIP("eth_ip", ETH.localIP());
+        json.addIP("eth_gateway", ETH.gatewayIP());
+        json.addIP("eth_subnet", ETH.subnetMask());
+        json.addIP("eth_dns1", ETH.dnsIP(0));
+        json.addIP("eth_dns2", ETH.dnsIP(1));
+        ETH.macAddress(mac);
+        json.addMac("eth_mac", mac);
+        snprintf(text, sizeof(text), "%d Mbps", ETH.linkSpeed());
+        json.addString("eth_speed", text);
+        json.addString("eth_duplex", ETH.fullDuplex() ? "Full" : "Half");
+    }
+    json.endObject();
 
     // Basic system info
-    doc["mac"] = ethConnected ? ETH.macAddress() : WiFi.macAddress();
-    doc["uptime"] = getUptimeString();
-    doc["active_protocol"] = getActiveProtocolName();
-    doc["firmware_version"] = FIRMWARE_VERSION;
-    doc["i2c_errors"] = i2cErrorCount;
-    doc["free_heap"] = ESP.getFreeHeap();
-    doc["cpu_freq"] = ESP.getCpuFreqMHz();
-    doc["last_error"] = lastErrorMessage;
+    if (ethConnected) {
+        ETH.macAddress(mac);
+    }
+    else {
+        WiFi.macAddress(mac);
+    }
+    json.addMac("mac", mac);
+    formatUptime(text, sizeof(text));
+    json.addString("uptime", text);
+    json.addString("active_protocol", getActiveProtocolLabel());
+    json.addString("firmware_version", firmwareVersion.c_str());
+    json.addUInt("i2c_errors", i2cErrorCount);
+    json.addUInt("free_heap", ESP.getFreeHeap());
+    json.addUInt("cpu_freq", ESP.getCpuFreqMHz());
+    json.addString("last_error", lastErrorMessage.c_str());
 
     // Add network status to display on dashboard
-    doc["rtc_initialized"] = rtcInitialized;
-
-    String jsonResponse;
-    serializeJson(doc, jsonResponse);
+    json.addBool("rtc_initialized", rtcInitialized);
+    json.endObject();
 
-    server.send(200, "application/json", jsonResponse);
+    sendJsonResponse(json);
 }
 
 // Enhanced Network Settings handler
@@ -3474,29 +6065,35 @@ void handleUpdateNetworkSettings() {
 
 // Handle schedules API
 void handleSchedules() {
-    DynamicJsonDocument doc(4096);
-    JsonArray schedulesArray = doc.createNestedArray("schedules");
-
-    for (int i = 0; i < MAX_SCHEDULES; i++) {
-        JsonObject schedule = schedulesArray.createNestedObject();
-        schedule["id"] = i;
-        schedule["enabled"] = schedules[i].enabled;
-        schedule["name"] = schedules[i].name;
-        schedule["triggerType"] = schedules[i].triggerType;
-        schedule["days"] = schedules[i].days;
-        schedule["hour"] = schedules[i].hour;
-        schedule["minute"] = schedules[i].minute;
-        schedule["inputMask"] = schedules[i].inputMask;
-        schedule["inputStates"] = schedules[i].inputStates;
-        schedule["logic"] = schedules[i].logic;
-        schedule["action"] = schedules[i].action;
-        schedule["targetType"] = schedules[i].targetType;
-        schedule["targetId"] = schedules[i].targetId;
+    if (respondNotModified(CONFIG_DOMAIN_SCHEDULES)) {
+        return;
     }
 
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response);
+    sendJsonCollection("schedules", MAX_SCHEDULES, writeScheduleJson);
+}
+
+void writeScheduleJson(JsonWriter& json, int index) {
+    const TimeSchedule& schedule = schedules[index];
+
+    json.beginObject();
+    json.addInt("id", index);
+    json.addBool("enabled", schedule.enabled);
+    json.addString("name", schedule.name);
+    json.addUInt("triggerType", schedule.triggerType);
+    json.addUInt("days", schedule.days);
+    json.addUInt("hour", schedule.hour);
+    json.addUInt("minute", schedule.minute);
+    json.addUInt("inputMask", schedule.inputMask);
+    json.addUInt("inputStates", schedule.inputStates);
+    json.addUInt("logic", schedule.logic);
+    json.addUInt("action", schedule.action);
+    json.addUInt("targetType", schedule.targetType);
+    json.addUInt("targetId", schedule.targetId);
+    json.addUInt("sensorIndex", schedule.sensorIndex);
+    json.addUInt("sensorTriggerType", schedule.sensorTriggerType);
+    json.addUInt("sensorCondition", schedule.sensorCondition);
+    json.addFloat("sensorThreshold", schedule.sensorThreshold, 1);
+    json.endObject();
 }
 
 // Update schedule handler
@@ -3515,6 +6112,7 @@ void handleUpdateSchedule() {
             int id = scheduleJson.containsKey("id") ? scheduleJson["id"].as<int>() : -1;
 
             if (id >= 0 && id < MAX_SCHEDULES) {
+                lockConfigArrays();
                 schedules[id].enabled = scheduleJson["enabled"];
                 strlcpy(schedules[id].name, scheduleJson["name"] | "Schedule", 32);
                 schedules[id].triggerType = scheduleJson["triggerType"] | 0;
@@ -3534,6 +6132,15 @@ void handleUpdateSchedule() {
                 schedules[id].targetType = scheduleJson["targetType"] | 0;
                 schedules[id].targetId = scheduleJson["targetId"] | 0;
 
+                // Sensor-based fields
+                schedules[id].sensorIndex = scheduleJson["sensorIndex"] | 0;
+                schedules[id].sensorTriggerType = scheduleJson["sensorTriggerType"] | 0;
+                schedules[id].sensorCondition = scheduleJson["sensorCondition"] | 0;
+                schedules[id].sensorThreshold = scheduleJson["sensorThreshold"] | 25.0f;
+                unlockConfigArrays();
+                registerSensorThresholds();
+
+                bumpConfigRevision(CONFIG_DOMAIN_SCHEDULES);
                 saveConfiguration();
                 response = "{\"status\":\"success\"}";
             }
@@ -3544,7 +6151,11 @@ void handleUpdateSchedule() {
             bool enabled = doc["enabled"];
 
             if (id >= 0 && id < MAX_SCHEDULES) {
+                lockConfigArrays();
                 schedules[id].enabled = enabled;
+                unlockConfigArrays();
+                registerSensorThresholds();
+                bumpConfigRevision(CONFIG_DOMAIN_SCHEDULES);
                 saveConfiguration();
                 response = "{\"status\":\"success\"}";
             }
@@ -3556,6 +6167,7 @@ void handleUpdateSchedule() {
 
             if (id >= 0 && id < MAX_SCHEDULES && deleteSchedule) {
                 // Reset this schedule slot to default values
+                lockConfigArrays();
                 schedules[id].enabled = false;
                 schedules[id].triggerType = 0;
                 schedules[id].days = 0;
@@ -3567,8 +6179,15 @@ void handleUpdateSchedule() {
                 schedules[id].action = 0;
                 schedules[id].targetType = 0;
                 schedules[id].targetId = 0;
+                schedules[id].sensorIndex = 0;
+                schedules[id].sensorTriggerType = 0;
+                schedules[id].sensorCondition = 0;
+                schedules[id].sensorThreshold = 25.0f;
                 snprintf(schedules[id].name, 32, "Schedule %d", id + 1);
+                unlockConfigArrays();
+                registerSensorThresholds();
 
+                bumpConfigRevision(CONFIG_DOMAIN_SCHEDULES);
                 saveConfiguration();
                 response = "{\"status\":\"success\"}";
             }
@@ -3591,25 +6210,27 @@ void handleEvaluateInputSchedules() {
 
 // Handle analog triggers API
 void handleAnalogTriggers() {
-    DynamicJsonDocument doc(4096);
-    JsonArray triggersArray = doc.createNestedArray("triggers");
-
-    for (int i = 0; i < MAX_ANALOG_TRIGGERS; i++) {
-        JsonObject trigger = triggersArray.createNestedObject();
-        trigger["id"] = i;
-        trigger["enabled"] = analogTriggers[i].enabled;
-        trigger["name"] = analogTriggers[i].name;
-        trigger["analogInput"] = analogTriggers[i].analogInput;
-        trigger["threshold"] = analogTriggers[i].threshold;
-        trigger["condition"] = analogTriggers[i].condition;
-        trigger["action"] = analogTriggers[i].action;
-        trigger["targetType"] = analogTriggers[i].targetType;
-        trigger["targetId"] = analogTriggers[i].targetId;
+    if (respondNotModified(CONFIG_DOMAIN_TRIGGERS)) {
+        return;
     }
 
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response);
+    sendJsonCollection("triggers", MAX_ANALOG_TRIGGERS, writeAnalogTriggerJson);
+}
+
+void writeAnalogTriggerJson(JsonWriter& json, int index) {
+    const AnalogTrigger& trigger = analogTriggers[index];
+
+    json.beginObject();
+    json.addInt("id", index);
+    json.addBool("enabled", trigger.enabled);
+    json.addString("name", trigger.name);
+    json.addUInt("analogInput", trigger.analogInput);
+    json.addUInt("threshold", trigger.threshold);
+    json.addUInt("condition", trigger.condition);
+    json.addUInt("action", trigger.action);
+    json.addUInt("targetType", trigger.targetType);
+    json.addUInt("targetId", trigger.targetId);
+    json.endObject();
 }
 
 // Update analog triggers handler
@@ -3628,6 +6249,7 @@ void handleUpdateAnalogTriggers() {
             int id = triggerJson.containsKey("id") ? triggerJson["id"].as<int>() : -1;
 
             if (id >= 0 && id < MAX_ANALOG_TRIGGERS) {
+                lockConfigArrays();
                 analogTriggers[id].enabled = triggerJson["enabled"];
                 strlcpy(analogTriggers[id].name, triggerJson["name"] | "Trigger", 32);
                 analogTriggers[id].analogInput = triggerJson["analogInput"];
@@ -3636,7 +6258,9 @@ void handleUpdateAnalogTriggers() {
                 analogTriggers[id].action = triggerJson["action"];
                 analogTriggers[id].targetType = triggerJson["targetType"];
                 analogTriggers[id].targetId = triggerJson["targetId"];
+                unlockConfigArrays();
 
+                bumpConfigRevision(CONFIG_DOMAIN_TRIGGERS);
                 saveConfiguration();
                 response = "{\"status\":\"success\"}";
             }
@@ -3647,7 +6271,10 @@ void handleUpdateAnalogTriggers() {
             bool enabled = doc["enabled"];
 
             if (id >= 0 && id < MAX_ANALOG_TRIGGERS) {
+                lockConfigArrays();
                 analogTriggers[id].enabled = enabled;
+                unlockConfigArrays();
+                bumpConfigRevision(CONFIG_DOMAIN_TRIGGERS);
                 saveConfiguration();
                 response = "{\"status\":\"success\"}";
             }
@@ -3659,6 +6286,10 @@ void handleUpdateAnalogTriggers() {
 
 // Handle configuration API
 void handleConfig() {
+    if (respondNotModified(CONFIG_DOMAIN_CONFIG)) {
+        return;
+    }
+
     DynamicJsonDocument doc(1024);
 
     doc["device_name"] = deviceName;
@@ -3757,23 +6388,23 @@ void handleUpdateConfig() {
 
 // Handle debug API
 void handleDebug() {
-    DynamicJsonDocument doc(4096);
+    JsonWriter json(JSON_OUT_PAYLOAD, JSON_OUT_BUFFER_SIZE);
 
-    doc["i2c_errors"] = i2cErrorCount;
-    doc["last_error"] = lastErrorMessage;
-    doc["uptime_ms"] = millis();
-    doc["free_heap"] = ESP.getFreeHeap();
-    doc["cpu_freq"] = ESP.getCpuFreqMHz();
-    doc["firmware_version"] = firmwareVersion;
+    json.beginObject();
+    json.addUInt("i2c_errors", i2cErrorCount);
+    json.addString("last_error", lastErrorMessage.c_str());
+    json.addUInt("uptime_ms", millis());
+    json.addUInt("free_heap", ESP.getFreeHeap());
+    json.addUInt("cpu_freq", ESP.getCpuFreqMHz());
+    json.addString("firmware_version", firmwareVersion.c_str());
 
     // Check internet connectivity
     time_t now;
     time(&now);
-    doc["internet_connected"] = (now > 1600000000);  // Reasonable timestamp indicates NTP sync worked
+    json.addBool("internet_connected", now > 1600000000);  // Reasonable timestamp indicates NTP sync worked
+    json.endObject();
 
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response);
+    sendJsonResponse(json);
 }
 
 // Handle debug command
@@ -3786,8 +6417,7 @@ void handleDebugCommand() {
         DeserializationError error = deserializeJson(doc, body);
 
         if (!error && doc.containsKey("command")) {
-            String command = doc["command"].as<String>();
-            String commandResponse = processCommand(command);
+            const char* commandResponse = executeCommandToBuffer(doc["command"] | "");
 
             DynamicJsonDocument responseDoc(1024);
             responseDoc["status"] = "success";
@@ -3812,6 +6442,10 @@ void handleReboot() {
 
 // Handle communication status endpoint
 void handleCommunicationStatus() {
+    if (respondNotModified(CONFIG_DOMAIN_COMMUNICATION, getLinkSignature())) {
+        return;
+    }
+
     DynamicJsonDocument doc(1024);
 
     doc["usb_available"] = true;  // Serial is always available on ESP32
@@ -3822,6 +6456,15 @@ void handleCommunicationStatus() {
 
     doc["active_protocol"] = currentCommunicationProtocol;
 
+    // Command channels, all served concurrently. Their counters change without
+    // a configuration revision, so they are reported by COMM STATUS instead
+    JsonArray channels = doc.createNestedArray("channels");
+    for (int i = 0; i < COMM_CHANNEL_COUNT; i++) {
+        JsonObject channel = channels.createNestedObject();
+        channel["name"] = commChannels[i].name;
+        channel["enabled"] = commChannels[i].enabled;
+    }
+
     // I2C status
     doc["i2c_status"] = (i2cErrorCount == 0) ? "OK" : "Issues detected";
     doc["i2c_error_count"] = i2cErrorCount;
@@ -3872,7 +6515,13 @@ void handleSetCommunication() {
                     // Apply protocol-specific settings
                     if (protocol == "rs485") {
                         // Initialize RS485 with current settings
+                        commChannels[COMM_CHANNEL_RS485].enabled = true;
                         initRS485();
+                        saveCommunicationConfig();
+                    }
+                    else if (protocol == "usb" && !commChannels[COMM_CHANNEL_USB].enabled) {
+                        setCommChannelEnabled(COMM_CHANNEL_USB, true);
+                        saveCommunicationConfig();
                     }
 
                     // Save to EEPROM
@@ -3889,6 +6538,10 @@ void handleSetCommunication() {
 
 // Handle communication configuration GET request
 void handleCommunicationConfig() {
+    if (respondNotModified(CONFIG_DOMAIN_COMMUNICATION, getLinkSignature())) {
+        return;
+    }
+
     DynamicJsonDocument doc(2048);
 
     // Get protocol from query string
@@ -3940,6 +6593,7 @@ void handleCommunicationConfig() {
         }
     }
     else if (protocol == "usb") {
+        doc["enabled"] = commChannels[COMM_CHANNEL_USB].enabled;
         doc["com_port"] = usbComPort;
         doc["baud_rate"] = usbBaudRate;
         doc["data_bits"] = usbDataBits;
@@ -3980,6 +6634,7 @@ void handleCommunicationConfig() {
         doc["device_address"] = rs485DeviceAddress;
         doc["flow_control"] = rs485FlowControl;
         doc["night_mode"] = rs485NightMode;
+        doc["enabled"] = commChannels[COMM_CHANNEL_RS485].enabled;
 
         // Available protocol types for selection
         JsonArray protocolTypes = doc.createNestedArray("available_protocols");
@@ -4008,6 +6663,11 @@ void handleCommunicationConfig() {
         baudRates.add(57600);
         baudRates.add(115200);
     }
+    else if (protocol == "modbus_tcp") {
+        doc["enabled"] = modbusTcpEnabled;
+        doc["port"] = MODBUS_TCP_PORT;
+        doc["masters"] = getModbusTcpClientCount();
+    }
 
     String response;
     serializeJson(doc, response);
@@ -4026,6 +6686,7 @@ void handleUpdateCommunicationConfig() {
         if (!error && doc.containsKey("protocol")) {
             String protocol = doc["protocol"];
             bool changed = false;
+            bool reopened = false;
 
             // Process protocol-specific settings
             if (protocol == "wifi") {
@@ -4088,6 +6749,10 @@ void handleUpdateCommunicationConfig() {
                     usbStopBits = doc["stop_bits"].as<int>();
                     changed = true;
                 }
+                if (doc.containsKey("enabled")) {
+                    setCommChannelEnabled(COMM_CHANNEL_USB, doc["enabled"].as<bool>());
+                    changed = true;
+                }
             }
             else if (protocol == "rs485") {
                 if (doc.containsKey("baud_rate")) {
@@ -4126,6 +6791,19 @@ void handleUpdateCommunicationConfig() {
                     rs485NightMode = doc["night_mode"].as<bool>();
                     changed = true;
                 }
+                if (doc.containsKey("enabled") && doc["enabled"].as<bool>() != commChannels[COMM_CHANNEL_RS485].enabled) {
+                    // Opens the port with the settings above, or closes it
+                    setCommChannelEnabled(COMM_CHANNEL_RS485, doc["enabled"].as<bool>());
+                    changed = true;
+                    reopened = true;
+                }
+            }
+            else if (protocol == "modbus_tcp") {
+                if (doc.containsKey("enabled")) {
+                    modbusTcpEnabled = doc["enabled"].as<bool>();
+                    applyModbusTcpConfig();
+                    changed = true;
+                }
             }
 
             // If any settings changed, save and return success
@@ -4133,7 +6811,7 @@ void handleUpdateCommunicationConfig() {
                 saveCommunicationConfig();
 
                 // Re-initialize interface if necessary
-                if (protocol == "rs485" && currentCommunicationProtocol == "rs485") {
+                if (protocol == "rs485" && commChannels[COMM_CHANNEL_RS485].enabled && !reopened) {
                     initRS485();
                 }
 
@@ -4202,551 +6880,3099 @@ void handleSetTime() {
         }
     }
 
-    server.send(200, "application/json", response);
+    server.send(200, "application/json", response);
+}
+
+// Handle I2C scan endpoint
+// Starts a background scan unless ?job= asks about an existing one, and returns
+// straight away with the job id and the presence map as it stands
+void handleI2CScan() {
+    DynamicJsonDocument doc(1024);
+
+    uint16_t jobId = i2cScanJobId;
+    if (server.hasArg("job")) {
+        jobId = server.arg("job").toInt();
+    }
+    else {
+        jobId = startI2CScan();
+    }
+
+    doc["job"] = jobId;
+    doc["running"] = i2cScanRunning && jobId == i2cScanJobId;
+    doc["progress"] = i2cScanRunning ? ((i2cScanNextAddress - 1) * 100) / 126 : 100;
+    if (jobId != i2cScanJobId) {
+        doc["error"] = "Unknown or superseded scan job";
+    }
+
+    JsonArray devices = doc.createNestedArray("devices");
+    for (uint8_t address = 1; address < 127; address++) {
+        if (isI2CDevicePresent(address)) {
+            JsonObject device = devices.createNestedObject();
+            device["address"] = "0x" + String(address, HEX);
+            device["name"] = getI2CDeviceName(address);
+        }
+    }
+
+    doc["total_devices"] = devices.size();
+    doc["skipped"] = i2cSkippedCount;
+
+    String response;
+    serializeJson(doc, response);
+    server.send(200, "application/json", response);
+}
+
+// Start a background bus scan; a scan already in progress keeps its job id
+uint16_t startI2CScan() {
+    if (!i2cScanRunning) {
+        i2cScanJobId++;
+        if (i2cScanJobId == 0) i2cScanJobId = 1;
+        i2cScanNextAddress = 1;
+        i2cScanRunning = true;
+    }
+    return i2cScanJobId;
+}
+
+// Probe the next few addresses of a running scan
+void processI2CScan() {
+    if (!i2cScanRunning) return;
+
+    for (int i = 0; i < I2C_SCAN_BATCH && i2cScanNextAddress < 127; i++) {
+        uint8_t address = i2cScanNextAddress++;
+
+        Wire.beginTransmission(address);
+        if (Wire.endTransmission() == 0) {
+            recordI2CResult(address, true);
+        }
+        else {
+            i2cPresenceMap[address >> 5] &= ~(1UL << (address & 31));
+        }
+    }
+
+    if (i2cScanNextAddress >= 127) {
+        i2cScanRunning = false;
+        i2cLastScanTime = millis();
+        debugPrintln("I2C scan " + String(i2cScanJobId) + " complete");
+    }
+}
+
+bool isI2CDevicePresent(uint8_t address) {
+    if (address >= 128) return false;
+    return (i2cPresenceMap[address >> 5] & (1UL << (address & 31))) != 0;
+}
+
+// False while a failing device is backing off - callers skip it instead of
+// waiting for a bus timeout on every access
+bool isI2CDeviceAvailable(uint8_t address) {
+    if (address >= 128) return false;
+    if (i2cFailures[address] < I2C_FAIL_LIMIT) return true;
+
+    // Let one attempt through once the back-off has elapsed
+    return (long)(millis() - i2cRetryAt[address]) >= 0;
+}
+
+// Keep the presence map and back-off in step with every expander transfer
+void recordI2CResult(uint8_t address, bool success) {
+    if (address >= 128) return;
+
+    if (success) {
+        i2cPresenceMap[address >> 5] |= (1UL << (address & 31));
+        i2cFailures[address] = 0;
+        return;
+    }
+
+    if (i2cFailures[address] < 255) {
+        i2cFailures[address]++;
+    }
+    if (i2cFailures[address] >= I2C_FAIL_LIMIT) {
+        i2cPresenceMap[address >> 5] &= ~(1UL << (address & 31));
+        uint8_t doublings = std::min(i2cFailures[address] - I2C_FAIL_LIMIT, 5);
+        i2cRetryAt[address] = millis() + std::min((unsigned long)I2C_BACKOFF_BASE << doublings, (unsigned long)I2C_BACKOFF_MAX);
+    }
+}
+
+// Read the port byte of a PCF8574; false if it is backing off or did not answer
+bool readExpanderPort(uint8_t address, uint8_t& value) {
+    if (!isI2CDeviceAvailable(address)) {
+        i2cSkippedCount++;
+        return false;
+    }
+
+    bool success = Wire.requestFrom(address, (uint8_t)1) == 1;
+    if (success) {
+        value = Wire.read();
+    }
+    else {
+        i2cErrorCount++;
+        lastErrorMessage = "No response from I2C device 0x" + String(address, HEX);
+    }
+    recordI2CResult(address, success);
+    return success;
+}
+
+// Write the port byte of a PCF8574; false if it is backing off or did not answer
+bool writeExpanderPort(uint8_t address, uint8_t value) {
+    if (!isI2CDeviceAvailable(address)) {
+        i2cSkippedCount++;
+        return false;
+    }
+
+    Wire.beginTransmission(address);
+    Wire.write(value);
+    bool success = Wire.endTransmission() == 0;
+    if (!success) {
+        i2cErrorCount++;
+        lastErrorMessage = "Failed to write to I2C device 0x" + String(address, HEX);
+    }
+    recordI2CResult(address, success);
+    return success;
+}
+
+// Identify known devices
+String getI2CDeviceName(uint8_t address) {
+    if (address == PCF8574_INPUTS_1_8) return "PCF8574 Inputs 1-8";
+    if (address == PCF8574_INPUTS_9_16) return "PCF8574 Inputs 9-16";
+    if (address == PCF8574_OUTPUTS_1_8) return "PCF8574 Outputs 1-8";
+    if (address == PCF8574_OUTPUTS_9_16) return "PCF8574 Outputs 9-16";
+    if (address == 0x68) return "DS3231 RTC";
+    return "Unknown device";
+}
+
+// Process commands received via Serial
+void processSerialCommands() {
+    serviceCommandChannel(Serial, commChannels[COMM_CHANNEL_USB]);
+}
+
+// Serve a serial command channel if its UART has reported data since the
+// last pass. The flag is cleared before reading, so bytes arriving during the
+// pass raise it again and are not missed.
+void serviceCommandChannel(Stream& port, CommChannel& channel) {
+    if (!channel.dataPending) return;
+    channel.dataPending = false;
+
+    serviceCommandPort(port, channel);
+
+    // The pass stops at a line or the read budget; come back for the rest
+    if (port.available() > 0) {
+        channel.dataPending = true;
+    }
+}
+
+// One pass over a command port: binary frames that are already in are
+// handled together, a text line ends the pass
+void serviceCommandPort(Stream& port, CommChannel& channel) {
+    CommandLineReader& reader = channel.reader;
+
+    for (int i = 0; i < BINARY_FRAMES_PER_PASS; i++) {
+        uint8_t result = readCommandPort(port, reader);
+        if (result == COMMAND_PORT_FRAME) {
+            handleBinaryFrame((const uint8_t*)reader.line, binaryPass);
+            channel.commands++;
+            continue;
+        }
+        if (result == COMMAND_PORT_LINE) {
+            // Answer earlier frames first so replies stay in order
+            finishBinaryPass(port, binaryPass);
+            if (commandDispatcher.execute(reader.line, port)) {
+                channel.commands++;
+            }
+            else {
+                channel.rejected++;
+            }
+        }
+        break;
+    }
+    finishBinaryPass(port, binaryPass);
+}
+
+// Switch a serial command channel on or off. RS485 is opened with the
+// current settings or closed, so the bus is released while it is off.
+void setCommChannelEnabled(uint8_t channel, bool enabled) {
+    if (commChannels[channel].enabled == enabled) return;
+    commChannels[channel].enabled = enabled;
+
+    if (channel == COMM_CHANNEL_RS485) {
+        if (enabled) {
+            initRS485();
+        }
+        else {
+            endModbusRtu();
+            rs485.end();
+        }
+    }
+
+    // Read whatever is waiting once the channel comes back
+    commChannels[channel].dataPending = enabled;
+    debugPrintln(String("Command channel ") + commChannels[channel].name + (enabled ? " enabled" : " disabled"));
+}
+
+// Collect bytes already received on a port without waiting for more. Returns
+// COMMAND_PORT_LINE when a whole text line is in reader.line (NUL-terminated)
+// and COMMAND_PORT_FRAME when a binary frame with a good CRC is; either stays
+// valid until the next call. Blank lines and over-long lines are dropped.
+uint8_t readCommandPort(Stream& port, CommandLineReader& reader) {
+    int budget = COMMAND_READ_BUDGET;
+
+    // A frame the sender broke off is dropped once the line goes quiet
+    if (reader.binary && millis() - reader.lastByteAt > BINARY_FRAME_GAP) {
+        reader.binary = false;
+        reader.length = 0;
+        reader.frameErrors++;
+    }
+
+    while (budget-- > 0 && port.available() > 0) {
+        int c = port.read();
+        if (c < 0) break;
+
+        if (reader.binary) {
+            reader.lastByteAt = millis();
+            reader.line[reader.length++] = (char)c;
+
+            if (reader.length == 2) {
+                if (c < 2 || c > BINARY_MAX_BODY) {
+                    reader.binary = false;
+                    reader.length = 0;
+                    reader.frameErrors++;
+                    continue;
+                }
+                // Start byte, length byte, body and CRC
+                reader.frameLength = c + 4;
+            }
+            else if (reader.length > 2 && reader.length == reader.frameLength) {
+                const uint8_t* frame = (const uint8_t*)reader.line;
+                uint16_t crc = modbusCrc16(frame + 1, reader.frameLength - 3);
+                reader.binary = false;
+                reader.length = 0;
+
+                if (frame[reader.frameLength - 2] != (crc & 0xFF) || frame[reader.frameLength - 1] != (crc >> 8)) {
+                    reader.frameErrors++;
+                    continue;
+                }
+                reader.frames++;
+                return COMMAND_PORT_FRAME;
+            }
+            continue;
+        }
+
+        if (c == BINARY_FRAME_START && reader.length == 0 && !reader.overflow) {
+            reader.binary = true;
+            reader.line[0] = (char)c;
+            reader.length = 1;
+            reader.lastByteAt = millis();
+            continue;
+        }
+
+        if (c == '\n') {
+            bool skipped = reader.overflow;
+            uint16_t length = reader.length;
+            reader.overflow = false;
+            reader.length = 0;
+
+            if (skipped) {
+                reader.overflows++;
+                continue;
+            }
+
+            // Strip the CR of CRLF and any trailing blanks
+            while (length > 0 && (reader.line[length - 1] == '\r' || reader.line[length - 1] == ' ' ||
+                reader.line[length - 1] == '\t')) {
+                length--;
+            }
+            if (length == 0) continue;
+
+            reader.line[length] = '\0';
+            reader.lines++;
+            return COMMAND_PORT_LINE;
+        }
+
+        if (reader.overflow) continue;
+
+        if (reader.length >= COMMAND_LINE_SIZE - 1) {
+            reader.overflow = true;
+            reader.length = 0;
+            continue;
+        }
+
+        reader.line[reader.length++] = (char)c;
+    }
+
+    return COMMAND_PORT_IDLE;
+}
+
+uint16_t getRelayMask() {
+    uint16_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (outputStates[i]) mask |= (1 << i);
+    }
+    return mask;
+}
+
+// Set outputStates to the mask without writing the expanders; true if
+// anything changed
+bool stageRelayMask(uint16_t mask) {
+    if (mask == getRelayMask()) return false;
+
+    for (int i = 0; i < 16; i++) {
+        outputStates[i] = (mask & (1 << i)) != 0;
+    }
+    return true;
+}
+
+// New relay mask after one of the mask opcodes
+uint16_t applyRelayOpcode(uint8_t opcode, uint16_t mask, uint16_t value) {
+    switch (opcode) {
+    case BINARY_OP_SET_RELAYS:    return mask | value;
+    case BINARY_OP_CLEAR_RELAYS:  return mask & ~value;
+    case BINARY_OP_TOGGLE_RELAYS: return mask ^ value;
+    }
+    return value;
+}
+
+bool isRelayOpcode(uint8_t opcode) {
+    return opcode >= BINARY_OP_SET_RELAYS && opcode <= BINARY_OP_WRITE_RELAYS;
+}
+
+void sealBinaryResponse(uint8_t* response) {
+    uint16_t crc = modbusCrc16(response + 1, response[1] + 1);
+    response[response[1] + 2] = crc & 0xFF;
+    response[response[1] + 3] = crc >> 8;
+}
+
+// Carry out a binary request and queue its response in the pass
+void handleBinaryFrame(const uint8_t* frame, BinaryPass& pass) {
+    uint8_t opcode = frame[3];
+    const uint8_t* payload = frame + 4;
+    uint8_t payloadLength = frame[1] - 2;
+
+    uint8_t* response = pass.responses + pass.length;
+    uint8_t* data = response + 5;
+    uint8_t dataLength = 0;
+    uint8_t status = BINARY_STATUS_OK;
+    bool relayChange = false;
+
+    switch (opcode) {
+    case BINARY_OP_PING:
+        data[0] = BINARY_PROTOCOL_VERSION;
+        dataLength = 1;
+        break;
+
+    case BINARY_OP_SET_RELAYS:
+    case BINARY_OP_CLEAR_RELAYS:
+    case BINARY_OP_TOGGLE_RELAYS:
+    case BINARY_OP_WRITE_RELAYS:
+        if (payloadLength != 2) {
+            status = BINARY_STATUS_BAD_LENGTH;
+            break;
+        }
+        relayChange = stageRelayMask(applyRelayOpcode(opcode, getRelayMask(), payload[0] | (payload[1] << 8)));
+        break;
+
+    case BINARY_OP_BATCH:
+    {
+        if (payloadLength == 0 || payloadLength % 3 != 0) {
+            status = BINARY_STATUS_BAD_LENGTH;
+            break;
+        }
+
+        // Nothing is applied unless every step is valid
+        uint16_t mask = getRelayMask();
+        for (uint8_t i = 0; i < payloadLength; i += 3) {
+            if (!isRelayOpcode(payload[i])) {
+                status = BINARY_STATUS_BAD_OPCODE;
+                break;
+            }
+            mask = applyRelayOpcode(payload[i], mask, payload[i + 1] | (payload[i + 2] << 8));
+        }
+        if (status == BINARY_STATUS_OK) {
+            relayChange = stageRelayMask(mask);
+        }
+        break;
+    }
+
+    case BINARY_OP_READ_RELAYS:
+        break;
+
+    case BINARY_OP_READ_INPUTS:
+    {
+        uint16_t inputs = getModbusInputRegister(MODBUS_IR_INPUTS);
+        data[0] = inputs & 0xFF;
+        data[1] = inputs >> 8;
+        data[2] = getModbusInputRegister(MODBUS_IR_HT_INPUTS);
+        dataLength = 3;
+        break;
+    }
+
+    case BINARY_OP_READ_ANALOG:
+        for (int i = 0; i < 8; i++) {
+            uint16_t value = getModbusInputRegister(MODBUS_IR_ANALOG_RAW + i);
+            data[i * 2] = value & 0xFF;
+            data[i * 2 + 1] = value >> 8;
+        }
+        dataLength = 16;
+        break;
+
+    default:
+        status = BINARY_STATUS_BAD_OPCODE;
+        break;
+    }
+
+    // Relay opcodes answer with the resulting relay mask
+    if (status == BINARY_STATUS_OK && (isRelayOpcode(opcode) || opcode == BINARY_OP_BATCH ||
+        opcode == BINARY_OP_READ_RELAYS)) {
+        uint16_t mask = getRelayMask();
+        data[0] = mask & 0xFF;
+        data[1] = mask >> 8;
+        dataLength = 2;
+    }
+    if (status != BINARY_STATUS_OK) {
+        dataLength = 0;
+    }
+
+    response[0] = BINARY_FRAME_START;
+    response[1] = 3 + dataLength;
+    response[2] = frame[2];
+    response[3] = opcode;
+    response[4] = status;
+    sealBinaryResponse(response);
+
+    if (relayChange) {
+        pass.relaysChanged = true;
+        pass.relayResponses[pass.relayResponseCount++] = pass.length;
+    }
+    pass.length += 7 + dataLength;
+}
+
+// Write the relays changed during the pass; if that fails, the responses
+// of the requests that changed them report it
+void applyBinaryRelays(BinaryPass& pass) {
+    if (pass.relaysChanged) {
+        if (writeOutputs()) {
+            requestBroadcast();
+        }
+        else {
+            for (uint8_t i = 0; i < pass.relayResponseCount; i++) {
+                uint8_t* response = pass.responses + pass.relayResponses[i];
+                response[4] = BINARY_STATUS_IO_ERROR;
+                sealBinaryResponse(response);
+            }
+        }
+    }
+
+    pass.relayResponseCount = 0;
+    pass.relaysChanged = false;
+}
+
+// Write the relays changed during the pass, then send its responses
+void finishBinaryPass(Stream& port, BinaryPass& pass) {
+    applyBinaryRelays(pass);
+
+    if (pass.length > 0) {
+        port.write(pass.responses, pass.length);
+    }
+    pass.length = 0;
+}
+
+uint16_t modbusCrc16(const uint8_t* data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc = (crc >> 8) ^ modbusCrcTable[(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+// Derive the frame timers from the line settings and hook the UART receive
+// timeout; called from initRS485() after rs485.begin()
+void beginModbusRtu() {
+    // One character is start + data + parity + stop bits
+    unsigned long bits = 1 + rs485DataBits + (rs485Parity != 0 ? 1 : 0) + rs485StopBits;
+    unsigned long charTime = (bits * 1000000UL + rs485BaudRate - 1) / rs485BaudRate;
+
+    // Above 19200 baud the spec fixes the timers at 750 us and 1750 us
+    unsigned long t15 = (rs485BaudRate > 19200) ? 750 : charTime * 3 / 2;
+    unsigned long t35 = (rs485BaudRate > 19200) ? 1750 : charTime * 7 / 2;
+
+    // The UART counts its receive timeout in whole characters
+    uint8_t timeoutSymbols = constrain((t15 + charTime - 1) / charTime, 1UL, 100UL);
+    unsigned long timeoutTime = timeoutSymbols * charTime;
+
+    portENTER_CRITICAL(&modbusRxMux);
+    modbusRtu.charTime = charTime;
+    modbusRtu.t15 = t15;
+    modbusRtu.t35 = t35;
+    modbusRtu.quietAfterTimeout = (t35 > timeoutTime) ? t35 - timeoutTime : 0;
+    modbusRtu.rxLength = 0;
+    modbusRtu.rxDiscard = false;
+    modbusRtu.frameReady = false;
+    modbusRtu.loopFrame = false;
+    modbusRtu.active = true;
+    portEXIT_CRITICAL(&modbusRxMux);
+
+    rs485.setRxTimeout(timeoutSymbols);
+    rs485.onReceive(onModbusReceive, true);
+
+    debugPrintln("Modbus RTU slave at address " + String(rs485DeviceAddress) +
+        ", t1.5 " + String(t15) + " us, t3.5 " + String(t35) + " us");
+}
+
+void endModbusRtu() {
+    rs485.onReceive(NULL);
+    modbusRtu.active = false;
+}
+
+// Hand the received frame on for answering; modbusRxMux must be held
+void completeModbusFrameLocked() {
+    if (modbusRtu.rxDiscard) {
+        modbusRtu.rxDiscard = false;
+    }
+    else if (modbusRtu.rxLength > 0) {
+        if (modbusRtu.frameReady) {
+            // loop() has not taken the previous frame yet
+            modbusRtu.overruns++;
+        }
+        else {
+            memcpy(modbusRtu.frame, modbusRtu.rx, modbusRtu.rxLength);
+            modbusRtu.frameLength = modbusRtu.rxLength;
+            modbusRtu.frameEndAt = modbusRtu.lastChunkAt;
+            modbusRtu.frameReady = true;
+        }
+    }
+    modbusRtu.rxLength = 0;
+}
+
+// UART event task: the line has been idle for t1.5, take the bytes received
+void onModbusReceive() {
+    uint8_t chunk[MODBUS_MAX_FRAME];
+    unsigned long now = micros();
+    size_t count = rs485.read(chunk, sizeof(chunk));
+    bool overflow = false;
+    while (rs485.available() > 0) {
+        rs485.read();
+        overflow = true;
+    }
+    if (count == 0) return;
+
+    portENTER_CRITICAL(&modbusRxMux);
+
+    if (modbusRtu.rxLength > 0 || modbusRtu.rxDiscard) {
+        // Silence between the previous chunk's last byte and this chunk's first
+        long gap = (long)(now - modbusRtu.lastChunkAt) - (long)(count * modbusRtu.charTime);
+        if (gap >= (long)modbusRtu.t35) {
+            // The previous frame ended before loop() came round to it
+            completeModbusFrameLocked();
+        }
+        else if (!modbusRtu.rxDiscard) {
+            // t1.5 < gap < t3.5 inside a frame
+            modbusRtu.framingErrors++;
+            modbusRtu.rxDiscard = true;
+        }
+    }
+
+    if (!modbusRtu.rxDiscard) {
+        if (overflow || modbusRtu.rxLength + count > MODBUS_MAX_FRAME) {
+            modbusRtu.framingErrors++;
+            modbusRtu.rxDiscard = true;
+        }
+        else {
+            memcpy(modbusRtu.rx + modbusRtu.rxLength, chunk, count);
+            modbusRtu.rxLength += count;
+        }
+    }
+    if (modbusRtu.rxDiscard) {
+        modbusRtu.rxLength = 0;
+    }
+    modbusRtu.lastChunkAt = now;
+
+    portEXIT_CRITICAL(&modbusRxMux);
+
+    // The comm task times t3.5 from here
+    xTaskNotifyGive(rs485TaskHandle);
+}
+
+// UART event task, command mode: wake loop()'s RS485 pass
+void onRs485CommandReceive() {
+    commChannels[COMM_CHANNEL_RS485].dataPending = true;
+}
+
+// UART event task: wake loop()'s USB pass
+void onUsbCommandReceive() {
+    commChannels[COMM_CHANNEL_USB].dataPending = true;
+}
+
+// RS485 comm task. Sleeps until the UART event task reports received bytes,
+// waits out t3.5 after the last of them (new bytes restart the wait) and
+// answers the frame - reads here, out of the register image, so the reply
+// does not wait for loop(); writes are passed on to loop().
+void rs485Task(void* parameter) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!modbusRtu.active) continue;
+
+        for (;;) {
+            portENTER_CRITICAL(&modbusRxMux);
+            bool receiving = (modbusRtu.rxLength > 0 || modbusRtu.rxDiscard);
+            long quiet = (long)modbusRtu.quietAfterTimeout - (long)(micros() - modbusRtu.lastChunkAt);
+            if (receiving && quiet <= 0) {
+                completeModbusFrameLocked();
+            }
+            bool answer = modbusRtu.frameReady && !modbusRtu.loopFrame;
+            portEXIT_CRITICAL(&modbusRxMux);
+
+            if (answer) {
+                answerModbusRtuFrame();
+            }
+            if (!receiving || quiet <= 0) break;
+
+            // Tick-granular sleep, woken early by a new chunk; re-checked above
+            ulTaskNotifyTake(pdTRUE, quiet / (1000L * portTICK_PERIOD_MS) + 1);
+        }
+    }
+}
+
+// Comm task: answer a read from the register image, leave a write to loop()
+void answerModbusRtuFrame() {
+    if (modbusRtu.frameLength < 2 || !isModbusReadFunction(modbusRtu.frame[1])) {
+        modbusRtu.loopFrame = true;
+        return;
+    }
+
+    unsigned long start = micros();
+    ModbusImage image;
+    copyModbusImage(image);
+    handleModbusRtuFrame(modbusRtu.frame, modbusRtu.frameLength, image);
+    modbusRtu.taskAnswers++;
+
+    portENTER_CRITICAL(&modbusRxMux);
+    modbusRtu.frameReady = false;
+    portEXIT_CRITICAL(&modbusRxMux);
+
+    recordModbusRtuService(start);
+}
+
+// Service time and request rate, for frames answered by either side
+void recordModbusRtuService(unsigned long start) {
+    unsigned long elapsed = micros() - start;
+    if (elapsed > modbusRtu.maxServiceTime) {
+        modbusRtu.maxServiceTime = elapsed;
+    }
+
+    // Requests per second over 5 s windows
+    unsigned long now = millis();
+    modbusRtu.rateWindowCount++;
+    if (now - modbusRtu.rateWindowStart >= 5000) {
+        modbusRtu.requestRate = modbusRtu.rateWindowCount * 1000.0f / (now - modbusRtu.rateWindowStart);
+        modbusRtu.rateWindowStart = now;
+        modbusRtu.rateWindowCount = 0;
+    }
+}
+
+// Answer a write request the comm task has passed on - called from loop(),
+// which only looks at a flag while there is none
+void serviceModbusRtu() {
+    if (!modbusRtu.loopFrame) return;
+
+    unsigned long start = micros();
+    handleModbusRtuFrame(modbusRtu.frame, modbusRtu.frameLength, modbusImage);
+
+    portENTER_CRITICAL(&modbusRxMux);
+    modbusRtu.frameReady = false;
+    modbusRtu.loopFrame = false;
+    portEXIT_CRITICAL(&modbusRxMux);
+
+    recordModbusRtuService(start);
+
+    // Publish what the request changed, now that the response is queued
+    refreshModbusImage();
+    applyModbusSettings();
+}
+
+// Save and apply serial settings written over Modbus (RTU or TCP)
+void applyModbusSettings() {
+    if (modbusRtu.savePending) {
+        modbusRtu.savePending = false;
+        saveCommunicationConfig();
+    }
+    if (modbusRtu.reinitPending) {
+        modbusRtu.reinitPending = false;
+        rs485.flush();
+        initRS485();
+    }
+}
+
+void handleModbusRtuFrame(const uint8_t* frame, uint16_t length, const ModbusImage& image) {
+    // Address, function code and CRC at least
+    if (length < 4) {
+        modbusRtu.framingErrors++;
+        return;
+    }
+
+    uint16_t crc = frame[length - 2] | (frame[length - 1] << 8);
+    if (modbusCrc16(frame, length - 2) != crc) {
+        modbusRtu.crcErrors++;
+        return;
+    }
+
+    uint8_t address = frame[0];
+    bool broadcast = (address == MODBUS_BROADCAST_ADDRESS);
+    if (!broadcast && address != rs485DeviceAddress) {
+        modbusRtu.otherAddress++;
+        return;
+    }
+    modbusRtu.requests++;
+
+    uint8_t response[MODBUS_MAX_FRAME];
+    size_t pduLength = processModbusPdu(frame + 1, length - 3, response + 1, image);
+
+    // Broadcasts are carried out but never answered
+    if (broadcast) {
+        modbusRtu.broadcasts++;
+        return;
+    }
+    if (pduLength == 0) return;
+    if (response[1] & 0x80) {
+        modbusRtu.exceptions++;
+    }
+
+    response[0] = address;
+    uint16_t responseCrc = modbusCrc16(response, pduLength + 1);
+    response[pduLength + 1] = responseCrc & 0xFF;
+    response[pduLength + 2] = responseCrc >> 8;
+
+    // Goes into the UART driver's transmit buffer, the caller does not wait
+    rs485.write(response, pduLength + 3);
+
+    unsigned long turnaround = micros() - modbusRtu.frameEndAt;
+    if (turnaround > modbusRtu.maxTurnaround) {
+        modbusRtu.maxTurnaround = turnaround;
+    }
+}
+
+size_t modbusException(uint8_t* response, uint8_t function, uint8_t code) {
+    response[0] = function | 0x80;
+    response[1] = code;
+    return 2;
+}
+
+bool getModbusDiscreteInput(uint16_t address) {
+    if (address < 16) return inputStates[address];
+    return directInputStates[address - 16];
+}
+
+uint16_t getModbusInputRegister(uint16_t address) {
+    if (address < MODBUS_IR_ANALOG_MV) {
+        return (uint16_t)analogValues[address - MODBUS_IR_ANALOG_RAW];
+    }
+    if (address < MODBUS_IR_HT_TEMPERATURE) {
+        return (uint16_t)(analogVoltages[address - MODBUS_IR_ANALOG_MV] * 1000.0f + 0.5f);
+    }
+    if (address < MODBUS_IR_HT_HUMIDITY) {
+        return (uint16_t)(int16_t)lroundf(htSensorConfig[address - MODBUS_IR_HT_TEMPERATURE].temperature * 10.0f);
+    }
+    if (address < MODBUS_IR_INPUTS) {
+        return (uint16_t)lroundf(htSensorConfig[address - MODBUS_IR_HT_HUMIDITY].humidity * 10.0f);
+    }
+
+    uint16_t mask = 0;
+    switch (address) {
+    case MODBUS_IR_INPUTS:
+        for (int i = 0; i < 16; i++) {
+            if (inputStates[i]) mask |= (1 << i);
+        }
+        return mask;
+    case MODBUS_IR_HT_INPUTS:
+        for (int i = 0; i < 3; i++) {
+            if (directInputStates[i]) mask |= (1 << i);
+        }
+        return mask;
+    case MODBUS_IR_UPTIME:
+        return (millis() / 1000) >> 16;
+    case MODBUS_IR_UPTIME + 1:
+        return (millis() / 1000) & 0xFFFF;
+    case MODBUS_IR_FREE_HEAP:
+        return ESP.getFreeHeap() / 1024;
+    case MODBUS_IR_I2C_ERRORS:
+        return i2cErrorCount > 0xFFFF ? 0xFFFF : (uint16_t)i2cErrorCount;
+    }
+    return 0;
+}
+
+uint16_t getModbusHoldingRegister(uint16_t address) {
+    uint16_t mask = 0;
+    switch (address) {
+    case MODBUS_HR_RELAY_MASK:
+        for (int i = 0; i < 16; i++) {
+            if (outputStates[i]) mask |= (1 << i);
+        }
+        return mask;
+    case MODBUS_HR_ADDRESS:
+        return rs485DeviceAddress;
+    case MODBUS_HR_BAUD:
+        return rs485BaudRate / 100;
+    case MODBUS_HR_PARITY:
+        return rs485Parity;
+    case MODBUS_HR_STOP_BITS:
+        return rs485StopBits;
+    case MODBUS_HR_DEBUG:
+        return debugMode ? 1 : 0;
+    }
+    return 0;
+}
+
+// Returns 0 or the Modbus exception code a write of value would get;
+// changes nothing, so multi-register writes can check every value first
+uint8_t checkModbusHoldingRegister(uint16_t address, uint16_t value) {
+    switch (address) {
+    case MODBUS_HR_RELAY_MASK:
+        return 0;
+
+    case MODBUS_HR_ADDRESS:
+        return (value < 1 || value > 247) ? MODBUS_EX_ILLEGAL_VALUE : 0;
+
+    case MODBUS_HR_BAUD:
+        if (value != 12 && value != 24 && value != 48 && value != 96 && value != 192 &&
+            value != 384 && value != 576 && value != 1152) {
+            return MODBUS_EX_ILLEGAL_VALUE;
+        }
+        return 0;
+
+    case MODBUS_HR_PARITY:
+        return (value > 2) ? MODBUS_EX_ILLEGAL_VALUE : 0;
+
+    case MODBUS_HR_STOP_BITS:
+        return (value < 1 || value > 2) ? MODBUS_EX_ILLEGAL_VALUE : 0;
+
+    case MODBUS_HR_DEBUG:
+        return (value > 1) ? MODBUS_EX_ILLEGAL_VALUE : 0;
+    }
+    return MODBUS_EX_ILLEGAL_ADDRESS;
+}
+
+// Returns 0 or the Modbus exception code
+uint8_t setModbusHoldingRegister(uint16_t address, uint16_t value) {
+    uint8_t error = checkModbusHoldingRegister(address, value);
+    if (error != 0) {
+        return error;
+    }
+
+    switch (address) {
+    case MODBUS_HR_RELAY_MASK:
+        for (int i = 0; i < 16; i++) {
+            outputStates[i] = (value & (1 << i)) != 0;
+        }
+        if (!writeOutputs()) {
+            return MODBUS_EX_DEVICE_FAILURE;
+        }
+        requestBroadcast();
+        return 0;
+
+    case MODBUS_HR_ADDRESS:
+        rs485DeviceAddress = value;
+        modbusRtu.savePending = true;
+        return 0;
+
+    case MODBUS_HR_BAUD:
+        rs485BaudRate = value * 100;
+        modbusRtu.savePending = true;
+        modbusRtu.reinitPending = true;
+        return 0;
+
+    case MODBUS_HR_PARITY:
+        rs485Parity = value;
+        modbusRtu.savePending = true;
+        modbusRtu.reinitPending = true;
+        return 0;
+
+    case MODBUS_HR_STOP_BITS:
+        rs485StopBits = value;
+        modbusRtu.savePending = true;
+        modbusRtu.reinitPending = true;
+        return 0;
+
+    case MODBUS_HR_DEBUG:
+        debugMode = (value == 1);
+        bumpConfigRevision(CONFIG_DOMAIN_CONFIG);
+        return 0;
+    }
+    return MODBUS_EX_ILLEGAL_ADDRESS;
+}
+
+// Copy the live state into the register image
+void refreshModbusImage() {
+    ModbusImage image;
+    memset(&image, 0, sizeof(image));
+
+    for (int i = 0; i < MODBUS_COIL_COUNT; i++) {
+        if (outputStates[i]) image.coils |= (1 << i);
+    }
+    for (int i = 0; i < MODBUS_DISCRETE_INPUT_COUNT; i++) {
+        if (getModbusDiscreteInput(i)) image.discreteInputs |= (1UL << i);
+    }
+    for (int i = 0; i < MODBUS_INPUT_REGISTER_COUNT; i++) {
+        image.inputRegisters[i] = getModbusInputRegister(i);
+    }
+    for (int i = 0; i < MODBUS_HOLDING_REGISTER_COUNT; i++) {
+        image.holdingRegisters[i] = getModbusHoldingRegister(i);
+    }
+
+    portENTER_CRITICAL(&modbusImageMux);
+    modbusImage = image;
+    portEXIT_CRITICAL(&modbusImageMux);
+
+    lastModbusImageRefresh = millis();
+}
+
+void copyModbusImage(ModbusImage& image) {
+    portENTER_CRITICAL(&modbusImageMux);
+    image = modbusImage;
+    portEXIT_CRITICAL(&modbusImageMux);
+}
+
+bool isModbusReadFunction(uint8_t function) {
+    return function == MODBUS_FC_READ_COILS || function == MODBUS_FC_READ_DISCRETE_INPUTS ||
+        function == MODBUS_FC_READ_HOLDING || function == MODBUS_FC_READ_INPUT;
+}
+
+// Carry out one request PDU (function code onwards) against the register
+// map and build the response PDU; returns its length. Transport neutral -
+// RTU adds address and CRC around it, TCP the MBAP header. Reads come from
+// the register image; writes change the live state and must run in loop().
+size_t processModbusPdu(const uint8_t* request, size_t length, uint8_t* response, const ModbusImage& image) {
+    if (length < 1) return 0;
+
+    uint8_t function = request[0];
+    uint16_t start = (length >= 3) ? (request[1] << 8) | request[2] : 0;
+    uint16_t quantity = (length >= 5) ? (request[3] << 8) | request[4] : 0;
+    response[0] = function;
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    {
+        uint16_t count = (function == MODBUS_FC_READ_COILS) ? MODBUS_COIL_COUNT : MODBUS_DISCRETE_INPUT_COUNT;
+        if (length != 5 || quantity < 1 || quantity > 2000) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_VALUE);
+        }
+        if ((uint32_t)start + quantity > count) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_ADDRESS);
+        }
+
+        uint8_t byteCount = (quantity + 7) / 8;
+        response[1] = byteCount;
+        memset(response + 2, 0, byteCount);
+        for (uint16_t i = 0; i < quantity; i++) {
+            uint32_t bits = (function == MODBUS_FC_READ_COILS) ? image.coils : image.discreteInputs;
+            bool bit = (bits >> (start + i)) & 1;
+            if (bit) response[2 + i / 8] |= (1 << (i % 8));
+        }
+        return 2 + byteCount;
+    }
+
+    case MODBUS_FC_READ_HOLDING:
+    case MODBUS_FC_READ_INPUT:
+    {
+        uint16_t count = (function == MODBUS_FC_READ_HOLDING) ? MODBUS_HOLDING_REGISTER_COUNT : MODBUS_INPUT_REGISTER_COUNT;
+        if (length != 5 || quantity < 1 || quantity > 125) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_VALUE);
+        }
+        if ((uint32_t)start + quantity > count) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_ADDRESS);
+        }
+
+        response[1] = quantity * 2;
+        for (uint16_t i = 0; i < quantity; i++) {
+            uint16_t value = (function == MODBUS_FC_READ_HOLDING) ?
+                image.holdingRegisters[start + i] : image.inputRegisters[start + i];
+            response[2 + i * 2] = value >> 8;
+            response[3 + i * 2] = value & 0xFF;
+        }
+        return 2 + quantity * 2;
+    }
+
+    case MODBUS_FC_WRITE_COIL:
+        // The value field is 0xFF00 for ON and 0x0000 for OFF
+        if (length != 5 || (quantity != 0xFF00 && quantity != 0x0000)) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_VALUE);
+        }
+        if (start >= MODBUS_COIL_COUNT) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_ADDRESS);
+        }
+
+        outputStates[start] = (quantity == 0xFF00);
+        if (!writeOutputs()) {
+            return modbusException(response, function, MODBUS_EX_DEVICE_FAILURE);
+        }
+        requestBroadcast();
+        memcpy(response, request, 5);
+        return 5;
+
+    case MODBUS_FC_WRITE_REGISTER:
+    {
+        if (length != 5) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_VALUE);
+        }
+        if (start >= MODBUS_HOLDING_REGISTER_COUNT) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_ADDRESS);
+        }
+
+        uint8_t error = setModbusHoldingRegister(start, quantity);
+        if (error != 0) {
+            return modbusException(response, function, error);
+        }
+        memcpy(response, request, 5);
+        return 5;
+    }
+
+    case MODBUS_FC_WRITE_COILS:
+    {
+        if (length < 6 || quantity < 1 || quantity > 0x07B0 ||
+            request[5] != (quantity + 7) / 8 || length != 6 + (size_t)request[5]) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_VALUE);
+        }
+        if ((uint32_t)start + quantity > MODBUS_COIL_COUNT) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_ADDRESS);
+        }
+
+        // Decode every coil before touching the outputs, then apply them
+        // together and do one expander write
+        bool coilStates[MODBUS_COIL_COUNT];
+        memcpy(coilStates, outputStates, sizeof(coilStates));
+        for (uint16_t i = 0; i < quantity; i++) {
+            coilStates[start + i] = (request[6 + i / 8] & (1 << (i % 8))) != 0;
+        }
+        memcpy(outputStates, coilStates, sizeof(coilStates));
+        if (!writeOutputs()) {
+            return modbusException(response, function, MODBUS_EX_DEVICE_FAILURE);
+        }
+        requestBroadcast();
+        memcpy(response, request, 5);
+        return 5;
+    }
+
+    case MODBUS_FC_WRITE_REGISTERS:
+    {
+        if (length < 6 || quantity < 1 || quantity > 123 ||
+            request[5] != quantity * 2 || length != 6 + (size_t)request[5]) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_VALUE);
+        }
+        if ((uint32_t)start + quantity > MODBUS_HOLDING_REGISTER_COUNT) {
+            return modbusException(response, function, MODBUS_EX_ILLEGAL_ADDRESS);
+        }
+
+        // Check every value before applying any, so a rejected request
+        // leaves all registers unchanged
+        for (uint16_t i = 0; i < quantity; i++) {
+            uint16_t value = (request[6 + i * 2] << 8) | request[7 + i * 2];
+            uint8_t error = checkModbusHoldingRegister(start + i, value);
+            if (error != 0) {
+                return modbusException(response, function, error);
+            }
+        }
+        for (uint16_t i = 0; i < quantity; i++) {
+            uint16_t value = (request[6 + i * 2] << 8) | request[7 + i * 2];
+            uint8_t error = setModbusHoldingRegister(start + i, value);
+            if (error != 0) {
+                return modbusException(response, function, error);
+            }
+        }
+        memcpy(response, request, 5);
+        return 5;
+    }
+    }
+
+    return modbusException(response, function, MODBUS_EX_ILLEGAL_FUNCTION);
+}
+
+// Set up the Modbus TCP server and start it if it is enabled - the AsyncTCP
+// task accepts and reads masters
+void beginModbusTcp() {
+    if (modbusTcpMutex == NULL) {
+        modbusTcpMutex = xSemaphoreCreateMutex();
+    }
+    modbusTcpServer.onClient(onModbusTcpClient, NULL);
+    modbusTcpServer.setNoDelay(true);
+    applyModbusTcpConfig();
+}
+
+// Start or stop listening to match modbusTcpEnabled
+void applyModbusTcpConfig() {
+    if (modbusTcpEnabled == modbusTcpListening) return;
+
+    if (modbusTcpEnabled) {
+        refreshModbusImage();
+        modbusTcpServer.begin();
+        modbusTcpListening = true;
+        debugPrintln("Modbus TCP server started on port " + String(MODBUS_TCP_PORT));
+        return;
+    }
+
+    modbusTcpServer.end();
+    modbusTcpListening = false;
+
+    // Connected masters go too; the disconnect handler frees their slots
+    xSemaphoreTake(modbusTcpMutex, portMAX_DELAY);
+    for (int i = 0; i < MODBUS_TCP_MAX_CLIENTS; i++) {
+        if (modbusTcpClients[i].client != NULL) {
+            modbusTcpClients[i].client->close();
+        }
+    }
+    xSemaphoreGive(modbusTcpMutex);
+    debugPrintln("Modbus TCP server stopped");
+}
+
+// AsyncTCP task: new master connected
+void onModbusTcpClient(void* arg, AsyncClient* client) {
+    int slot = -1;
+
+    xSemaphoreTake(modbusTcpMutex, portMAX_DELAY);
+    for (int i = 0; i < MODBUS_TCP_MAX_CLIENTS; i++) {
+        if (modbusTcpClients[i].client == NULL) {
+            slot = i;
+            modbusTcpClients[i].client = client;
+            modbusTcpClients[i].rxLength = 0;
+
+            // Requests of the previous connection still queued no longer count
+            portENTER_CRITICAL(&modbusTcpQueueMux);
+            modbusTcpClients[i].generation++;
+            modbusTcpClients[i].queued = 0;
+            portEXIT_CRITICAL(&modbusTcpQueueMux);
+            break;
+        }
+    }
+    xSemaphoreGive(modbusTcpMutex);
+
+    if (slot < 0) {
+        modbusTcpRejected++;
+        client->onDisconnect([](void* arg, AsyncClient* c) { delete c; }, NULL);
+        client->close(true);
+        return;
+    }
+
+    modbusTcpConnections++;
+    client->setNoDelay(true);
+    client->setRxTimeout(MODBUS_TCP_IDLE_TIMEOUT);
+    client->onData(onModbusTcpData, (void*)(intptr_t)slot);
+    client->onDisconnect(onModbusTcpDisconnect, (void*)(intptr_t)slot);
+    client->onTimeout([](void* arg, AsyncClient* c, uint32_t time) { c->close(); }, NULL);
+    client->onError([](void* arg, AsyncClient* c, int8_t error) { c->close(); }, NULL);
+}
+
+// AsyncTCP task: master went away - free the slot before the client
+void onModbusTcpDisconnect(void* arg, AsyncClient* client) {
+    int slot = (intptr_t)arg;
+
+    xSemaphoreTake(modbusTcpMutex, portMAX_DELAY);
+    if (modbusTcpClients[slot].client == client) {
+        modbusTcpClients[slot].client = NULL;
+        modbusTcpClients[slot].rxLength = 0;
+    }
+    xSemaphoreGive(modbusTcpMutex);
+
+    delete client;
+}
+
+// AsyncTCP task: split the byte stream into ADUs (a packet can carry part
+// of one or several pipelined requests)
+void onModbusTcpData(void* arg, AsyncClient* client, void* data, size_t length) {
+    ModbusTcpClient& slot = modbusTcpClients[(intptr_t)arg];
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    while (length > 0) {
+        size_t take = std::min(length, (size_t)(MODBUS_TCP_MAX_ADU - slot.rxLength));
+        memcpy(slot.rx + slot.rxLength, bytes, take);
+        slot.rxLength += take;
+        bytes += take;
+        length -= take;
+
+        while (slot.rxLength >= MODBUS_MBAP_SIZE) {
+            uint16_t protocol = (slot.rx[2] << 8) | slot.rx[3];
+            uint16_t follow = (slot.rx[4] << 8) | slot.rx[5];  // Unit id + PDU
+            if (protocol != 0 || follow < 2 || follow > MODBUS_MAX_PDU + 1) {
+                // Not Modbus - the stream cannot be resynchronised
+                modbusTcpBadFrames++;
+                slot.rxLength = 0;
+                client->close();
+                return;
+            }
+
+            size_t aduLength = 6 + follow;
+            if (slot.rxLength < aduLength) break;
+
+            handleModbusTcpAdu((intptr_t)arg, slot.rx, aduLength);
+            slot.rxLength -= aduLength;
+            memmove(slot.rx, slot.rx + aduLength, slot.rxLength);
+        }
+    }
+}
+
+// AsyncTCP task: answer a read from the image, queue anything else. A read
+// also waits in the queue while this connection has requests there, so it
+// can never overtake (or miss the effect of) an earlier write
+void handleModbusTcpAdu(uint8_t slot, const uint8_t* adu, size_t length) {
+    uint8_t response[MODBUS_TCP_MAX_ADU];
+    size_t pduLength;
+    bool read = isModbusReadFunction(adu[MODBUS_MBAP_SIZE]);
+    bool queued = false;
+    bool inOrder = true;
+
+    portENTER_CRITICAL(&modbusTcpQueueMux);
+    uint32_t generation = modbusTcpClients[slot].generation;
+    bool behind = modbusTcpClients[slot].queued > 0;
+    if (!read || behind) {
+        if (modbusTcpQueueCount < MODBUS_TCP_QUEUE_DEPTH) {
+            ModbusTcpRequest& request = modbusTcpQueue[(modbusTcpQueueHead + modbusTcpQueueCount) % MODBUS_TCP_QUEUE_DEPTH];
+            request.slot = slot;
+            request.generation = generation;
+            request.queuedAt = micros();
+            request.length = length;
+            memcpy(request.adu, adu, length);
+            modbusTcpQueueCount++;
+            modbusTcpClients[slot].queued++;
+            queued = true;
+        }
+        else {
+            // A busy reply now would overtake the requests still queued
+            inOrder = !behind;
+        }
+    }
+    portEXIT_CRITICAL(&modbusTcpQueueMux);
+
+    if (queued) return;
+
+    if (!inOrder) {
+        // Replies must keep request order - drop the master instead
+        modbusTcpBusy++;
+        xSemaphoreTake(modbusTcpMutex, portMAX_DELAY);
+        AsyncClient* client = modbusTcpClients[slot].client;
+        if (client != NULL && modbusTcpClients[slot].generation == generation) {
+            client->close();
+        }
+        xSemaphoreGive(modbusTcpMutex);
+        return;
+    }
+
+    if (read) {
+        ModbusImage image;
+        copyModbusImage(image);
+        pduLength = processModbusPdu(adu + MODBUS_MBAP_SIZE, length - MODBUS_MBAP_SIZE,
+            response + MODBUS_MBAP_SIZE, image);
+        modbusTcpReads++;
+    }
+    else {
+        modbusTcpBusy++;
+        pduLength = modbusException(response + MODBUS_MBAP_SIZE, adu[MODBUS_MBAP_SIZE], MODBUS_EX_DEVICE_BUSY);
+    }
+
+    sendModbusTcpResponse(slot, generation, adu, response, pduLength);
+}
+
+// MBAP header from the request, then the response PDU already in place
+void sendModbusTcpResponse(uint8_t slot, uint32_t generation, const uint8_t* request, uint8_t* response, size_t pduLength) {
+    memcpy(response, request, MODBUS_MBAP_SIZE);
+    response[4] = (pduLength + 1) >> 8;
+    response[5] = (pduLength + 1) & 0xFF;
+
+    xSemaphoreTake(modbusTcpMutex, portMAX_DELAY);
+    AsyncClient* client = modbusTcpClients[slot].client;
+    if (client != NULL && modbusTcpClients[slot].generation == generation && client->connected()) {
+        client->write((const char*)response, MODBUS_MBAP_SIZE + pduLength);
+    }
+    xSemaphoreGive(modbusTcpMutex);
+}
+
+// Carry out queued TCP requests in arrival order and keep the register
+// image fresh - loop()
+void serviceModbusTcp() {
+    ModbusTcpRequest request;
+    bool wrote = false;
+    bool imageStale = false;
+
+    for (uint8_t i = 0; i < MODBUS_TCP_QUEUE_DEPTH; i++) {
+        bool found = false;
+        portENTER_CRITICAL(&modbusTcpQueueMux);
+        if (modbusTcpQueueCount > 0) {
+            request = modbusTcpQueue[modbusTcpQueueHead];
+            modbusTcpQueueHead = (modbusTcpQueueHead + 1) % MODBUS_TCP_QUEUE_DEPTH;
+            modbusTcpQueueCount--;
+            found = true;
+        }
+        portEXIT_CRITICAL(&modbusTcpQueueMux);
+        if (!found) break;
+
+        uint8_t response[MODBUS_TCP_MAX_ADU];
+        bool read = isModbusReadFunction(request.adu[MODBUS_MBAP_SIZE]);
+
+        // A read queued behind a write must see that write
+        if (read && imageStale) {
+            refreshModbusImage();
+            imageStale = false;
+        }
+
+        size_t pduLength = processModbusPdu(request.adu + MODBUS_MBAP_SIZE, request.length - MODBUS_MBAP_SIZE,
+            response + MODBUS_MBAP_SIZE, modbusImage);
+
+        sendModbusTcpResponse(request.slot, request.generation, request.adu, response, pduLength);
+
+        // Only now may the next read of this connection skip the queue
+        portENTER_CRITICAL(&modbusTcpQueueMux);
+        if (modbusTcpClients[request.slot].generation == request.generation &&
+            modbusTcpClients[request.slot].queued > 0) {
+            modbusTcpClients[request.slot].queued--;
+        }
+        portEXIT_CRITICAL(&modbusTcpQueueMux);
+
+        if (read) {
+            modbusTcpOrderedReads++;
+            continue;
+        }
+        wrote = true;
+        imageStale = true;
+
+        unsigned long latency = micros() - request.queuedAt;
+        modbusTcpWrites++;
+        modbusTcpWriteLatencyTotal += latency;
+        if (latency > modbusTcpMaxWriteLatency) {
+            modbusTcpMaxWriteLatency = latency;
+        }
+    }
+
+    if (wrote || millis() - lastModbusImageRefresh >= MODBUS_IMAGE_INTERVAL) {
+        refreshModbusImage();
+    }
+    if (wrote) {
+        applyModbusSettings();
+    }
+}
+
+uint8_t getModbusTcpClientCount() {
+    uint8_t count = 0;
+    for (int i = 0; i < MODBUS_TCP_MAX_CLIENTS; i++) {
+        if (modbusTcpClients[i].client != NULL) count++;
+    }
+    return count;
+}
+
+// Load the UDP settings and open the port if it is enabled
+void beginUdp() {
+    loadUdpConfig();
+    applyUdpConfig();
+}
+
+// (Re)open the UDP port with the current settings
+void applyUdpConfig() {
+    if (udpListening) {
+        udp.close();
+        udpListening = false;
+    }
+    memset(udpPeers, 0, sizeof(udpPeers));
+    udpBeaconGroup.fromString(udpConfig.group);
+
+    commChannels[COMM_CHANNEL_UDP].enabled = udpConfig.enabled;
+    if (!udpConfig.enabled && !udpConfig.beacon) return;
+
+    // The beacon goes out from the command port too
+    if (!udp.listen(udpConfig.port)) {
+        debugPrintln("UDP port " + String(udpConfig.port) + " could not be opened");
+        return;
+    }
+    udp.onPacket(onUdpPacket, NULL);
+    udpListening = true;
+
+    debugPrintln("UDP control on port " + String(udpConfig.port) + (udpConfig.enabled ? "" : " (beacon only)") +
+        (udpConfig.beacon ? ", beacon to " + String(udpConfig.group) + ":" + String(udpConfig.beaconPort) : ""));
+}
+
+// AsyncUDP task: check the datagram and queue it for loop()
+void onUdpPacket(void* arg, AsyncUDPPacket& packet) {
+    if (!udpConfig.enabled || packet.isMulticast() || packet.isBroadcast()) return;
+
+    const uint8_t* data = packet.data();
+    size_t length = packet.length();
+    udpDatagrams++;
+
+    if (length < 6 || length > UDP_MAX_DATAGRAM || data[0] != BINARY_FRAME_START || data[1] < 2 ||
+        (size_t)data[1] + 4 != length) {
+        udpBadDatagrams++;
+        return;
+    }
+    uint16_t crc = modbusCrc16(data + 1, length - 3);
+    if (data[length - 2] != (crc & 0xFF) || data[length - 1] != (crc >> 8)) {
+        udpBadDatagrams++;
+        return;
+    }
+
+    bool queued = false;
+    portENTER_CRITICAL(&udpQueueMux);
+    if (udpQueueCount < UDP_QUEUE_DEPTH) {
+        UdpRequest& request = udpQueue[(udpQueueHead + udpQueueCount) % UDP_QUEUE_DEPTH];
+        request.address = (uint32_t)packet.remoteIP();
+        request.port = packet.remotePort();
+        request.receivedAt = micros();
+        request.length = length;
+        memcpy(request.frame, data, length);
+        udpQueueCount++;
+        queued = true;
+    }
+    portEXIT_CRITICAL(&udpQueueMux);
+
+    // Dropped requests are retried by the client
+    if (!queued) {
+        udpBusy++;
+    }
+}
+
+void serviceUdp() {
+    if (!udpListening) return;
+
+    if (udpConfig.enabled) {
+        serviceUdpCommands();
+    }
+    if (udpConfig.beacon) {
+        serviceUdpBeacon();
+    }
+}
+
+// Peer with its replay cache; a new peer takes a free slot or the least
+// recently seen one not used in this pass. NULL if every slot is in use.
+UdpPeer* findUdpPeer(uint32_t address, uint16_t port) {
+    UdpPeer* free = NULL;
+
+    for (int i = 0; i < UDP_MAX_PEERS; i++) {
+        UdpPeer& peer = udpPeers[i];
+        if (peer.address == address && peer.port == port) {
+            peer.lastSeen = millis();
+            peer.pass = udpPass;
+            return &peer;
+        }
+        if (peer.pass != udpPass && (free == NULL || peer.address == 0 ||
+            (free->address != 0 && peer.lastSeen < free->lastSeen))) {
+            free = &peer;
+        }
+    }
+
+    if (free != NULL) {
+        memset(free, 0, sizeof(UdpPeer));
+        free->address = address;
+        free->port = port;
+        free->lastSeen = millis();
+        free->pass = udpPass;
+    }
+    return free;
+}
+
+// Cached response to a retried request, or NULL if the request is new
+UdpReplay* findUdpReplay(UdpPeer& peer, const uint8_t* frame, uint8_t length) {
+    uint16_t crc = frame[length - 2] | (frame[length - 1] << 8);
+
+    for (int i = 0; i < UDP_REPLAY_DEPTH; i++) {
+        UdpReplay& replay = peer.replays[i];
+        if (replay.valid && replay.id == frame[2] && replay.crc == crc) {
+            return &replay;
+        }
+    }
+    return NULL;
+}
+
+// Claim the peer's oldest cache entry for a request; the response is filled
+// in once the pass has written the relays, until then a retry in the same
+// pass finds it at offset in binaryPass
+UdpReplay* addUdpReplay(UdpPeer& peer, const uint8_t* frame, uint8_t length, uint16_t offset) {
+    UdpReplay& replay = peer.replays[peer.next];
+    peer.next = (peer.next + 1) % UDP_REPLAY_DEPTH;
+
+    replay.valid = true;
+    replay.id = frame[2];
+    replay.crc = frame[length - 2] | (frame[length - 1] << 8);
+    replay.length = 0;
+    replay.offset = offset;
+    return &replay;
+}
+
+// Carry out the queued requests: new ones together, with one relay write,
+// retries (also of a request earlier in the same pass) from the cache. A
+// cached response is copied into binaryPass when it is found, since claiming
+// entries for later requests in the pass may overwrite it
+void serviceUdpCommands() {
+    uint8_t count;
+
+    portENTER_CRITICAL(&udpQueueMux);
+    count = udpQueueCount;
+    for (uint8_t i = 0; i < count; i++) {
+        udpBatch[i] = udpQueue[(udpQueueHead + i) % UDP_QUEUE_DEPTH];
+    }
+    udpQueueHead = (udpQueueHead + count) % UDP_QUEUE_DEPTH;
+    udpQueueCount = 0;
+    portEXIT_CRITICAL(&udpQueueMux);
+
+    if (count == 0) return;
+    udpPass++;
+
+    UdpReplay* replays[UDP_QUEUE_DEPTH];     // Entries claimed by new requests
+    uint16_t offsets[UDP_QUEUE_DEPTH];
+
+    for (uint8_t i = 0; i < count; i++) {
+        UdpRequest& request = udpBatch[i];
+        UdpPeer* peer = findUdpPeer(request.address, request.port);
+        UdpReplay* cached = (peer != NULL) ? findUdpReplay(*peer, request.frame, request.length) : NULL;
+
+        replays[i] = NULL;
+        if (cached != NULL) {
+            udpRetries++;
+            if (cached->length == 0) {
+                // Retry of a request earlier in this pass
+                offsets[i] = cached->offset;
+            }
+            else {
+                offsets[i] = binaryPass.length;
+                memcpy(binaryPass.responses + binaryPass.length, cached->response, cached->length);
+                binaryPass.length += cached->length;
+            }
+            continue;
+        }
+
+        offsets[i] = binaryPass.length;
+        handleBinaryFrame(request.frame, binaryPass);
+        commChannels[COMM_CHANNEL_UDP].commands++;
+        if (peer != NULL) {
+            replays[i] = addUdpReplay(*peer, request.frame, request.length, offsets[i]);
+        }
+    }
+
+    applyBinaryRelays(binaryPass);
+
+    for (uint8_t i = 0; i < count; i++) {
+        const UdpRequest& request = udpBatch[i];
+        const uint8_t* response = binaryPass.responses + offsets[i];
+        uint8_t length = response[1] + 4;
+
+        if (replays[i] != NULL) {
+            memcpy(replays[i]->response, response, length);
+            replays[i]->length = length;
+        }
+
+        udp.writeTo(response, length, IPAddress(request.address), request.port);
+
+        unsigned long latency = micros() - request.receivedAt;
+        udpAnswered++;
+        udpLatencyTotal += latency;
+        if (latency > udpMaxLatency) {
+            udpMaxLatency = latency;
+        }
+    }
+
+    binaryPass.length = 0;
+}
+
+// Multicast the state frame when relays or inputs change, and as a heartbeat
+void serviceUdpBeacon() {
+    unsigned long now = millis();
+
+    uint16_t relays = getRelayMask();
+    uint16_t inputs = 0;
+    for (int i = 0; i < 16; i++) {
+        if (inputStates[i]) inputs |= (1 << i);
+    }
+    uint8_t direct = 0;
+    for (int i = 0; i < 3; i++) {
+        if (directInputStates[i]) direct |= (1 << i);
+    }
+
+    bool changed = (relays != udpBeaconRelays || inputs != udpBeaconInputs || direct != udpBeaconDirect);
+    if (changed ? (now - udpLastBeacon < UDP_BEACON_MIN_GAP) : (now - udpLastBeacon < udpConfig.beaconInterval)) {
+        return;
+    }
+
+    uint8_t frame[WS_BIN_STATE_SIZE];
+    buildBinaryState(frame, udpBeaconSequence + 1);
+    if (udp.writeTo(frame, WS_BIN_STATE_SIZE, udpBeaconGroup, udpConfig.beaconPort) == WS_BIN_STATE_SIZE) {
+        udpBeaconSequence++;
+        udpBeacons++;
+    }
+
+    // A failed send (no network yet) waits for the next heartbeat
+    udpLastBeacon = now;
+    udpBeaconRelays = relays;
+    udpBeaconInputs = inputs;
+    udpBeaconDirect = direct;
+}
+
+void udpConfigToJson(JsonDocument& doc) {
+    doc["enabled"] = udpConfig.enabled;
+    doc["port"] = udpConfig.port;
+    doc["beacon"] = udpConfig.beacon;
+    doc["group"] = udpConfig.group;
+    doc["beacon_port"] = udpConfig.beaconPort;
+    doc["beacon_interval"] = udpConfig.beaconInterval;
+}
+
+// Apply any subset of the settings; nothing changes if one of them is invalid
+bool updateUdpConfig(JsonObject settings) {
+    if (settings.containsKey("group")) {
+        IPAddress group;
+        if (!group.fromString(settings["group"] | "") || group[0] < 224 || group[0] > 239) {
+            return false;
+        }
+    }
+
+    if (settings.containsKey("enabled")) udpConfig.enabled = settings["enabled"].as<bool>();
+    if (settings.containsKey("port")) udpConfig.port = constrain(settings["port"].as<long>(), 1L, 65535L);
+    if (settings.containsKey("beacon")) udpConfig.beacon = settings["beacon"].as<bool>();
+    if (settings.containsKey("group")) strlcpy(udpConfig.group, settings["group"] | "", sizeof(udpConfig.group));
+    if (settings.containsKey("beacon_port")) udpConfig.beaconPort = constrain(settings["beacon_port"].as<long>(), 1L, 65535L);
+    if (settings.containsKey("beacon_interval")) udpConfig.beaconInterval = constrain(settings["beacon_interval"].as<long>(), 50L, 60000L);
+    return true;
+}
+
+void saveUdpConfig() {
+    DynamicJsonDocument doc(512);
+    udpConfigToJson(doc);
+
+    File file = SPIFFS.open(UDP_CONFIG_FILE, FILE_WRITE);
+    if (!file) {
+        debugPrintln("Failed to open UDP config file for writing");
+        return;
+    }
+    serializeJson(doc, file);
+    file.close();
+
+    debugPrintln("Saved UDP configuration");
+    bumpConfigRevision(CONFIG_DOMAIN_UDP);
+}
+
+void loadUdpConfig() {
+    if (!SPIFFS.exists(UDP_CONFIG_FILE)) {
+        debugPrintln("No UDP configuration found, UDP control disabled");
+        return;
+    }
+
+    File file = SPIFFS.open(UDP_CONFIG_FILE, FILE_READ);
+    if (!file) {
+        debugPrintln("Failed to open UDP config file");
+        return;
+    }
+
+    DynamicJsonDocument doc(512);
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
+
+    if (error || !updateUdpConfig(doc.as<JsonObject>())) {
+        debugPrintln("Failed to parse UDP configuration");
+        return;
+    }
+    debugPrintln("UDP configuration loaded from SPIFFS");
+}
+
+// GET /api/udp - command port and beacon settings
+void handleUdpConfig() {
+    if (respondNotModified(CONFIG_DOMAIN_UDP)) {
+        return;
+    }
+
+    DynamicJsonDocument doc(512);
+    udpConfigToJson(doc);
+
+    String response;
+    serializeJson(doc, response);
+    server.send(200, "application/json", response);
+}
+
+// POST /api/udp - change any of the settings; the port is reopened with them
+void handleUpdateUdpConfig() {
+    String response = "{\"status\":\"error\",\"message\":\"Invalid request\"}";
+
+    if (server.hasArg("plain")) {
+        DynamicJsonDocument doc(512);
+        DeserializationError error = deserializeJson(doc, server.arg("plain"));
+
+        if (!error && doc.is<JsonObject>()) {
+            if (updateUdpConfig(doc.as<JsonObject>())) {
+                saveUdpConfig();
+                applyUdpConfig();
+                response = "{\"status\":\"success\",\"message\":\"UDP settings updated\"}";
+            }
+            else {
+                response = "{\"status\":\"error\",\"message\":\"Invalid UDP settings\"}";
+            }
+        }
+    }
+
+    server.send(200, "application/json", response);
+}
+
+// GET /api/udp/status - live counters (not cached)
+void handleUdpStatus() {
+    DynamicJsonDocument doc(512);
+
+    doc["listening"] = udpListening;
+    doc["datagrams"] = udpDatagrams;
+    doc["bad_datagrams"] = udpBadDatagrams;
+    doc["busy"] = udpBusy;
+    doc["retries"] = udpRetries;
+    doc["answered"] = udpAnswered;
+    doc["avg_latency_us"] = udpAnswered > 0 ? udpLatencyTotal / udpAnswered : 0;
+    doc["max_latency_us"] = udpMaxLatency;
+    doc["beacons"] = udpBeacons;
+    doc["beacon_seq"] = udpBeaconSequence;
+
+    String response;
+    serializeJson(doc, response);
+    server.send(200, "application/json", response);
+}
+
+// Load the MQTT settings and start the client if it is enabled
+void beginMqtt() {
+    for (int i = 0; i < 3; i++) {
+        mqttPublished.temperature[i] = NAN;
+        mqttPublished.humidity[i] = NAN;
+    }
+
+    loadMqttConfig();
+    mqtt.onMessage(onMqttMessage);
+    applyMqttConfig();
+}
+
+// (Re)start the client with the current settings
+void applyMqttConfig() {
+    char topic[MQTT_MAX_TOPIC];
+
+    // A clean disconnect does not fire the last will, so say so first
+    if (mqtt.connected()) {
+        snprintf(topic, sizeof(topic), "%s/status", mqttBase);
+        mqtt.publish(topic, "offline", true);
+    }
+    mqtt.end();
+
+    if (mqttConfig.baseTopic[0] != '\0') {
+        strlcpy(mqttBase, mqttConfig.baseTopic, sizeof(mqttBase));
+    }
+    else {
+        uint64_t mac = ESP.getEfuseMac();
+        snprintf(mqttBase, sizeof(mqttBase), "kc868-a16/%02x%02x%02x",
+            (uint8_t)(mac >> 24), (uint8_t)(mac >> 32), (uint8_t)(mac >> 40));
+    }
+    size_t baseLength = strlen(mqttBase);
+    while (baseLength > 0 && mqttBase[baseLength - 1] == '/') {
+        mqttBase[--baseLength] = '\0';
+    }
+
+    // The client id defaults to the base topic, which is unique per board
+    char clientId[MQTT_MAX_CREDENTIAL];
+    strlcpy(clientId, mqttConfig.clientId[0] != '\0' ? mqttConfig.clientId : mqttBase, sizeof(clientId));
+    for (char* p = clientId; *p != '\0'; p++) {
+        if (*p == '/') *p = '-';
+    }
+
+    snprintf(topic, sizeof(topic), "%s/status", mqttBase);
+    mqtt.setWill(topic, "offline");
+    mqtt.setServer(mqttConfig.host, mqttConfig.port);
+    mqtt.setKeepAlive(mqttConfig.keepAlive);
+    mqtt.setCredentials(clientId, mqttConfig.user, mqttConfig.password);
+
+    commChannels[COMM_CHANNEL_MQTT].enabled = mqttConfig.enabled;
+    if (mqttConfig.enabled && mqttConfig.host[0] != '\0') {
+        mqtt.begin();
+        debugPrintln("MQTT client started for " + String(mqttConfig.host) + ":" + String(mqttConfig.port) +
+            ", base topic " + String(mqttBase));
+    }
+}
+
+void serviceMqtt() {
+    mqtt.loop();
+    if (!mqtt.connected()) return;
+
+    unsigned long now = millis();
+
+    // New session: subscribe, announce, and publish the whole state
+    if (mqtt.takeSessionStart()) {
+        char topic[MQTT_MAX_TOPIC];
+        snprintf(topic, sizeof(topic), "%s/relay/+/set", mqttBase);
+        mqtt.subscribe(topic);
+        snprintf(topic, sizeof(topic), "%s/relays/set", mqttBase);
+        mqtt.subscribe(topic);
+        snprintf(topic, sizeof(topic), "%s/command", mqttBase);
+        mqtt.subscribe(topic);
+        snprintf(topic, sizeof(topic), "%s/status", mqttBase);
+        mqtt.publish(topic, "online", true);
+
+        debugPrintln("MQTT connected, session " + String(mqtt.getSessionCount()));
+        mqttFullPending = true;
+        mqttLastPublish = now - mqttConfig.batchInterval;
+    }
+
+    // Relay changes go out at once, so a command is confirmed without waiting
+    // for the batch interval; everything else is collected over the interval
+    if (now - mqttLastPublish >= mqttConfig.batchInterval || getRelayMask() != mqttPublished.outputs) {
+        mqttLastPublish = now;
+        if (publishMqttChanges(mqttFullPending)) {
+            mqttFullPending = false;
+        }
+    }
+
+    mqtt.flush();
+}
+
+// True when a reading has moved past the deadband since it was published
+bool mqttValueMoved(float value, float published, float deadband) {
+    if (isnan(value)) return false;
+    if (isnan(published)) return true;
+    return fabsf(value - published) > deadband;
+}
+
+// Publish what changed since the last call (everything when full); false if
+// some of it did not fit in the transmit buffer and is still pending
+bool publishMqttChanges(bool full) {
+    PendingChanges changes;
+    memset(&changes, 0, sizeof(changes));
+
+    for (int i = 0; i < 16; i++) {
+        if (full || outputStates[i] != (bool)((mqttPublished.outputs >> i) & 1)) changes.outputs |= (1 << i);
+        if (full || inputStates[i] != (bool)((mqttPublished.inputs >> i) & 1)) changes.inputs |= (1 << i);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (full || directInputStates[i] != (bool)((mqttPublished.directInputs >> i) & 1)) changes.directInputs |= (1 << i);
+    }
+    for (int i = 0; i < 4; i++) {
+        long millivolts = lroundf(analogVoltages[i] * 1000.0f);
+        if (full || labs(millivolts - mqttPublished.analogMillivolts[i]) > mqttConfig.analogDeadband) {
+            changes.analog |= (1 << i);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        const HTSensorConfig& sensor = htSensorConfig[i];
+        if (sensor.sensorType == SENSOR_TYPE_DIGITAL) continue;
+
+        bool humidity = (sensor.sensorType == SENSOR_TYPE_DHT11 || sensor.sensorType == SENSOR_TYPE_DHT22);
+        if (full || mqttValueMoved(sensor.temperature, mqttPublished.temperature[i], mqttConfig.temperatureDeadband) ||
+            (humidity && mqttValueMoved(sensor.humidity, mqttPublished.humidity[i], mqttConfig.humidityDeadband))) {
+            changes.sensors |= (1 << i);
+        }
+    }
+
+    if (!hasPendingChanges(changes)) return true;
+
+    // An element counts as published once every enabled form of it is queued
+    PendingChanges sent = changes;
+    if (mqttConfig.valueTopics) {
+        publishMqttValues(sent);
+    }
+    if (mqttConfig.batchFormat != MQTT_BATCH_NONE && !publishMqttBatch(changes, full)) {
+        memset(&sent, 0, sizeof(sent));
+    }
+
+    for (int i = 0; i < 16; i++) {
+        if (sent.outputs & (1 << i)) {
+            mqttPublished.outputs = (mqttPublished.outputs & ~(1 << i)) | (outputStates[i] << i);
+        }
+        if (sent.inputs & (1 << i)) {
+            mqttPublished.inputs = (mqttPublished.inputs & ~(1 << i)) | (inputStates[i] << i);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (sent.directInputs & (1 << i)) {
+            mqttPublished.directInputs = (mqttPublished.directInputs & ~(1 << i)) | (directInputStates[i] << i);
+        }
+        if (sent.sensors & (1 << i)) {
+            mqttPublished.temperature[i] = htSensorConfig[i].temperature;
+            mqttPublished.humidity[i] = htSensorConfig[i].humidity;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        if (sent.analog & (1 << i)) {
+            mqttPublished.analogMillivolts[i] = lroundf(analogVoltages[i] * 1000.0f);
+        }
+    }
+
+    return memcmp(&sent, &changes, sizeof(sent)) == 0;
+}
+
+// Publish every changed element on its retained topic; elements that did not
+// fit in the transmit buffer have their bit cleared so they are sent again
+void publishMqttValues(PendingChanges& changes) {
+    char topic[MQTT_MAX_TOPIC];
+    char value[16];
+
+    for (int i = 0; i < 16; i++) {
+        if (changes.outputs & (1 << i)) {
+            snprintf(topic, sizeof(topic), "%s/relay/%d", mqttBase, i + 1);
+            if (!mqtt.publish(topic, outputStates[i] ? "ON" : "OFF", true)) changes.outputs &= ~(1 << i);
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        if (changes.inputs & (1 << i)) {
+            snprintf(topic, sizeof(topic), "%s/input/%d", mqttBase, i + 1);
+            if (!mqtt.publish(topic, inputStates[i] ? "ON" : "OFF", true)) changes.inputs &= ~(1 << i);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (changes.directInputs & (1 << i)) {
+            snprintf(topic, sizeof(topic), "%s/ht/%d", mqttBase, i + 1);
+            if (!mqtt.publish(topic, directInputStates[i] ? "ON" : "OFF", true)) changes.directInputs &= ~(1 << i);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        if (changes.analog & (1 << i)) {
+            snprintf(topic, sizeof(topic), "%s/analog/%d", mqttBase, i + 1);
+            formatFixed(value, sizeof(value), lroundf(analogVoltages[i] * 1000.0f), 3);
+            if (!mqtt.publish(topic, value, true)) changes.analog &= ~(1 << i);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (!(changes.sensors & (1 << i))) continue;
+
+        // A sensor without a valid reading yet has nothing to publish
+        const HTSensorConfig& sensor = htSensorConfig[i];
+        bool queued = true;
+        if (!isnan(sensor.temperature)) {
+            snprintf(topic, sizeof(topic), "%s/sensor/%d/temperature", mqttBase, i + 1);
+            formatFixed(value, sizeof(value), lroundf(sensor.temperature * 10.0f), 1);
+            queued = mqtt.publish(topic, value, true);
+        }
+        if ((sensor.sensorType == SENSOR_TYPE_DHT11 || sensor.sensorType == SENSOR_TYPE_DHT22) && !isnan(sensor.humidity)) {
+            snprintf(topic, sizeof(topic), "%s/sensor/%d/humidity", mqttBase, i + 1);
+            formatFixed(value, sizeof(value), lroundf(sensor.humidity * 10.0f), 1);
+            queued = mqtt.publish(topic, value, true) && queued;
+        }
+        if (!queued) changes.sensors &= ~(1 << i);
+    }
+}
+
+// All changes in one message on <base>/state, in the WebSocket formats. The
+// binary frame always holds the whole state and is retained; JSON deltas
+// are not, since a retained delta would be stale for the next subscriber.
+bool publishMqttBatch(const PendingChanges& changes, bool full) {
+    char topic[MQTT_MAX_TOPIC];
+    snprintf(topic, sizeof(topic), "%s/state", mqttBase);
+    bool sent;
+
+    if (mqttConfig.batchFormat == MQTT_BATCH_BINARY) {
+        uint8_t frame[WS_BIN_STATE_SIZE];
+        buildBinaryState(frame, mqttSequence + 1);
+        sent = mqtt.publish(topic, frame, WS_BIN_STATE_SIZE, true);
+    }
+    else {
+        JsonWriter json(JSON_OUT_PAYLOAD, JSON_OUT_BUFFER_SIZE);
+        json.beginObject();
+        json.addString("type", full ? "status_update" : "delta");
+        json.addUInt("seq", mqttSequence + 1);
+        writeStatusJson(json, WS_TOPIC_OUTPUTS | WS_TOPIC_INPUTS | WS_TOPIC_ANALOG | WS_TOPIC_SENSORS, full ? NULL : &changes);
+        json.endObject();
+        if (json.overflow) {
+            jsonOverflowCount++;
+            return false;
+        }
+        sent = mqtt.publish(topic, (const uint8_t*)JSON_OUT_PAYLOAD, json.length, false);
+    }
+
+    if (sent) {
+        mqttSequence++;
+    }
+    return sent;
+}
+
+// Fixed-point value as text without float formatting: 3215, 3 -> "3.215"
+void formatFixed(char* out, size_t size, long scaled, uint8_t decimals) {
+    unsigned long divisor = 1;
+    for (uint8_t i = 0; i < decimals; i++) {
+        divisor *= 10;
+    }
+    unsigned long magnitude = labs(scaled);
+    snprintf(out, size, "%s%lu.%0*lu", scaled < 0 ? "-" : "", magnitude / divisor, (int)decimals, magnitude % divisor);
+}
+
+// Relay set payload: 1 = on, 0 = off, 2 = toggle, -1 = not understood
+int parseMqttSwitch(const char* text) {
+    if (strcasecmp(text, "ON") == 0 || strcmp(text, "1") == 0 || strcasecmp(text, "TRUE") == 0) return 1;
+    if (strcasecmp(text, "OFF") == 0 || strcmp(text, "0") == 0 || strcasecmp(text, "FALSE") == 0) return 0;
+    if (strcasecmp(text, "TOGGLE") == 0) return 2;
+    return -1;
+}
+
+// Message on a subscribed topic, delivered from mqtt.loop() in loop()
+void onMqttMessage(const char* topic, const uint8_t* payload, size_t length, void* context) {
+    size_t baseLength = strlen(mqttBase);
+    if (strncmp(topic, mqttBase, baseLength) != 0 || topic[baseLength] != '/') return;
+    const char* subtopic = topic + baseLength + 1;
+
+    CommChannel& channel = commChannels[COMM_CHANNEL_MQTT];
+    char text[COMMAND_LINE_SIZE];
+    if (length >= sizeof(text)) {
+        channel.rejected++;
+        return;
+    }
+    memcpy(text, payload, length);
+    while (length > 0 && isspace((unsigned char)text[length - 1])) {
+        length--;
+    }
+    text[length] = '\0';
+
+    // Text command, answered on command/result
+    if (strcmp(subtopic, "command") == 0) {
+        CommandBufferSink sink(commandResponse, sizeof(commandResponse));
+        if (commandDispatcher.execute(text, sink)) {
+            channel.commands++;
+        }
+        else {
+            channel.rejected++;
+        }
+
+        char resultTopic[MQTT_MAX_TOPIC];
+        snprintf(resultTopic, sizeof(resultTopic), "%s/command/result", mqttBase);
+        mqtt.publish(resultTopic, (const uint8_t*)sink.c_str(), sink.length(), false);
+        return;
+    }
+
+    uint16_t mask = getRelayMask();
+    bool valid = false;
+
+    if (strcmp(subtopic, "relays/set") == 0) {
+        char* end;
+        unsigned long value = strtoul(text, &end, 0);
+        valid = (end != text && *end == '\0' && value <= 0xFFFF);
+        mask = value;
+    }
+    else if (strncmp(subtopic, "relay/", 6) == 0) {
+        char* end;
+        long relay = strtol(subtopic + 6, &end, 10);
+        int state = parseMqttSwitch(text);
+        if (relay >= 1 && relay <= 16 && strcmp(end, "/set") == 0 && state >= 0) {
+            uint16_t bit = 1 << (relay - 1);
+            mask = (state == 2) ? (mask ^ bit) : (state == 1 ? (mask | bit) : (mask & ~bit));
+            valid = true;
+        }
+    }
+
+    if (!valid) {
+        channel.rejected++;
+        debugPrintln("MQTT: ignored '" + String(text) + "' on " + String(topic));
+        return;
+    }
+
+    channel.commands++;
+    if (stageRelayMask(mask)) {
+        if (writeOutputs()) {
+            requestBroadcast();
+        }
+        else {
+            debugPrintln("MQTT: relay write failed");
+        }
+    }
+}
+
+// The password is only reported as set or not - it is stored in NVS on its own
+void mqttConfigToJson(JsonDocument& doc) {
+    static const char* batchFormats[] = { "none", "json", "binary" };
+
+    doc["enabled"] = mqttConfig.enabled;
+    doc["host"] = mqttConfig.host;
+    doc["port"] = mqttConfig.port;
+    doc["client_id"] = mqttConfig.clientId;
+    doc["user"] = mqttConfig.user;
+    doc["password_set"] = mqttConfig.password[0] != '\0';
+    doc["base_topic"] = mqttConfig.baseTopic;
+    doc["keep_alive"] = mqttConfig.keepAlive;
+    doc["value_topics"] = mqttConfig.valueTopics;
+    doc["batch_format"] = batchFormats[mqttConfig.batchFormat];
+    doc["batch_interval"] = mqttConfig.batchInterval;
+    doc["analog_deadband"] = mqttConfig.analogDeadband;
+    doc["temperature_deadband"] = mqttConfig.temperatureDeadband;
+    doc["humidity_deadband"] = mqttConfig.humidityDeadband;
+}
+
+// Apply any subset of the settings; nothing changes if one of them is invalid
+bool updateMqttConfig(JsonObject settings) {
+    int batchFormat = mqttConfig.batchFormat;
+    if (settings.containsKey("batch_format")) {
+        const char* format = settings["batch_format"] | "";
+        if (strcmp(format, "none") == 0) batchFormat = MQTT_BATCH_NONE;
+        else if (strcmp(format, "json") == 0) batchFormat = MQTT_BATCH_JSON;
+        else if (strcmp(format, "binary") == 0) batchFormat = MQTT_BATCH_BINARY;
+        else return false;
+    }
+
+    // Wildcards cannot appear in a topic that is published to
+    if (settings.containsKey("base_topic") && strpbrk(settings["base_topic"] | "", "+#") != NULL) {
+        return false;
+    }
+
+    mqttConfig.batchFormat = batchFormat;
+    if (settings.containsKey("enabled")) mqttConfig.enabled = settings["enabled"].as<bool>();
+    if (settings.containsKey("host")) strlcpy(mqttConfig.host, settings["host"] | "", sizeof(mqttConfig.host));
+    if (settings.containsKey("port")) mqttConfig.port = constrain(settings["port"].as<long>(), 1L, 65535L);
+    if (settings.containsKey("client_id")) strlcpy(mqttConfig.clientId, settings["client_id"] | "", sizeof(mqttConfig.clientId));
+    if (settings.containsKey("user")) strlcpy(mqttConfig.user, settings["user"] | "", sizeof(mqttConfig.user));
+    if (settings.containsKey("password")) strlcpy(mqttConfig.password, settings["password"] | "", sizeof(mqttConfig.password));
+    if (settings.containsKey("base_topic")) strlcpy(mqttConfig.baseTopic, settings["base_topic"] | "", sizeof(mqttConfig.baseTopic));
+    if (settings.containsKey("keep_alive")) mqttConfig.keepAlive = constrain(settings["keep_alive"].as<long>(), 0L, 3600L);
+    if (settings.containsKey("value_topics")) mqttConfig.valueTopics = settings["value_topics"].as<bool>();
+    if (settings.containsKey("batch_interval")) mqttConfig.batchInterval = constrain(settings["batch_interval"].as<long>(), 10L, 60000L);
+    if (settings.containsKey("analog_deadband")) mqttConfig.analogDeadband = constrain(settings["analog_deadband"].as<long>(), 0L, 5000L);
+    if (settings.containsKey("temperature_deadband")) mqttConfig.temperatureDeadband = constrain(settings["temperature_deadband"].as<float>(), 0.0f, 50.0f);
+    if (settings.containsKey("humidity_deadband")) mqttConfig.humidityDeadband = constrain(settings["humidity_deadband"].as<float>(), 0.0f, 50.0f);
+    return true;
+}
+
+void saveMqttConfig() {
+    Preferences secrets;
+    if (secrets.begin(MQTT_SECRET_NAMESPACE, false)) {
+        secrets.putString("password", mqttConfig.password);
+        secrets.end();
+    }
+    else {
+        debugPrintln("Failed to open NVS for the MQTT password");
+    }
+
+    DynamicJsonDocument doc(1024);
+    mqttConfigToJson(doc);
+
+    File file = SPIFFS.open(MQTT_CONFIG_FILE, FILE_WRITE);
+    if (!file) {
+        debugPrintln("Failed to open MQTT config file for writing");
+        return;
+    }
+    serializeJson(doc, file);
+    file.close();
+
+    debugPrintln("Saved MQTT configuration");
+    bumpConfigRevision(CONFIG_DOMAIN_MQTT);
+}
+
+void loadMqttConfig() {
+    // Older firmware kept everything, password included, in /mqtt.json
+    bool legacy = !SPIFFS.exists(MQTT_CONFIG_FILE) && SPIFFS.exists(MQTT_LEGACY_CONFIG_FILE);
+    const char* path = legacy ? MQTT_LEGACY_CONFIG_FILE : MQTT_CONFIG_FILE;
+
+    if (!SPIFFS.exists(path)) {
+        debugPrintln("No MQTT configuration found, client disabled");
+        return;
+    }
+
+    File file = SPIFFS.open(path, FILE_READ);
+    if (!file) {
+        debugPrintln("Failed to open MQTT config file");
+        return;
+    }
+
+    DynamicJsonDocument doc(1024);
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
+
+    if (error || !updateMqttConfig(doc.as<JsonObject>())) {
+        debugPrintln("Failed to parse MQTT configuration");
+        return;
+    }
+
+    if (legacy) {
+        // Password moves to NVS, the rest to the private path
+        saveMqttConfig();
+        SPIFFS.remove(MQTT_LEGACY_CONFIG_FILE);
+        debugPrintln("MQTT configuration migrated from " MQTT_LEGACY_CONFIG_FILE);
+        return;
+    }
+
+    Preferences secrets;
+    if (secrets.begin(MQTT_SECRET_NAMESPACE, true)) {
+        secrets.getString("password", mqttConfig.password, sizeof(mqttConfig.password));
+        secrets.end();
+    }
+    debugPrintln("MQTT configuration loaded from SPIFFS");
+}
+
+// GET /api/mqtt - client settings; the password is only reported as set or not
+void handleMqttConfig() {
+    if (respondNotModified(CONFIG_DOMAIN_MQTT)) {
+        return;
+    }
+
+    DynamicJsonDocument doc(1024);
+    mqttConfigToJson(doc);
+    doc["topic_base"] = mqttBase;   // Base topic in use, after the default is applied
+
+    String response;
+    serializeJson(doc, response);
+    server.send(200, "application/json", response);
+}
+
+// POST /api/mqtt - change any of the settings; the client reconnects with them
+void handleUpdateMqttConfig() {
+    String response = "{\"status\":\"error\",\"message\":\"Invalid request\"}";
+
+    if (server.hasArg("plain")) {
+        DynamicJsonDocument doc(1024);
+        DeserializationError error = deserializeJson(doc, server.arg("plain"));
+
+        if (!error && doc.is<JsonObject>()) {
+            if (updateMqttConfig(doc.as<JsonObject>())) {
+                saveMqttConfig();
+                applyMqttConfig();
+                response = "{\"status\":\"success\",\"message\":\"MQTT settings updated\"}";
+            }
+            else {
+                response = "{\"status\":\"error\",\"message\":\"Invalid MQTT settings\"}";
+            }
+        }
+    }
+
+    server.send(200, "application/json", response);
+}
+
+// GET /api/mqtt/status - live session state and counters (not cached)
+void handleMqttStatus() {
+    DynamicJsonDocument doc(768);
+
+    doc["enabled"] = mqttConfig.enabled;
+    doc["state"] = mqtt.getStateName();
+    doc["connected"] = mqtt.connected();
+    doc["topic_base"] = mqttBase;
+    doc["sessions"] = mqtt.getSessionCount();
+    doc["failed_connects"] = mqtt.getFailedConnectCount();
+    doc["last_connack"] = mqtt.getLastConnackCode();
+    doc["published"] = mqtt.getPublishedCount();
+    doc["dropped"] = mqtt.getDroppedCount();
+    doc["received"] = mqtt.getReceivedCount();
+    doc["bytes_sent"] = mqtt.getBytesSent();
+    doc["queued_bytes"] = mqtt.getQueuedBytes();
+    doc["batches"] = mqttSequence;
+    doc["commands"] = commChannels[COMM_CHANNEL_MQTT].commands;
+    doc["rejected"] = commChannels[COMM_CHANNEL_MQTT].rejected;
+
+    String response;
+    serializeJson(doc, response);
+    server.send(200, "application/json", response);
+}
+
+// Process commands received via RS485
+void processRS485Commands() {
+    // Modbus RTU owns the line when selected
+    if (modbusRtu.active) {
+        serviceModbusRtu();
+        return;
+    }
+
+    serviceCommandChannel(rs485, commChannels[COMM_CHANNEL_RS485]);
+}
+
+// Text command handlers. Each writes its response to the caller's sink, so a
+// serial port gets the text as it is produced and the web transports collect
+// it in commandResponse[]. Commands are registered in commandTable below.
+
+void commandRelayStatus(const CommandArgs& args, Print& out) {
+    out.println("RELAY STATUS:");
+    for (int i = 0; i < 16; i++) {
+        out.print(i + 1);
+        out.print(" (Relay ");
+        out.print(i + 1);
+        out.print("): ");
+        out.println(outputStates[i] ? "ON" : "OFF");
+    }
+}
+
+void commandRelayAll(const CommandArgs& args, Print& out) {
+    bool on;
+    if (strcmp(args.words[0], "ON") == 0) {
+        on = true;
+    }
+    else if (strcmp(args.words[0], "OFF") == 0) {
+        on = false;
+    }
+    else {
+        out.println("ERROR: Invalid relay command");
+        return;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        outputStates[i] = on;
+    }
+    if (writeOutputs()) {
+        requestBroadcast();
+        out.println(on ? "All relays turned ON" : "All relays turned OFF");
+    }
+    else {
+        out.println(on ? "ERROR: Failed to turn all relays ON" : "ERROR: Failed to turn all relays OFF");
+    }
+}
+
+void commandRelay(const CommandArgs& args, Print& out) {
+    long relayNum = args.numbers[0];
+    bool on = (strcmp(args.words[1], "ON") == 0);
+
+    if (relayNum < 1 || relayNum > 16 || (!on && strcmp(args.words[1], "OFF") != 0)) {
+        out.println("ERROR: Invalid relay command");
+        return;
+    }
+
+    outputStates[relayNum - 1] = on;
+    if (writeOutputs()) {
+        requestBroadcast();
+        out.print("Relay ");
+        out.print(relayNum);
+        out.println(on ? " turned ON" : " turned OFF");
+    }
+    else {
+        out.println(on ? "ERROR: Failed to turn relay ON" : "ERROR: Failed to turn relay OFF");
+    }
+}
+
+void commandInputStatus(const CommandArgs& args, Print& out) {
+    out.println("INPUT STATUS:");
+    for (int i = 0; i < 16; i++) {
+        out.print(i + 1);
+        out.print(" (Input ");
+        out.print(i + 1);
+        out.print("): ");
+        out.println(inputStates[i] ? "HIGH" : "LOW");
+    }
+}
+
+void commandInterruptStatus(const CommandArgs& args, Print& out) {
+    out.println("INTERRUPT CONFIGURATIONS:");
+    for (int i = 0; i < 16; i++) {
+        out.print(i + 1);
+        out.print(" (Input ");
+        out.print(i + 1);
+        out.print("): ");
+        out.print(interruptConfigs[i].enabled ? "Enabled" : "Disabled");
+        out.print(", Priority: ");
+
+        switch (interruptConfigs[i].priority) {
+        case INPUT_PRIORITY_HIGH: out.print("High"); break;
+        case INPUT_PRIORITY_MEDIUM: out.print("Medium"); break;
+        case INPUT_PRIORITY_LOW: out.print("Low"); break;
+        case INPUT_PRIORITY_NONE: out.print("None (Polling)"); break;
+        default: out.print("Unknown");
+        }
+
+        out.print(", Trigger: ");
+        switch (interruptConfigs[i].triggerType) {
+        case INTERRUPT_TRIGGER_RISING: out.println("Rising Edge"); break;
+        case INTERRUPT_TRIGGER_FALLING: out.println("Falling Edge"); break;
+        case INTERRUPT_TRIGGER_CHANGE: out.println("Change (Any Edge)"); break;
+        case INTERRUPT_TRIGGER_HIGH_LEVEL: out.println("High Level"); break;
+        case INTERRUPT_TRIGGER_LOW_LEVEL: out.println("Low Level"); break;
+        default: out.println("Unknown");
+        }
+    }
+    out.print("\nInterrupt System: ");
+    out.println(inputInterruptsEnabled ? "Active" : "Inactive");
 }
 
-// Handle I2C scan endpoint
-void handleI2CScan() {
-    DynamicJsonDocument doc(1024);
-    JsonArray devices = doc.createNestedArray("devices");
+void commandInterruptEnable(const CommandArgs& args, Print& out) {
+    long inputNum = args.numbers[0];
+    if (inputNum < 1 || inputNum > 16) {
+        out.println("ERROR: Invalid input number. Must be between 1-16.");
+        return;
+    }
 
-    // Scan I2C bus
-    for (uint8_t address = 1; address < 127; address++) {
-        Wire.beginTransmission(address);
-        uint8_t error = Wire.endTransmission();
+    lockConfigArrays();
+    interruptConfigs[inputNum - 1].enabled = true;
+    unlockConfigArrays();
+    saveInterruptConfigs();
 
-        if (error == 0) {
-            JsonObject device = devices.createNestedObject();
-            device["address"] = "0x" + String(address, HEX);
+    if (!inputInterruptsEnabled) {
+        inputInterruptsEnabled = true; // Enable the interrupt system
+    }
+    setupInputInterrupts(); // Reconfigure interrupts
 
-            // Identify known devices
-            if (address == PCF8574_INPUTS_1_8) {
-                device["name"] = "PCF8574 Inputs 1-8";
-            }
-            else if (address == PCF8574_INPUTS_9_16) {
-                device["name"] = "PCF8574 Inputs 9-16";
-            }
-            else if (address == PCF8574_OUTPUTS_1_8) {
-                device["name"] = "PCF8574 Outputs 1-8";
-            }
-            else if (address == PCF8574_OUTPUTS_9_16) {
-                device["name"] = "PCF8574 Outputs 9-16";
-            }
-            else if (address == 0x68) {
-                device["name"] = "DS3231 RTC";
-            }
-            else {
-                device["name"] = "Unknown device";
-            }
+    out.print("Interrupt enabled for input ");
+    out.println(inputNum);
+}
+
+void commandInterruptDisable(const CommandArgs& args, Print& out) {
+    long inputNum = args.numbers[0];
+    if (inputNum < 1 || inputNum > 16) {
+        out.println("ERROR: Invalid input number. Must be between 1-16.");
+        return;
+    }
+
+    lockConfigArrays();
+    interruptConfigs[inputNum - 1].enabled = false;
+    unlockConfigArrays();
+    saveInterruptConfigs();
+
+    // Check if any interrupts are still enabled
+    bool anyEnabled = false;
+    for (int i = 0; i < 16; i++) {
+        if (interruptConfigs[i].enabled) {
+            anyEnabled = true;
+            break;
         }
     }
 
-    doc["total_devices"] = devices.size();
+    if (anyEnabled && inputInterruptsEnabled) {
+        setupInputInterrupts(); // Reconfigure interrupts
+    }
+    else if (!anyEnabled) {
+        disableInputInterrupts(); // Disable the entire interrupt system
+    }
 
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response);
+    out.print("Interrupt disabled for input ");
+    out.println(inputNum);
 }
 
-// Process commands received via Serial
-void processSerialCommands() {
-    if (Serial.available()) {
-        String command = Serial.readStringUntil('\n');
-        command.trim();
+void commandInterruptPriority(const CommandArgs& args, Print& out) {
+    long inputNum = args.numbers[0];
+    const char* priorityStr = args.words[1];
 
-        String response = processCommand(command);
-        Serial.println(response);
+    uint8_t priority;
+    if (strcmp(priorityStr, "HIGH") == 0) {
+        priority = INPUT_PRIORITY_HIGH;
+    }
+    else if (strcmp(priorityStr, "MEDIUM") == 0) {
+        priority = INPUT_PRIORITY_MEDIUM;
+    }
+    else if (strcmp(priorityStr, "LOW") == 0) {
+        priority = INPUT_PRIORITY_LOW;
+    }
+    else if (strcmp(priorityStr, "NONE") == 0) {
+        priority = INPUT_PRIORITY_NONE;
+    }
+    else {
+        out.println("ERROR: Invalid priority. Use HIGH, MEDIUM, LOW, or NONE.");
+        return;
     }
-}
 
-// Process commands received via RS485
-void processRS485Commands() {
-    if (rs485.available()) {
-        String command = rs485.readStringUntil('\n');
-        command.trim();
+    if (inputNum < 1 || inputNum > 16) {
+        out.println("ERROR: Invalid input number. Must be between 1-16.");
+        return;
+    }
+
+    lockConfigArrays();
+    interruptConfigs[inputNum - 1].priority = priority;
+    unlockConfigArrays();
+    saveInterruptConfigs();
 
-        String response = processCommand(command);
-        rs485.println(response);
+    if (inputInterruptsEnabled) {
+        setupInputInterrupts(); // Reconfigure interrupts
     }
-}
 
-// Process command and return response
-String processCommand(String command) {
-    if (command.startsWith("RELAY ")) {
-        // Relay control command
-        command = command.substring(6);
+    out.print("Priority for input ");
+    out.print(inputNum);
+    out.print(" set to ");
+    out.println(priorityStr);
+}
 
-        if (command.startsWith("STATUS")) {
-            // Return relay status
-            String response = "RELAY STATUS:\n";
-            for (int i = 0; i < 16; i++) {
-                response += String(i + 1) + " (Relay " + String(i + 1) + "): ";
-                response += outputStates[i] ? "ON" : "OFF";
-                response += "\n";
-            }
-            return response;
-        }
-        else if (command.startsWith("ALL ON")) {
-            // Turn all relays on
-            for (int i = 0; i < 16; i++) {
-                outputStates[i] = true;
-            }
-            if (writeOutputs()) {
-                broadcastUpdate();
-                return "All relays turned ON";
-            }
-            else {
-                return "ERROR: Failed to turn all relays ON";
-            }
-        }
-        else if (command.startsWith("ALL OFF")) {
-            // Turn all relays off
-            for (int i = 0; i < 16; i++) {
-                outputStates[i] = false;
-            }
-            if (writeOutputs()) {
-                broadcastUpdate();
-                return "All relays turned OFF";
-            }
-            else {
-                return "ERROR: Failed to turn all relays OFF";
-            }
-        }
-        else {
-            // Individual relay control: RELAY <number> <ON|OFF>
-            int spacePos = command.indexOf(' ');
-            if (spacePos > 0) {
-                int relayNum = command.substring(0, spacePos).toInt();
-                String action = command.substring(spacePos + 1);
-
-                if (relayNum >= 1 && relayNum <= 16) {
-                    int index = relayNum - 1;
-                    if (action == "ON") {
-                        outputStates[index] = true;
-                        if (writeOutputs()) {
-                            broadcastUpdate();
-                            return "Relay " + String(relayNum) + " turned ON";
-                        }
-                        else {
-                            return "ERROR: Failed to turn relay ON";
-                        }
-                    }
-                    else if (action == "OFF") {
-                        outputStates[index] = false;
-                        if (writeOutputs()) {
-                            broadcastUpdate();
-                            return "Relay " + String(relayNum) + " turned OFF";
-                        }
-                        else {
-                            return "ERROR: Failed to turn relay OFF";
-                        }
-                    }
-                }
-            }
-        }
+void commandInterruptTrigger(const CommandArgs& args, Print& out) {
+    long inputNum = args.numbers[0];
+    const char* triggerStr = args.words[1];
 
-        return "ERROR: Invalid relay command";
+    uint8_t triggerType;
+    if (strcmp(triggerStr, "RISING") == 0 || strcmp(triggerStr, "RISE") == 0) {
+        triggerType = INTERRUPT_TRIGGER_RISING;
     }
-    else if (command.startsWith("INPUT STATUS")) {
-        // Return input status
-        String response = "INPUT STATUS:\n";
-        for (int i = 0; i < 16; i++) {
-            response += String(i + 1) + " (Input " + String(i + 1) + "): ";
-            response += inputStates[i] ? "HIGH" : "LOW";
-            response += "\n";
-        }
-        return response;
+    else if (strcmp(triggerStr, "FALLING") == 0 || strcmp(triggerStr, "FALL") == 0) {
+        triggerType = INTERRUPT_TRIGGER_FALLING;
     }
-    else if (command.startsWith("INTERRUPT STATUS")) {
-        // Return interrupt configuration status
-        String response = "INTERRUPT CONFIGURATIONS:\n";
-        for (int i = 0; i < 16; i++) {
-            response += String(i + 1) + " (Input " + String(i + 1) + "): ";
-            response += interruptConfigs[i].enabled ? "Enabled" : "Disabled";
-            response += ", Priority: ";
-
-            switch (interruptConfigs[i].priority) {
-            case INPUT_PRIORITY_HIGH: response += "High"; break;
-            case INPUT_PRIORITY_MEDIUM: response += "Medium"; break;
-            case INPUT_PRIORITY_LOW: response += "Low"; break;
-            case INPUT_PRIORITY_NONE: response += "None (Polling)"; break;
-            default: response += "Unknown";
-            }
-
-            response += ", Trigger: ";
-            switch (interruptConfigs[i].triggerType) {
-            case INTERRUPT_TRIGGER_RISING: response += "Rising Edge"; break;
-            case INTERRUPT_TRIGGER_FALLING: response += "Falling Edge"; break;
-            case INTERRUPT_TRIGGER_CHANGE: response += "Change (Any Edge)"; break;
-            case INTERRUPT_TRIGGER_HIGH_LEVEL: response += "High Level"; break;
-            case INTERRUPT_TRIGGER_LOW_LEVEL: response += "Low Level"; break;
-            default: response += "Unknown";
-            }
-
-            response += "\n";
-        }
-        response += "\nInterrupt System: " + String(inputInterruptsEnabled ? "Active" : "Inactive");
-        return response;
+    else if (strcmp(triggerStr, "CHANGE") == 0 || strcmp(triggerStr, "BOTH") == 0) {
+        triggerType = INTERRUPT_TRIGGER_CHANGE;
+    }
+    else if (strcmp(triggerStr, "HIGH") == 0 || strcmp(triggerStr, "HIGH_LEVEL") == 0) {
+        triggerType = INTERRUPT_TRIGGER_HIGH_LEVEL;
+    }
+    else if (strcmp(triggerStr, "LOW") == 0 || strcmp(triggerStr, "LOW_LEVEL") == 0) {
+        triggerType = INTERRUPT_TRIGGER_LOW_LEVEL;
+    }
+    else {
+        out.println("ERROR: Invalid trigger type. Use RISING, FALLING, CHANGE, HIGH_LEVEL, or LOW_LEVEL.");
+        return;
     }
-    else if (command.startsWith("ANALOG STATUS")) {
-        // Return analog input status with voltage values
-        String response = "ANALOG STATUS:\n";
-        for (int i = 0; i < 4; i++) {
-            response += String(i + 1) + " (Analog " + String(i + 1) + "): ";
-            response += String(analogValues[i]) + " (Raw), ";
-            response += String(analogVoltages[i], 2) + "V, ";
-            response += String(calculatePercentage(analogVoltages[i])) + "% (of 5V scale)";
-            response += "\n";
-        }
-        return response;
-    }
-    else if (command.startsWith("COMM STATUS")) {
-        // Return communication status
-        String response = "COMMUNICATION STATUS:\n";
-        response += "Active Protocol: " + currentCommunicationProtocol + "\n";
-        response += "WiFi Connected: " + String(wifiConnected ? "Yes" : "No") + "\n";
-        response += "Ethernet Connected: " + String(ethConnected ? "Yes" : "No") + "\n";
-        response += "RS485 Available: Yes\n";
-        response += "USB Available: Yes\n";
-
-        // Add protocol-specific details
-        if (currentCommunicationProtocol == "wifi") {
-            response += "\nWIFI DETAILS:\n";
-            response += "SSID: " + wifiSSID + "\n";
-            response += "Security: " + wifiSecurity + "\n";
-            response += "Channel: " + String(wifiChannel) + "\n";
-            if (wifiConnected) {
-                response += "IP: " + WiFi.localIP().toString() + "\n";
-                response += "Signal: " + String(WiFi.RSSI()) + " dBm\n";
-            }
-        }
-        else if (currentCommunicationProtocol == "ethernet") {
-            response += "\nETHERNET DETAILS:\n";
-            if (ethConnected) {
-                response += "MAC: " + ETH.macAddress() + "\n";
-                response += "IP: " + ETH.localIP().toString() + "\n";
-                response += "Speed: " + String(ETH.linkSpeed()) + " Mbps\n";
-                response += "Duplex: " + String(ETH.fullDuplex() ? "Full" : "Half") + "\n";
-            }
-            else {
-                response += "Status: Disconnected\n";
-            }
-        }
-        else if (currentCommunicationProtocol == "rs485") {
-            response += "\nRS485 DETAILS:\n";
-            response += "Baud Rate: " + String(rs485BaudRate) + "\n";
-            response += "Protocol: " + rs485Protocol + "\n";
-            response += "Mode: " + rs485Mode + "\n";
-            response += "Address: " + String(rs485DeviceAddress) + "\n";
-        }
-        else if (currentCommunicationProtocol == "usb") {
-            response += "\nUSB DETAILS:\n";
-            response += "COM Port: " + String(usbComPort) + "\n";
-            response += "Baud Rate: " + String(usbBaudRate) + "\n";
-            response += "Data Bits: " + String(usbDataBits) + "\n";
-            response += "Parity: " + String(usbParity == 0 ? "None" : usbParity == 1 ? "Odd" : "Even") + "\n";
-            response += "Stop Bits: " + String(usbStopBits) + "\n";
-        }
 
-        return response;
+    if (inputNum < 1 || inputNum > 16) {
+        out.println("ERROR: Invalid input number. Must be between 1-16.");
+        return;
     }
-    else if (command.startsWith("SCAN I2C")) {
-        // Scan I2C bus
-        String response = "I2C DEVICES:\n";
-        int deviceCount = 0;
 
-        for (uint8_t address = 1; address < 127; address++) {
-            Wire.beginTransmission(address);
-            uint8_t error = Wire.endTransmission();
+    lockConfigArrays();
+    interruptConfigs[inputNum - 1].triggerType = triggerType;
+    unlockConfigArrays();
+    saveInterruptConfigs();
 
-            if (error == 0) {
-                deviceCount++;
-                response += "0x" + String(address, HEX) + " - ";
+    if (inputInterruptsEnabled) {
+        setupInputInterrupts(); // Reconfigure interrupts
+    }
 
-                // Identify known devices
-                if (address == PCF8574_INPUTS_1_8) {
-                    response += "PCF8574 Inputs 1-8";
-                }
-                else if (address == PCF8574_INPUTS_9_16) {
-                    response += "PCF8574 Inputs 9-16";
-                }
-                else if (address == PCF8574_OUTPUTS_1_8) {
-                    response += "PCF8574 Outputs 1-8";
-                }
-                else if (address == PCF8574_OUTPUTS_9_16) {
-                    response += "PCF8574 Outputs 9-16";
-                }
-                else if (address == 0x68) {
-                    response += "DS3231 RTC";
-                }
-                else {
-                    response += "Unknown device";
-                }
+    out.print("Trigger type for input ");
+    out.print(inputNum);
+    out.print(" set to ");
+    out.println(triggerStr);
+}
 
-                response += "\n";
-            }
-        }
+// One analog input as "<raw> (Raw), <volts>V, <percent>%"
+void printAnalogValue(Print& out, int index) {
+    out.print(analogValues[index]);
+    out.print(" (Raw), ");
+    out.print(analogVoltages[index], 2);
+    out.print("V, ");
+    out.print(calculatePercentage(analogVoltages[index]));
+    out.print("%");
+}
 
-        response += "Found " + String(deviceCount) + " device(s)\n";
-        return response;
+void commandAnalogStatus(const CommandArgs& args, Print& out) {
+    out.println("ANALOG STATUS:");
+    for (int i = 0; i < 4; i++) {
+        out.print(i + 1);
+        out.print(" (Analog ");
+        out.print(i + 1);
+        out.print("): ");
+        printAnalogValue(out, i);
+        out.println(" (of 5V scale)");
     }
-    else if (command == "STATUS") {
-        // Return system status
-        String response = "KC868-A16 System Status\n";
-        response += "---------------------\n";
-        response += "Device: " + deviceName + "\n";
-        response += "Firmware: " + firmwareVersion + "\n";
-        response += "Uptime: " + String(millis() / 1000) + " seconds\n";
+}
 
+void commandCommStatus(const CommandArgs& args, Print& out) {
+    out.println("COMMUNICATION STATUS:");
+    out.print("Active Protocol: ");
+    out.println(currentCommunicationProtocol);
+    out.print("WiFi Connected: ");
+    out.println(wifiConnected ? "Yes" : "No");
+    out.print("Ethernet Connected: ");
+    out.println(ethConnected ? "Yes" : "No");
+    out.println("RS485 Available: Yes");
+    out.println("USB Available: Yes");
+
+    // Add protocol-specific details
+    if (currentCommunicationProtocol == "wifi") {
+        out.println("\nWIFI DETAILS:");
+        out.print("SSID: ");
+        out.println(wifiSSID);
+        out.print("Security: ");
+        out.println(wifiSecurity);
+        out.print("Channel: ");
+        out.println(wifiChannel);
         if (wifiConnected) {
-            response += "WiFi: Connected, IP: " + WiFi.localIP().toString() + "\n";
+            out.print("IP: ");
+            out.println(WiFi.localIP());
+            out.print("Signal: ");
+            out.print(WiFi.RSSI());
+            out.println(" dBm");
         }
-        else {
-            response += "WiFi: Not connected\n";
-        }
-
+    }
+    else if (currentCommunicationProtocol == "ethernet") {
+        out.println("\nETHERNET DETAILS:");
         if (ethConnected) {
-            response += "Ethernet: Connected, IP: " + ETH.localIP().toString() + "\n";
+            out.print("MAC: ");
+            out.println(ETH.macAddress());
+            out.print("IP: ");
+            out.println(ETH.localIP());
+            out.print("Speed: ");
+            out.print(ETH.linkSpeed());
+            out.println(" Mbps");
+            out.print("Duplex: ");
+            out.println(ETH.fullDuplex() ? "Full" : "Half");
         }
         else {
-            response += "Ethernet: Not connected\n";
+            out.println("Status: Disconnected");
         }
+    }
+    else if (currentCommunicationProtocol == "rs485") {
+        out.println("\nRS485 DETAILS:");
+        out.print("Baud Rate: ");
+        out.println(rs485BaudRate);
+        out.print("Protocol: ");
+        out.println(rs485Protocol);
+        out.print("Mode: ");
+        out.println(rs485Mode);
+        out.print("Address: ");
+        out.println(rs485DeviceAddress);
+    }
+    else if (currentCommunicationProtocol == "usb") {
+        out.println("\nUSB DETAILS:");
+        out.print("COM Port: ");
+        out.println(usbComPort);
+        out.print("Baud Rate: ");
+        out.println(usbBaudRate);
+        out.print("Data Bits: ");
+        out.println(usbDataBits);
+        out.print("Parity: ");
+        out.println(usbParity == 0 ? "None" : usbParity == 1 ? "Odd" : "Even");
+        out.print("Stop Bits: ");
+        out.println(usbStopBits);
+    }
+
+    // Every channel is served at the same time, whichever protocol is active
+    out.println("\nCOMMAND CHANNELS:");
+    for (int i = 0; i < COMM_CHANNEL_COUNT; i++) {
+        const CommChannel& channel = commChannels[i];
+        out.print(channel.name);
+        out.print(channel.enabled ? ": on, " : ": off, ");
+        out.print(channel.commands);
+        out.print(" commands (");
+        out.print(channel.rejected);
+        out.print(" rejected)");
+        if (i < COMM_CHANNEL_NETWORK) {
+            out.print(", ");
+            out.print(channel.reader.lines);
+            out.print(" lines (");
+            out.print(channel.reader.overflows);
+            out.print(" too long), ");
+            out.print(channel.reader.frames);
+            out.print(" binary frames (");
+            out.print(channel.reader.frameErrors);
+            out.print(" dropped)");
+        }
+        out.println();
+    }
+
+    out.print("Commands run: ");
+    out.print(commandDispatcher.getExecutedCount());
+    out.print(" (");
+    out.print(commandDispatcher.getRejectedCount());
+    out.println(" rejected)");
+}
 
-        response += "Active Protocol: " + currentCommunicationProtocol + "\n";
-        response += "I2C errors: " + String(i2cErrorCount) + "\n";
-        response += "RTC available: " + String(rtcInitialized ? "Yes" : "No") + "\n";
-        response += "Current time: " + getTimeString() + "\n";
-        response += "Free heap: " + String(ESP.getFreeHeap()) + " bytes\n";
+void commandScanI2C(const CommandArgs& args, Print& out) {
+    // The scan runs in the background from loop(); report the presence map
+    // as it stands instead of holding every transport for 126 probes
+    uint16_t jobId = startI2CScan();
+    out.print("I2C DEVICES (scan job ");
+    out.print(jobId);
+    out.print(", ");
+    out.print(i2cScanRunning ? ((i2cScanNextAddress - 1) * 100) / 126 : 100);
+    out.println("% done):");
+    int deviceCount = 0;
 
-        // Add analog inputs status with voltage values
-        response += "\nAnalog Inputs (0-5V range):\n";
-        for (int i = 0; i < 4; i++) {
-            response += "A" + String(i + 1) + ": ";
-            response += String(analogValues[i]) + " (Raw), ";
-            response += String(analogVoltages[i], 2) + "V, ";
-            response += String(calculatePercentage(analogVoltages[i])) + "%\n";
+    for (uint8_t address = 1; address < 127; address++) {
+        if (isI2CDevicePresent(address)) {
+            deviceCount++;
+            out.print("0x");
+            out.print(address, HEX);
+            out.print(" - ");
+            out.println(getI2CDeviceName(address));
         }
+    }
 
-        // Add interrupt status summary
-        response += "\nInterrupt System: " + String(inputInterruptsEnabled ? "Active" : "Inactive") + "\n";
-        int highCount = 0, medCount = 0, lowCount = 0, noneCount = 0;
-        for (int i = 0; i < 16; i++) {
-            if (!interruptConfigs[i].enabled) continue;
+    out.print("Found ");
+    out.print(deviceCount);
+    out.println(" device(s)");
+    if (i2cScanRunning) {
+        out.println("Scan in progress, repeat SCAN I2C for the complete list");
+    }
+}
 
-            switch (interruptConfigs[i].priority) {
-            case INPUT_PRIORITY_HIGH: highCount++; break;
-            case INPUT_PRIORITY_MEDIUM: medCount++; break;
-            case INPUT_PRIORITY_LOW: lowCount++; break;
-            case INPUT_PRIORITY_NONE: noneCount++; break;
-            }
-        }
-        response += "Configured interrupts: High=" + String(highCount) +
-            ", Med=" + String(medCount) +
-            ", Low=" + String(lowCount) +
-            ", Polling=" + String(noneCount) + "\n";
-
-        return response;
-    }
-    else if (command == "HELP") {
-        // Return help information
-        String response = "KC868-A16 Controller Command Help\n";
-        response += "---------------------\n";
-        response += "RELAY STATUS - Show all relay states\n";
-        response += "RELAY ALL ON - Turn all relays on\n";
-        response += "RELAY ALL OFF - Turn all relays off\n";
-        response += "RELAY <num> ON - Turn relay on (1-16)\n";
-        response += "RELAY <num> OFF - Turn relay off (1-16)\n";
-        response += "INPUT STATUS - Show all input states\n";
-        response += "INTERRUPT STATUS - Show interrupt configurations\n";
-        response += "ANALOG STATUS - Show all analog input values\n";
-        response += "COMM STATUS - Show communication interface status\n";
-        response += "SCAN I2C - Scan for I2C devices\n";
-        response += "STATUS - Show system status\n";
-        response += "DEBUG ON - Enable debug mode\n";
-        response += "DEBUG OFF - Disable debug mode\n";
-        response += "SET TIME <yyyy-mm-dd hh:mm:ss> - Set system time\n";
-        response += "INTERRUPT ENABLE <num> - Enable interrupt for input (1-16)\n";
-        response += "INTERRUPT DISABLE <num> - Disable interrupt for input (1-16)\n";
-        response += "INTERRUPT PRIORITY <num> <priority> - Set input interrupt priority (HIGH/MEDIUM/LOW/NONE)\n";
-        response += "INTERRUPT TRIGGER <num> <type> - Set input trigger type (RISING/FALLING/CHANGE/HIGH_LEVEL/LOW_LEVEL)\n";
-        response += "REBOOT - Restart the system\n";
-        response += "VERSION - Show firmware version\n";
-
-        return response;
-    }
-    else if (command.startsWith("SET TIME ")) {
-        // Set time command
-        String timeStr = command.substring(9);
-
-        // Format should be "yyyy-mm-dd hh:mm:ss"
-        if (timeStr.length() == 19) {
-            int year = timeStr.substring(0, 4).toInt();
-            int month = timeStr.substring(5, 7).toInt();
-            int day = timeStr.substring(8, 10).toInt();
-            int hour = timeStr.substring(11, 13).toInt();
-            int minute = timeStr.substring(14, 16).toInt();
-            int second = timeStr.substring(17, 19).toInt();
-
-            if (year >= 2023 && month >= 1 && month <= 12 && day >= 1 && day <= 31 &&
-                hour >= 0 && hour <= 23 && minute >= 0 && minute <= 59 && second >= 0 && second <= 59) {
+void commandStatus(const CommandArgs& args, Print& out) {
+    out.println("KC868-A16 System Status");
+    out.println("---------------------");
+    out.print("Device: ");
+    out.println(deviceName);
+    out.print("Firmware: ");
+    out.println(firmwareVersion);
+    out.print("Uptime: ");
+    out.print(millis() / 1000);
+    out.println(" seconds");
 
-                syncTimeFromClient(year, month, day, hour, minute, second);
-                return "Time set successfully: " + getTimeString();
-            }
-        }
+    if (wifiConnected) {
+        out.print("WiFi: Connected, IP: ");
+        out.println(WiFi.localIP());
+    }
+    else {
+        out.println("WiFi: Not connected");
+    }
 
-        return "ERROR: Invalid time format. Use SET TIME yyyy-mm-dd hh:mm:ss";
+    if (ethConnected) {
+        out.print("Ethernet: Connected, IP: ");
+        out.println(ETH.localIP());
+    }
+    else {
+        out.println("Ethernet: Not connected");
+    }
+
+    out.print("Active Protocol: ");
+    out.println(currentCommunicationProtocol);
+    out.print("I2C errors: ");
+    out.println(i2cErrorCount);
+    out.print("RTC available: ");
+    out.println(rtcInitialized ? "Yes" : "No");
+    out.print("Current time: ");
+    out.println(getTimeString());
+    out.print("Free heap: ");
+    out.print(ESP.getFreeHeap());
+    out.println(" bytes");
+
+    // Add analog inputs status with voltage values
+    out.println("\nAnalog Inputs (0-5V range):");
+    for (int i = 0; i < 4; i++) {
+        out.print("A");
+        out.print(i + 1);
+        out.print(": ");
+        printAnalogValue(out, i);
+        out.println();
     }
-    else if (command.startsWith("INTERRUPT ENABLE ")) {
-        int inputNum = command.substring(17).toInt();
-        if (inputNum >= 1 && inputNum <= 16) {
-            int index = inputNum - 1;
-            interruptConfigs[index].enabled = true;
-            saveInterruptConfigs();
 
-            if (inputInterruptsEnabled) {
-                setupInputInterrupts(); // Reconfigure interrupts
-            }
-            else {
-                inputInterruptsEnabled = true; // Enable the interrupt system
-                setupInputInterrupts();
-            }
+    // Add interrupt status summary
+    out.print("\nInterrupt System: ");
+    out.println(inputInterruptsEnabled ? "Active" : "Inactive");
+    int highCount = 0, medCount = 0, lowCount = 0, noneCount = 0;
+    for (int i = 0; i < 16; i++) {
+        if (!interruptConfigs[i].enabled) continue;
+
+        switch (interruptConfigs[i].priority) {
+        case INPUT_PRIORITY_HIGH: highCount++; break;
+        case INPUT_PRIORITY_MEDIUM: medCount++; break;
+        case INPUT_PRIORITY_LOW: lowCount++; break;
+        case INPUT_PRIORITY_NONE: noneCount++; break;
+        }
+    }
+    out.print("Configured interrupts: High=");
+    out.print(highCount);
+    out.print(", Med=");
+    out.print(medCount);
+    out.print(", Low=");
+    out.print(lowCount);
+    out.print(", Polling=");
+    out.println(noneCount);
+}
 
-            return "Interrupt enabled for input " + String(inputNum);
-        }
-        return "ERROR: Invalid input number. Must be between 1-16.";
+void commandHelp(const CommandArgs& args, Print& out) {
+    out.println("KC868-A16 Controller Command Help");
+    out.println("---------------------");
+    commandDispatcher.printHelp(out);
+}
+
+void commandWsStatus(const CommandArgs& args, Print& out) {
+    out.println("WEBSOCKET UPDATES:");
+    out.print("Clients: ");
+    out.println(webSocket.connectedClients());
+    out.print("Max rate: ");
+    out.print(wsMaxUpdateRate);
+    out.println("/s");
+    out.print("Change requests: ");
+    out.println(broadcastRequestCount);
+    out.print("Change passes: ");
+    out.println(broadcastSentCount);
+    out.print("Oversized messages dropped: ");
+    out.println(jsonOverflowCount);
+    out.print("Collection elements cut off: ");
+    out.println(jsonStreamOverflowCount);
+    for (int i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
+        WebSocketClientState& client = webSocketClients[i];
+        if (!client.subscribed) continue;
+        out.print("#");
+        out.print(i);
+        out.print(": topics 0x");
+        out.print(client.topics, HEX);
+        out.print(client.format == WS_FORMAT_BINARY ? ", binary" : ", json");
+        out.print(", every ");
+        out.print(client.interval);
+        out.print(" ms, seq ");
+        out.print(client.sequence);
+        out.print(", merged ");
+        out.print(client.mergedUpdates);
+        out.print(", slow ");
+        out.println(client.slowSends);
     }
-    else if (command.startsWith("INTERRUPT DISABLE ")) {
-        int inputNum = command.substring(18).toInt();
-        if (inputNum >= 1 && inputNum <= 16) {
-            int index = inputNum - 1;
-            interruptConfigs[index].enabled = false;
-            saveInterruptConfigs();
+}
 
-            // Check if any interrupts are still enabled
-            bool anyEnabled = false;
-            for (int i = 0; i < 16; i++) {
-                if (interruptConfigs[i].enabled) {
-                    anyEnabled = true;
-                    break;
-                }
-            }
+void commandWsRate(const CommandArgs& args, Print& out) {
+    long rate = args.numbers[0];
+    if (rate < 1 || rate > 50) {
+        out.println("ERROR: Rate must be 1-50 updates per second");
+        return;
+    }
+    wsMaxUpdateRate = rate;
+    out.print("WebSocket update rate set to ");
+    out.print(rate);
+    out.println("/s");
+}
 
-            if (anyEnabled && inputInterruptsEnabled) {
-                setupInputInterrupts(); // Reconfigure interrupts
-            }
-            else if (!anyEnabled) {
-                disableInputInterrupts(); // Disable the entire interrupt system
-            }
+void commandWsBench(const CommandArgs& args, Print& out) {
+    out.println(runSerializerBenchmark());
+}
 
-            return "Interrupt disabled for input " + String(inputNum);
-        }
-        return "ERROR: Invalid input number. Must be between 1-16.";
+void commandHttpStatus(const CommandArgs& args, Print& out) {
+    out.println("HTTP API:");
+    out.print("Handled: ");
+    out.println(server.getHandledCount());
+    out.print("Requests/s: ");
+    out.println(server.getRequestRate(), 1);
+    out.print("Latency p50: ");
+    out.print(server.getLatencyPercentile(50));
+    out.println(" us");
+    out.print("Latency p99: ");
+    out.print(server.getLatencyPercentile(99));
+    out.println(" us");
+    out.print("Longest handler: ");
+    out.print(server.getMaxHandlerTime());
+    out.println(" us");
+    out.print("Max queue depth: ");
+    out.print(server.getMaxQueueDepth());
+    out.print("/");
+    out.println(HTTP_QUEUE_DEPTH);
+    out.print("Rejected (busy/too large): ");
+    out.println(server.getRejectedCount());
+    out.print("Abandoned by client: ");
+    out.println(server.getAbandonedCount());
+    out.print("Responses copied (slots busy): ");
+    out.println(server.getCopiedCount());
+    out.print("Static files sent: ");
+    out.println(webAssetSentCount);
+    out.print("Static files not modified (304): ");
+    out.println(webAssetNotModifiedCount);
+    out.print("Config not modified (304): ");
+    out.println(configNotModifiedCount);
+}
+
+void commandModbusStatus(const CommandArgs& args, Print& out) {
+    out.println("MODBUS RTU SLAVE:");
+    out.print("Active: ");
+    out.println(modbusRtu.active ? "Yes" : "No");
+    out.print("Address: ");
+    out.println(rs485DeviceAddress);
+    out.print("Baud rate: ");
+    out.println(rs485BaudRate);
+    out.print("t1.5 / t3.5: ");
+    out.print(modbusRtu.t15);
+    out.print(" / ");
+    out.print(modbusRtu.t35);
+    out.println(" us");
+    out.print("Requests: ");
+    out.println(modbusRtu.requests);
+    out.print("Requests/s: ");
+    out.println(modbusRtu.requestRate, 1);
+    out.print("Broadcasts: ");
+    out.println(modbusRtu.broadcasts);
+    out.print("Exceptions: ");
+    out.println(modbusRtu.exceptions);
+    out.print("For other slaves: ");
+    out.println(modbusRtu.otherAddress);
+    out.print("CRC errors: ");
+    out.println(modbusRtu.crcErrors);
+    out.print("Framing errors: ");
+    out.println(modbusRtu.framingErrors);
+    out.print("Overruns: ");
+    out.println(modbusRtu.overruns);
+    out.print("Longest service: ");
+    out.print(modbusRtu.maxServiceTime);
+    out.println(" us");
+    out.print("Answered by comm task: ");
+    out.println(modbusRtu.taskAnswers);
+    out.print("Longest turnaround: ");
+    out.print(modbusRtu.maxTurnaround);
+    out.println(" us");
+
+    out.print("\nMODBUS TCP (port ");
+    out.print(MODBUS_TCP_PORT);
+    out.println(modbusTcpListening ? "):" : ", disabled):");
+    out.print("Masters: ");
+    out.print(getModbusTcpClientCount());
+    out.print("/");
+    out.println(MODBUS_TCP_MAX_CLIENTS);
+    out.print("Connections: ");
+    out.print(modbusTcpConnections);
+    out.print(" (");
+    out.print(modbusTcpRejected);
+    out.println(" rejected)");
+    out.print("Reads: ");
+    out.print(modbusTcpReads + modbusTcpOrderedReads);
+    out.print(" (");
+    out.print(modbusTcpOrderedReads);
+    out.println(" queued behind a write)");
+    out.print("Writes: ");
+    out.println(modbusTcpWrites);
+    out.print("Write latency avg/max: ");
+    out.print(modbusTcpWrites > 0 ? modbusTcpWriteLatencyTotal / modbusTcpWrites : 0);
+    out.print(" / ");
+    out.print(modbusTcpMaxWriteLatency);
+    out.println(" us");
+    out.print("Busy (queue full): ");
+    out.println(modbusTcpBusy);
+    out.print("Bad frames: ");
+    out.println(modbusTcpBadFrames);
+}
+
+void commandModbusTcp(const CommandArgs& args, Print& out) {
+    bool on;
+    if (strcmp(args.words[0], "ON") == 0) {
+        on = true;
+    }
+    else if (strcmp(args.words[0], "OFF") == 0) {
+        on = false;
+    }
+    else {
+        out.println("ERROR: Use MODBUS TCP ON or MODBUS TCP OFF");
+        return;
     }
-    else if (command.startsWith("INTERRUPT PRIORITY ")) {
-        String params = command.substring(19);
-        int spacePos = params.indexOf(' ');
 
-        if (spacePos > 0) {
-            int inputNum = params.substring(0, spacePos).toInt();
-            String priorityStr = params.substring(spacePos + 1);
-            priorityStr.toUpperCase();
+    modbusTcpEnabled = on;
+    applyModbusTcpConfig();
+    saveCommunicationConfig();
 
-            uint8_t priority = INPUT_PRIORITY_MEDIUM; // Default medium
-            if (priorityStr == "HIGH") {
-                priority = INPUT_PRIORITY_HIGH;
-            }
-            else if (priorityStr == "MEDIUM") {
-                priority = INPUT_PRIORITY_MEDIUM;
-            }
-            else if (priorityStr == "LOW") {
-                priority = INPUT_PRIORITY_LOW;
-            }
-            else if (priorityStr == "NONE") {
-                priority = INPUT_PRIORITY_NONE;
-            }
-            else {
-                return "ERROR: Invalid priority. Use HIGH, MEDIUM, LOW, or NONE.";
-            }
+    out.print("Modbus TCP server ");
+    out.print(modbusTcpListening ? "listening on port " : "disabled");
+    if (modbusTcpListening) out.print(MODBUS_TCP_PORT);
+    out.println();
+}
 
-            if (inputNum >= 1 && inputNum <= 16) {
-                int index = inputNum - 1;
-                interruptConfigs[index].priority = priority;
-                saveInterruptConfigs();
+void commandMqttStatus(const CommandArgs& args, Print& out) {
+    out.println("MQTT CLIENT:");
+    out.print("Enabled: ");
+    out.println(mqttConfig.enabled ? "Yes" : "No");
+    out.print("Broker: ");
+    out.print(mqttConfig.host[0] != '\0' ? mqttConfig.host : "(not set)");
+    out.print(':');
+    out.println(mqttConfig.port);
+    out.print("Base topic: ");
+    out.println(mqttBase);
+    out.print("State: ");
+    out.println(mqtt.getStateName());
+    out.print("Sessions / failed connects: ");
+    out.print(mqtt.getSessionCount());
+    out.print(" / ");
+    out.println(mqtt.getFailedConnectCount());
+    out.print("Last CONNACK code: ");
+    out.println(mqtt.getLastConnackCode());
+    out.print("Published / dropped: ");
+    out.print(mqtt.getPublishedCount());
+    out.print(" / ");
+    out.println(mqtt.getDroppedCount());
+    out.print("Batch messages: ");
+    out.println(mqttSequence);
+    out.print("Bytes sent / queued: ");
+    out.print(mqtt.getBytesSent());
+    out.print(" / ");
+    out.println(mqtt.getQueuedBytes());
+    out.print("Received: ");
+    out.print(mqtt.getReceivedCount());
+    out.print(" (");
+    out.print(commChannels[COMM_CHANNEL_MQTT].commands);
+    out.print(" commands, ");
+    out.print(commChannels[COMM_CHANNEL_MQTT].rejected);
+    out.println(" rejected)");
+}
 
-                if (inputInterruptsEnabled) {
-                    setupInputInterrupts(); // Reconfigure interrupts
-                }
+void commandUdpStatus(const CommandArgs& args, Print& out) {
+    out.println("UDP CONTROL:");
+    out.print("Command port: ");
+    out.print(udpConfig.enabled ? "on, " : "off, ");
+    out.println(udpConfig.port);
+    out.print("Beacon: ");
+    if (udpConfig.beacon) {
+        out.print(udpConfig.group);
+        out.print(':');
+        out.print(udpConfig.beaconPort);
+        out.print(" every ");
+        out.print(udpConfig.beaconInterval);
+        out.println(" ms and on change");
+    }
+    else {
+        out.println("off");
+    }
+    out.print("Listening: ");
+    out.println(udpListening ? "Yes" : "No");
+    out.print("Datagrams / bad / busy: ");
+    out.print(udpDatagrams);
+    out.print(" / ");
+    out.print(udpBadDatagrams);
+    out.print(" / ");
+    out.println(udpBusy);
+    out.print("Answered (retries from cache): ");
+    out.print(udpAnswered);
+    out.print(" (");
+    out.print(udpRetries);
+    out.println(")");
+    out.print("Latency avg / max: ");
+    out.print(udpAnswered > 0 ? udpLatencyTotal / udpAnswered : 0);
+    out.print(" / ");
+    out.print(udpMaxLatency);
+    out.println(" us");
+    out.print("Beacons sent: ");
+    out.println(udpBeacons);
+}
 
-                return "Priority for input " + String(inputNum) + " set to " + priorityStr;
-            }
-            return "ERROR: Invalid input number. Must be between 1-16.";
+void commandDebugOn(const CommandArgs& args, Print& out) {
+    debugMode = true;
+    bumpConfigRevision(CONFIG_DOMAIN_CONFIG);
+    out.println("Debug mode enabled");
+}
+
+void commandDebugOff(const CommandArgs& args, Print& out) {
+    debugMode = false;
+    bumpConfigRevision(CONFIG_DOMAIN_CONFIG);
+    out.println("Debug mode disabled");
+}
+
+void commandSetTime(const CommandArgs& args, Print& out) {
+    const char* dateStr = args.words[0];
+    const char* timeStr = args.words[1];
+
+    // Format should be "yyyy-mm-dd hh:mm:ss"
+    if (strlen(dateStr) == 10 && strlen(timeStr) == 8) {
+        int year = atoi(dateStr);
+        int month = atoi(dateStr + 5);
+        int day = atoi(dateStr + 8);
+        int hour = atoi(timeStr);
+        int minute = atoi(timeStr + 3);
+        int second = atoi(timeStr + 6);
+
+        if (year >= 2023 && month >= 1 && month <= 12 && day >= 1 && day <= 31 &&
+            hour >= 0 && hour <= 23 && minute >= 0 && minute <= 59 && second >= 0 && second <= 59) {
+
+            syncTimeFromClient(year, month, day, hour, minute, second);
+            out.print("Time set successfully: ");
+            out.println(getTimeString());
+            return;
         }
-        return "ERROR: Invalid format. Use INTERRUPT PRIORITY <input_num> <HIGH|MEDIUM|LOW|NONE>";
     }
-    else if (command.startsWith("INTERRUPT TRIGGER ")) {
-        String params = command.substring(18);
-        int spacePos = params.indexOf(' ');
 
-        if (spacePos > 0) {
-            int inputNum = params.substring(0, spacePos).toInt();
-            String triggerStr = params.substring(spacePos + 1);
-            triggerStr.toUpperCase();
+    out.println("ERROR: Invalid time format. Use SET TIME yyyy-mm-dd hh:mm:ss");
+}
 
-            uint8_t triggerType = INTERRUPT_TRIGGER_CHANGE; // Default to change
-            if (triggerStr == "RISING" || triggerStr == "RISE") {
-                triggerType = INTERRUPT_TRIGGER_RISING;
-            }
-            else if (triggerStr == "FALLING" || triggerStr == "FALL") {
-                triggerType = INTERRUPT_TRIGGER_FALLING;
-            }
-            else if (triggerStr == "CHANGE" || triggerStr == "BOTH") {
-                triggerType = INTERRUPT_TRIGGER_CHANGE;
-            }
-            else if (triggerStr == "HIGH" || triggerStr == "HIGH_LEVEL") {
-                triggerType = INTERRUPT_TRIGGER_HIGH_LEVEL;
-            }
-            else if (triggerStr == "LOW" || triggerStr == "LOW_LEVEL") {
-                triggerType = INTERRUPT_TRIGGER_LOW_LEVEL;
-            }
-            else {
-                return "ERROR: Invalid trigger type. Use RISING, FALLING, CHANGE, HIGH_LEVEL, or LOW_LEVEL.";
-            }
+void commandVersion(const CommandArgs& args, Print& out) {
+    out.print("KC868-A16 Controller firmware version ");
+    out.println(firmwareVersion);
+}
 
-            if (inputNum >= 1 && inputNum <= 16) {
-                int index = inputNum - 1;
-                interruptConfigs[index].triggerType = triggerType;
-                saveInterruptConfigs();
+void commandReboot(const CommandArgs& args, Print& out) {
+    out.println("Rebooting system...");
+    delay(100);
+    ESP.restart();
+}
 
-                if (inputInterruptsEnabled) {
-                    setupInputInterrupts(); // Reconfigure interrupts
-                }
+// Command table, in HELP order. Two-word names are matched before one-word
+// names, so "RELAY STATUS" wins over "RELAY <num> <ON|OFF>".
+const CommandEntry commandTable[] = {
+    COMMAND("RELAY STATUS", "", "", "Show all relay states", commandRelayStatus),
+    COMMAND("RELAY ALL", "k", "<ON|OFF>", "Turn all relays on or off", commandRelayAll),
+    COMMAND("RELAY", "nk", "<num> <ON|OFF>", "Turn relay on or off (1-16)", commandRelay),
+    COMMAND("INPUT STATUS", "", "", "Show all input states", commandInputStatus),
+    COMMAND("INTERRUPT STATUS", "", "", "Show interrupt configurations", commandInterruptStatus),
+    COMMAND("ANALOG STATUS", "", "", "Show all analog input values", commandAnalogStatus),
+    COMMAND("COMM STATUS", "", "", "Show communication interface status", commandCommStatus),
+    COMMAND("SCAN I2C", "", "", "Start a background I2C scan and list known devices", commandScanI2C),
+    COMMAND("STATUS", "", "", "Show system status", commandStatus),
+    COMMAND("WS STATUS", "", "", "Show WebSocket update statistics", commandWsStatus),
+    COMMAND("WS RATE", "n", "<n>", "Set maximum WebSocket updates per second (1-50)", commandWsRate),
+    COMMAND("WS BENCH", "", "", "Benchmark the status serializer", commandWsBench),
+    COMMAND("HTTP STATUS", "", "", "Show web API request statistics", commandHttpStatus),
+    COMMAND("MODBUS STATUS", "", "", "Show Modbus RTU and TCP statistics", commandModbusStatus),
+    COMMAND("MODBUS TCP", "k", "<ON|OFF>", "Enable or disable the Modbus TCP server (saved)", commandModbusTcp),
+    COMMAND("MQTT STATUS", "", "", "Show MQTT client statistics", commandMqttStatus),
+    COMMAND("UDP STATUS", "", "", "Show UDP control port and beacon statistics", commandUdpStatus),
+    COMMAND("DEBUG ON", "", "", "Enable debug mode", commandDebugOn),
+    COMMAND("DEBUG OFF", "", "", "Disable debug mode", commandDebugOff),
+    COMMAND("SET TIME", "ss", "<yyyy-mm-dd> <hh:mm:ss>", "Set system time", commandSetTime),
+    COMMAND("INTERRUPT ENABLE", "n", "<num>", "Enable interrupt for input (1-16)", commandInterruptEnable),
+    COMMAND("INTERRUPT DISABLE", "n", "<num>", "Disable interrupt for input (1-16)", commandInterruptDisable),
+    COMMAND("INTERRUPT PRIORITY", "nk", "<num> <HIGH|MEDIUM|LOW|NONE>", "Set input interrupt priority", commandInterruptPriority),
+    COMMAND("INTERRUPT TRIGGER", "nk", "<num> <RISING|FALLING|CHANGE|HIGH_LEVEL|LOW_LEVEL>", "Set input trigger type", commandInterruptTrigger),
+    COMMAND("REBOOT", "", "", "Restart the system", commandReboot),
+    COMMAND("VERSION", "", "", "Show firmware version", commandVersion),
+    COMMAND("HELP", "", "", "Show this list", commandHelp),
+};
+constexpr uint8_t commandTableSize = sizeof(commandTable) / sizeof(commandTable[0]);
+static_assert(commandTableSize <= COMMAND_INDEX_SIZE / 2, "commandTable outgrew the dispatcher index, raise COMMAND_INDEX_SIZE");
 
-                return "Trigger type for input " + String(inputNum) + " set to " + triggerStr;
-            }
-            return "ERROR: Invalid input number. Must be between 1-16.";
-        }
-        return "ERROR: Invalid format. Use INTERRUPT TRIGGER <input_num> <RISING|FALLING|CHANGE|HIGH_LEVEL|LOW_LEVEL>";
-    }
-    else if (command == "DEBUG ON") {
-        debugMode = true;
-        return "Debug mode enabled";
-    }
-    else if (command == "DEBUG OFF") {
-        debugMode = false;
-        return "Debug mode disabled";
+// Run a command from the web API or the WebSocket console; the response is
+// collected in commandResponse[] and stays valid until the next command
+const char* executeCommandToBuffer(const char* command) {
+    char line[COMMAND_LINE_SIZE];
+    strlcpy(line, command, sizeof(line));
+
+    CommandBufferSink sink(commandResponse, sizeof(commandResponse));
+    if (commandDispatcher.execute(line, sink)) {
+        commChannels[COMM_CHANNEL_NETWORK].commands++;
     }
-    else if (command == "VERSION") {
-        return "KC868-A16 Controller firmware version " + firmwareVersion;
+    else {
+        commChannels[COMM_CHANNEL_NETWORK].rejected++;
     }
-    else if (command == "REBOOT") {
-        String response = "Rebooting system...";
-        delay(100);
-        ESP.restart();
-        return response;
+    if (sink.overflowed()) {
+        debugPrintln("Command response truncated to " + String(sink.length()) + " bytes");
     }
-
-    return "ERROR: Unknown command. Type HELP for commands.";
+    return commandResponse;
 }
 
 // Improved checkSchedules function to focus on time-based triggers only
@@ -4870,7 +10096,7 @@ void executeSchedule(int scheduleIndex) {
     }
 
     // Broadcast update
-    broadcastUpdate();
+    requestBroadcast();
 }
 
 // Check analog triggers against current values
@@ -4934,7 +10160,7 @@ void checkAnalogTriggers() {
                     writeOutputs();
 
                     // Broadcast update
-                    broadcastUpdate();
+                    requestBroadcast();
                 }
             }
         }
@@ -5034,6 +10260,8 @@ void initializeSensor(int htIndex) {
 
     htSensorConfig[htIndex].configured = true;
     htSensorConfig[htIndex].lastReadTime = 0;
+    resetSensorHealth(htIndex);
+    resetSensorThresholds(htIndex);
 
     debugPrintln("HT" + String(htIndex + 1) + " sensor initialized as type " +
         String(htSensorConfig[htIndex].sensorType));
@@ -5064,8 +10292,16 @@ void readSensor(int htIndex) {
         break;
     }
 
+    // Failing sensors are retried at their back-off interval instead
+    unsigned long readInterval = minInterval;
+    if (htSensorConfig[htIndex].retryInterval > readInterval) {
+        readInterval = htSensorConfig[htIndex].retryInterval;
+    }
+
     // Return if it's not time to read yet
-    if (currentMillis - htSensorConfig[htIndex].lastReadTime < minInterval) {
+    if (currentMillis - htSensorConfig[htIndex].lastReadTime < readInterval) {
+        // Still age out the last good reading while waiting
+        isSensorStale(htIndex);
         return;
     }
 
@@ -5080,6 +10316,7 @@ void readSensor(int htIndex) {
     case SENSOR_TYPE_DIGITAL:
         // For digital input, just update the directInputStates array
         directInputStates[htIndex] = !digitalRead(pin); // Invert for active LOW logic
+        recordSensorReadSuccess(htIndex);
         break;
 
     case SENSOR_TYPE_DHT11:
@@ -5093,14 +10330,18 @@ void readSensor(int htIndex) {
             if (!isnan(newHumidity) && !isnan(newTemperature)) {
                 htSensorConfig[htIndex].humidity = newHumidity;
                 htSensorConfig[htIndex].temperature = newTemperature;
+                recordSensorReadSuccess(htIndex);
                 debugPrintln("HT" + String(htIndex + 1) + " DHT: " +
                     String(newTemperature, 1) + "C, " +
                     String(newHumidity, 1) + "%");
             }
             else {
-                debugPrintln("HT" + String(htIndex + 1) + " DHT read error");
+                recordSensorReadFailure(htIndex, minInterval);
             }
         }
+        else {
+            recordSensorReadFailure(htIndex, minInterval);
+        }
         break;
 
     case SENSOR_TYPE_DS18B20:
@@ -5114,17 +10355,96 @@ void readSensor(int htIndex) {
             // Check if reading is valid
             if (newTemperature != DEVICE_DISCONNECTED_C) {
                 htSensorConfig[htIndex].temperature = newTemperature;
+                recordSensorReadSuccess(htIndex);
                 debugPrintln("HT" + String(htIndex + 1) + " DS18B20: " +
                     String(newTemperature, 1) + "C");
             }
             else {
-                debugPrintln("HT" + String(htIndex + 1) + " DS18B20 read error");
+                recordSensorReadFailure(htIndex, minInterval);
             }
         }
+        else {
+            recordSensorReadFailure(htIndex, minInterval);
+        }
         break;
     }
 }
 
+// Reset read health tracking for an HT sensor
+void resetSensorHealth(int htIndex) {
+    htSensorConfig[htIndex].consecutiveFailures = 0;
+    htSensorConfig[htIndex].lastGoodReadTime = 0;
+    htSensorConfig[htIndex].retryInterval = 0;
+    // No valid reading has been taken yet
+    htSensorConfig[htIndex].stale = (htSensorConfig[htIndex].sensorType != SENSOR_TYPE_DIGITAL);
+}
+
+// Record a valid reading and clear any back-off
+void recordSensorReadSuccess(int htIndex) {
+    if (htSensorConfig[htIndex].consecutiveFailures > 0) {
+        debugPrintln("HT" + String(htIndex + 1) + " sensor recovered after " +
+            String(htSensorConfig[htIndex].consecutiveFailures) + " failed reads");
+    }
+
+    htSensorConfig[htIndex].consecutiveFailures = 0;
+    htSensorConfig[htIndex].lastGoodReadTime = millis();
+    htSensorConfig[htIndex].retryInterval = 0;
+    htSensorConfig[htIndex].stale = false;
+
+    // A fresh reading may have crossed a sensor schedule's threshold
+    if (htSensorConfig[htIndex].sensorType != SENSOR_TYPE_DIGITAL) {
+        checkSensorThresholds(htIndex);
+    }
+}
+
+// Record a failed reading and back off exponentially
+void recordSensorReadFailure(int htIndex, unsigned long baseInterval) {
+    if (htSensorConfig[htIndex].consecutiveFailures < 255) {
+        htSensorConfig[htIndex].consecutiveFailures++;
+    }
+
+    // Double the retry interval up to the maximum
+    unsigned long nextInterval = (htSensorConfig[htIndex].retryInterval > 0) ?
+        htSensorConfig[htIndex].retryInterval * 2 : baseInterval * 2;
+    if (nextInterval > SENSOR_BACKOFF_MAX_INTERVAL) {
+        nextInterval = SENSOR_BACKOFF_MAX_INTERVAL;
+    }
+    htSensorConfig[htIndex].retryInterval = nextInterval;
+
+    // Only log the first failure and the transition to stale, not every retry
+    if (htSensorConfig[htIndex].consecutiveFailures == 1) {
+        debugPrintln("HT" + String(htIndex + 1) + " read error, retrying in " +
+            String(nextInterval) + "ms");
+    }
+
+    bool wasStale = htSensorConfig[htIndex].stale;
+    if (isSensorStale(htIndex) && !wasStale) {
+        debugPrintln("HT" + String(htIndex + 1) + " reading is stale after " +
+            String(htSensorConfig[htIndex].consecutiveFailures) + " failed reads");
+    }
+}
+
+// Check whether an HT sensor reading is too old to be trusted
+bool isSensorStale(int htIndex) {
+    if (htIndex < 0 || htIndex >= 3) {
+        return true;
+    }
+
+    // Digital inputs have no reading to go stale
+    if (htSensorConfig[htIndex].sensorType == SENSOR_TYPE_DIGITAL) {
+        htSensorConfig[htIndex].stale = false;
+        return false;
+    }
+
+    if (htSensorConfig[htIndex].consecutiveFailures >= SENSOR_STALE_FAILURES ||
+        htSensorConfig[htIndex].lastGoodReadTime == 0 ||
+        millis() - htSensorConfig[htIndex].lastGoodReadTime > SENSOR_STALE_TIMEOUT) {
+        htSensorConfig[htIndex].stale = true;
+    }
+
+    return htSensorConfig[htIndex].stale;
+}
+
 // Save HT sensor configuration to EEPROM
 void saveHTSensorConfig() {
     DynamicJsonDocument doc(512);
@@ -5221,6 +10541,8 @@ void handleHTSensors() {
         sensor["pin"] = "HT" + String(i + 1);
         sensor["sensorType"] = htSensorConfig[i].sensorType;
         sensor["sensorTypeName"] = sensorTypeNames[htSensorConfig[i].sensorType];
+        sensor["stale"] = htSensorConfig[i].stale;
+        sensor["failures"] = htSensorConfig[i].consecutiveFailures;
 
         // Add appropriate readings based on sensor type
         if (htSensorConfig[i].sensorType == SENSOR_TYPE_DIGITAL) {
@@ -5235,6 +10557,7 @@ void handleHTSensors() {
             sensor["temperature"] = htSensorConfig[i].temperature;
         }
     }
+    doc["thresholdCrossings"] = sensorThresholdCrossings;
 
     String response;
     serializeJson(doc, response);
@@ -5278,8 +10601,8 @@ void handleUpdateHTSensor() {
     server.send(200, "application/json", response);
 }
 
-// Get uptime as a formatted string (days:hours:minutes:seconds)
-String getUptimeString() {
+// Format uptime into a caller buffer (days, hours:minutes:seconds)
+void formatUptime(char* out, size_t size) {
     unsigned long uptime = millis() / 1000; // Convert to seconds
 
     unsigned long days = uptime / 86400;
@@ -5291,35 +10614,29 @@ String getUptimeString() {
     unsigned long minutes = uptime / 60;
     unsigned long seconds = uptime % 60;
 
-    char uptimeStr[30];
     if (days > 0) {
-        sprintf(uptimeStr, "%ld days, %02ld:%02ld:%02ld", days, hours, minutes, seconds);
+        snprintf(out, size, "%ld days, %02ld:%02ld:%02ld", days, hours, minutes, seconds);
     }
     else {
-        sprintf(uptimeStr, "%02ld:%02ld:%02ld", hours, minutes, seconds);
+        snprintf(out, size, "%02ld:%02ld:%02ld", hours, minutes, seconds);
     }
-
-    return String(uptimeStr);
 }
 
 // Get the active protocol name in a readable format
-String getActiveProtocolName() {
-    // Convert the protocol name to uppercase for display
-    String protocolName = currentCommunicationProtocol;
-
-    if (protocolName == "wifi") {
+const char* getActiveProtocolLabel() {
+    if (currentCommunicationProtocol == "wifi") {
         return "WiFi";
     }
-    else if (protocolName == "ethernet") {
+    else if (currentCommunicationProtocol == "ethernet") {
         return "Ethernet";
     }
-    else if (protocolName == "rs485") {
+    else if (currentCommunicationProtocol == "rs485") {
         return "RS-485";
     }
-    else if (protocolName == "usb") {
+    else if (currentCommunicationProtocol == "usb") {
         return "USB";
     }
 
     // Return as-is if unknown
-    return protocolName;
+    return currentCommunicationProtocol.c_str();
 }
\ No newline at end of file
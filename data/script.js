@@ -15,6 +15,10 @@ let lastDataTimestamp = 0;
 let reconnectAttempts = 0;
 let maxReconnectAttempts = 10;
 let connectionStatusElement = null;
+let liveState = null;         // Controller state rebuilt from the WebSocket delta stream
+let lastSequence = -1;        // Sequence number of the last applied update
+let resyncPending = false;    // Waiting for a full snapshot after a gap
+let binaryStream = false;     // Controller is sending compact binary state frames
 
 // DOM elements
 let sections;
@@ -532,15 +536,21 @@ function initWebSocket() {
     
     try {
         ws = new WebSocket(wsUrl);
+        ws.binaryType = 'arraybuffer';
         
         ws.onopen = function() {
             console.log('WebSocket connected');
             webSocketConnected = true;
             reconnectAttempts = 0;
+            liveState = null;
+            lastSequence = -1;
+            resyncPending = false;
+            binaryStream = false;
             updateConnectionStatus('connected');
             
-            // Subscribe to real-time updates
-            ws.send(JSON.stringify({command: 'subscribe'}));
+            // Subscribe to real-time updates, asking for the compact binary format;
+            // firmware without it ignores the field and keeps sending JSON
+            ws.send(JSON.stringify({command: 'subscribe', format: 'binary'}));
             
             // Show connection toast
             showToast('Real-time connection established', 'success');
@@ -552,6 +562,7 @@ function initWebSocket() {
         ws.onclose = function(event) {
             console.log(`WebSocket disconnected, code: ${event.code}, reason: ${event.reason}`);
             webSocketConnected = false;
+            binaryStream = false;
             updateConnectionStatus('disconnected');
             
             // Try to reconnect with exponential backoff
@@ -583,11 +594,31 @@ function initWebSocket() {
                 lastDataTimestamp = Date.now();
                 showDataRefreshIndicator();
                 
+                if (event.data instanceof ArrayBuffer) {
+                    handleBinaryFrame(event.data);
+                    return;
+                }
+                
                 const data = JSON.parse(event.data);
                 
                 if (data.type === 'status_update') {
-                    // Handle real-time status updates
-                    handleStatusUpdate(data);
+                    // Full snapshot - the base the following deltas apply to
+                    if (data.seq !== undefined) {
+                        lastSequence = data.seq;
+                    }
+                    resyncPending = false;
+                    liveState = data;
+                    handleStatusUpdate(liveState);
+                }
+                else if (data.type === 'delta') {
+                    // Only changed fields; a missing sequence number means we lost one
+                    if (!liveState || data.seq !== lastSequence + 1) {
+                        requestResync();
+                        return;
+                    }
+                    lastSequence = data.seq;
+                    applyStateDelta(liveState, data);
+                    handleStatusUpdate(liveState);
                 }
                 else if (data.type === 'relay_update') {
                     // Handle relay status change
@@ -611,6 +642,169 @@ function initWebSocket() {
     }
 }
 
+// Slow the live stream down while the page is in the background
+document.addEventListener('visibilitychange', () => {
+    if (webSocketConnected) {
+        ws.send(JSON.stringify({command: 'subscribe', rate: document.hidden ? 1 : 10}));
+    }
+});
+
+// Ask the controller for a full snapshot after a gap in the delta stream
+function requestResync() {
+    if (resyncPending || !webSocketConnected) return;
+    
+    resyncPending = true;
+    console.log(`WebSocket update gap after seq ${lastSequence}, requesting snapshot`);
+    ws.send(JSON.stringify({command: 'resync'}));
+}
+
+// Binary WebSocket format (little-endian, layout matches the firmware)
+const WS_BIN_STATE = 0x01;
+const WS_BIN_ERROR = 0x7F;
+const WS_BIN_CMD_SET_RELAY = 0x10;
+const WS_BIN_CMD_SET_MASK = 0x11;
+const WS_BIN_STATE_SIZE = 66;
+const WS_BIN_ERRORS = {1: 'Malformed command', 2: 'Invalid relay', 3: 'Failed to write to relay'};
+const SENSOR_TYPE_NAMES = ['Digital Input', 'DHT11', 'DHT22', 'DS18B20'];
+
+function handleBinaryFrame(buffer) {
+    const view = new DataView(buffer);
+    if (view.byteLength < 2) return;
+    
+    const type = view.getUint8(0);
+    if (type === WS_BIN_ERROR) {
+        showToast(WS_BIN_ERRORS[view.getUint8(1)] || 'Command failed', 'error');
+        refreshSystemStatus();
+        return;
+    }
+    if (type !== WS_BIN_STATE || view.byteLength < WS_BIN_STATE_SIZE) return;
+    
+    binaryStream = true;
+    
+    // Text fields (device name, addresses) come from the last JSON snapshot
+    if (!liveState) {
+        requestResync();
+        return;
+    }
+    
+    const linkFlags = view.getUint8(11);
+    const wifiConnected = (linkFlags & 0x01) !== 0;
+    const ethConnected = (linkFlags & 0x02) !== 0;
+    if (wifiConnected !== liveState.wifi_connected || ethConnected !== liveState.eth_connected) {
+        // Addresses have probably changed too
+        requestResync();
+    }
+    
+    const state = liveState;
+    lastSequence = view.getUint32(2, true);
+    
+    const outputsMask = view.getUint16(6, true);
+    const inputsMask = view.getUint16(8, true);
+    const directMask = view.getUint8(10);
+    state.outputs = [];
+    state.inputs = [];
+    for (let i = 0; i < 16; i++) {
+        state.outputs.push({id: i, state: (outputsMask & (1 << i)) !== 0});
+        state.inputs.push({id: i, state: (inputsMask & (1 << i)) !== 0});
+    }
+    state.direct_inputs = [];
+    for (let i = 0; i < 3; i++) {
+        state.direct_inputs.push({id: i, state: (directMask & (1 << i)) !== 0});
+    }
+    
+    state.analog = [];
+    for (let i = 0; i < 4; i++) {
+        const value = view.getUint16(12 + i * 4, true);
+        state.analog.push({
+            id: i,
+            value: value,
+            voltage: view.getUint16(14 + i * 4, true) / 1000,
+            percentage: Math.round(value * 100 / 4095)
+        });
+    }
+    
+    state.htSensors = [];
+    for (let i = 0; i < 3; i++) {
+        const offset = 28 + i * 7;
+        const sensorType = view.getUint8(offset);
+        const sensor = {
+            index: i,
+            pin: `HT${i + 1}`,
+            sensorType: sensorType,
+            sensorTypeName: SENSOR_TYPE_NAMES[sensorType] || 'Unknown',
+            stale: (view.getUint8(offset + 1) & 0x01) !== 0,
+            failures: view.getUint8(offset + 2)
+        };
+        if (sensorType === 0) {
+            sensor.value = state.direct_inputs[i].state ? 'HIGH' : 'LOW';
+        } else {
+            sensor.temperature = view.getInt16(offset + 3, true) / 10;
+            if (sensorType !== 3) {
+                sensor.humidity = view.getUint16(offset + 5, true) / 10;
+            }
+        }
+        state.htSensors.push(sensor);
+    }
+    
+    const pad = n => String(n).padStart(2, '0');
+    state.time = `${2000 + view.getUint8(49)}-${pad(view.getUint8(50))}-${pad(view.getUint8(51))} ` +
+                 `${pad(view.getUint8(52))}:${pad(view.getUint8(53))}:${pad(view.getUint8(54))}`;
+    
+    // Same format as the firmware's getUptimeString()
+    const uptime = view.getUint32(55, true);
+    const days = Math.floor(uptime / 86400);
+    const clock = `${pad(Math.floor(uptime % 86400 / 3600))}:${pad(Math.floor(uptime % 3600 / 60))}:${pad(uptime % 60)}`;
+    state.uptime = days > 0 ? `${days} days, ${clock}` : clock;
+    state.free_heap = view.getUint32(59, true);
+    state.wifi_rssi = view.getInt8(63);
+    state.i2c_errors = view.getUint16(64, true);
+    
+    handleStatusUpdate(state);
+}
+
+// Send relay changes as binary command frames; returns false if the HTTP API should be used
+function sendRelayMaskCommand(mask, states) {
+    if (!webSocketConnected || !binaryStream) return false;
+    
+    const frame = new Uint8Array([WS_BIN_CMD_SET_MASK, mask & 0xFF, mask >> 8, states & 0xFF, states >> 8]);
+    ws.send(frame.buffer);
+    return true;
+}
+
+function sendRelayCommand(relayId, state) {
+    if (!webSocketConnected || !binaryStream) return false;
+    
+    ws.send(new Uint8Array([WS_BIN_CMD_SET_RELAY, relayId, state ? 1 : 0]).buffer);
+    return true;
+}
+
+// Merge a delta message into the full state
+function applyStateDelta(state, delta) {
+    // Collections are sent as the changed elements only, keyed by id
+    ['outputs', 'inputs', 'direct_inputs', 'analog'].forEach(key => {
+        if (!delta[key]) return;
+        state[key] = state[key] || [];
+        delta[key].forEach(item => {
+            state[key][item.id] = item;
+        });
+    });
+    
+    if (delta.htSensors) {
+        state.htSensors = state.htSensors || [];
+        delta.htSensors.forEach(sensor => {
+            state.htSensors[sensor.index] = sensor;
+        });
+    }
+    
+    // Everything else is a plain field
+    const collections = ['type', 'seq', 'outputs', 'inputs', 'direct_inputs', 'analog', 'htSensors'];
+    Object.keys(delta).forEach(key => {
+        if (!collections.includes(key)) {
+            state[key] = delta[key];
+        }
+    });
+}
+
 // Function to reconnect WebSocket
 function reconnectWebSocket() {
     if (ws) {
@@ -3976,8 +4170,19 @@ function scanI2CBus() {
     
     i2cDevices.innerHTML = '<p>Scanning I2C bus...</p>';
     
-    fetch('/api/i2c/scan')
+    // The scan runs in the background on the controller; poll the job until it is done
+    const pollScan = (url) => fetch(url)
         .then(response => response.json())
+        .then(data => {
+            if (data.running) {
+                i2cDevices.innerHTML = `<p>Scanning I2C bus... ${data.progress}%</p>`;
+                return new Promise(resolve => setTimeout(resolve, 250))
+                    .then(() => pollScan(`/api/i2c/scan?job=${data.job}`));
+            }
+            return data;
+        });
+    
+    pollScan('/api/i2c/scan')
         .then(data => {
             if (data.devices && data.devices.length > 0) {
                 i2cDevices.innerHTML = `<p>Found ${data.total_devices} device(s):</p>`;
@@ -5026,6 +5231,12 @@ function checkDeviceOnline() {
 function controlRelay(relayId, state) {
     console.log(`Controlling relay ${relayId} - setting to ${state ? "ON" : "OFF"}`);
     
+    // The next state frame confirms the change
+    if (sendRelayCommand(parseInt(relayId), state)) {
+        showToast(`Relay ${parseInt(relayId) + 1} ${state ? 'ON' : 'OFF'}`);
+        return;
+    }
+    
     fetch('/api/relay', {
         method: 'POST',
         headers: {
@@ -5066,6 +5277,11 @@ function controlRelay(relayId, state) {
 
 // Control all relays
 function controlAllRelays(state) {
+    if (sendRelayMaskCommand(0xFFFF, state ? 0xFFFF : 0)) {
+        showToast(`All relays turned ${state ? 'ON' : 'OFF'}`);
+        return;
+    }
+    
     fetch('/api/relay', {
         method: 'POST',
         headers: {
@@ -5107,6 +5323,13 @@ function controlSelectedRelays(state) {
         return;
     }
     
+    // One binary frame covers the whole selection
+    const mask = selected.reduce((bits, relayId) => bits | (1 << relayId), 0);
+    if (sendRelayMaskCommand(mask, state ? mask : 0)) {
+        showToast(`${selected.length} relays turned ${state ? 'ON' : 'OFF'}`);
+        return;
+    }
+    
     // Create promises for each relay
     const promises = selected.map(relayId => {
         return fetch('/api/relay', {
@@ -5593,10 +5816,14 @@ function renderHTSensors(sensors) {
     
     sensors.forEach(sensor => {
         const sensorCard = document.createElement('div');
-        sensorCard.className = 'sensor-card';
+        sensorCard.className = sensor.stale ? 'sensor-card stale' : 'sensor-card';
         
         let sensorContent = '';
         
+        // Badge shown when the last reading is too old to be trusted
+        const staleBadge = sensor.stale ?
+            `<span class="sensor-stale" title="${sensor.failures || 0} failed reads">STALE</span>` : '';
+        
         // Create content based on sensor type
         switch (sensor.sensorType) {
             case 0: // Digital Input
@@ -5616,7 +5843,7 @@ function renderHTSensors(sensors) {
                 sensorContent = `
                     <div class="sensor-header">
                         <h4>${sensor.pin}</h4>
-                        <span class="sensor-type">${sensor.sensorTypeName}</span>
+                        <span class="sensor-type">${sensor.sensorTypeName}</span>${staleBadge}
                     </div>
                     <div class="sensor-values">
                         <div class="sensor-temp">
@@ -5635,7 +5862,7 @@ function renderHTSensors(sensors) {
                 sensorContent = `
                     <div class="sensor-header">
                         <h4>${sensor.pin}</h4>
-                        <span class="sensor-type">${sensor.sensorTypeName}</span>
+                        <span class="sensor-type">${sensor.sensorTypeName}</span>${staleBadge}
                     </div>
                     <div class="sensor-values">
                         <div class="sensor-temp">
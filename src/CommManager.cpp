@@ -6,9 +6,68 @@
 
 #include "CommManager.h"
 #include <EEPROM.h>
-#include <Wire.h>
+#include <SPIFFS.h>
 
-CommManager::CommManager() :
+// Modbus CRC-16 (polynomial 0xA001, initial value 0xFFFF)
+static uint16_t modbusCrc16(const uint8_t* data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+        }
+    }
+    return crc;
+}
+
+// Clear the runtime part of a poll table entry
+static void resetModbusPollStats(ModbusPoll& poll) {
+    poll.lastRequest = 0;
+    poll.interval = 0;
+    poll.latency = 0;
+    poll.maxLatency = 0;
+    poll.requests = 0;
+    poll.responses = 0;
+    poll.timeouts = 0;
+    poll.frameErrors = 0;
+    poll.exceptions = 0;
+    poll.lastException = 0;
+    poll.consecutiveErrors = 0;
+}
+
+// Persisted fields of a poll table entry
+static void modbusPollToJson(const ModbusPoll& poll, JsonObject& pollJson) {
+    pollJson["enabled"] = poll.enabled;
+    pollJson["slave"] = poll.slave;
+    pollJson["function"] = poll.function;
+    pollJson["address"] = poll.address;
+    pollJson["count"] = poll.count;
+    pollJson["target"] = poll.target;
+    pollJson["period"] = poll.period;
+}
+
+static void modbusPollFromJson(ModbusPoll& poll, JsonObject& pollJson) {
+    poll.enabled = pollJson["enabled"] | false;
+    poll.slave = pollJson["slave"] | 1;
+    poll.function = pollJson["function"] | 3;
+    poll.address = pollJson["address"] | 0;
+    poll.count = pollJson["count"] | 1;
+    poll.target = pollJson["target"] | 0;
+    poll.period = pollJson["period"] | 1000UL;
+
+    // Reads only; the results must fit the virtual channels
+    bool bits = (poll.function == 1 || poll.function == 2);
+    uint16_t channels = bits ? MODBUS_VIRTUAL_INPUTS : MODBUS_VIRTUAL_ANALOGS;
+    if (poll.slave < 1 || poll.slave > 247) poll.enabled = false;
+    if (poll.function < 1 || poll.function > 4) poll.enabled = false;
+    if (poll.target >= channels) poll.enabled = false;
+    if (poll.count < 1) poll.count = 1;
+    if (poll.target < channels && poll.count > channels - poll.target) poll.count = channels - poll.target;
+    if (poll.period < 10) poll.period = 10;
+}
+
+CommManager::CommManager(I2CBusManager& i2cBus) :
+    _i2cBus(i2cBus),
     _activeProtocol("wifi"),
     _usbBaudRate(115200),
     _usbDataBits(8),
@@ -22,9 +81,52 @@ CommManager::CommManager() :
     _rs485Mode("Half-duplex"),
     _rs485DeviceAddress(1),
     _rs485FlowControl(false),
-    _rs485NightMode(false)
+    _rs485NightMode(false),
+    _commandDispatcher(_commandTable, _commandTableSize, this),
+    _modbusMasterEnabled(false),
+    _modbusTimeout(MODBUS_MASTER_TIMEOUT),
+    _virtualChanged(false),
+    _modbusMasterState(MODBUS_MASTER_IDLE),
+    _modbusCurrentPoll(-1),
+    _modbusFrameLength(0),
+    _modbusExpectedLength(0),
+    _modbusRequestStart(0),
+    _modbusRequestTime(0),
+    _modbusIdleStart(0),
+    _modbusCharTime(0),
+    _modbusFrameGap(0),
+    _modbusCyclePending(0),
+    _modbusCycleStart(0),
+    _modbusCycleTime(0),
+    _modbusMaxCycleTime(0),
+    _modbusCycleCount(0)
 {
     _rs485Serial = new HardwareSerial(1);
+    
+    memset(&_usbChannel, 0, sizeof(_usbChannel));
+    memset(&_rs485Channel, 0, sizeof(_rs485Channel));
+    _usbChannel.enabled = true;
+    _rs485Channel.enabled = true;
+    
+    // Empty poll table
+    for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+        _modbusPolls[i].enabled = false;
+        _modbusPolls[i].slave = 1;
+        _modbusPolls[i].function = 3;
+        _modbusPolls[i].address = 0;
+        _modbusPolls[i].count = 1;
+        _modbusPolls[i].target = 0;
+        _modbusPolls[i].period = 1000;
+        resetModbusPollStats(_modbusPolls[i]);
+    }
+    
+    for (int i = 0; i < MODBUS_VIRTUAL_INPUTS; i++) {
+        _virtualInputs[i] = false;
+    }
+    for (int i = 0; i < MODBUS_VIRTUAL_ANALOGS; i++) {
+        _virtualAnalogs[i] = 0;
+    }
+    rebuildVirtualChannelMap();
 }
 
 void CommManager::begin() {
@@ -37,6 +139,9 @@ void CommManager::begin() {
     // Load saved protocol settings
     loadProtocolConfig();
     
+    // Load the Modbus master poll table
+    loadModbusPolls();
+    
     Serial.println("Communication manager initialized");
 }
 
@@ -95,119 +200,585 @@ void CommManager::initRS485(int baudRate, int dataBits, int parity, int stopBits
     // Using the class variables for pins instead of macros
     _rs485Serial->begin(baudRate, configParity, RS485_RX_PIN_NUM, RS485_TX_PIN_NUM);
     Serial.println("RS485 initialized with baud rate: " + String(baudRate));
+    
+    // Any transaction in flight is lost with the port re-initialization
+    _modbusMasterEnabled = (_rs485Protocol == "Modbus Master");
+    _modbusMasterState = MODBUS_MASTER_IDLE;
+    _modbusCyclePending = 0;
+    updateModbusTiming();
+}
+
+void CommManager::updateModbusTiming() {
+    // Start bit + data bits + parity bit + stop bits
+    unsigned long bitsPerChar = 1 + _rs485DataBits + (_rs485Parity != 0 ? 1 : 0) + _rs485StopBits;
+    unsigned long baudRate = _rs485BaudRate > 0 ? _rs485BaudRate : 9600;
+    
+    _modbusCharTime = (bitsPerChar * 1000000UL + baudRate - 1) / baudRate;
+    
+    // 3.5 characters of silence between frames, fixed at 1.75 ms above 19200 baud
+    _modbusFrameGap = (baudRate > 19200) ? 1750 : (_modbusCharTime * 7 + 1) / 2;
 }
 
 
 void CommManager::processCommands() {
-    if (_activeProtocol == "usb") {
+    // As Modbus master the controller owns the RS485 bus, whatever protocol takes commands
+    if (_modbusMasterEnabled) {
+        processModbusMaster();
+    }
+    
+    // Every enabled channel is served each pass, a quiet one costs an available() check
+    if (_usbChannel.enabled) {
         processUSBCommands();
     }
-    else if (_activeProtocol == "rs485") {
+    if (_rs485Channel.enabled && !_modbusMasterEnabled) {
         processRS485Commands();
     }
     // Note: WiFi and Ethernet commands are handled by WebServerManager
 }
 
 void CommManager::processUSBCommands() {
-    if (Serial.available()) {
-        String command = Serial.readStringUntil('\n');
-        command.trim();
+    serviceChannel(Serial, _usbChannel);
+}
+
+void CommManager::processRS485Commands() {
+    serviceChannel(*_rs485Serial, _rs485Channel);
+}
+
+void CommManager::serviceChannel(Stream& port, CommChannel& channel) {
+    if (!readCommandLine(port, channel.reader)) return;
+    
+    if (_commandDispatcher.execute(channel.reader.line, port)) {
+        channel.commands++;
+    }
+    else {
+        channel.rejected++;
+    }
+}
+
+bool CommManager::readCommandLine(Stream& port, CommandLineReader& reader) {
+    int budget = COMMAND_READ_BUDGET;
+    
+    // Stop at the end of a line; later lines wait in the UART ring buffer
+    while (budget-- > 0 && port.available() > 0) {
+        int c = port.read();
+        if (c < 0) break;
         
-        String response = processCommand(command);
-        Serial.println(response);
+        if (c == '\n') {
+            bool skipped = reader.overflow;
+            uint16_t length = reader.length;
+            reader.overflow = false;
+            reader.length = 0;
+            
+            if (skipped) {
+                reader.overflows++;
+                continue;
+            }
+            
+            // Strip the CR of CRLF and surrounding blanks
+            while (length > 0 && isspace((unsigned char)reader.line[length - 1])) {
+                length--;
+            }
+            uint16_t start = 0;
+            while (start < length && isspace((unsigned char)reader.line[start])) {
+                start++;
+            }
+            if (start == length) continue;
+            
+            memmove(reader.line, reader.line + start, length - start);
+            reader.line[length - start] = '\0';
+            reader.lines++;
+            return true;
+        }
+        
+        if (reader.overflow) continue;
+        
+        if (reader.length >= COMMAND_LINE_SIZE - 1) {
+            reader.overflow = true;
+            reader.length = 0;
+            continue;
+        }
+        
+        reader.line[reader.length++] = (char)c;
     }
+    
+    return false;
 }
 
-void CommManager::processRS485Commands() {
-    if (_rs485Serial->available()) {
-        String command = _rs485Serial->readStringUntil('\n');
-        command.trim();
+void CommManager::processModbusMaster() {
+    unsigned long now = micros();
+    
+    if (_modbusMasterState == MODBUS_MASTER_WAITING) {
+        // Collect what has arrived; the header tells how long the response is
+        while (_rs485Serial->available() && _modbusFrameLength < MODBUS_MASTER_MAX_FRAME) {
+            _modbusFrame[_modbusFrameLength++] = _rs485Serial->read();
+            
+            if (_modbusFrameLength == 2 && (_modbusFrame[1] & 0x80)) {
+                _modbusExpectedLength = 5;                          // Exception response
+            }
+            else if (_modbusFrameLength == 3 && _modbusExpectedLength == 0) {
+                _modbusExpectedLength = 5 + _modbusFrame[2];        // Address, function, count, data, CRC
+            }
+            
+            if (_modbusExpectedLength > 0 && _modbusFrameLength >= _modbusExpectedLength) {
+                break;
+            }
+        }
+        
+        if (_modbusExpectedLength > 0 && _modbusFrameLength >= _modbusExpectedLength) {
+            finishModbusTransaction(applyModbusResponse(_modbusPolls[_modbusCurrentPoll]));
+        }
+        else if (now - _modbusRequestStart > _modbusRequestTime + _modbusTimeout * 1000UL) {
+            _modbusPolls[_modbusCurrentPoll].timeouts++;
+            finishModbusTransaction(false);
+        }
+        return;
+    }
+    
+    if (_modbusMasterState == MODBUS_MASTER_TURNAROUND) {
+        // Late or stray bytes restart the silent interval
+        if (_rs485Serial->available()) {
+            while (_rs485Serial->available()) {
+                _rs485Serial->read();
+            }
+            _modbusIdleStart = now;
+            return;
+        }
         
-        String response = processCommand(command);
-        _rs485Serial->println(response);
+        if (now - _modbusIdleStart < _modbusFrameGap) {
+            return;
+        }
+        _modbusMasterState = MODBUS_MASTER_IDLE;
+    }
+    
+    // Bus is free - send the most overdue poll straight away
+    int next = selectNextModbusPoll(millis());
+    if (next >= 0) {
+        sendModbusRequest(next);
     }
 }
 
-String CommManager::processCommand(String command) {
-    // This is a simplified implementation - the actual implementation would interact
-    // with HardwareManager, SensorManager, etc.
+int CommManager::selectNextModbusPoll(unsigned long now) {
+    int best = -1;
+    unsigned long bestLateness = 0;
     
-    if (command.startsWith("RELAY ")) {
-        return handleRelayCommand(command.substring(6));
+    for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+        ModbusPoll& poll = _modbusPolls[i];
+        if (!poll.enabled) continue;
+        
+        // A poll that was never sent is due at once
+        unsigned long lateness = ULONG_MAX;
+        if (poll.requests > 0) {
+            unsigned long elapsed = now - poll.lastRequest;
+            if (elapsed < poll.period) continue;
+            lateness = elapsed - poll.period;
+        }
+        
+        if (best < 0 || lateness > bestLateness) {
+            best = i;
+            bestLateness = lateness;
+        }
     }
-    else if (command.startsWith("INPUT STATUS")) {
-        return handleInputStatusCommand();
+    
+    return best;
+}
+
+void CommManager::sendModbusRequest(int pollIndex) {
+    ModbusPoll& poll = _modbusPolls[pollIndex];
+    
+    uint8_t request[8];
+    request[0] = poll.slave;
+    request[1] = poll.function;
+    request[2] = poll.address >> 8;
+    request[3] = poll.address & 0xFF;
+    request[4] = poll.count >> 8;
+    request[5] = poll.count & 0xFF;
+    uint16_t crc = modbusCrc16(request, 6);
+    request[6] = crc & 0xFF;
+    request[7] = crc >> 8;
+    
+    // Drop anything left over from the previous transaction
+    while (_rs485Serial->available()) {
+        _rs485Serial->read();
     }
-    else if (command.startsWith("ANALOG STATUS")) {
-        return handleAnalogStatusCommand();
+    
+    // A new cycle starts with the first request after the previous one completed
+    unsigned long now = millis();
+    if (_modbusCyclePending == 0) {
+        for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+            if (_modbusPolls[i].enabled) {
+                _modbusCyclePending |= (1UL << i);
+            }
+        }
+        _modbusCycleStart = now;
     }
-    else if (command == "STATUS") {
-        return handleSystemStatusCommand();
+    
+    if (poll.requests > 0) {
+        poll.interval = now - poll.lastRequest;
     }
-    else if (command.startsWith("SCAN I2C")) {
-        return handleI2CScanCommand();
+    poll.lastRequest = now;
+    poll.requests++;
+    
+    _rs485Serial->write(request, sizeof(request));
+    
+    _modbusCurrentPoll = pollIndex;
+    _modbusFrameLength = 0;
+    _modbusExpectedLength = 0;
+    _modbusRequestStart = micros();
+    _modbusRequestTime = sizeof(request) * _modbusCharTime;
+    _modbusMasterState = MODBUS_MASTER_WAITING;
+}
+
+void CommManager::finishModbusTransaction(bool success) {
+    ModbusPoll& poll = _modbusPolls[_modbusCurrentPoll];
+    
+    if (success) {
+        poll.responses++;
+        poll.consecutiveErrors = 0;
+        poll.latency = (micros() - _modbusRequestStart) / 1000;
+        if (poll.latency > poll.maxLatency) {
+            poll.maxLatency = poll.latency;
+        }
     }
-    else if (command == "HELP") {
-        return handleHelpCommand();
+    else if (poll.consecutiveErrors < 255) {
+        poll.consecutiveErrors++;
     }
     
-    return "ERROR: Unknown command. Type HELP for commands.";
+    // The cycle is complete once every enabled poll has been served
+    if (_modbusCyclePending != 0) {
+        _modbusCyclePending &= ~(1UL << _modbusCurrentPoll);
+        if (_modbusCyclePending == 0) {
+            _modbusCycleTime = millis() - _modbusCycleStart;
+            if (_modbusCycleTime > _modbusMaxCycleTime) {
+                _modbusMaxCycleTime = _modbusCycleTime;
+            }
+            _modbusCycleCount++;
+        }
+    }
+    
+    // Keep the bus silent for t3.5 before the next request
+    _modbusMasterState = MODBUS_MASTER_TURNAROUND;
+    _modbusIdleStart = micros();
 }
 
-String CommManager::handleRelayCommand(String command) {
+bool CommManager::applyModbusResponse(ModbusPoll& poll) {
+    uint16_t length = _modbusFrameLength;
+    
+    uint16_t crc = modbusCrc16(_modbusFrame, length - 2);
+    if (_modbusFrame[length - 2] != (crc & 0xFF) || _modbusFrame[length - 1] != (crc >> 8)) {
+        poll.frameErrors++;
+        return false;
+    }
+    
+    // Must answer the request that is outstanding
+    if (_modbusFrame[0] != poll.slave || (_modbusFrame[1] & 0x7F) != poll.function) {
+        poll.frameErrors++;
+        return false;
+    }
+    
+    if (_modbusFrame[1] & 0x80) {
+        poll.exceptions++;
+        poll.lastException = _modbusFrame[2];
+        return false;
+    }
+    
+    bool bits = (poll.function == 1 || poll.function == 2);
+    uint16_t expectedBytes = bits ? (poll.count + 7) / 8 : poll.count * 2;
+    if (_modbusFrame[2] != expectedBytes) {
+        poll.frameErrors++;
+        return false;
+    }
+    
+    const uint8_t* data = &_modbusFrame[3];
+    for (uint16_t i = 0; i < poll.count; i++) {
+        uint16_t channel = poll.target + i;
+        
+        if (bits) {
+            if (channel >= MODBUS_VIRTUAL_INPUTS) break;
+            bool state = (data[i / 8] >> (i % 8)) & 0x01;
+            if (_virtualInputs[channel] != state) {
+                _virtualInputs[channel] = state;
+                _virtualChanged = true;
+            }
+        }
+        else {
+            if (channel >= MODBUS_VIRTUAL_ANALOGS) break;
+            uint16_t value = ((uint16_t)data[i * 2] << 8) | data[i * 2 + 1];
+            if (_virtualAnalogs[channel] != value) {
+                _virtualAnalogs[channel] = value;
+                _virtualChanged = true;
+            }
+        }
+    }
+    
+    return true;
+}
+
+void CommManager::rebuildVirtualChannelMap() {
+    for (int i = 0; i < MODBUS_VIRTUAL_INPUTS; i++) {
+        _virtualInputSource[i] = -1;
+    }
+    for (int i = 0; i < MODBUS_VIRTUAL_ANALOGS; i++) {
+        _virtualAnalogSource[i] = -1;
+    }
+    
+    // Later entries win where two polls write the same channel
+    for (int p = 0; p < MODBUS_MASTER_MAX_POLLS; p++) {
+        ModbusPoll& poll = _modbusPolls[p];
+        if (!poll.enabled) continue;
+        
+        bool bits = (poll.function == 1 || poll.function == 2);
+        for (uint16_t i = 0; i < poll.count; i++) {
+            uint16_t channel = poll.target + i;
+            if (bits && channel < MODBUS_VIRTUAL_INPUTS) {
+                _virtualInputSource[channel] = p;
+            }
+            else if (!bits && channel < MODBUS_VIRTUAL_ANALOGS) {
+                _virtualAnalogSource[channel] = p;
+            }
+        }
+    }
+}
+
+ModbusPoll* CommManager::getModbusPoll(int index) {
+    if (index < 0 || index >= MODBUS_MASTER_MAX_POLLS) {
+        return nullptr;
+    }
+    return &_modbusPolls[index];
+}
+
+bool CommManager::getVirtualInput(uint8_t index) {
+    return index < MODBUS_VIRTUAL_INPUTS ? _virtualInputs[index] : false;
+}
+
+uint16_t CommManager::getVirtualAnalog(uint8_t index) {
+    return index < MODBUS_VIRTUAL_ANALOGS ? _virtualAnalogs[index] : 0;
+}
+
+bool CommManager::isVirtualInputOnline(uint8_t index) {
+    if (!_modbusMasterEnabled || index >= MODBUS_VIRTUAL_INPUTS || _virtualInputSource[index] < 0) {
+        return false;
+    }
+    ModbusPoll& poll = _modbusPolls[_virtualInputSource[index]];
+    return poll.responses > 0 && poll.consecutiveErrors < MODBUS_MASTER_OFFLINE_ERRORS;
+}
+
+bool CommManager::isVirtualAnalogOnline(uint8_t index) {
+    if (!_modbusMasterEnabled || index >= MODBUS_VIRTUAL_ANALOGS || _virtualAnalogSource[index] < 0) {
+        return false;
+    }
+    ModbusPoll& poll = _modbusPolls[_virtualAnalogSource[index]];
+    return poll.responses > 0 && poll.consecutiveErrors < MODBUS_MASTER_OFFLINE_ERRORS;
+}
+
+bool CommManager::takeVirtualChanges() {
+    bool changed = _virtualChanged;
+    _virtualChanged = false;
+    return changed;
+}
+
+void CommManager::getModbusMasterJson(JsonObject& master) {
+    master["enabled"] = _modbusMasterEnabled;
+    master["response_timeout"] = _modbusTimeout;
+    master["frame_gap_us"] = _modbusFrameGap;
+    master["cycle_time"] = _modbusCycleTime;
+    master["max_cycle_time"] = _modbusMaxCycleTime;
+    master["cycles"] = _modbusCycleCount;
+    
+    JsonArray pollsArray = master.createNestedArray("polls");
+    for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+        ModbusPoll& poll = _modbusPolls[i];
+        if (!poll.enabled) continue;
+        
+        JsonObject pollJson = pollsArray.createNestedObject();
+        pollJson["id"] = i;
+        modbusPollToJson(poll, pollJson);
+        pollJson["interval"] = poll.interval;
+        pollJson["latency"] = poll.latency;
+        pollJson["max_latency"] = poll.maxLatency;
+        pollJson["requests"] = poll.requests;
+        pollJson["responses"] = poll.responses;
+        pollJson["timeouts"] = poll.timeouts;
+        pollJson["frame_errors"] = poll.frameErrors;
+        pollJson["exceptions"] = poll.exceptions;
+        pollJson["last_exception"] = poll.lastException;
+        pollJson["online"] = poll.responses > 0 && poll.consecutiveErrors < MODBUS_MASTER_OFFLINE_ERRORS;
+    }
+    
+    JsonArray inputsArray = master.createNestedArray("inputs");
+    for (int i = 0; i < MODBUS_VIRTUAL_INPUTS; i++) {
+        inputsArray.add(_virtualInputs[i]);
+    }
+    
+    JsonArray analogArray = master.createNestedArray("analog");
+    for (int i = 0; i < MODBUS_VIRTUAL_ANALOGS; i++) {
+        analogArray.add(_virtualAnalogs[i]);
+    }
+}
+
+const CommandEntry CommManager::_commandTable[] = {
+    COMMAND("RELAY", "s", "<num|ALL|STATUS> [ON|OFF]", "Switch or list relays", handleRelayCommand),
+    COMMAND("INPUT STATUS", "", "", "Show all input states", handleInputStatusCommand),
+    COMMAND("ANALOG STATUS", "", "", "Show all analog input values", handleAnalogStatusCommand),
+    COMMAND("SCAN I2C", "", "", "Start a background I2C scan and list known devices", handleI2CScanCommand),
+    COMMAND("MODBUS POLL STATUS", "", "", "Show the Modbus master poll table and statistics", handleModbusPollStatusCommand),
+    COMMAND("STATUS", "", "", "Show system status", handleSystemStatusCommand),
+    COMMAND("HELP", "", "", "Show this list", handleHelpCommand),
+};
+const uint8_t CommManager::_commandTableSize = sizeof(CommManager::_commandTable) / sizeof(CommManager::_commandTable[0]);
+
+bool CommManager::executeCommand(char* line, Print& out) {
+    // In a member so the private table is accessible
+    static_assert(sizeof(_commandTable) / sizeof(_commandTable[0]) <= COMMAND_INDEX_SIZE / 2,
+                  "_commandTable outgrew the dispatcher index, raise COMMAND_INDEX_SIZE");
+    return _commandDispatcher.execute(line, out);
+}
+
+String CommManager::processCommand(String command) {
+    // Callers that want the response as a string (web API) get it through a buffer sink
+    char line[COMMAND_LINE_SIZE];
+    char response[1536];
+    strlcpy(line, command.c_str(), sizeof(line));
+    
+    CommandBufferSink sink(response, sizeof(response));
+    _commandDispatcher.execute(line, sink);
+    return String(sink.c_str());
+}
+
+void CommManager::handleRelayCommand(const CommandArgs& args, Print& out) {
     // Placeholder - would interact with HardwareManager in full implementation
-    return "Relay command processed: " + command;
+    out.print("Relay command processed: ");
+    out.println(args.words[0]);
 }
 
-String CommManager::handleInputStatusCommand() {
+void CommManager::handleInputStatusCommand(const CommandArgs& args, Print& out) {
     // Placeholder - would interact with HardwareManager in full implementation
-    return "INPUT STATUS:\nReading input states...";
+    out.println("INPUT STATUS:");
+    out.println("Reading input states...");
 }
 
-String CommManager::handleAnalogStatusCommand() {
+void CommManager::handleAnalogStatusCommand(const CommandArgs& args, Print& out) {
     // Placeholder - would interact with HardwareManager in full implementation
-    return "ANALOG STATUS:\nReading analog inputs...";
+    out.println("ANALOG STATUS:");
+    out.println("Reading analog inputs...");
 }
 
-String CommManager::handleSystemStatusCommand() {
+void CommManager::handleSystemStatusCommand(const CommandArgs& args, Print& out) {
     // Placeholder - would collect data from multiple managers in full implementation
-    return "KC868-A16 System Status\n---------------------\nDevice: KC868-A16";
+    out.println("KC868-A16 System Status");
+    out.println("---------------------");
+    out.println("Device: KC868-A16");
 }
 
-String CommManager::handleI2CScanCommand() {
-    // Simple I2C scanner that actually works
-    String response = "I2C DEVICES:\n";
+void CommManager::handleI2CScanCommand(const CommandArgs& args, Print& out) {
+    CommManager* self = (CommManager*)args.context;
+    I2CBusManager& bus = self->_i2cBus;
+    
+    // The scan runs in the background; report the presence map as it stands
+    uint16_t jobId = bus.startScan();
+    out.print("I2C DEVICES (scan job ");
+    out.print(jobId);
+    out.print(", ");
+    out.print(bus.getScanProgress());
+    out.println("% done):");
     int deviceCount = 0;
     
-    for (uint8_t address = 1; address < 127; address++) {
-        Wire.beginTransmission(address);
-        uint8_t error = Wire.endTransmission();
-        
-        if (error == 0) {
+    for (uint8_t address = I2C_FIRST_ADDRESS; address <= I2C_LAST_ADDRESS; address++) {
+        uint8_t state = bus.getDeviceState(address);
+        if (state == I2C_DEVICE_PRESENT) {
             deviceCount++;
-            response += "0x" + String(address, HEX) + "\n";
+            out.print("0x");
+            out.println(address, HEX);
+        }
+        else if (state == I2C_DEVICE_ABSENT) {
+            out.print("0x");
+            out.print(address, HEX);
+            out.print(" (not responding, ");
+            out.print(bus.getDeviceFailures(address));
+            out.println(" failures)");
         }
     }
     
-    response += "Found " + String(deviceCount) + " device(s)\n";
-    return response;
+    out.print("Found ");
+    out.print(deviceCount);
+    out.println(" device(s)");
 }
 
-String CommManager::handleHelpCommand() {
-    String response = "KC868-A16 Controller Command Help\n";
-    response += "---------------------\n";
-    response += "RELAY STATUS - Show all relay states\n";
-    response += "RELAY ALL ON - Turn all relays on\n";
-    response += "RELAY ALL OFF - Turn all relays off\n";
-    response += "RELAY <num> ON - Turn relay on (1-16)\n";
-    response += "RELAY <num> OFF - Turn relay off (1-16)\n";
-    response += "INPUT STATUS - Show all input states\n";
-    response += "ANALOG STATUS - Show all analog input values\n";
-    response += "SCAN I2C - Scan for I2C devices\n";
-    response += "STATUS - Show system status\n";
-    response += "VERSION - Show firmware version\n";
+void CommManager::handleModbusPollStatusCommand(const CommandArgs& args, Print& out) {
+    CommManager* self = (CommManager*)args.context;
     
-    return response;
+    out.print("MODBUS MASTER: ");
+    out.println(self->_modbusMasterEnabled ? "enabled" : "disabled (set RS485 protocol to Modbus Master)");
+    out.print("Response timeout: ");
+    out.print(self->_modbusTimeout);
+    out.print(" ms, frame gap: ");
+    out.print(self->_modbusFrameGap);
+    out.println(" us");
+    out.print("Poll cycle: ");
+    out.print(self->_modbusCycleTime);
+    out.print(" ms (max ");
+    out.print(self->_modbusMaxCycleTime);
+    out.print(" ms), ");
+    out.print(self->_modbusCycleCount);
+    out.println(" cycles");
+    
+    for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+        ModbusPoll& poll = self->_modbusPolls[i];
+        if (!poll.enabled) continue;
+        
+        bool bits = (poll.function == 1 || poll.function == 2);
+        unsigned long errors = poll.timeouts + poll.frameErrors + poll.exceptions;
+        float errorRate = poll.requests > 0 ? (100.0f * errors) / poll.requests : 0.0f;
+        
+        out.print("Poll ");
+        out.print(i + 1);
+        out.print(": slave ");
+        out.print(poll.slave);
+        out.print(" FC");
+        out.print(poll.function);
+        out.print(" @");
+        out.print(poll.address);
+        out.print(" x");
+        out.print(poll.count);
+        out.print(bits ? " -> VI" : " -> VA");
+        out.print(poll.target);
+        out.print(" every ");
+        out.print(poll.period);
+        out.println(" ms");
+        
+        out.print("  ");
+        out.print(poll.requests);
+        out.print(" requests, ");
+        out.print(poll.timeouts);
+        out.print(" timeouts, ");
+        out.print(poll.frameErrors);
+        out.print(" frame errors, ");
+        out.print(poll.exceptions);
+        out.print(" exceptions (");
+        out.print(errorRate, 1);
+        out.print("% errors)");
+        if (poll.exceptions > 0) {
+            out.print(", last exception ");
+            out.print(poll.lastException);
+        }
+        out.println();
+        
+        out.print("  interval ");
+        out.print(poll.interval);
+        out.print(" ms, latency ");
+        out.print(poll.latency);
+        out.print(" ms (max ");
+        out.print(poll.maxLatency);
+        out.print(" ms), ");
+        out.println((poll.responses > 0 && poll.consecutiveErrors < MODBUS_MASTER_OFFLINE_ERRORS) ? "online" : "offline");
+    }
+}
+
+void CommManager::handleHelpCommand(const CommandArgs& args, Print& out) {
+    CommManager* self = (CommManager*)args.context;
+    
+    out.println("KC868-A16 Controller Command Help");
+    out.println("---------------------");
+    self->_commandDispatcher.printHelp(out);
 }
 
 String CommManager::getActiveProtocol() {
@@ -228,8 +799,14 @@ void CommManager::getProtocolConfig(String protocol, JsonDocument& doc) {
         doc["data_bits"] = _usbDataBits;
         doc["parity"] = _usbParity;
         doc["stop_bits"] = _usbStopBits;
+        doc["enabled"] = _usbChannel.enabled;
+        doc["commands"] = _usbChannel.commands;
+        doc["rejected"] = _usbChannel.rejected;
     }
     else if (protocol == "rs485") {
+        doc["enabled"] = _rs485Channel.enabled;
+        doc["commands"] = _rs485Channel.commands;
+        doc["rejected"] = _rs485Channel.rejected;
         doc["baud_rate"] = _rs485BaudRate;
         doc["parity"] = _rs485Parity;
         doc["data_bits"] = _rs485DataBits;
@@ -239,12 +816,21 @@ void CommManager::getProtocolConfig(String protocol, JsonDocument& doc) {
         doc["device_address"] = _rs485DeviceAddress;
         doc["flow_control"] = _rs485FlowControl;
         doc["night_mode"] = _rs485NightMode;
+        
+        // Modbus master poll table
+        doc["response_timeout"] = _modbusTimeout;
+        JsonArray pollsArray = doc.createNestedArray("modbus_polls");
+        for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+            JsonObject pollJson = pollsArray.createNestedObject();
+            modbusPollToJson(_modbusPolls[i], pollJson);
+        }
     }
     // Note: WiFi and Ethernet settings are handled by NetworkManager
 }
 
 bool CommManager::updateProtocolConfig(String protocol, JsonObject& config) {
     bool changed = false;
+    bool pollsChanged = false;
     
     if (protocol == "usb") {
         if (config.containsKey("baud_rate")) {
@@ -263,6 +849,10 @@ bool CommManager::updateProtocolConfig(String protocol, JsonObject& config) {
             _usbStopBits = config["stop_bits"];
             changed = true;
         }
+        if (config.containsKey("enabled")) {
+            _usbChannel.enabled = config["enabled"];
+            changed = true;
+        }
         
         if (changed) {
             initUSB(_usbBaudRate, _usbDataBits, _usbParity, _usbStopBits);
@@ -305,17 +895,57 @@ bool CommManager::updateProtocolConfig(String protocol, JsonObject& config) {
             _rs485NightMode = config["night_mode"];
             changed = true;
         }
+        if (config.containsKey("enabled")) {
+            _rs485Channel.enabled = config["enabled"];
+            changed = true;
+        }
         
         if (changed) {
             initRS485(_rs485BaudRate, _rs485DataBits, _rs485Parity, _rs485StopBits);
         }
+        
+        // The Modbus master poll table lives on SPIFFS and needs no port restart
+        if (config.containsKey("response_timeout")) {
+            _modbusTimeout = constrain((unsigned long)config["response_timeout"], 10UL, 5000UL);
+            pollsChanged = true;
+        }
+        if (config.containsKey("modbus_polls")) {
+            JsonArray pollsArray = config["modbus_polls"];
+            int index = 0;
+            for (JsonObject pollJson : pollsArray) {
+                if (index >= MODBUS_MASTER_MAX_POLLS) break;
+                modbusPollFromJson(_modbusPolls[index], pollJson);
+                index++;
+            }
+            
+            // Entries missing from the request are disabled
+            for (; index < MODBUS_MASTER_MAX_POLLS; index++) {
+                _modbusPolls[index].enabled = false;
+            }
+            
+            // Restart statistics and the current cycle for the new table
+            for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+                resetModbusPollStats(_modbusPolls[i]);
+            }
+            _modbusCyclePending = 0;
+            _modbusCycleTime = 0;
+            _modbusMaxCycleTime = 0;
+            _modbusCycleCount = 0;
+            _modbusMasterState = MODBUS_MASTER_IDLE;
+            rebuildVirtualChannelMap();
+            pollsChanged = true;
+        }
+        
+        if (pollsChanged) {
+            saveModbusPolls();
+        }
     }
     
     if (changed) {
         saveProtocolConfig();
     }
     
-    return changed;
+    return changed || pollsChanged;
 }
 
 void CommManager::saveProtocolConfig() {
@@ -330,6 +960,7 @@ void CommManager::saveProtocolConfig() {
     usb["data_bits"] = _usbDataBits;
     usb["parity"] = _usbParity;
     usb["stop_bits"] = _usbStopBits;
+    usb["enabled"] = _usbChannel.enabled;
     
     // RS485 settings
     JsonObject rs485 = doc.createNestedObject("rs485");
@@ -342,6 +973,7 @@ void CommManager::saveProtocolConfig() {
     rs485["device_address"] = _rs485DeviceAddress;
     rs485["flow_control"] = _rs485FlowControl;
     rs485["night_mode"] = _rs485NightMode;
+    rs485["enabled"] = _rs485Channel.enabled;
     
     // Serialize JSON to a buffer
     char jsonBuffer[2048];
@@ -391,6 +1023,7 @@ void CommManager::loadProtocolConfig() {
                 _usbDataBits = doc["usb"]["data_bits"] | 8;
                 _usbParity = doc["usb"]["parity"] | 0;
                 _usbStopBits = doc["usb"]["stop_bits"] | 1;
+                _usbChannel.enabled = doc["usb"]["enabled"] | true;
             }
             
             // RS485 settings
@@ -404,6 +1037,7 @@ void CommManager::loadProtocolConfig() {
                 _rs485DeviceAddress = doc["rs485"]["device_address"] | 1;
                 _rs485FlowControl = doc["rs485"]["flow_control"] | false;
                 _rs485NightMode = doc["rs485"]["night_mode"] | false;
+                _rs485Channel.enabled = doc["rs485"]["enabled"] | true;
             }
             
             Serial.println("Communication settings loaded from EEPROM");
@@ -419,4 +1053,62 @@ void CommManager::loadProtocolConfig() {
     // Initialize USB and RS485 with loaded settings
     initUSB(_usbBaudRate, _usbDataBits, _usbParity, _usbStopBits);
     initRS485(_rs485BaudRate, _rs485DataBits, _rs485Parity, _rs485StopBits);
-}
\ No newline at end of file
+}
+
+void CommManager::saveModbusPolls() {
+    DynamicJsonDocument doc(3072);
+    doc["response_timeout"] = _modbusTimeout;
+    
+    JsonArray pollsArray = doc.createNestedArray("polls");
+    for (int i = 0; i < MODBUS_MASTER_MAX_POLLS; i++) {
+        JsonObject pollJson = pollsArray.createNestedObject();
+        modbusPollToJson(_modbusPolls[i], pollJson);
+    }
+    
+    File file = SPIFFS.open(MODBUS_POLLS_FILE, FILE_WRITE);
+    if (!file) {
+        Serial.println("Failed to open Modbus poll file for writing");
+        return;
+    }
+    
+    serializeJson(doc, file);
+    file.close();
+    
+    Serial.println("Modbus poll table saved to SPIFFS");
+}
+
+void CommManager::loadModbusPolls() {
+    if (!SPIFFS.exists(MODBUS_POLLS_FILE)) {
+        Serial.println("No Modbus poll table found, using defaults");
+        return;
+    }
+    
+    File file = SPIFFS.open(MODBUS_POLLS_FILE, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open Modbus poll file");
+        return;
+    }
+    
+    DynamicJsonDocument doc(3072);
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
+    
+    if (error || !doc.containsKey("polls")) {
+        Serial.println("Failed to parse Modbus poll table");
+        return;
+    }
+    
+    _modbusTimeout = constrain((unsigned long)(doc["response_timeout"] | (unsigned long)MODBUS_MASTER_TIMEOUT), 10UL, 5000UL);
+    
+    JsonArray pollsArray = doc["polls"];
+    int index = 0;
+    for (JsonObject pollJson : pollsArray) {
+        if (index >= MODBUS_MASTER_MAX_POLLS) break;
+        modbusPollFromJson(_modbusPolls[index], pollJson);
+        resetModbusPollStats(_modbusPolls[index]);
+        index++;
+    }
+    rebuildVirtualChannelMap();
+    
+    Serial.println("Modbus poll table loaded from SPIFFS");
+}
@@ -10,17 +10,81 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <HardwareSerial.h>
+#include "I2CBusManager.h"
+#include "CommandDispatcher.h"
+
+// Text command lines are collected byte by byte into a fixed buffer per port
+#define COMMAND_LINE_SIZE             128     // Longest command line, longer ones are discarded
+#define COMMAND_READ_BUDGET           64      // Bytes taken from a port per processCommands() pass
+
+struct CommandLineReader {
+    char line[COMMAND_LINE_SIZE];
+    uint16_t length;            // Bytes of the line collected so far
+    bool overflow;              // Line is too long, skip to its end
+    unsigned long lines;        // Complete lines received
+    unsigned long overflows;    // Lines discarded for length
+};
+
+// Serial command channel. USB and RS485 are served side by side on every
+// processCommands() pass; each can be switched off on its own.
+struct CommChannel {
+    bool enabled;
+    CommandLineReader reader;
+    unsigned long commands;     // Commands run
+    unsigned long rejected;     // Unknown commands and bad arguments
+};
+
+// Modbus RTU master (RS485 protocol type "Modbus Master")
+#define MODBUS_MASTER_MAX_POLLS       16      // Entries in the poll table
+#define MODBUS_VIRTUAL_INPUTS         64      // Coils / discrete inputs read from slaves
+#define MODBUS_VIRTUAL_ANALOGS        32      // Holding / input registers read from slaves
+#define MODBUS_MASTER_TIMEOUT         100     // Default response timeout (ms)
+#define MODBUS_MASTER_MAX_FRAME       256     // Largest RTU frame
+#define MODBUS_MASTER_OFFLINE_ERRORS  3       // Consecutive failures before a poll counts as offline
+#define MODBUS_POLLS_FILE             "/modbus_polls.json" // Poll table on SPIFFS (EEPROM map is full)
+
+// Master transaction states
+#define MODBUS_MASTER_IDLE            0       // Bus free, next due poll may be sent
+#define MODBUS_MASTER_WAITING         1       // Request sent, collecting the response
+#define MODBUS_MASTER_TURNAROUND      2       // Inter-frame silence before the next request
+
+// Poll table entry: one read request repeated at a fixed period
+struct ModbusPoll {
+    bool enabled;
+    uint8_t slave;              // Slave address (1-247)
+    uint8_t function;           // 1=Coils, 2=Discrete inputs, 3=Holding registers, 4=Input registers
+    uint16_t address;           // First coil / input / register on the slave
+    uint16_t count;             // Number of bits (FC1/2) or registers (FC3/4) to read
+    uint16_t target;            // First virtual input (FC1/2) or analog channel (FC3/4)
+    unsigned long period;       // Poll period (ms)
+
+    // Runtime state (not persisted)
+    unsigned long lastRequest;  // millis() of the last request
+    unsigned long interval;     // Actual time between the last two requests (ms)
+    unsigned long latency;      // Last request-to-response time (ms)
+    unsigned long maxLatency;   // Slowest response since boot (ms)
+    unsigned long requests;     // Requests sent
+    unsigned long responses;    // Valid responses applied to the virtual channels
+    unsigned long timeouts;     // No (complete) response within the timeout
+    unsigned long frameErrors;  // CRC errors and malformed or mismatched replies
+    unsigned long exceptions;   // Exception responses from the slave
+    uint8_t lastException;      // Last exception code
+    uint8_t consecutiveErrors;  // Failed transactions in a row
+};
 
 class CommManager {
 public:
-    CommManager();
+    CommManager(I2CBusManager& i2cBus);
     
     // Initialize communication manager
     void begin();
     
-    // Process commands received via active protocol
+    // Process commands received on every enabled channel
     void processCommands();
     
+    // Execute a command line (split in place), writing the response to out
+    bool executeCommand(char* line, Print& out);
+    
     // Execute command and return response
     String processCommand(String command);
     
@@ -30,6 +94,12 @@ public:
     // Set the active communication protocol
     void setActiveProtocol(String protocol);
     
+    // Serial command channels; the active protocol no longer selects which one is served
+    bool isUSBEnabled() { return _usbChannel.enabled; }
+    bool isRS485Enabled() { return _rs485Channel.enabled; }
+    const CommChannel& getUSBChannel() { return _usbChannel; }
+    const CommChannel& getRS485Channel() { return _rs485Channel; }
+    
     // Set up USB serial communication
     void initUSB(int baudRate = 115200, int dataBits = 8, int parity = 0, int stopBits = 1);
     
@@ -48,8 +118,38 @@ public:
     // Load protocol configuration from EEPROM
     void loadProtocolConfig();
     
+    // Modbus master poll table on SPIFFS
+    void saveModbusPolls();
+    void loadModbusPolls();
+    
+    // Modbus master state
+    bool isModbusMasterEnabled() { return _modbusMasterEnabled; }
+    ModbusPoll* getModbusPoll(int index);
+    
+    // Values read by the Modbus master; they hold their last value while a slave is offline
+    bool getVirtualInput(uint8_t index);
+    uint16_t getVirtualAnalog(uint8_t index);
+    
+    // True when the poll feeding this channel is answering
+    bool isVirtualInputOnline(uint8_t index);
+    bool isVirtualAnalogOnline(uint8_t index);
+    
+    // Returns true once after any virtual channel changed value
+    bool takeVirtualChanges();
+    
+    // Poll cycle statistics: a cycle ends when every enabled poll has been served once
+    unsigned long getModbusCycleTime() { return _modbusCycleTime; }
+    unsigned long getModbusMaxCycleTime() { return _modbusMaxCycleTime; }
+    unsigned long getModbusCycleCount() { return _modbusCycleCount; }
+    
+    // Poll table and statistics for JSON responses
+    void getModbusMasterJson(JsonObject& master);
+    
 private:
-    // Currently active protocol: "usb", "rs485", "wifi", "ethernet"
+    // Shared I2C bus (used for bus scans)
+    I2CBusManager& _i2cBus;
+    
+    // Protocol selected in the UI: "usb", "rs485", "wifi", "ethernet"
     String _activeProtocol;
     
     // USB configuration
@@ -72,6 +172,44 @@ private:
     // Hardware serial for RS485
     HardwareSerial* _rs485Serial;
     
+    // Command channels with their non-blocking line readers
+    CommChannel _usbChannel;
+    CommChannel _rs485Channel;
+    
+    // Text commands shared by every port; handlers receive this manager as context
+    static const CommandEntry _commandTable[];
+    static const uint8_t _commandTableSize;
+    CommandDispatcher _commandDispatcher;
+    
+    // Modbus master poll table and virtual channels
+    bool _modbusMasterEnabled;
+    unsigned long _modbusTimeout;              // Response timeout (ms)
+    ModbusPoll _modbusPolls[MODBUS_MASTER_MAX_POLLS];
+    bool _virtualInputs[MODBUS_VIRTUAL_INPUTS];
+    uint16_t _virtualAnalogs[MODBUS_VIRTUAL_ANALOGS];
+    int8_t _virtualInputSource[MODBUS_VIRTUAL_INPUTS];   // Poll that writes each channel, -1 if none
+    int8_t _virtualAnalogSource[MODBUS_VIRTUAL_ANALOGS];
+    bool _virtualChanged;
+    
+    // Modbus master transaction state
+    uint8_t _modbusMasterState;
+    int _modbusCurrentPoll;                    // Poll awaiting a response
+    uint8_t _modbusFrame[MODBUS_MASTER_MAX_FRAME];
+    uint16_t _modbusFrameLength;
+    uint16_t _modbusExpectedLength;            // Response length, 0 until known
+    unsigned long _modbusRequestStart;         // micros() when the request was queued
+    unsigned long _modbusRequestTime;          // Time on the wire for the request (us)
+    unsigned long _modbusIdleStart;            // micros() when the bus went quiet
+    unsigned long _modbusCharTime;             // One character at the RS485 settings (us)
+    unsigned long _modbusFrameGap;             // t3.5 inter-frame silence (us)
+    
+    // Poll cycle statistics
+    uint32_t _modbusCyclePending;              // Enabled polls not yet served this cycle
+    unsigned long _modbusCycleStart;
+    unsigned long _modbusCycleTime;
+    unsigned long _modbusMaxCycleTime;
+    unsigned long _modbusCycleCount;
+    
     // Pin definitions - renamed to avoid conflicts
     // Using pins directly instead of macros
     const int RS485_TX_PIN_NUM = 13;
@@ -87,13 +225,29 @@ private:
     // Process commands via RS485
     void processRS485Commands();
     
-    // Helper functions for command processing
-    String handleRelayCommand(String command);
-    String handleInputStatusCommand();
-    String handleAnalogStatusCommand();
-    String handleSystemStatusCommand();
-    String handleI2CScanCommand();
-    String handleHelpCommand();
+    // Collect received bytes without waiting; true once a whole line is in reader.line
+    bool readCommandLine(Stream& port, CommandLineReader& reader);
+    
+    // Run a line waiting on a channel, if any, and count the result
+    void serviceChannel(Stream& port, CommChannel& channel);
+    
+    // Modbus master scheduler - sends due polls back-to-back and collects responses
+    void processModbusMaster();
+    int selectNextModbusPoll(unsigned long now);
+    void sendModbusRequest(int pollIndex);
+    void finishModbusTransaction(bool success);
+    bool applyModbusResponse(ModbusPoll& poll);
+    void updateModbusTiming();
+    void rebuildVirtualChannelMap();
+    
+    // Command handlers registered in _commandTable
+    static void handleRelayCommand(const CommandArgs& args, Print& out);
+    static void handleInputStatusCommand(const CommandArgs& args, Print& out);
+    static void handleAnalogStatusCommand(const CommandArgs& args, Print& out);
+    static void handleSystemStatusCommand(const CommandArgs& args, Print& out);
+    static void handleI2CScanCommand(const CommandArgs& args, Print& out);
+    static void handleHelpCommand(const CommandArgs& args, Print& out);
+    static void handleModbusPollStatusCommand(const CommandArgs& args, Print& out);
 };
 
 #endif // COMM_MANAGER_H
\ No newline at end of file
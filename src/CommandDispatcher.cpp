@@ -0,0 +1,201 @@
+/**
+ * CommandDispatcher.cpp - Table-driven text command dispatcher for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#include "CommandDispatcher.h"
+
+CommandBufferSink::CommandBufferSink(char* buffer, size_t size) :
+    _buffer(buffer),
+    _size(size),
+    _length(0),
+    _overflowed(false)
+{
+    if (_size > 0) {
+        _buffer[0] = '\0';
+    }
+}
+
+size_t CommandBufferSink::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t CommandBufferSink::write(const uint8_t* data, size_t length) {
+    if (_size == 0) {
+        _overflowed = true;
+        return 0;
+    }
+
+    // Keep room for the terminator
+    size_t room = _size - 1 - _length;
+    if (length > room) {
+        _overflowed = true;
+        length = room;
+    }
+
+    memcpy(_buffer + _length, data, length);
+    _length += length;
+    _buffer[_length] = '\0';
+    return length;
+}
+
+CommandDispatcher::CommandDispatcher(const CommandEntry* table, uint8_t count, void* context) :
+    _table(table),
+    _count(count),
+    _context(context),
+    _executed(0),
+    _rejected(0)
+{
+    for (int i = 0; i < COMMAND_INDEX_SIZE; i++) {
+        _index[i] = -1;
+    }
+
+    // Build the hash index once; lookups then probe a slot or two. Callers
+    // static_assert their table against COMMAND_INDEX_SIZE / 2; the bound
+    // here only keeps the probe loop finite
+    for (uint8_t i = 0; i < _count && i < COMMAND_INDEX_SIZE / 2; i++) {
+        uint32_t slot = _table[i].hash & (COMMAND_INDEX_SIZE - 1);
+        while (_index[slot] >= 0) {
+            slot = (slot + 1) & (COMMAND_INDEX_SIZE - 1);
+        }
+        _index[slot] = i;
+    }
+}
+
+uint8_t CommandDispatcher::tokenize(char* line, char** words, uint8_t maxWords) {
+    uint8_t count = 0;
+    char* p = line;
+
+    while (*p != '\0' && count < maxWords) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (*p == '\0') break;
+
+        words[count++] = p;
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        if (*p != '\0') *p++ = '\0';
+    }
+
+    return count;
+}
+
+int CommandDispatcher::find(uint32_t hash, char** words, uint8_t nameWords) {
+    uint32_t slot = hash & (COMMAND_INDEX_SIZE - 1);
+
+    while (_index[slot] >= 0) {
+        const CommandEntry& entry = _table[_index[slot]];
+
+        if (entry.hash == hash) {
+            // Guard against hash collisions: compare the name word by word
+            const char* name = entry.name;
+            bool match = true;
+            for (uint8_t w = 0; w < nameWords && match; w++) {
+                size_t length = strlen(words[w]);
+                if (strncmp(name, words[w], length) != 0) {
+                    match = false;
+                }
+                else {
+                    name += length;
+                    if (w + 1 < nameWords) {
+                        match = (*name == ' ');
+                        name++;
+                    }
+                }
+            }
+            if (match && *name == '\0') {
+                return _index[slot];
+            }
+        }
+
+        slot = (slot + 1) & (COMMAND_INDEX_SIZE - 1);
+    }
+
+    return -1;
+}
+
+bool CommandDispatcher::execute(char* line, Print& out) {
+    char* words[COMMAND_MAX_TOKENS];
+    uint8_t count = tokenize(line, words, COMMAND_MAX_TOKENS);
+
+    // Hash of the first one, two, ... words as they would appear in a name
+    uint32_t hashes[COMMAND_NAME_WORDS];
+    uint8_t prefixes = 0;
+    for (; prefixes < count && prefixes < COMMAND_NAME_WORDS; prefixes++) {
+        hashes[prefixes] = (prefixes == 0) ? commandHash(words[0]) :
+            commandHash(words[prefixes], commandHash(" ", hashes[prefixes - 1]));
+    }
+
+    // Longest name wins ("RELAY STATUS" before "RELAY")
+    int entryIndex = -1;
+    uint8_t nameWords;
+    for (nameWords = prefixes; nameWords > 0; nameWords--) {
+        entryIndex = find(hashes[nameWords - 1], words, nameWords);
+        if (entryIndex >= 0) break;
+    }
+
+    if (entryIndex < 0) {
+        _rejected++;
+        out.println("ERROR: Unknown command. Type HELP for commands.");
+        return false;
+    }
+
+    const CommandEntry& entry = _table[entryIndex];
+
+    // Typed arguments; words after the expected ones are ignored
+    CommandArgs args;
+    args.count = 0;
+    args.context = _context;
+
+    bool valid = true;
+    for (const char* spec = entry.argSpec; *spec != '\0' && args.count < COMMAND_MAX_ARGS; spec++) {
+        uint8_t position = nameWords + args.count;
+        if (position >= count) {
+            valid = false;
+            break;
+        }
+
+        char* word = words[position];
+        args.numbers[args.count] = 0;
+
+        if (*spec == 'n') {
+            char* end;
+            args.numbers[args.count] = strtol(word, &end, 10);
+            if (end == word || *end != '\0') {
+                valid = false;
+                break;
+            }
+        }
+        else if (*spec == 'k') {
+            for (char* p = word; *p != '\0'; p++) {
+                *p = toupper((unsigned char)*p);
+            }
+        }
+
+        args.words[args.count++] = word;
+    }
+
+    if (!valid) {
+        _rejected++;
+        out.print("ERROR: Invalid format. Use ");
+        out.print(entry.name);
+        out.print(' ');
+        out.println(entry.usage);
+        return false;
+    }
+
+    _executed++;
+    entry.handler(args, out);
+    return true;
+}
+
+void CommandDispatcher::printHelp(Print& out) {
+    for (uint8_t i = 0; i < _count; i++) {
+        out.print(_table[i].name);
+        if (_table[i].usage[0] != '\0') {
+            out.print(' ');
+            out.print(_table[i].usage);
+        }
+        out.print(" - ");
+        out.println(_table[i].help);
+    }
+}
@@ -0,0 +1,103 @@
+/**
+ * CommandDispatcher.h - Table-driven text command dispatcher for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#ifndef COMMAND_DISPATCHER_H
+#define COMMAND_DISPATCHER_H
+
+#include <Arduino.h>
+
+#define COMMAND_MAX_TOKENS    8      // Words parsed from one command line
+#define COMMAND_NAME_WORDS    3      // Longest command name, e.g. "MODBUS POLL STATUS"
+#define COMMAND_MAX_ARGS      4      // Typed arguments per command
+#define COMMAND_INDEX_SIZE    64     // Hash index slots (power of two, at least twice the table)
+
+// FNV-1a hash of a command name. Table keys are computed at compile time;
+// multi-word names hash their words joined by single spaces.
+constexpr uint32_t commandHash(const char* text, uint32_t hash = 2166136261UL) {
+    return *text == '\0' ? hash : commandHash(text + 1, (uint32_t)((hash ^ (uint8_t)*text) * 16777619UL));
+}
+
+// Arguments following the command name, parsed according to the entry's spec
+struct CommandArgs {
+    uint8_t count;
+    long numbers[COMMAND_MAX_ARGS];          // Value of each 'n' argument
+    char* words[COMMAND_MAX_ARGS];           // Every argument as text
+    void* context;                           // Owner passed to the dispatcher
+};
+
+// Handlers write their response to the caller's sink (serial port, buffer, ...)
+typedef void (*CommandHandler)(const CommandArgs& args, Print& out);
+
+// Registered command
+struct CommandEntry {
+    uint32_t hash;            // commandHash(name)
+    const char* name;         // Up to COMMAND_NAME_WORDS words, e.g. "VERSION" or "WS RATE"
+    const char* argSpec;      // One character per argument: n=number, k=keyword (upper-cased), s=text
+    const char* usage;        // Argument syntax for HELP and format errors
+    const char* help;         // One-line description
+    CommandHandler handler;
+};
+
+// Table entry with its key hashed at compile time
+#define COMMAND(name, argSpec, usage, help, handler) { commandHash(name), name, argSpec, usage, help, handler }
+
+// Print sink collecting a response in a caller-provided buffer; output beyond
+// the buffer is dropped and reported by overflowed()
+class CommandBufferSink : public Print {
+public:
+    CommandBufferSink(char* buffer, size_t size);
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* data, size_t length) override;
+
+    const char* c_str() const { return _buffer; }
+    size_t length() const { return _length; }
+    bool overflowed() const { return _overflowed; }
+
+private:
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+    bool _overflowed;
+};
+
+class CommandDispatcher {
+public:
+    // The table must outlive the dispatcher and hold at most
+    // COMMAND_INDEX_SIZE / 2 entries (static_assert it where it is defined);
+    // context is handed to every handler
+    CommandDispatcher(const CommandEntry* table, uint8_t count, void* context = NULL);
+
+    // Split the line in place, look up the command and run it; false if the
+    // command is unknown or its arguments do not parse (the error is written to out)
+    bool execute(char* line, Print& out);
+
+    // Every command with its usage and description
+    void printHelp(Print& out);
+
+    // Split a line in place: blanks become NULs and each word points into the line
+    static uint8_t tokenize(char* line, char** words, uint8_t maxWords);
+
+    // Commands run and lines rejected since boot
+    unsigned long getExecutedCount() { return _executed; }
+    unsigned long getRejectedCount() { return _rejected; }
+
+private:
+    const CommandEntry* _table;
+    uint8_t _count;
+    void* _context;
+
+    // Table position for each hash slot, -1 when empty (open addressing)
+    int8_t _index[COMMAND_INDEX_SIZE];
+
+    unsigned long _executed;
+    unsigned long _rejected;
+
+    // Find an entry by hash and confirm the name against the words
+    int find(uint32_t hash, char** words, uint8_t nameWords);
+};
+
+#endif // COMMAND_DISPATCHER_H
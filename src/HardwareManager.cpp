@@ -6,12 +6,10 @@
 
 #include "HardwareManager.h"
 
-HardwareManager::HardwareManager() :
-    _inputIC1(PCF8574_INPUTS_1_8),
-    _inputIC2(PCF8574_INPUTS_9_16),
-    _outputIC3(PCF8574_OUTPUTS_9_16),
-    _outputIC4(PCF8574_OUTPUTS_1_8),
-    _i2cErrorCount(0)
+HardwareManager::HardwareManager(I2CBusManager& i2cBus) :
+    _i2cBus(i2cBus),
+    _i2cErrorCount(0),
+    _skippedCount(0)
 {
     // Initialize state arrays
     for (int i = 0; i < 16; i++) {
@@ -23,6 +21,9 @@ HardwareManager::HardwareManager() :
         _directInputStates[i] = false;
     }
     
+    _outputsPending[0] = false;
+    _outputsPending[1] = false;
+    
     for (int i = 0; i < 4; i++) {
         _analogValues[i] = 0;
         _analogVoltages[i] = 0.0;
@@ -30,9 +31,7 @@ HardwareManager::HardwareManager() :
 }
 
 void HardwareManager::begin() {
-    // Initialize I2C with custom pins
-    Wire.begin(SDA_PIN, SCL_PIN);
-    Wire.setClock(50000);  // Lower to 50kHz for more reliable communication
+    // The I2C bus itself is started by the bus manager
     
     // Initialize PCF8574 expanders
     initI2C();
@@ -55,49 +54,34 @@ void HardwareManager::begin() {
 }
 
 void HardwareManager::initI2C() {
-    // Configure input pins (set as inputs with pull-ups)
-    for (int i = 0; i < 8; i++) {
-        _inputIC1.pinMode(i, INPUT);
-        _inputIC2.pinMode(i, INPUT);
-    }
-    
-    // Configure output pins (set as outputs)
-    for (int i = 0; i < 8; i++) {
-        _outputIC3.pinMode(i, OUTPUT);
-        _outputIC4.pinMode(i, OUTPUT);
-    }
+    // PCF8574 pins are quasi-bidirectional: writing 1 releases a pin so it
+    // can be read as an input (weak pull-up) and leaves relays OFF (active LOW)
     
     // Initialize PCF8574 ICs
-    if (!_inputIC1.begin()) {
+    if (!writeExpander(PCF8574_INPUTS_1_8, 0xFF)) {
         Serial.println("Error: Could not initialize Input IC1 (0x22)");
         _i2cErrorCount++;
         _lastErrorMessage = "Failed to initialize Input IC1";
     }
     
-    if (!_inputIC2.begin()) {
+    if (!writeExpander(PCF8574_INPUTS_9_16, 0xFF)) {
         Serial.println("Error: Could not initialize Input IC2 (0x21)");
         _i2cErrorCount++;
         _lastErrorMessage = "Failed to initialize Input IC2";
     }
     
-    if (!_outputIC3.begin()) {
+    if (!writeExpander(PCF8574_OUTPUTS_9_16, 0xFF)) {
         Serial.println("Error: Could not initialize Output IC3 (0x25)");
         _i2cErrorCount++;
         _lastErrorMessage = "Failed to initialize Output IC3";
     }
     
-    if (!_outputIC4.begin()) {
+    if (!writeExpander(PCF8574_OUTPUTS_1_8, 0xFF)) {
         Serial.println("Error: Could not initialize Output IC4 (0x24)");
         _i2cErrorCount++;
         _lastErrorMessage = "Failed to initialize Output IC4";
     }
     
-    // Initialize all outputs to HIGH (OFF state due to inverted logic)
-    for (int i = 0; i < 8; i++) {
-        _outputIC3.digitalWrite(i, HIGH);
-        _outputIC4.digitalWrite(i, HIGH);
-    }
-    
     // Initialize input state arrays
     for (int i = 0; i < 16; i++) {
         _inputStates[i] = true;   // Default HIGH (pull-up)
@@ -123,52 +107,35 @@ bool HardwareManager::readInputs() {
         prevDirectInputStates[i] = _directInputStates[i];
     }
     
-    // Read from PCF8574 input expanders using the PCF8574 library
-    // Inputs 1-8 (IC1)
-    for (int i = 0; i < 8; i++) {
-        bool newState = false;
-        try {
-            newState = _inputIC1.digitalRead(i);
-        }
-        catch (const std::exception& e) {
-            _i2cErrorCount++;
-            _lastErrorMessage = "Error reading from Input IC1";
+    // Read each PCF8574 input expander with a single one-byte transfer
+    const uint8_t inputAddresses[2] = { PCF8574_INPUTS_1_8, PCF8574_INPUTS_9_16 };
+    for (int ic = 0; ic < 2; ic++) {
+        // Expanders the bus has marked absent are skipped until their retry time
+        if (!_i2cBus.isDeviceAvailable(inputAddresses[ic])) {
+            _skippedCount++;
             success = false;
-            Serial.println("Error reading from Input IC1: " + String(e.what()));
             continue;
         }
         
-        // Invert because of the pull-up configuration (LOW = active/true)
-        newState = !newState;
-        
-        if (_inputStates[i] != newState) {
-            _inputStates[i] = newState;
-            anyChanged = true;
-            Serial.println("Input " + String(i + 1) + " changed to " + String(newState ? "HIGH" : "LOW"));
-        }
-    }
-    
-    // Inputs 9-16 (IC2)
-    for (int i = 0; i < 8; i++) {
-        bool newState = false;
-        try {
-            newState = _inputIC2.digitalRead(i);
-        }
-        catch (const std::exception& e) {
+        uint8_t portValue;
+        if (!readExpander(inputAddresses[ic], portValue)) {
             _i2cErrorCount++;
-            _lastErrorMessage = "Error reading from Input IC2";
+            _lastErrorMessage = "Error reading from Input IC" + String(ic + 1);
             success = false;
-            Serial.println("Error reading from Input IC2: " + String(e.what()));
+            Serial.println("Error reading from Input IC" + String(ic + 1));
             continue;
         }
         
-        // Invert because of the pull-up configuration (LOW = active/true)
-        newState = !newState;
-        
-        if (_inputStates[i + 8] != newState) {
-            _inputStates[i + 8] = newState;
-            anyChanged = true;
-            Serial.println("Input " + String(i + 9) + " changed to " + String(newState ? "HIGH" : "LOW"));
+        for (int i = 0; i < 8; i++) {
+            // Invert because of the pull-up configuration (LOW = active/true)
+            bool newState = !(portValue & (1 << i));
+            int index = ic * 8 + i;
+            
+            if (_inputStates[index] != newState) {
+                _inputStates[index] = newState;
+                anyChanged = true;
+                Serial.println("Input " + String(index + 1) + " changed to " + String(newState ? "HIGH" : "LOW"));
+            }
         }
     }
     
@@ -199,49 +166,78 @@ bool HardwareManager::readInputs() {
 }
 
 bool HardwareManager::writeOutputs() {
-    bool success = true;
+    // Both ports are owed until they have been written
+    _outputsPending[0] = true;
+    _outputsPending[1] = true;
     
-    // Set outputs 1-8 (IC4)
-    for (int i = 0; i < 8; i++) {
-        try {
-            // Write HIGH when output state is false (relays are active LOW)
-            _outputIC4.digitalWrite(i, _outputStates[i] ? LOW : HIGH);
-        }
-        catch (const std::exception& e) {
-            _i2cErrorCount++;
-            _lastErrorMessage = "Failed to write to Output IC4";
-            success = false;
-            Serial.println("Error writing to Output IC4: " + String(e.what()));
+    bool success = flushOutputs();
+    
+    if (success) {
+        Serial.println("Successfully updated all relays");
+    }
+    else {
+        Serial.println("ERROR: Failed to write to some output expanders");
+    }
+    
+    return success;
+}
+
+void HardwareManager::update() {
+    // Only try again once an owed expander's back-off has elapsed
+    if ((_outputsPending[0] && _i2cBus.isDeviceAvailable(PCF8574_OUTPUTS_1_8)) ||
+        (_outputsPending[1] && _i2cBus.isDeviceAvailable(PCF8574_OUTPUTS_9_16))) {
+        if (flushOutputs()) {
+            Serial.println("Relay states re-sent to recovered output expander");
         }
     }
+}
+
+bool HardwareManager::flushOutputs() {
+    // Outputs 1-8 on IC4, 9-16 on IC3 - relay writes have the highest bus priority
+    const uint8_t outputAddresses[2] = { PCF8574_OUTPUTS_1_8, PCF8574_OUTPUTS_9_16 };
+    const char* outputNames[2] = { "Output IC4", "Output IC3" };
+    bool success = true;
     
-    // Set outputs 9-16 (IC3)
-    for (int i = 0; i < 8; i++) {
-        try {
-            // Write HIGH when output state is false (relays are active LOW)
-            _outputIC3.digitalWrite(i, _outputStates[i + 8] ? LOW : HIGH);
+    for (int ic = 0; ic < 2; ic++) {
+        if (!_outputsPending[ic]) continue;
+        
+        // Build the port byte - a bit is LOW when the relay is on (relays are active LOW)
+        uint8_t portValue = 0xFF;
+        for (int i = 0; i < 8; i++) {
+            if (_outputStates[ic * 8 + i]) portValue &= ~(1 << i);
         }
-        catch (const std::exception& e) {
+        
+        // An expander in back-off is skipped; the port stays pending and
+        // update() writes it as soon as the expander is available again
+        if (!_i2cBus.isDeviceAvailable(outputAddresses[ic])) {
+            _skippedCount++;
+            _lastErrorMessage = String(outputNames[ic]) + " not responding";
+            success = false;
+            continue;
+        }
+        
+        if (!writeExpander(outputAddresses[ic], portValue)) {
             _i2cErrorCount++;
-            _lastErrorMessage = "Failed to write to Output IC3";
+            _lastErrorMessage = "Failed to write to " + String(outputNames[ic]);
             success = false;
-            Serial.println("Error writing to Output IC3: " + String(e.what()));
+            Serial.println("Error writing to " + String(outputNames[ic]));
+            continue;
         }
-    }
-    
-    if (success) {
-        Serial.println("Successfully updated all relays");
-    }
-    else {
-        Serial.println("ERROR: Failed to write to some output expanders");
-        // Try to recover I2C bus
-        Wire.flush();
-        delay(50);
+        
+        _outputsPending[ic] = false;
     }
     
     return success;
 }
 
+bool HardwareManager::readExpander(uint8_t address, uint8_t& value) {
+    return _i2cBus.read(address, &value, 1, I2C_PRIORITY_INPUT);
+}
+
+bool HardwareManager::writeExpander(uint8_t address, uint8_t value) {
+    return _i2cBus.write(address, &value, 1, I2C_PRIORITY_RELAY);
+}
+
 int HardwareManager::readAnalogInput(uint8_t index) {
     int pinMapping[] = { ANALOG_PIN_1, ANALOG_PIN_2, ANALOG_PIN_3, ANALOG_PIN_4 };
     
@@ -8,8 +8,7 @@
 #define HARDWARE_MANAGER_H
 
 #include <Arduino.h>
-#include <Wire.h>
-#include <PCF8574.h>
+#include "I2CBusManager.h"
 
 // I2C PCF8574 addresses
 #define PCF8574_INPUTS_1_8    0x22
@@ -39,7 +38,7 @@
 
 class HardwareManager {
 public:
-    HardwareManager();
+    HardwareManager(I2CBusManager& i2cBus);
     
     // Initialize hardware
     void begin();
@@ -50,6 +49,10 @@ public:
     // Write outputs to PCF8574 chips
     bool writeOutputs();
     
+    // Re-send relay states still owed to an output expander that was backing
+    // off or failed, once the bus reports it available again (call from loop)
+    void update();
+    
     // Read a single analog input with improved noise reduction
     int readAnalogInput(uint8_t index);
     
@@ -89,15 +92,19 @@ public:
     // Get I2C error count
     unsigned long getI2CErrorCount() { return _i2cErrorCount; }
     
+    // Expander accesses skipped because the device is absent or backing off
+    unsigned long getSkippedCount() { return _skippedCount; }
+    
     // Get last error message
     String getLastErrorMessage() { return _lastErrorMessage; }
     
+    // Shared I2C bus
+    I2CBusManager& getI2CBus() { return _i2cBus; }
+    
 private:
-    // PCF8574 expanders
-    PCF8574 _inputIC1;  // Digital Inputs 1-8
-    PCF8574 _inputIC2;  // Digital Inputs 9-16
-    PCF8574 _outputIC3; // Digital Outputs 9-16
-    PCF8574 _outputIC4; // Digital Outputs 1-8
+    // Shared I2C bus - PCF8574 expanders are driven with whole-port
+    // transfers (one byte per expander) instead of per-pin calls
+    I2CBusManager& _i2cBus;
     
     // State arrays
     bool _outputStates[16];        // Current output states
@@ -105,13 +112,24 @@ private:
     bool _directInputStates[3];    // Current HT1-HT3 states
     int _analogValues[4];          // Current analog input values (raw ADC values)
     float _analogVoltages[4];      // Current analog input voltages (0-5V)
+    bool _outputsPending[2];       // Port byte not yet written (outputs 1-8, 9-16)
     
     // Diagnostics
     unsigned long _i2cErrorCount;
+    unsigned long _skippedCount;
     String _lastErrorMessage;
     
     // Initialize I2C communication with PCF8574 chips
     void initI2C();
+    
+    // Read the port byte of an input expander
+    bool readExpander(uint8_t address, uint8_t& value);
+    
+    // Write the port byte of an output expander
+    bool writeExpander(uint8_t address, uint8_t value);
+    
+    // Write every pending output port; false if any is still owed
+    bool flushOutputs();
 };
 
 #endif // HARDWARE_MANAGER_H
\ No newline at end of file
@@ -0,0 +1,325 @@
+/**
+ * I2CBusManager.cpp - Shared I2C bus transaction scheduler for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#include "I2CBusManager.h"
+
+// Guards the transaction queues (short critical sections only)
+static portMUX_TYPE i2cQueueMux = portMUX_INITIALIZER_UNLOCKED;
+
+I2CBusManager::I2CBusManager() :
+    _busMutex(NULL),
+    _errorCount(0),
+    _coalescedCount(0),
+    _lastErrorAddress(0),
+    _scanRunning(false),
+    _scanJobId(0),
+    _scanNextAddress(I2C_FIRST_ADDRESS),
+    _lastScanTime(0)
+{
+    for (int p = 0; p < I2C_PRIORITY_LEVELS; p++) {
+        _waiting[p] = 0;
+        _queueHead[p] = 0;
+        _queueCount[p] = 0;
+        _transactionCount[p] = 0;
+    }
+
+    for (int a = 0; a < 128; a++) {
+        _deviceState[a] = I2C_DEVICE_UNKNOWN;
+        _deviceFailures[a] = 0;
+        _deviceRetryAt[a] = 0;
+    }
+}
+
+void I2CBusManager::begin(int sdaPin, int sclPin, uint32_t frequency) {
+    if (_busMutex == NULL) {
+        _busMutex = xSemaphoreCreateMutex();
+    }
+
+    Wire.begin(sdaPin, sclPin);
+    Wire.setClock(frequency);
+
+    Serial.printf("I2C bus initialized (SDA %d, SCL %d, %lu Hz)\n", sdaPin, sclPin, (unsigned long)frequency);
+}
+
+void I2CBusManager::acquire(uint8_t priority) {
+    if (priority >= I2C_PRIORITY_LEVELS) priority = I2C_PRIORITY_SENSOR;
+    if (_busMutex == NULL) return;
+
+    // Announce the wait so queued lower-priority work stands aside
+    _waiting[priority]++;
+    xSemaphoreTake(_busMutex, portMAX_DELAY);
+    _waiting[priority]--;
+}
+
+void I2CBusManager::release() {
+    if (_busMutex == NULL) return;
+    xSemaphoreGive(_busMutex);
+}
+
+bool I2CBusManager::write(uint8_t address, const uint8_t* data, uint8_t length, uint8_t priority) {
+    return writeRead(address, data, length, NULL, 0, priority);
+}
+
+bool I2CBusManager::read(uint8_t address, uint8_t* data, uint8_t length, uint8_t priority) {
+    return writeRead(address, NULL, 0, data, length, priority);
+}
+
+bool I2CBusManager::writeRead(uint8_t address, const uint8_t* txData, uint8_t txLength,
+    uint8_t* rxData, uint8_t rxLength, uint8_t priority) {
+    if (priority >= I2C_PRIORITY_LEVELS) priority = I2C_PRIORITY_SENSOR;
+
+    acquire(priority);
+    bool success = transferLocked(address, txData, txLength, rxData, rxLength);
+    _transactionCount[priority]++;
+    release();
+
+    return success;
+}
+
+bool I2CBusManager::probe(uint8_t address, uint8_t priority) {
+    if (priority >= I2C_PRIORITY_LEVELS) priority = I2C_PRIORITY_SENSOR;
+
+    acquire(priority);
+    Wire.beginTransmission(address);
+    uint8_t error = Wire.endTransmission();
+    // A NACK from an address nothing has used yet is just an empty slot
+    if (error == 0 || getDeviceState(address) != I2C_DEVICE_UNKNOWN) {
+        recordDeviceResult(address, error == 0);
+    }
+    release();
+
+    return error == 0;
+}
+
+bool I2CBusManager::submit(const I2CTransaction& transaction, uint8_t priority) {
+    if (priority >= I2C_PRIORITY_LEVELS) return false;
+    if (transaction.txLength > I2C_MAX_TRANSFER || transaction.rxLength > I2C_MAX_TRANSFER) return false;
+
+    bool queued = false;
+    bool coalesced = false;
+
+    portENTER_CRITICAL(&i2cQueueMux);
+
+    // A whole-byte write replaces the newest queued transfer to the same
+    // device if that is also a whole-byte write - anything else in between
+    // (a register write, a read) keeps both, in order
+    if (transaction.txLength == 1 && transaction.rxLength == 0 && transaction.callback == NULL) {
+        for (uint8_t i = _queueCount[priority]; i > 0; i--) {
+            I2CTransaction& queuedTxn = _queue[priority][(_queueHead[priority] + i - 1) % I2C_QUEUE_DEPTH];
+            if (queuedTxn.address != transaction.address) continue;
+
+            if (queuedTxn.txLength == 1 && queuedTxn.rxLength == 0 && queuedTxn.callback == NULL) {
+                queuedTxn.txData[0] = transaction.txData[0];
+                coalesced = true;
+                queued = true;
+            }
+            break;
+        }
+    }
+
+    if (!queued && _queueCount[priority] < I2C_QUEUE_DEPTH) {
+        uint8_t tail = (_queueHead[priority] + _queueCount[priority]) % I2C_QUEUE_DEPTH;
+        _queue[priority][tail] = transaction;
+        _queueCount[priority]++;
+        queued = true;
+    }
+
+    portEXIT_CRITICAL(&i2cQueueMux);
+
+    if (coalesced) {
+        _coalescedCount++;
+    }
+
+    return queued;
+}
+
+bool I2CBusManager::popTransaction(uint8_t priority, I2CTransaction& transaction) {
+    bool found = false;
+
+    portENTER_CRITICAL(&i2cQueueMux);
+    if (_queueCount[priority] > 0) {
+        transaction = _queue[priority][_queueHead[priority]];
+        _queueHead[priority] = (_queueHead[priority] + 1) % I2C_QUEUE_DEPTH;
+        _queueCount[priority]--;
+        found = true;
+    }
+    portEXIT_CRITICAL(&i2cQueueMux);
+
+    return found;
+}
+
+bool I2CBusManager::higherPriorityPending(uint8_t priority) {
+    for (uint8_t p = 0; p < priority; p++) {
+        if (_waiting[p] > 0 || _queueCount[p] > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void I2CBusManager::process() {
+    I2CTransaction transaction;
+
+    // Relay writes first, then input reads - both queues are drained
+    for (uint8_t p = I2C_PRIORITY_RELAY; p <= I2C_PRIORITY_INPUT; p++) {
+        while (!higherPriorityPending(p) && popTransaction(p, transaction)) {
+            execute(transaction, p);
+        }
+    }
+
+    // One sensor transaction per call, and only when nothing more urgent is waiting
+    if (!higherPriorityPending(I2C_PRIORITY_SENSOR) && popTransaction(I2C_PRIORITY_SENSOR, transaction)) {
+        execute(transaction, I2C_PRIORITY_SENSOR);
+    }
+
+    // A few scan probes per call at sensor priority
+    if (_scanRunning) {
+        scanStep();
+    }
+}
+
+uint16_t I2CBusManager::startScan() {
+    portENTER_CRITICAL(&i2cQueueMux);
+    if (!_scanRunning) {
+        _scanJobId++;
+        if (_scanJobId == 0) _scanJobId = 1;
+        _scanNextAddress = I2C_FIRST_ADDRESS;
+        _scanRunning = true;
+    }
+    uint16_t jobId = _scanJobId;
+    portEXIT_CRITICAL(&i2cQueueMux);
+
+    return jobId;
+}
+
+uint8_t I2CBusManager::getScanProgress() {
+    if (!_scanRunning) {
+        return _scanJobId == 0 ? 0 : 100;
+    }
+
+    uint8_t done = _scanNextAddress - I2C_FIRST_ADDRESS;
+    return (uint8_t)((done * 100UL) / (I2C_LAST_ADDRESS - I2C_FIRST_ADDRESS + 1));
+}
+
+void I2CBusManager::scanStep() {
+    for (uint8_t i = 0; i < I2C_SCAN_BATCH && _scanNextAddress <= I2C_LAST_ADDRESS; i++) {
+        // Stand aside as soon as relay or input work turns up
+        if (higherPriorityPending(I2C_PRIORITY_SENSOR)) {
+            return;
+        }
+
+        probe(_scanNextAddress, I2C_PRIORITY_SENSOR);
+        _scanNextAddress++;
+    }
+
+    if (_scanNextAddress > I2C_LAST_ADDRESS) {
+        _scanRunning = false;
+        _lastScanTime = millis();
+    }
+}
+
+void I2CBusManager::recordDeviceResult(uint8_t address, bool success) {
+    if (address >= 128) return;
+
+    if (success) {
+        _deviceState[address] = I2C_DEVICE_PRESENT;
+        _deviceFailures[address] = 0;
+        return;
+    }
+
+    if (_deviceFailures[address] < 255) {
+        _deviceFailures[address]++;
+    }
+
+    if (_deviceFailures[address] >= I2C_DEVICE_FAIL_LIMIT) {
+        // Exponential back-off: 1 s, 2 s, 4 s ... capped at I2C_BACKOFF_MAX
+        uint8_t shift = _deviceFailures[address] - I2C_DEVICE_FAIL_LIMIT;
+        unsigned long delayMs = (shift >= 5) ? I2C_BACKOFF_MAX : ((unsigned long)I2C_BACKOFF_BASE << shift);
+        if (delayMs > I2C_BACKOFF_MAX) delayMs = I2C_BACKOFF_MAX;
+
+        _deviceState[address] = I2C_DEVICE_ABSENT;
+        _deviceRetryAt[address] = millis() + delayMs;
+    }
+}
+
+uint8_t I2CBusManager::getDeviceState(uint8_t address) {
+    return address < 128 ? _deviceState[address] : I2C_DEVICE_UNKNOWN;
+}
+
+uint8_t I2CBusManager::getDeviceFailures(uint8_t address) {
+    return address < 128 ? _deviceFailures[address] : 0;
+}
+
+bool I2CBusManager::isDeviceAvailable(uint8_t address) {
+    if (address >= 128) return false;
+    if (_deviceState[address] != I2C_DEVICE_ABSENT) return true;
+
+    // Let one attempt through once the back-off has elapsed
+    return (long)(millis() - _deviceRetryAt[address]) >= 0;
+}
+
+void I2CBusManager::execute(I2CTransaction& transaction, uint8_t priority) {
+    uint8_t rxData[I2C_MAX_TRANSFER];
+
+    acquire(priority);
+    bool success = transferLocked(transaction.address, transaction.txData, transaction.txLength,
+        rxData, transaction.rxLength);
+    _transactionCount[priority]++;
+    release();
+
+    if (transaction.callback != NULL) {
+        transaction.callback(success, rxData, success ? transaction.rxLength : 0, transaction.context);
+    }
+}
+
+bool I2CBusManager::transferLocked(uint8_t address, const uint8_t* txData, uint8_t txLength,
+    uint8_t* rxData, uint8_t rxLength) {
+    bool success = true;
+
+    if (txLength > 0) {
+        Wire.beginTransmission(address);
+        Wire.write(txData, txLength);
+
+        // Keep the bus with a repeated start when a read follows
+        if (Wire.endTransmission(rxLength == 0) != 0) {
+            success = false;
+        }
+    }
+
+    if (success && rxLength > 0) {
+        if (Wire.requestFrom(address, rxLength) != rxLength) {
+            success = false;
+        }
+        else {
+            for (uint8_t i = 0; i < rxLength; i++) {
+                rxData[i] = Wire.read();
+            }
+        }
+    }
+
+    if (!success) {
+        _errorCount++;
+        _lastErrorAddress = address;
+    }
+
+    recordDeviceResult(address, success);
+
+    return success;
+}
+
+unsigned long I2CBusManager::getTransactionCount(uint8_t priority) {
+    if (priority < I2C_PRIORITY_LEVELS) {
+        return _transactionCount[priority];
+    }
+    return 0;
+}
+
+uint8_t I2CBusManager::getQueuedCount(uint8_t priority) {
+    if (priority < I2C_PRIORITY_LEVELS) {
+        return _queueCount[priority];
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+/**
+ * I2CBusManager.h - Shared I2C bus transaction scheduler for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#ifndef I2C_BUS_MANAGER_H
+#define I2C_BUS_MANAGER_H
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Transaction priorities (lower value runs first)
+#define I2C_PRIORITY_RELAY    0  // Relay output writes
+#define I2C_PRIORITY_INPUT    1  // Input expander reads
+#define I2C_PRIORITY_SENSOR   2  // Environmental sensors, RTC, bus scans
+#define I2C_PRIORITY_LEVELS   3
+
+// Queue sizing
+#define I2C_QUEUE_DEPTH       8  // Queued transactions per priority
+#define I2C_MAX_TRANSFER      8  // Largest queued write or read (bytes)
+
+// Background bus scan
+#define I2C_FIRST_ADDRESS     0x01
+#define I2C_LAST_ADDRESS      0x7E
+#define I2C_SCAN_BATCH        4  // Addresses probed per process() call
+
+// Device presence map
+#define I2C_DEVICE_UNKNOWN    0  // Never seen on the bus
+#define I2C_DEVICE_PRESENT    1  // Acknowledged its last transfer or probe
+#define I2C_DEVICE_ABSENT     2  // Missing or failing - skipped until its retry time
+#define I2C_DEVICE_FAIL_LIMIT 3      // Consecutive failures before a device counts as absent
+#define I2C_BACKOFF_BASE      1000   // First retry delay for an absent device (ms)
+#define I2C_BACKOFF_MAX       30000  // Longest retry delay (ms)
+
+// Called from process() when a queued transaction completes
+typedef void (*I2CCompletionCallback)(bool success, const uint8_t* data, uint8_t length, void* context);
+
+// Queued bus transaction: optional write followed by optional read
+struct I2CTransaction {
+    uint8_t address;                    // 7-bit device address
+    uint8_t txData[I2C_MAX_TRANSFER];   // Bytes to write (register pointer first)
+    uint8_t txLength;                   // Number of bytes to write
+    uint8_t rxLength;                   // Number of bytes to read after the write
+    I2CCompletionCallback callback;     // Completion handler (may be NULL)
+    void* context;                      // Passed back to the callback
+};
+
+class I2CBusManager {
+public:
+    I2CBusManager();
+
+    // Initialize Wire on the given pins; the bus manager owns Wire from here on
+    void begin(int sdaPin, int sclPin, uint32_t frequency);
+
+    // Immediate transfers - take the bus as soon as it is free. Relay and
+    // input expander traffic (HardwareManager) uses these and so pre-empts the
+    // queues: the priority only makes queued and scan work stand aside while
+    // such a transfer is waiting (it is not queued behind anything)
+    bool write(uint8_t address, const uint8_t* data, uint8_t length, uint8_t priority);
+    bool read(uint8_t address, uint8_t* data, uint8_t length, uint8_t priority);
+    bool writeRead(uint8_t address, const uint8_t* txData, uint8_t txLength,
+        uint8_t* rxData, uint8_t rxLength, uint8_t priority);
+
+    // Check whether a device acknowledges its address
+    bool probe(uint8_t address, uint8_t priority = I2C_PRIORITY_SENSOR);
+
+    // Queue a transaction to run from process(). A whole-byte write (one
+    // byte, no register pointer, e.g. an expander port) replaces the previous
+    // one to the same device only when no other transfer to that device is
+    // queued after it, so register writes are never reordered
+    bool submit(const I2CTransaction& transaction, uint8_t priority);
+
+    // Run queued transactions: relay and input queues are drained, the sensor
+    // queue yields after one transaction so it never holds up a relay command
+    void process();
+
+    // Start a background scan of the whole bus, run a few addresses at a time
+    // from process(); returns the job id (a scan already running keeps its id)
+    uint16_t startScan();
+    bool isScanRunning() { return _scanRunning; }
+    uint16_t getScanJobId() { return _scanJobId; }
+    uint8_t getScanProgress();  // Percent of the address range probed
+    unsigned long getLastScanTime() { return _lastScanTime; }
+
+    // Device presence map, updated by scans and by every transfer
+    uint8_t getDeviceState(uint8_t address);
+    uint8_t getDeviceFailures(uint8_t address);
+    bool isDevicePresent(uint8_t address) { return getDeviceState(address) == I2C_DEVICE_PRESENT; }
+
+    // False while an absent device is backing off - callers skip it instead
+    // of waiting for a timeout on every access
+    bool isDeviceAvailable(uint8_t address);
+
+    // Exclusive bus access for libraries that talk to Wire directly (RTClib)
+    void acquire(uint8_t priority);
+    void release();
+
+    // Diagnostics
+    unsigned long getTransactionCount(uint8_t priority);
+    unsigned long getErrorCount() { return _errorCount; }
+    unsigned long getCoalescedCount() { return _coalescedCount; }
+    uint8_t getQueuedCount(uint8_t priority);
+    uint8_t getLastErrorAddress() { return _lastErrorAddress; }
+
+private:
+    SemaphoreHandle_t _busMutex;
+
+    // Tasks currently waiting for the bus at each priority
+    volatile uint8_t _waiting[I2C_PRIORITY_LEVELS];
+
+    // Ring buffer per priority
+    I2CTransaction _queue[I2C_PRIORITY_LEVELS][I2C_QUEUE_DEPTH];
+    uint8_t _queueHead[I2C_PRIORITY_LEVELS];
+    uint8_t _queueCount[I2C_PRIORITY_LEVELS];
+
+    // Statistics
+    unsigned long _transactionCount[I2C_PRIORITY_LEVELS];
+    unsigned long _errorCount;
+    unsigned long _coalescedCount;
+    uint8_t _lastErrorAddress;
+
+    // Presence map, indexed by 7-bit address
+    uint8_t _deviceState[128];
+    uint8_t _deviceFailures[128];
+    unsigned long _deviceRetryAt[128];
+
+    // Background scan job
+    volatile bool _scanRunning;
+    uint16_t _scanJobId;
+    uint8_t _scanNextAddress;
+    unsigned long _lastScanTime;
+
+    // Take the next queued transaction of a priority
+    bool popTransaction(uint8_t priority, I2CTransaction& transaction);
+
+    // True if anything of higher priority is queued or waiting
+    bool higherPriorityPending(uint8_t priority);
+
+    // Run a queued transaction and call its completion handler
+    void execute(I2CTransaction& transaction, uint8_t priority);
+
+    // Probe the next batch of addresses of the running scan
+    void scanStep();
+
+    // Update the presence map after a transfer or probe
+    void recordDeviceResult(uint8_t address, bool success);
+
+    // Perform the Wire operations; bus must be held
+    bool transferLocked(uint8_t address, const uint8_t* txData, uint8_t txLength,
+        uint8_t* rxData, uint8_t rxLength);
+};
+
+#endif // I2C_BUS_MANAGER_H
@@ -0,0 +1,369 @@
+/**
+ * I2CSensors.cpp - SHT3x and BME280 environmental sensor drivers for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#include "I2CSensors.h"
+
+// SHT3x commands
+#define SHT3X_CMD_SOFT_RESET_MSB   0x30
+#define SHT3X_CMD_SOFT_RESET_LSB   0xA2
+#define SHT3X_CMD_MEASURE_MSB      0x24  // Single shot, no clock stretching
+#define SHT3X_CMD_MEASURE_LSB      0x00  // High repeatability
+
+// BME280 registers
+#define BME280_REG_CALIB_00        0x88
+#define BME280_REG_CHIP_ID         0xD0
+#define BME280_REG_CALIB_26        0xE1
+#define BME280_REG_CTRL_HUM        0xF2
+#define BME280_REG_CTRL_MEAS       0xF4
+#define BME280_REG_CONFIG          0xF5
+#define BME280_REG_DATA            0xF7
+#define BME280_CHIP_ID             0x60
+#define BMP280_CHIP_ID             0x58
+#define BME280_CTRL_MEAS_FORCED    0x25  // Temperature x1, pressure x1, forced mode
+
+// ------------------------------------------------------------------------
+// SHT3x
+// ------------------------------------------------------------------------
+
+SHT3xSensor::SHT3xSensor(I2CBusManager& i2cBus, uint8_t address) :
+    _i2cBus(i2cBus),
+    _address(address),
+    _present(false),
+    _state(I2C_SENSOR_IDLE),
+    _interval(I2C_SENSOR_READ_INTERVAL),
+    _lastStart(0),
+    _conversionStart(0),
+    _temperature(0),
+    _humidity(0),
+    _lastGoodReadTime(0),
+    _errorCount(0)
+{
+}
+
+bool SHT3xSensor::begin() {
+    _present = _i2cBus.probe(_address);
+
+    if (_present) {
+        const uint8_t reset[2] = { SHT3X_CMD_SOFT_RESET_MSB, SHT3X_CMD_SOFT_RESET_LSB };
+        _i2cBus.write(_address, reset, 2, I2C_PRIORITY_SENSOR);
+        Serial.printf("SHT3x found at 0x%02X\n", _address);
+    }
+
+    _state = I2C_SENSOR_IDLE;
+    return _present;
+}
+
+void SHT3xSensor::update() {
+    if (!_present) return;
+
+    unsigned long now = millis();
+
+    switch (_state) {
+    case I2C_SENSOR_IDLE:
+        if (_lastStart == 0 || now - _lastStart >= _interval) {
+            I2CTransaction txn;
+            txn.address = _address;
+            txn.txData[0] = SHT3X_CMD_MEASURE_MSB;
+            txn.txData[1] = SHT3X_CMD_MEASURE_LSB;
+            txn.txLength = 2;
+            txn.rxLength = 0;
+            txn.callback = onTriggered;
+            txn.context = this;
+
+            if (_i2cBus.submit(txn, I2C_PRIORITY_SENSOR)) {
+                _lastStart = now;
+                _state = I2C_SENSOR_TRIGGERING;
+            }
+        }
+        break;
+
+    case I2C_SENSOR_CONVERTING:
+        if (now - _conversionStart >= SHT3X_CONVERSION_TIME) {
+            I2CTransaction txn;
+            txn.address = _address;
+            txn.txLength = 0;
+            txn.rxLength = 6;
+            txn.callback = onDataRead;
+            txn.context = this;
+
+            if (_i2cBus.submit(txn, I2C_PRIORITY_SENSOR)) {
+                _state = I2C_SENSOR_READING;
+            }
+        }
+        break;
+
+    default:
+        // Waiting for the bus to run the queued transaction
+        break;
+    }
+}
+
+void SHT3xSensor::onTriggered(bool success, const uint8_t* data, uint8_t length, void* context) {
+    SHT3xSensor* sensor = static_cast<SHT3xSensor*>(context);
+
+    if (success) {
+        sensor->_conversionStart = millis();
+        sensor->_state = I2C_SENSOR_CONVERTING;
+    }
+    else {
+        sensor->_errorCount++;
+        sensor->_state = I2C_SENSOR_IDLE;
+    }
+}
+
+void SHT3xSensor::onDataRead(bool success, const uint8_t* data, uint8_t length, void* context) {
+    SHT3xSensor* sensor = static_cast<SHT3xSensor*>(context);
+    sensor->_state = I2C_SENSOR_IDLE;
+
+    // Each 16-bit word is followed by its CRC
+    if (!success || length != 6 || crc8(data, 2) != data[2] || crc8(data + 3, 2) != data[5]) {
+        sensor->_errorCount++;
+        return;
+    }
+
+    uint16_t rawTemperature = ((uint16_t)data[0] << 8) | data[1];
+    uint16_t rawHumidity = ((uint16_t)data[3] << 8) | data[4];
+
+    sensor->_temperature = -45.0f + 175.0f * rawTemperature / 65535.0f;
+    sensor->_humidity = 100.0f * rawHumidity / 65535.0f;
+    sensor->_lastGoodReadTime = millis();
+}
+
+uint8_t SHT3xSensor::crc8(const uint8_t* data, uint8_t length) {
+    uint8_t crc = 0xFF;
+
+    for (uint8_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+// ------------------------------------------------------------------------
+// BME280
+// ------------------------------------------------------------------------
+
+BME280Sensor::BME280Sensor(I2CBusManager& i2cBus, uint8_t address) :
+    _i2cBus(i2cBus),
+    _address(address),
+    _present(false),
+    _hasHumidity(false),
+    _state(I2C_SENSOR_IDLE),
+    _interval(I2C_SENSOR_READ_INTERVAL),
+    _lastStart(0),
+    _conversionStart(0),
+    _temperature(0),
+    _humidity(0),
+    _pressure(0),
+    _lastGoodReadTime(0),
+    _errorCount(0)
+{
+}
+
+bool BME280Sensor::begin() {
+    _present = false;
+
+    if (!_i2cBus.probe(_address)) {
+        return false;
+    }
+
+    // Identify the chip
+    uint8_t reg = BME280_REG_CHIP_ID;
+    uint8_t chipId = 0;
+    if (!_i2cBus.writeRead(_address, &reg, 1, &chipId, 1, I2C_PRIORITY_SENSOR)) {
+        return false;
+    }
+
+    if (chipId != BME280_CHIP_ID && chipId != BMP280_CHIP_ID) {
+        Serial.printf("Device at 0x%02X is not a BME280/BMP280 (id 0x%02X)\n", _address, chipId);
+        return false;
+    }
+    _hasHumidity = (chipId == BME280_CHIP_ID);
+
+    if (!readCalibration()) {
+        Serial.println("Failed to read BME280 calibration");
+        return false;
+    }
+
+    // Humidity oversampling x1 (takes effect on the next ctrl_meas write), no IIR filter
+    const uint8_t ctrlHum[2] = { BME280_REG_CTRL_HUM, 0x01 };
+    const uint8_t config[2] = { BME280_REG_CONFIG, 0x00 };
+    _i2cBus.write(_address, ctrlHum, 2, I2C_PRIORITY_SENSOR);
+    _i2cBus.write(_address, config, 2, I2C_PRIORITY_SENSOR);
+
+    _present = true;
+    _state = I2C_SENSOR_IDLE;
+    Serial.printf("%s found at 0x%02X\n", _hasHumidity ? "BME280" : "BMP280", _address);
+    return true;
+}
+
+bool BME280Sensor::readCalibration() {
+    uint8_t calib[26];
+    uint8_t reg = BME280_REG_CALIB_00;
+    if (!_i2cBus.writeRead(_address, &reg, 1, calib, 26, I2C_PRIORITY_SENSOR)) {
+        return false;
+    }
+
+    _digT1 = (uint16_t)(calib[1] << 8 | calib[0]);
+    _digT2 = (int16_t)(calib[3] << 8 | calib[2]);
+    _digT3 = (int16_t)(calib[5] << 8 | calib[4]);
+    _digP1 = (uint16_t)(calib[7] << 8 | calib[6]);
+    _digP2 = (int16_t)(calib[9] << 8 | calib[8]);
+    _digP3 = (int16_t)(calib[11] << 8 | calib[10]);
+    _digP4 = (int16_t)(calib[13] << 8 | calib[12]);
+    _digP5 = (int16_t)(calib[15] << 8 | calib[14]);
+    _digP6 = (int16_t)(calib[17] << 8 | calib[16]);
+    _digP7 = (int16_t)(calib[19] << 8 | calib[18]);
+    _digP8 = (int16_t)(calib[21] << 8 | calib[20]);
+    _digP9 = (int16_t)(calib[23] << 8 | calib[22]);
+    _digH1 = calib[25];
+
+    if (_hasHumidity) {
+        uint8_t hcalib[7];
+        reg = BME280_REG_CALIB_26;
+        if (!_i2cBus.writeRead(_address, &reg, 1, hcalib, 7, I2C_PRIORITY_SENSOR)) {
+            return false;
+        }
+
+        _digH2 = (int16_t)(hcalib[1] << 8 | hcalib[0]);
+        _digH3 = hcalib[2];
+        _digH4 = (int16_t)(((int8_t)hcalib[3] << 4) | (hcalib[4] & 0x0F));
+        _digH5 = (int16_t)(((int8_t)hcalib[5] << 4) | (hcalib[4] >> 4));
+        _digH6 = (int8_t)hcalib[6];
+    }
+
+    return true;
+}
+
+void BME280Sensor::update() {
+    if (!_present) return;
+
+    unsigned long now = millis();
+
+    switch (_state) {
+    case I2C_SENSOR_IDLE:
+        if (_lastStart == 0 || now - _lastStart >= _interval) {
+            I2CTransaction txn;
+            txn.address = _address;
+            txn.txData[0] = BME280_REG_CTRL_MEAS;
+            txn.txData[1] = BME280_CTRL_MEAS_FORCED;
+            txn.txLength = 2;
+            txn.rxLength = 0;
+            txn.callback = onTriggered;
+            txn.context = this;
+
+            if (_i2cBus.submit(txn, I2C_PRIORITY_SENSOR)) {
+                _lastStart = now;
+                _state = I2C_SENSOR_TRIGGERING;
+            }
+        }
+        break;
+
+    case I2C_SENSOR_CONVERTING:
+        if (now - _conversionStart >= BME280_CONVERSION_TIME) {
+            // Burst read pressure, temperature and humidity (0xF7-0xFE)
+            I2CTransaction txn;
+            txn.address = _address;
+            txn.txData[0] = BME280_REG_DATA;
+            txn.txLength = 1;
+            txn.rxLength = 8;
+            txn.callback = onDataRead;
+            txn.context = this;
+
+            if (_i2cBus.submit(txn, I2C_PRIORITY_SENSOR)) {
+                _state = I2C_SENSOR_READING;
+            }
+        }
+        break;
+
+    default:
+        // Waiting for the bus to run the queued transaction
+        break;
+    }
+}
+
+void BME280Sensor::onTriggered(bool success, const uint8_t* data, uint8_t length, void* context) {
+    BME280Sensor* sensor = static_cast<BME280Sensor*>(context);
+
+    if (success) {
+        sensor->_conversionStart = millis();
+        sensor->_state = I2C_SENSOR_CONVERTING;
+    }
+    else {
+        sensor->_errorCount++;
+        sensor->_state = I2C_SENSOR_IDLE;
+    }
+}
+
+void BME280Sensor::onDataRead(bool success, const uint8_t* data, uint8_t length, void* context) {
+    BME280Sensor* sensor = static_cast<BME280Sensor*>(context);
+    sensor->_state = I2C_SENSOR_IDLE;
+
+    if (!success || length != 8) {
+        sensor->_errorCount++;
+        return;
+    }
+
+    int32_t adcP = ((int32_t)data[0] << 12) | ((int32_t)data[1] << 4) | (data[2] >> 4);
+    int32_t adcT = ((int32_t)data[3] << 12) | ((int32_t)data[4] << 4) | (data[5] >> 4);
+    int32_t adcH = ((int32_t)data[6] << 8) | data[7];
+
+    // 0x80000 is the reset value when a measurement was skipped
+    if (adcT == 0x80000) {
+        sensor->_errorCount++;
+        return;
+    }
+
+    int32_t tFine;
+    sensor->_temperature = sensor->compensateTemperature(adcT, tFine) / 100.0f;
+    sensor->_pressure = sensor->compensatePressure(adcP, tFine) / 25600.0f;  // Q24.8 Pa -> hPa
+    if (sensor->_hasHumidity) {
+        sensor->_humidity = sensor->compensateHumidity(adcH, tFine) / 1024.0f;
+    }
+    sensor->_lastGoodReadTime = millis();
+}
+
+int32_t BME280Sensor::compensateTemperature(int32_t adcT, int32_t& tFine) {
+    int32_t var1 = ((((adcT >> 3) - ((int32_t)_digT1 << 1))) * ((int32_t)_digT2)) >> 11;
+    int32_t var2 = (((((adcT >> 4) - ((int32_t)_digT1)) * ((adcT >> 4) - ((int32_t)_digT1))) >> 12) *
+        ((int32_t)_digT3)) >> 14;
+    tFine = var1 + var2;
+    return (tFine * 5 + 128) >> 8;  // 0.01 degC
+}
+
+uint32_t BME280Sensor::compensatePressure(int32_t adcP, int32_t tFine) {
+    int64_t var1 = ((int64_t)tFine) - 128000;
+    int64_t var2 = var1 * var1 * (int64_t)_digP6;
+    var2 = var2 + ((var1 * (int64_t)_digP5) << 17);
+    var2 = var2 + (((int64_t)_digP4) << 35);
+    var1 = ((var1 * var1 * (int64_t)_digP3) >> 8) + ((var1 * (int64_t)_digP2) << 12);
+    var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)_digP1) >> 33;
+
+    if (var1 == 0) {
+        return 0;  // Avoid division by zero
+    }
+
+    int64_t p = 1048576 - adcP;
+    p = (((p << 31) - var2) * 3125) / var1;
+    var1 = (((int64_t)_digP9) * (p >> 13) * (p >> 13)) >> 25;
+    var2 = (((int64_t)_digP8) * p) >> 19;
+    p = ((p + var1 + var2) >> 8) + (((int64_t)_digP7) << 4);
+    return (uint32_t)p;  // Q24.8 Pa
+}
+
+uint32_t BME280Sensor::compensateHumidity(int32_t adcH, int32_t tFine) {
+    int32_t v = tFine - ((int32_t)76800);
+    v = (((((adcH << 14) - (((int32_t)_digH4) << 20) - (((int32_t)_digH5) * v)) + ((int32_t)16384)) >> 15) *
+        (((((((v * ((int32_t)_digH6)) >> 10) * (((v * ((int32_t)_digH3)) >> 11) + ((int32_t)32768))) >> 10) +
+            ((int32_t)2097152)) * ((int32_t)_digH2) + 8192) >> 14));
+    v = (v - (((((v >> 15) * (v >> 15)) >> 7) * ((int32_t)_digH1)) >> 4));
+    v = (v < 0 ? 0 : v);
+    v = (v > 419430400 ? 419430400 : v);
+    return (uint32_t)(v >> 12);  // Q22.10 %RH
+}
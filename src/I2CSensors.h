@@ -0,0 +1,128 @@
+/**
+ * I2CSensors.h - SHT3x and BME280 environmental sensor drivers for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#ifndef I2C_SENSORS_H
+#define I2C_SENSORS_H
+
+#include <Arduino.h>
+#include "I2CBusManager.h"
+
+// Default addresses
+#define SHT3X_DEFAULT_ADDRESS    0x44
+#define BME280_DEFAULT_ADDRESS   0x76
+
+// Measurement timing (ms)
+#define SHT3X_CONVERSION_TIME    16   // Single shot, high repeatability
+#define BME280_CONVERSION_TIME   10   // Forced mode, 1x oversampling
+#define I2C_SENSOR_READ_INTERVAL 2000 // Default time between measurements
+
+// Driver states - each step is one short bus transaction, conversions are
+// waited out with millis() so the bus is free for relays in between
+#define I2C_SENSOR_IDLE          0    // Waiting for the next measurement
+#define I2C_SENSOR_TRIGGERING    1    // Start command queued
+#define I2C_SENSOR_CONVERTING    2    // Sensor is measuring
+#define I2C_SENSOR_READING       3    // Result read queued
+
+// Sensirion SHT30/SHT31/SHT35 temperature and humidity sensor
+class SHT3xSensor {
+public:
+    SHT3xSensor(I2CBusManager& i2cBus, uint8_t address = SHT3X_DEFAULT_ADDRESS);
+
+    // Probe for the sensor and soft-reset it
+    bool begin();
+
+    // Advance the measurement state machine (call often, never blocks)
+    void update();
+
+    bool isPresent() { return _present; }
+    bool hasReading() { return _lastGoodReadTime != 0; }
+    float getTemperature() { return _temperature; }
+    float getHumidity() { return _humidity; }
+    unsigned long getLastReadTime() { return _lastGoodReadTime; }
+    unsigned long getErrorCount() { return _errorCount; }
+    uint8_t getAddress() { return _address; }
+    void setInterval(unsigned long interval) { _interval = interval; }
+
+private:
+    I2CBusManager& _i2cBus;
+    uint8_t _address;
+    bool _present;
+    uint8_t _state;
+    unsigned long _interval;
+    unsigned long _lastStart;
+    unsigned long _conversionStart;
+    float _temperature;
+    float _humidity;
+    unsigned long _lastGoodReadTime;
+    unsigned long _errorCount;
+
+    // Completion handlers for queued bus transactions
+    static void onTriggered(bool success, const uint8_t* data, uint8_t length, void* context);
+    static void onDataRead(bool success, const uint8_t* data, uint8_t length, void* context);
+
+    // Sensirion CRC-8 (polynomial 0x31, init 0xFF)
+    static uint8_t crc8(const uint8_t* data, uint8_t length);
+};
+
+// Bosch BME280 (or BMP280 without humidity) environmental sensor
+class BME280Sensor {
+public:
+    BME280Sensor(I2CBusManager& i2cBus, uint8_t address = BME280_DEFAULT_ADDRESS);
+
+    // Probe for the sensor, read its calibration and configure it
+    bool begin();
+
+    // Advance the measurement state machine (call often, never blocks)
+    void update();
+
+    bool isPresent() { return _present; }
+    bool hasHumidity() { return _hasHumidity; }
+    bool hasReading() { return _lastGoodReadTime != 0; }
+    float getTemperature() { return _temperature; }
+    float getHumidity() { return _humidity; }
+    float getPressure() { return _pressure; }  // hPa
+    unsigned long getLastReadTime() { return _lastGoodReadTime; }
+    unsigned long getErrorCount() { return _errorCount; }
+    uint8_t getAddress() { return _address; }
+    void setInterval(unsigned long interval) { _interval = interval; }
+
+private:
+    I2CBusManager& _i2cBus;
+    uint8_t _address;
+    bool _present;
+    bool _hasHumidity;
+    uint8_t _state;
+    unsigned long _interval;
+    unsigned long _lastStart;
+    unsigned long _conversionStart;
+    float _temperature;
+    float _humidity;
+    float _pressure;
+    unsigned long _lastGoodReadTime;
+    unsigned long _errorCount;
+
+    // Factory calibration
+    uint16_t _digT1;
+    int16_t _digT2, _digT3;
+    uint16_t _digP1;
+    int16_t _digP2, _digP3, _digP4, _digP5, _digP6, _digP7, _digP8, _digP9;
+    uint8_t _digH1, _digH3;
+    int16_t _digH2, _digH4, _digH5;
+    int8_t _digH6;
+
+    bool readCalibration();
+
+    // Compensation formulas from the BME280 datasheet
+    int32_t compensateTemperature(int32_t adcT, int32_t& tFine);
+    uint32_t compensatePressure(int32_t adcP, int32_t tFine);
+    uint32_t compensateHumidity(int32_t adcH, int32_t tFine);
+
+    // Completion handlers for queued bus transactions
+    static void onTriggered(bool success, const uint8_t* data, uint8_t length, void* context);
+    static void onDataRead(bool success, const uint8_t* data, uint8_t length, void* context);
+};
+
+#endif // I2C_SENSORS_H
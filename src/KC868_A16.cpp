@@ -11,15 +11,15 @@
 const String KC868_A16::FIRMWARE_VERSION = ::FIRMWARE_VERSION;
 
 KC868_A16::KC868_A16() :
-    _hardwareManager(),
+    _i2cBusManager(),
+    _hardwareManager(_i2cBusManager),
     _networkManager(),
-    _sensorManager(),
+    _sensorManager(_i2cBusManager),
     _configManager(),
-    _commManager(),
-    _scheduleManager(_hardwareManager, _sensorManager),
+    _commManager(_i2cBusManager),
+    _scheduleManager(_hardwareManager, _sensorManager, _commManager),
     _interruptManager(_hardwareManager, _scheduleManager),
     _webServerManager(_hardwareManager, _networkManager, _sensorManager, _scheduleManager, _configManager, _commManager, _interruptManager),
-    _lastWebSocketUpdate(0),
     _lastInputsCheck(0),
     _lastAnalogCheck(0),
     _lastSensorCheck(0),
@@ -45,15 +45,25 @@ void KC868_A16::begin() {
     // Initialize file system
     _webServerManager.initFileSystem();
 
+    // Initialize the shared I2C bus (50kHz for more reliable communication)
+    _i2cBusManager.begin(SDA_PIN, SCL_PIN, 50000);
+
     // Initialize hardware
     _hardwareManager.begin();
 
+    // Populate the I2C presence map in the background
+    _i2cBusManager.startScan();
+
     // Initialize HT sensors
     _sensorManager.begin();
 
     // Initialize RTC
     _sensorManager.initRTC();
 
+    // Load schedules, analog triggers and control loops, and register the
+    // sensor thresholds (needs the sensor manager started above)
+    _scheduleManager.begin();
+
     // Reset Ethernet controller
     _networkManager.resetEthernet();
 
@@ -125,13 +135,18 @@ void KC868_A16::loop() {
         _lastInputsCheck = currentMillis;
         bool inputsChanged = _hardwareManager.readInputs();
 
-        // If inputs changed, broadcast immediately
+        // If inputs changed, broadcast as soon as the rate limit allows
         if (inputsChanged) {
-            _webServerManager.broadcastUpdate();
-            _lastWebSocketUpdate = currentMillis;
+            _webServerManager.requestBroadcast();
         }
     }
 
+    // Run queued I2C transactions, re-send relay states owed to a recovered
+    // output expander and advance the I2C sensor drivers
+    _i2cBusManager.process();
+    _hardwareManager.update();
+    _sensorManager.updateI2CSensors();
+
     // Read HT sensors periodically
     if (currentMillis - _lastSensorCheck >= 1000) { // Check sensors every second
         _lastSensorCheck = currentMillis;
@@ -147,9 +162,8 @@ void KC868_A16::loop() {
         if (analogChanged) {
             _scheduleManager.checkAnalogTriggers();
 
-            // Broadcast immediately if analog values changed
-            _webServerManager.broadcastUpdate();
-            _lastWebSocketUpdate = currentMillis;
+            // Broadcast as soon as the rate limit allows
+            _webServerManager.requestBroadcast();
         }
     }
 
@@ -159,15 +173,21 @@ void KC868_A16::loop() {
         _networkManager.checkNetworkStatus();
     }
 
-    // Broadcast periodic updates even if no changes
-    if (currentMillis - _lastWebSocketUpdate >= 1000) {
-        _webServerManager.broadcastUpdate();
-        _lastWebSocketUpdate = currentMillis;
-    }
+    // Send the coalesced WebSocket update (or the periodic one when idle)
+    _webServerManager.serviceBroadcasts();
 
     // Process commands based on active communication protocol
     _commManager.processCommands();
 
+    // Values polled from Modbus slaves drive the analog triggers like the local inputs
+    if (_commManager.takeVirtualChanges()) {
+        _scheduleManager.checkAnalogTriggers();
+        _webServerManager.requestBroadcast();
+    }
+
+    // Run thermostat and PID control loops (each loop keeps its own fixed rate)
+    _scheduleManager.runControlLoops();
+
     // Check schedules every second
     if (currentMillis - _lastTimeCheck >= 1000) {
         _lastTimeCheck = currentMillis;
@@ -8,6 +8,7 @@
 #define KC868_A16_H
 
 #include <Arduino.h>
+#include "I2CBusManager.h"
 #include "HardwareManager.h"
 #include "NetworkManager.h" // Will be included as KC868NetworkManager
 #include "WebServerManager.h"
@@ -30,6 +31,7 @@ public:
 
     // Access to managers
     HardwareManager* hardware() { return &_hardwareManager; }
+    I2CBusManager* i2cBus() { return &_i2cBusManager; }
     KC868NetworkManager* network() { return &_networkManager; }
     WebServerManager* server() { return &_webServerManager; }
     ScheduleManager* scheduler() { return &_scheduleManager; }
@@ -48,6 +50,7 @@ public:
 
 private:
     // Manager instances
+    I2CBusManager _i2cBusManager;       // Shared I2C bus, constructed first
     HardwareManager _hardwareManager;
     KC868NetworkManager _networkManager; // Updated to use the renamed class
     SensorManager _sensorManager;
@@ -58,7 +61,6 @@ private:
     WebServerManager _webServerManager; // Moved after all dependencies
 
     // Timer variables for periodic operations
-    unsigned long _lastWebSocketUpdate;
     unsigned long _lastInputsCheck;
     unsigned long _lastAnalogCheck;
     unsigned long _lastSensorCheck;
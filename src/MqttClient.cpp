@@ -0,0 +1,483 @@
+/**
+ * MqttClient.cpp - Non-blocking MQTT 3.1.1 client for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#include "MqttClient.h"
+
+MqttClient::MqttClient() :
+    _port(1883),
+    _keepAlive(30),
+    _handler(NULL),
+    _handlerContext(NULL),
+    _state(MQTT_STATE_DISABLED),
+    _stateSince(0),
+    _retryDelay(MQTT_RETRY_MIN),
+    _sessionStart(false),
+    _tcpConnected(false),
+    _tcpClosed(false),
+    _rxOverflow(false),
+    _rxQueued(0),
+    _packetLength(0),
+    _txLength(0),
+    _lastSend(0),
+    _lastReceive(0),
+    _pingPending(false),
+    _nextPacketId(1),
+    _sessions(0),
+    _failedConnects(0),
+    _published(0),
+    _dropped(0),
+    _received(0),
+    _bytesSent(0),
+    _lastConnackCode(0)
+{
+    _host[0] = '\0';
+    _clientId[0] = '\0';
+    _user[0] = '\0';
+    _password[0] = '\0';
+    _willTopic[0] = '\0';
+    _willPayload[0] = '\0';
+    _rxMux = portMUX_INITIALIZER_UNLOCKED;
+
+    _client.onConnect(onTcpConnect, this);
+    _client.onDisconnect(onTcpDisconnect, this);
+    _client.onData(onTcpData, this);
+}
+
+void MqttClient::setServer(const char* host, uint16_t port) {
+    strlcpy(_host, host, sizeof(_host));
+    _port = port;
+}
+
+void MqttClient::setCredentials(const char* clientId, const char* user, const char* password) {
+    strlcpy(_clientId, clientId, sizeof(_clientId));
+    strlcpy(_user, user, sizeof(_user));
+    strlcpy(_password, password, sizeof(_password));
+}
+
+void MqttClient::setWill(const char* topic, const char* payload) {
+    strlcpy(_willTopic, topic, sizeof(_willTopic));
+    strlcpy(_willPayload, payload, sizeof(_willPayload));
+}
+
+void MqttClient::setKeepAlive(uint16_t seconds) {
+    _keepAlive = seconds;
+}
+
+void MqttClient::onMessage(MqttMessageHandler handler, void* context) {
+    _handler = handler;
+    _handlerContext = context;
+}
+
+void MqttClient::begin() {
+    if (_state != MQTT_STATE_DISABLED) return;
+
+    // Connect on the first loop()
+    _retryDelay = 0;
+    setState(MQTT_STATE_WAITING, millis());
+}
+
+void MqttClient::end() {
+    if (_state == MQTT_STATE_CONNECTED) {
+        // Clean disconnect after what is already queued, so the broker does
+        // not publish the last will
+        if (beginPacket(MQTT_DISCONNECT, 0)) {
+            flush();
+        }
+    }
+    if (_state >= MQTT_STATE_CONNECTING) {
+        _client.close();
+    }
+
+    _txLength = 0;
+    _packetLength = 0;
+    setState(MQTT_STATE_DISABLED, millis());
+}
+
+const char* MqttClient::getStateName() {
+    switch (_state) {
+    case MQTT_STATE_WAITING:    return "Waiting to reconnect";
+    case MQTT_STATE_CONNECTING: return "Connecting";
+    case MQTT_STATE_HANDSHAKE:  return "Handshake";
+    case MQTT_STATE_CONNECTED:  return "Connected";
+    }
+    return "Disabled";
+}
+
+bool MqttClient::takeSessionStart() {
+    bool start = _sessionStart;
+    _sessionStart = false;
+    return start;
+}
+
+void MqttClient::setState(uint8_t state, unsigned long now) {
+    _state = state;
+    _stateSince = now;
+}
+
+void MqttClient::loop() {
+    unsigned long now = millis();
+
+    switch (_state) {
+    case MQTT_STATE_DISABLED:
+        return;
+
+    case MQTT_STATE_WAITING:
+        if (now - _stateSince >= _retryDelay) {
+            startConnect(now);
+        }
+        return;
+
+    case MQTT_STATE_CONNECTING:
+        if (_tcpClosed) {
+            closeSession(now, true);
+        }
+        else if (_tcpConnected) {
+            sendConnect();
+            setState(MQTT_STATE_HANDSHAKE, now);
+            _lastReceive = now;
+        }
+        else if (now - _stateSince >= MQTT_CONNECT_TIMEOUT) {
+            _client.close(true);
+            closeSession(now, true);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (_state < MQTT_STATE_HANDSHAKE) return;
+
+    if (_tcpClosed || _rxOverflow) {
+        if (_rxOverflow) {
+            _client.close(true);
+        }
+        closeSession(now, _state == MQTT_STATE_HANDSHAKE);
+        return;
+    }
+
+    readPackets(now);
+    if (_state < MQTT_STATE_HANDSHAKE) return;
+
+    if (_state == MQTT_STATE_HANDSHAKE && now - _stateSince >= MQTT_CONNECT_TIMEOUT) {
+        _client.close(true);
+        closeSession(now, true);
+        return;
+    }
+
+    if (_state == MQTT_STATE_CONNECTED && _keepAlive > 0) {
+        unsigned long keepAlive = (unsigned long)_keepAlive * 1000;
+
+        // The broker must answer within the keep-alive; a silent one is gone
+        if (now - _lastReceive > keepAlive + keepAlive / 2) {
+            _client.close(true);
+            closeSession(now, false);
+            return;
+        }
+        if (!_pingPending && now - _lastSend >= keepAlive / 2 && beginPacket(MQTT_PINGREQ, 0)) {
+            _pingPending = true;
+        }
+    }
+
+    flush();
+}
+
+void MqttClient::startConnect(unsigned long now) {
+    _tcpConnected = false;
+    _tcpClosed = false;
+    _rxOverflow = false;
+    _rxQueued = 0;
+    _packetLength = 0;
+    _txLength = 0;
+    _pingPending = false;
+
+    setState(MQTT_STATE_CONNECTING, now);
+
+    // Resolves the host name and connects from the AsyncTCP task
+    if (_host[0] == '\0' || !_client.connect(_host, _port)) {
+        closeSession(now, true);
+    }
+}
+
+// Drop the session and wait before the next attempt; failed connects back
+// off up to MQTT_RETRY_MAX, a session that was up retries quickly
+void MqttClient::closeSession(unsigned long now, bool failed) {
+    if (failed) {
+        _failedConnects++;
+        _retryDelay = (_retryDelay == 0) ? MQTT_RETRY_MIN : _retryDelay * 2;
+        if (_retryDelay > MQTT_RETRY_MAX) _retryDelay = MQTT_RETRY_MAX;
+    }
+    else {
+        _retryDelay = MQTT_RETRY_MIN;
+    }
+
+    // QoS 0: whatever was still queued is lost with the session
+    _txLength = 0;
+    _packetLength = 0;
+    setState(MQTT_STATE_WAITING, now);
+}
+
+void MqttClient::sendConnect() {
+    size_t clientIdLength = strlen(_clientId);
+    size_t willTopicLength = strlen(_willTopic);
+    size_t willPayloadLength = strlen(_willPayload);
+    size_t userLength = strlen(_user);
+    size_t passwordLength = strlen(_password);
+
+    uint8_t flags = 0x02;                       // Clean session
+    size_t remaining = 10 + 2 + clientIdLength;
+    if (willTopicLength > 0) {
+        flags |= 0x04 | 0x20;                   // Will, QoS 0, retained
+        remaining += 2 + willTopicLength + 2 + willPayloadLength;
+    }
+    if (userLength > 0) {
+        flags |= 0x80;
+        remaining += 2 + userLength;
+        if (passwordLength > 0) {
+            flags |= 0x40;
+            remaining += 2 + passwordLength;
+        }
+    }
+
+    if (!beginPacket(MQTT_CONNECT, remaining)) return;
+
+    putString("MQTT", 4);
+    uint8_t level = 4;                          // MQTT 3.1.1
+    putBytes(&level, 1);
+    putBytes(&flags, 1);
+    putUint16(_keepAlive);
+
+    putString(_clientId, clientIdLength);
+    if (flags & 0x04) {
+        putString(_willTopic, willTopicLength);
+        putString(_willPayload, willPayloadLength);
+    }
+    if (flags & 0x80) {
+        putString(_user, userLength);
+    }
+    if (flags & 0x40) {
+        putString(_password, passwordLength);
+    }
+
+    flush();
+}
+
+// Move what the AsyncTCP task received into the packet buffer and handle
+// every complete packet in it
+void MqttClient::readPackets(unsigned long now) {
+    portENTER_CRITICAL(&_rxMux);
+    size_t take = _rxQueued;
+    if (take > MQTT_RX_BUFFER_SIZE - _packetLength) {
+        take = MQTT_RX_BUFFER_SIZE - _packetLength;
+    }
+    memcpy(_packet + _packetLength, _rxQueue, take);
+    memmove(_rxQueue, _rxQueue + take, _rxQueued - take);
+    _rxQueued -= take;
+    portEXIT_CRITICAL(&_rxMux);
+    _packetLength += take;
+
+    while (_packetLength >= 2) {
+        // Remaining length: 1-4 bytes, 7 bits each
+        size_t remaining = 0;
+        size_t position = 1;
+        uint8_t shift = 0;
+        bool complete = false;
+        while (position < _packetLength && position <= 4) {
+            uint8_t digit = _packet[position++];
+            remaining |= (size_t)(digit & 0x7F) << shift;
+            shift += 7;
+            if (!(digit & 0x80)) {
+                complete = true;
+                break;
+            }
+        }
+
+        // A malformed length or a packet that can never fit ends the session
+        if ((!complete && position > 4) || position + remaining > MQTT_RX_BUFFER_SIZE) {
+            _client.close(true);
+            closeSession(now, false);
+            return;
+        }
+        if (!complete || _packetLength < position + remaining) break;
+
+        handlePacket(_packet[0], _packet + position, remaining, now);
+        if (_state < MQTT_STATE_HANDSHAKE) return;
+
+        size_t used = position + remaining;
+        memmove(_packet, _packet + used, _packetLength - used);
+        _packetLength -= used;
+    }
+}
+
+void MqttClient::handlePacket(uint8_t header, const uint8_t* body, size_t length, unsigned long now) {
+    _lastReceive = now;
+
+    switch (header & 0xF0) {
+    case MQTT_CONNACK:
+        _lastConnackCode = (length >= 2) ? body[1] : 0xFF;
+        if (_state != MQTT_STATE_HANDSHAKE) break;
+        if (_lastConnackCode == 0) {
+            setState(MQTT_STATE_CONNECTED, now);
+            _retryDelay = MQTT_RETRY_MIN;
+            _sessionStart = true;
+            _sessions++;
+        }
+        else {
+            // Refused (bad credentials, client id, ...): back off
+            _client.close(true);
+            closeSession(now, true);
+        }
+        break;
+
+    case MQTT_PUBLISH: {
+        uint8_t qos = (header >> 1) & 0x03;
+        if (length < 2) break;
+        size_t topicLength = ((size_t)body[0] << 8) | body[1];
+        size_t offset = 2 + topicLength;
+        if (qos > 0) offset += 2;
+        if (offset > length) break;
+
+        // QoS 1 is acknowledged, though the subscriptions ask for QoS 0
+        if (qos == 1 && beginPacket(MQTT_PUBACK, 2)) {
+            putBytes(body + 2 + topicLength, 2);
+        }
+
+        if (topicLength >= MQTT_MAX_TOPIC) break;
+        char topic[MQTT_MAX_TOPIC];
+        memcpy(topic, body + 2, topicLength);
+        topic[topicLength] = '\0';
+
+        _received++;
+        if (_handler != NULL) {
+            _handler(topic, body + offset, length - offset, _handlerContext);
+        }
+        break;
+    }
+
+    case MQTT_PINGRESP:
+        _pingPending = false;
+        break;
+
+    default:
+        // SUBACK and anything else needs no action
+        break;
+    }
+}
+
+bool MqttClient::publish(const char* topic, const uint8_t* payload, size_t length, bool retain) {
+    size_t topicLength = strlen(topic);
+
+    if (_state != MQTT_STATE_CONNECTED || !beginPacket(MQTT_PUBLISH | (retain ? 0x01 : 0x00), 2 + topicLength + length)) {
+        _dropped++;
+        return false;
+    }
+
+    putString(topic, topicLength);
+    putBytes(payload, length);
+    _published++;
+    return true;
+}
+
+bool MqttClient::publish(const char* topic, const char* payload, bool retain) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retain);
+}
+
+bool MqttClient::subscribe(const char* filter) {
+    size_t filterLength = strlen(filter);
+
+    if (_state != MQTT_STATE_CONNECTED || !beginPacket(MQTT_SUBSCRIBE, 2 + 2 + filterLength + 1)) {
+        return false;
+    }
+
+    putUint16(_nextPacketId++);
+    if (_nextPacketId == 0) _nextPacketId = 1;
+    putString(filter, filterLength);
+    uint8_t qos = 0;
+    putBytes(&qos, 1);
+    return true;
+}
+
+void MqttClient::flush() {
+    if (_txLength == 0 || !_client.connected()) return;
+
+    size_t room = _client.space();
+    if (room == 0) return;
+
+    size_t added = _client.add((const char*)_tx, (_txLength < room) ? _txLength : room);
+    if (added == 0) return;
+
+    _client.send();
+    memmove(_tx, _tx + added, _txLength - added);
+    _txLength -= added;
+    _bytesSent += added;
+    _lastSend = millis();
+}
+
+size_t MqttClient::encodedLength(size_t remaining) {
+    if (remaining < 128) return 1;
+    if (remaining < 16384) return 2;
+    if (remaining < 2097152) return 3;
+    return 4;
+}
+
+bool MqttClient::beginPacket(uint8_t header, size_t remaining) {
+    if (_txLength + 1 + encodedLength(remaining) + remaining > MQTT_TX_BUFFER_SIZE) {
+        return false;
+    }
+
+    _tx[_txLength++] = header;
+    do {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        if (remaining > 0) digit |= 0x80;
+        _tx[_txLength++] = digit;
+    } while (remaining > 0);
+    return true;
+}
+
+void MqttClient::putBytes(const uint8_t* data, size_t length) {
+    memcpy(_tx + _txLength, data, length);
+    _txLength += length;
+}
+
+void MqttClient::putUint16(uint16_t value) {
+    _tx[_txLength++] = value >> 8;
+    _tx[_txLength++] = value & 0xFF;
+}
+
+void MqttClient::putString(const char* text, size_t length) {
+    putUint16(length);
+    putBytes((const uint8_t*)text, length);
+}
+
+// AsyncTCP task: TCP connection established
+void MqttClient::onTcpConnect(void* arg, AsyncClient* client) {
+    MqttClient* self = (MqttClient*)arg;
+    client->setNoDelay(true);
+    self->_tcpConnected = true;
+}
+
+// AsyncTCP task: connection closed, refused or failed
+void MqttClient::onTcpDisconnect(void* arg, AsyncClient* client) {
+    MqttClient* self = (MqttClient*)arg;
+    self->_tcpClosed = true;
+}
+
+// AsyncTCP task: queue the bytes for loop(); a broker that outruns loop()
+// by a whole buffer ends the session
+void MqttClient::onTcpData(void* arg, AsyncClient* client, void* data, size_t length) {
+    MqttClient* self = (MqttClient*)arg;
+
+    portENTER_CRITICAL(&self->_rxMux);
+    if (self->_rxQueued + length <= MQTT_RX_BUFFER_SIZE) {
+        memcpy(self->_rxQueue + self->_rxQueued, data, length);
+        self->_rxQueued += length;
+    }
+    else {
+        self->_rxOverflow = true;
+    }
+    portEXIT_CRITICAL(&self->_rxMux);
+}
@@ -0,0 +1,167 @@
+/**
+ * MqttClient.h - Non-blocking MQTT 3.1.1 client for KC868-A16
+ * Created by Your Name, Date
+ * Released into the public domain.
+ */
+
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+
+#define MQTT_TX_BUFFER_SIZE   4096    // Packets waiting for room in the TCP window
+#define MQTT_RX_BUFFER_SIZE   1024    // Received bytes waiting for loop(), and the largest inbound packet
+#define MQTT_MAX_HOST         64
+#define MQTT_MAX_CREDENTIAL   64      // Client id, user name, password
+#define MQTT_MAX_TOPIC        128
+#define MQTT_MAX_WILL         16      // Last-will payload
+#define MQTT_CONNECT_TIMEOUT  10000   // DNS lookup, TCP connect and CONNACK (ms)
+#define MQTT_RETRY_MIN        1000    // First reconnect delay (ms), doubled after each failure
+#define MQTT_RETRY_MAX        30000   // Longest reconnect delay (ms)
+
+// Connection states
+#define MQTT_STATE_DISABLED   0
+#define MQTT_STATE_WAITING    1       // Waiting out the reconnect delay
+#define MQTT_STATE_CONNECTING 2       // DNS lookup and TCP connect in progress
+#define MQTT_STATE_HANDSHAKE  3       // CONNECT sent, waiting for CONNACK
+#define MQTT_STATE_CONNECTED  4
+
+// Packet types (high nibble of the fixed header)
+#define MQTT_CONNECT          0x10
+#define MQTT_CONNACK          0x20
+#define MQTT_PUBLISH          0x30
+#define MQTT_PUBACK           0x40
+#define MQTT_SUBSCRIBE        0x82    // Including the reserved flags
+#define MQTT_SUBACK           0x90
+#define MQTT_PINGREQ          0xC0
+#define MQTT_PINGRESP         0xD0
+#define MQTT_DISCONNECT       0xE0
+
+// Called from loop() for every message received on a subscribed topic
+typedef void (*MqttMessageHandler)(const char* topic, const uint8_t* payload, size_t length, void* context);
+
+class MqttClient {
+public:
+    MqttClient();
+
+    // Broker and session settings; they take effect on the next connection
+    void setServer(const char* host, uint16_t port);
+    void setCredentials(const char* clientId, const char* user, const char* password);
+    void setWill(const char* topic, const char* payload);   // Retained, QoS 0
+    void setKeepAlive(uint16_t seconds);
+    void onMessage(MqttMessageHandler handler, void* context = NULL);
+
+    // Start connecting, and reconnecting after every drop / disconnect and stay down
+    void begin();
+    void end();
+
+    // Drive the session from loop(). Nothing here waits on the network: the
+    // connect and DNS lookup run in the AsyncTCP task, received bytes are
+    // parsed from a buffer it fills, and queued packets go out as far as the
+    // TCP window allows.
+    void loop();
+
+    bool connected() { return _state == MQTT_STATE_CONNECTED; }
+    uint8_t getState() { return _state; }
+    const char* getStateName();
+
+    // True once for every new session, so the owner can subscribe and
+    // publish its full state
+    bool takeSessionStart();
+
+    // Queue a QoS 0 message. Returns false, and counts it as dropped, while
+    // there is no session or when the transmit buffer has no room for it.
+    bool publish(const char* topic, const uint8_t* payload, size_t length, bool retain);
+    bool publish(const char* topic, const char* payload, bool retain);
+
+    // Subscribe with QoS 0
+    bool subscribe(const char* filter);
+
+    // Hand queued packets to the TCP stack now rather than at the next loop()
+    void flush();
+
+    size_t getQueuedBytes() { return _txLength; }
+
+    // Statistics since boot
+    unsigned long getSessionCount() { return _sessions; }
+    unsigned long getFailedConnectCount() { return _failedConnects; }
+    unsigned long getPublishedCount() { return _published; }
+    unsigned long getDroppedCount() { return _dropped; }
+    unsigned long getReceivedCount() { return _received; }
+    unsigned long getBytesSent() { return _bytesSent; }
+    uint8_t getLastConnackCode() { return _lastConnackCode; }
+
+private:
+    AsyncClient _client;
+
+    char _host[MQTT_MAX_HOST];
+    uint16_t _port;
+    char _clientId[MQTT_MAX_CREDENTIAL];
+    char _user[MQTT_MAX_CREDENTIAL];
+    char _password[MQTT_MAX_CREDENTIAL];
+    char _willTopic[MQTT_MAX_TOPIC];
+    char _willPayload[MQTT_MAX_WILL];
+    uint16_t _keepAlive;
+
+    MqttMessageHandler _handler;
+    void* _handlerContext;
+
+    uint8_t _state;
+    unsigned long _stateSince;          // millis() of the last state change
+    unsigned long _retryDelay;
+    bool _sessionStart;
+
+    // Set from the AsyncTCP task
+    volatile bool _tcpConnected;
+    volatile bool _tcpClosed;
+    volatile bool _rxOverflow;
+
+    // Bytes received by the AsyncTCP task, moved to _packet by loop()
+    uint8_t _rxQueue[MQTT_RX_BUFFER_SIZE];
+    size_t _rxQueued;
+    portMUX_TYPE _rxMux;
+
+    // Inbound packets being assembled and parsed
+    uint8_t _packet[MQTT_RX_BUFFER_SIZE];
+    size_t _packetLength;
+
+    // Outbound packets not yet accepted by the TCP stack
+    uint8_t _tx[MQTT_TX_BUFFER_SIZE];
+    size_t _txLength;
+
+    unsigned long _lastSend;            // millis() of the last bytes handed to TCP
+    unsigned long _lastReceive;         // millis() of the last packet from the broker
+    bool _pingPending;
+    uint16_t _nextPacketId;
+
+    unsigned long _sessions;
+    unsigned long _failedConnects;
+    unsigned long _published;
+    unsigned long _dropped;
+    unsigned long _received;
+    unsigned long _bytesSent;
+    uint8_t _lastConnackCode;
+
+    void setState(uint8_t state, unsigned long now);
+    void startConnect(unsigned long now);
+    void closeSession(unsigned long now, bool failed);
+    void sendConnect();
+    void readPackets(unsigned long now);
+    void handlePacket(uint8_t header, const uint8_t* body, size_t length, unsigned long now);
+
+    // Packet assembly in the transmit buffer; beginPacket() fails when the
+    // whole packet would not fit
+    bool beginPacket(uint8_t header, size_t remaining);
+    void putBytes(const uint8_t* data, size_t length);
+    void putUint16(uint16_t value);
+    void putString(const char* text, size_t length);
+    static size_t encodedLength(size_t remaining);
+
+    // AsyncTCP task callbacks
+    static void onTcpConnect(void* arg, AsyncClient* client);
+    static void onTcpDisconnect(void* arg, AsyncClient* client);
+    static void onTcpData(void* arg, AsyncClient* client, void* data, size_t length);
+};
+
+#endif // MQTT_CLIENT_H
@@ -6,10 +6,12 @@
 
 #include "ScheduleManager.h"
 #include <EEPROM.h>
+#include <SPIFFS.h>
 
-ScheduleManager::ScheduleManager(HardwareManager& hardwareManager, SensorManager& sensorManager) :
+ScheduleManager::ScheduleManager(HardwareManager& hardwareManager, SensorManager& sensorManager, CommManager& commManager) :
     _hardwareManager(hardwareManager),
-    _sensorManager(sensorManager) // Removed the extra parenthesis
+    _sensorManager(sensorManager),
+    _commManager(commManager)
 {
     // Initialize default schedules
     for (int i = 0; i < MAX_SCHEDULES; i++) {
@@ -43,11 +45,38 @@ ScheduleManager::ScheduleManager(HardwareManager& hardwareManager, SensorManager
         _analogTriggers[i].targetId = 0;
         snprintf(_analogTriggers[i].name, 32, "Trigger %d", i + 1);
     }
+
+    // Initialize default control loops
+    for (int i = 0; i < MAX_CONTROL_LOOPS; i++) {
+        _controlLoops[i].enabled = false;
+        _controlLoops[i].mode = CONTROL_MODE_THERMOSTAT;
+        _controlLoops[i].sourceType = CONTROL_SOURCE_HT_TEMPERATURE;
+        _controlLoops[i].sourceIndex = 0;
+        _controlLoops[i].outputRelay = i;
+        _controlLoops[i].reverseActing = false;
+        _controlLoops[i].setpoint = 20.0f;
+        _controlLoops[i].hysteresis = 1.0f;
+        _controlLoops[i].minOnTime = 60000;     // 1 minute
+        _controlLoops[i].minOffTime = 60000;    // 1 minute
+        _controlLoops[i].kp = 10.0f;
+        _controlLoops[i].ki = 0.05f;
+        _controlLoops[i].kd = 0.0f;
+        _controlLoops[i].windowSize = 120000;   // 2 minute window
+        _controlLoops[i].sampleInterval = 1000; // 1 second
+        snprintf(_controlLoops[i].name, 32, "Control Loop %d", i + 1);
+        resetControlLoop(i);
+    }
 }
 
 void ScheduleManager::begin() {
     loadSchedules();
     loadAnalogTriggers();
+    loadControlLoops();
+
+    // Evaluate sensor-based schedules when a reading crosses their threshold
+    _sensorManager.setThresholdCallback(onSensorThreshold, this);
+    registerSensorThresholds();
+
     Serial.println("Schedule manager initialized");
 }
 
@@ -104,6 +133,9 @@ void ScheduleManager::saveSchedules() {
     catch (...) {
         Serial.println("Unknown exception in saveSchedules");
     }
+
+    // Schedules may have changed - refresh the sensor thresholds
+    registerSensorThresholds();
 }
 
 void ScheduleManager::loadSchedules() {
@@ -387,45 +419,10 @@ void ScheduleManager::checkInputBasedSchedules() {
             // Skip if sensor is configured as digital input
             if (_sensorManager.getSensorType(sensorIndex) == 0) continue;
             
-            bool sensorConditionMet = false;
+            // Skip if the last reading is stale - never act on old data
+            if (_sensorManager.isSensorStale(sensorIndex)) continue;
             
-            // Check temperature threshold
-            if (_schedules[i].sensorTriggerType == 0) { // Temperature
-                float currentTemp = _sensorManager.getTemperature(sensorIndex);
-                float threshold = _schedules[i].sensorThreshold;
-                
-                switch (_schedules[i].sensorCondition) {
-                    case 0: // Above
-                        sensorConditionMet = (currentTemp > threshold);
-                        break;
-                    case 1: // Below
-                        sensorConditionMet = (currentTemp < threshold);
-                        break;
-                    case 2: // Equal (with tolerance)
-                        sensorConditionMet = (abs(currentTemp - threshold) < 0.5f);
-                        break;
-                }
-            }
-            // Check humidity threshold (only for DHT sensors)
-            else if (_schedules[i].sensorTriggerType == 1 && 
-                    (_sensorManager.getSensorType(sensorIndex) == 1 || 
-                     _sensorManager.getSensorType(sensorIndex) == 2)) {
-                
-                float currentHumidity = _sensorManager.getHumidity(sensorIndex);
-                float threshold = _schedules[i].sensorThreshold;
-                
-                switch (_schedules[i].sensorCondition) {
-                    case 0: // Above
-                        sensorConditionMet = (currentHumidity > threshold);
-                        break;
-                    case 1: // Below
-                        sensorConditionMet = (currentHumidity < threshold);
-                        break;
-                    case 2: // Equal (with tolerance)
-                        sensorConditionMet = (abs(currentHumidity - threshold) < 2.0f);
-                        break;
-                }
-            }
+            bool sensorConditionMet = evaluateSensorCondition(i);
             
             conditionMet = sensorConditionMet;
             
@@ -512,6 +509,113 @@ void ScheduleManager::checkInputBasedSchedules() {
     }
 }
 
+bool ScheduleManager::evaluateSensorCondition(int scheduleIndex) {
+    TimeSchedule& schedule = _schedules[scheduleIndex];
+    uint8_t sensorIndex = schedule.sensorIndex;
+    
+    // Invalid index, digital input or stale reading never meets a condition
+    if (sensorIndex >= 3) return false;
+    if (_sensorManager.getSensorType(sensorIndex) == 0) return false;
+    if (_sensorManager.isSensorStale(sensorIndex)) return false;
+    
+    bool sensorConditionMet = false;
+    
+    // Check temperature threshold
+    if (schedule.sensorTriggerType == 0) { // Temperature
+        float currentTemp = _sensorManager.getTemperature(sensorIndex);
+        float threshold = schedule.sensorThreshold;
+        
+        switch (schedule.sensorCondition) {
+            case 0: // Above
+                sensorConditionMet = (currentTemp > threshold);
+                break;
+            case 1: // Below
+                sensorConditionMet = (currentTemp < threshold);
+                break;
+            case 2: // Equal (with tolerance)
+                sensorConditionMet = (abs(currentTemp - threshold) < 0.5f);
+                break;
+        }
+    }
+    // Check humidity threshold (only for DHT sensors)
+    else if (schedule.sensorTriggerType == 1 && 
+            (_sensorManager.getSensorType(sensorIndex) == 1 || 
+             _sensorManager.getSensorType(sensorIndex) == 2)) {
+        
+        float currentHumidity = _sensorManager.getHumidity(sensorIndex);
+        float threshold = schedule.sensorThreshold;
+        
+        switch (schedule.sensorCondition) {
+            case 0: // Above
+                sensorConditionMet = (currentHumidity > threshold);
+                break;
+            case 1: // Below
+                sensorConditionMet = (currentHumidity < threshold);
+                break;
+            case 2: // Equal (with tolerance)
+                sensorConditionMet = (abs(currentHumidity - threshold) < 2.0f);
+                break;
+        }
+    }
+    
+    return sensorConditionMet;
+}
+
+void ScheduleManager::registerSensorThresholds() {
+    _sensorManager.clearThresholds();
+    
+    for (int i = 0; i < MAX_SCHEDULES; i++) {
+        if (!_schedules[i].enabled || _schedules[i].triggerType != 3) continue;
+        if (_schedules[i].sensorIndex >= 3) continue;
+        
+        bool humidity = (_schedules[i].sensorTriggerType == 1);
+        uint8_t measurement = humidity ? SENSOR_MEASURE_HUMIDITY : SENSOR_MEASURE_TEMPERATURE;
+        float hysteresis = humidity ? SENSOR_HYSTERESIS_HUMIDITY : SENSOR_HYSTERESIS_TEMPERATURE;
+        float threshold = _schedules[i].sensorThreshold;
+        
+        // Put the hysteresis on the side the condition does not care about,
+        // so the crossing into the condition happens exactly at the threshold
+        switch (_schedules[i].sensorCondition) {
+            case 0: // Above
+                _sensorManager.registerThreshold(i, _schedules[i].sensorIndex, measurement,
+                    threshold, threshold - hysteresis);
+                break;
+            case 1: // Below
+                _sensorManager.registerThreshold(i, _schedules[i].sensorIndex, measurement,
+                    threshold + hysteresis, threshold);
+                break;
+            case 2: { // Equal - watch both edges of the tolerance band
+                float tolerance = humidity ? 2.0f : 0.5f;
+                _sensorManager.registerThreshold(i, _schedules[i].sensorIndex, measurement,
+                    threshold - tolerance, threshold - tolerance - hysteresis);
+                _sensorManager.registerThreshold(i, _schedules[i].sensorIndex, measurement,
+                    threshold + tolerance + hysteresis, threshold + tolerance);
+                break;
+            }
+        }
+    }
+}
+
+void ScheduleManager::checkSensorSchedule(int scheduleIndex) {
+    if (scheduleIndex < 0 || scheduleIndex >= MAX_SCHEDULES) return;
+    if (!_schedules[scheduleIndex].enabled || _schedules[scheduleIndex].triggerType != 3) return;
+    
+    if (evaluateSensorCondition(scheduleIndex)) {
+        Serial.printf("Sensor threshold crossed for schedule %d: %s\n", scheduleIndex, _schedules[scheduleIndex].name);
+        
+        if (_schedules[scheduleIndex].targetId > 0) {
+            executeScheduleAction(scheduleIndex, _schedules[scheduleIndex].targetId);
+        }
+    }
+}
+
+void ScheduleManager::onSensorThreshold(uint8_t ownerId, bool above, void* context) {
+    ScheduleManager* self = static_cast<ScheduleManager*>(context);
+    if (self != NULL) {
+        self->checkSensorSchedule(ownerId);
+    }
+}
+
 void ScheduleManager::checkInputBasedSchedules(int changedInputIndex, bool newState) {
     // Calculate the bit mask for this input
     uint16_t changedInputMask = (1UL << changedInputIndex);
@@ -614,13 +718,37 @@ void ScheduleManager::checkInputBasedSchedules(int changedInputIndex, bool newSt
     }
 }
 
+bool ScheduleManager::readTriggerInput(uint8_t analogInput, int& value) {
+    if (analogInput < 4) {
+        value = _hardwareManager.getAnalogValue(analogInput);
+        return true;
+    }
+    
+    // Never act on a Modbus slave that stopped answering
+    if (analogInput >= ANALOG_TRIGGER_MODBUS_INPUT && analogInput < ANALOG_TRIGGER_MODBUS_INPUT + MODBUS_VIRTUAL_INPUTS) {
+        uint8_t channel = analogInput - ANALOG_TRIGGER_MODBUS_INPUT;
+        if (!_commManager.isVirtualInputOnline(channel)) return false;
+        value = _commManager.getVirtualInput(channel) ? 1 : 0;
+        return true;
+    }
+    
+    if (analogInput >= ANALOG_TRIGGER_MODBUS_ANALOG && analogInput < ANALOG_TRIGGER_MODBUS_ANALOG + MODBUS_VIRTUAL_ANALOGS) {
+        uint8_t channel = analogInput - ANALOG_TRIGGER_MODBUS_ANALOG;
+        if (!_commManager.isVirtualAnalogOnline(channel)) return false;
+        value = _commManager.getVirtualAnalog(channel);
+        return true;
+    }
+    
+    return false;
+}
+
 void ScheduleManager::checkAnalogTriggers() {
     for (int i = 0; i < MAX_ANALOG_TRIGGERS; i++) {
         if (_analogTriggers[i].enabled) {
             uint8_t analogInput = _analogTriggers[i].analogInput;
+            int value;
             
-            if (analogInput < 4) {
-                int value = _hardwareManager.getAnalogValue(analogInput);
+            if (readTriggerInput(analogInput, value)) {
                 bool triggerConditionMet = false;
                 
                 // Check condition
@@ -773,43 +901,61 @@ AnalogTrigger* ScheduleManager::getAnalogTrigger(int index) {
 void ScheduleManager::getSchedulesJson(JsonArray& schedulesArray) {
     for (int i = 0; i < MAX_SCHEDULES; i++) {
         JsonObject schedule = schedulesArray.createNestedObject();
-        schedule["id"] = i;
-        schedule["enabled"] = _schedules[i].enabled;
-        schedule["name"] = _schedules[i].name;
-        schedule["triggerType"] = _schedules[i].triggerType;
-        schedule["days"] = _schedules[i].days;
-        schedule["hour"] = _schedules[i].hour;
-        schedule["minute"] = _schedules[i].minute;
-        schedule["inputMask"] = _schedules[i].inputMask;
-        schedule["inputStates"] = _schedules[i].inputStates;
-        schedule["logic"] = _schedules[i].logic;
-        schedule["action"] = _schedules[i].action;
-        schedule["targetType"] = _schedules[i].targetType;
-        schedule["targetId"] = _schedules[i].targetId;
-        schedule["targetIdLow"] = _schedules[i].targetIdLow;
-        schedule["sensorIndex"] = _schedules[i].sensorIndex;
-        schedule["sensorTriggerType"] = _schedules[i].sensorTriggerType;
-        schedule["sensorCondition"] = _schedules[i].sensorCondition;
-        schedule["sensorThreshold"] = _schedules[i].sensorThreshold;
+        getScheduleJson(i, schedule);
     }
 }
 
+// Get one schedule for JSON response
+void ScheduleManager::getScheduleJson(int index, JsonObject& schedule) {
+    if (index < 0 || index >= MAX_SCHEDULES) {
+        return;
+    }
+
+    schedule["id"] = index;
+    schedule["enabled"] = _schedules[index].enabled;
+    schedule["name"] = _schedules[index].name;
+    schedule["triggerType"] = _schedules[index].triggerType;
+    schedule["days"] = _schedules[index].days;
+    schedule["hour"] = _schedules[index].hour;
+    schedule["minute"] = _schedules[index].minute;
+    schedule["inputMask"] = _schedules[index].inputMask;
+    schedule["inputStates"] = _schedules[index].inputStates;
+    schedule["logic"] = _schedules[index].logic;
+    schedule["action"] = _schedules[index].action;
+    schedule["targetType"] = _schedules[index].targetType;
+    schedule["targetId"] = _schedules[index].targetId;
+    schedule["targetIdLow"] = _schedules[index].targetIdLow;
+    schedule["sensorIndex"] = _schedules[index].sensorIndex;
+    schedule["sensorTriggerType"] = _schedules[index].sensorTriggerType;
+    schedule["sensorCondition"] = _schedules[index].sensorCondition;
+    schedule["sensorThreshold"] = _schedules[index].sensorThreshold;
+}
+
 // Get analog triggers for JSON response
 void ScheduleManager::getAnalogTriggersJson(JsonArray& triggersArray) {
     for (int i = 0; i < MAX_ANALOG_TRIGGERS; i++) {
         JsonObject trigger = triggersArray.createNestedObject();
-        trigger["id"] = i;
-        trigger["enabled"] = _analogTriggers[i].enabled;
-        trigger["name"] = _analogTriggers[i].name;
-        trigger["analogInput"] = _analogTriggers[i].analogInput;
-        trigger["threshold"] = _analogTriggers[i].threshold;
-        trigger["condition"] = _analogTriggers[i].condition;
-        trigger["action"] = _analogTriggers[i].action;
-        trigger["targetType"] = _analogTriggers[i].targetType;
-        trigger["targetId"] = _analogTriggers[i].targetId;
+        getAnalogTriggerJson(i, trigger);
     }
 }
 
+// Get one analog trigger for JSON response
+void ScheduleManager::getAnalogTriggerJson(int index, JsonObject& trigger) {
+    if (index < 0 || index >= MAX_ANALOG_TRIGGERS) {
+        return;
+    }
+
+    trigger["id"] = index;
+    trigger["enabled"] = _analogTriggers[index].enabled;
+    trigger["name"] = _analogTriggers[index].name;
+    trigger["analogInput"] = _analogTriggers[index].analogInput;
+    trigger["threshold"] = _analogTriggers[index].threshold;
+    trigger["condition"] = _analogTriggers[index].condition;
+    trigger["action"] = _analogTriggers[index].action;
+    trigger["targetType"] = _analogTriggers[index].targetType;
+    trigger["targetId"] = _analogTriggers[index].targetId;
+}
+
 // Update schedule from JSON
 bool ScheduleManager::updateSchedule(JsonObject& scheduleJson) {
     int id = scheduleJson.containsKey("id") ? scheduleJson["id"].as<int>() : -1;
@@ -895,3 +1041,349 @@ bool ScheduleManager::updateAnalogTrigger(JsonObject& triggerJson) {
     return false;
 }
 
+// Write the persisted control loop settings into a JSON object
+static void controlLoopConfigToJson(const ControlLoop& loop, JsonObject& loopJson) {
+    loopJson["enabled"] = loop.enabled;
+    loopJson["name"] = loop.name;
+    loopJson["mode"] = loop.mode;
+    loopJson["sourceType"] = loop.sourceType;
+    loopJson["sourceIndex"] = loop.sourceIndex;
+    loopJson["outputRelay"] = loop.outputRelay;
+    loopJson["reverseActing"] = loop.reverseActing;
+    loopJson["setpoint"] = loop.setpoint;
+    loopJson["hysteresis"] = loop.hysteresis;
+    loopJson["minOnTime"] = loop.minOnTime;
+    loopJson["minOffTime"] = loop.minOffTime;
+    loopJson["kp"] = loop.kp;
+    loopJson["ki"] = loop.ki;
+    loopJson["kd"] = loop.kd;
+    loopJson["windowSize"] = loop.windowSize;
+    loopJson["sampleInterval"] = loop.sampleInterval;
+}
+
+// Read control loop settings from a JSON object, keeping values in range
+static void controlLoopConfigFromJson(ControlLoop& loop, JsonObject& loopJson) {
+    loop.enabled = loopJson["enabled"] | false;
+
+    // For string values, ensure we don't exceed buffer size
+    const char* nameStr = loopJson["name"] | "Control Loop";
+    strncpy(loop.name, nameStr, 31);
+    loop.name[31] = '\0';
+
+    loop.mode = loopJson["mode"] | CONTROL_MODE_THERMOSTAT;
+    loop.sourceType = loopJson["sourceType"] | CONTROL_SOURCE_HT_TEMPERATURE;
+    loop.sourceIndex = loopJson["sourceIndex"] | 0;
+    loop.outputRelay = loopJson["outputRelay"] | 0;
+    loop.reverseActing = loopJson["reverseActing"] | false;
+    loop.setpoint = loopJson["setpoint"] | 20.0f;
+    loop.hysteresis = loopJson["hysteresis"] | 1.0f;
+    loop.minOnTime = loopJson["minOnTime"] | 60000UL;
+    loop.minOffTime = loopJson["minOffTime"] | 60000UL;
+    loop.kp = loopJson["kp"] | 10.0f;
+    loop.ki = loopJson["ki"] | 0.05f;
+    loop.kd = loopJson["kd"] | 0.0f;
+    loop.windowSize = loopJson["windowSize"] | 120000UL;
+    loop.sampleInterval = loopJson["sampleInterval"] | 1000UL;
+
+    if (loop.mode > CONTROL_MODE_PID) loop.mode = CONTROL_MODE_THERMOSTAT;
+    if (loop.sourceType > CONTROL_SOURCE_MODBUS) loop.sourceType = CONTROL_SOURCE_HT_TEMPERATURE;
+    if (loop.outputRelay > 15) loop.outputRelay = 0;
+    if (loop.hysteresis < 0.0f) loop.hysteresis = 0.0f;
+    if (loop.sampleInterval < 100) loop.sampleInterval = 100;
+    if (loop.windowSize < 1000) loop.windowSize = 1000;
+}
+
+void ScheduleManager::resetControlLoop(int loopIndex) {
+    ControlLoop& loop = _controlLoops[loopIndex];
+    loop.initialized = false;
+    loop.relayOn = false;
+    loop.processValue = NAN;
+    loop.output = 0.0f;
+    loop.integral = 0.0f;
+    loop.lastRunTime = 0;
+    loop.lastSwitchTime = 0;
+    loop.windowStart = 0;
+    loop.switchCount = 0;
+}
+
+void ScheduleManager::runControlLoops() {
+    unsigned long now = millis();
+
+    for (int i = 0; i < MAX_CONTROL_LOOPS; i++) {
+        ControlLoop& loop = _controlLoops[i];
+        if (!loop.enabled) continue;
+
+        if (!loop.initialized) {
+            // Run on the first call and allow an immediate first switch
+            loop.initialized = true;
+            loop.relayOn = _hardwareManager.getOutputState(loop.outputRelay);
+            loop.lastRunTime = now - loop.sampleInterval;
+            loop.lastSwitchTime = now - max(loop.minOnTime, loop.minOffTime);
+            loop.windowStart = now;
+        }
+
+        bool inputValid = true;
+
+        // Execute the control law at a fixed rate
+        if (now - loop.lastRunTime >= loop.sampleInterval) {
+            // Advance by whole periods so the rate does not drift with loop() jitter,
+            // but resynchronise instead of bursting if we fell far behind
+            loop.lastRunTime += loop.sampleInterval;
+            if (now - loop.lastRunTime >= loop.sampleInterval) {
+                loop.lastRunTime = now;
+            }
+
+            float value;
+            if (readControlInput(loop, value)) {
+                float previousValue = isnan(loop.processValue) ? value : loop.processValue;
+                loop.processValue = value;
+
+                if (loop.mode == CONTROL_MODE_PID) {
+                    runPID(loop, previousValue, loop.sampleInterval / 1000.0f);
+                }
+                else {
+                    runThermostat(loop);
+                }
+            }
+            else {
+                inputValid = false;
+                loop.processValue = NAN;
+                loop.output = 0.0f;
+            }
+        }
+        else if (isnan(loop.processValue)) {
+            inputValid = false;
+        }
+
+        // Fail safe: without a valid process value the relay is released at once
+        if (!inputValid) {
+            if (loop.relayOn) {
+                Serial.printf("Control loop %d: no valid input, releasing relay %d\n", i, loop.outputRelay + 1);
+                setControlRelay(i, false, now);
+            }
+            continue;
+        }
+
+        // Translate controller output into a relay demand
+        bool demand;
+        if (loop.mode == CONTROL_MODE_PID) {
+            // Time-proportioning: relay is on for output% of each window
+            if (now - loop.windowStart >= loop.windowSize) {
+                loop.windowStart = now - ((now - loop.windowStart) % loop.windowSize);
+            }
+
+            unsigned long onTime = (unsigned long)(loop.output / 100.0f * loop.windowSize);
+
+            // Skip pulses shorter than the minimum cycle times to spare the contactor
+            if (onTime < loop.minOnTime) {
+                onTime = 0;
+            }
+            else if (loop.windowSize - onTime < loop.minOffTime) {
+                onTime = loop.windowSize;
+            }
+
+            demand = (now - loop.windowStart) < onTime;
+        }
+        else {
+            demand = loop.output > 50.0f;
+        }
+
+        // Honour minimum on/off times before switching
+        if (demand != loop.relayOn) {
+            unsigned long minTime = loop.relayOn ? loop.minOnTime : loop.minOffTime;
+            if (now - loop.lastSwitchTime >= minTime) {
+                setControlRelay(i, demand, now);
+            }
+        }
+    }
+}
+
+bool ScheduleManager::readControlInput(ControlLoop& loop, float& value) {
+    switch (loop.sourceType) {
+        case CONTROL_SOURCE_HT_TEMPERATURE:
+        case CONTROL_SOURCE_HT_HUMIDITY: {
+            if (loop.sourceIndex >= 3) return false;
+
+            uint8_t sensorType = _sensorManager.getSensorType(loop.sourceIndex);
+            if (sensorType == SENSOR_TYPE_DIGITAL) return false;
+
+            // Never regulate on old data
+            if (_sensorManager.isSensorStale(loop.sourceIndex)) return false;
+
+            if (loop.sourceType == CONTROL_SOURCE_HT_HUMIDITY) {
+                // Only DHT sensors report humidity
+                if (sensorType != SENSOR_TYPE_DHT11 && sensorType != SENSOR_TYPE_DHT22) return false;
+                value = _sensorManager.getHumidity(loop.sourceIndex);
+            }
+            else {
+                value = _sensorManager.getTemperature(loop.sourceIndex);
+            }
+            return true;
+        }
+
+        case CONTROL_SOURCE_ANALOG:
+            if (loop.sourceIndex >= 4) return false;
+            value = _hardwareManager.getAnalogVoltage(loop.sourceIndex);
+            return true;
+
+        case CONTROL_SOURCE_MODBUS:
+            if (!_commManager.isVirtualAnalogOnline(loop.sourceIndex)) return false;
+            value = _commManager.getVirtualAnalog(loop.sourceIndex);
+            return true;
+    }
+
+    return false;
+}
+
+void ScheduleManager::runThermostat(ControlLoop& loop) {
+    // Positive error means the loop needs output (heating below / cooling above setpoint)
+    float error = loop.reverseActing ? (loop.processValue - loop.setpoint) : (loop.setpoint - loop.processValue);
+    float halfBand = loop.hysteresis / 2.0f;
+
+    if (error > halfBand) {
+        loop.output = 100.0f;
+    }
+    else if (error < -halfBand) {
+        loop.output = 0.0f;
+    }
+    // Inside the dead band the previous output is held
+}
+
+void ScheduleManager::runPID(ControlLoop& loop, float previousValue, float dt) {
+    float error = loop.reverseActing ? (loop.processValue - loop.setpoint) : (loop.setpoint - loop.processValue);
+
+    float pTerm = loop.kp * error;
+
+    // Derivative on measurement avoids an output kick when the setpoint changes
+    float rate = (loop.processValue - previousValue) / dt;
+    float dTerm = loop.reverseActing ? (loop.kd * rate) : (-loop.kd * rate);
+
+    // Anti-windup: integrate only while the output is not saturated in the
+    // direction the error is pushing it, and keep the integral within range
+    float integral = loop.integral + loop.ki * error * dt;
+    integral = constrain(integral, 0.0f, 100.0f);
+
+    float output = pTerm + integral + dTerm;
+    if ((output > 100.0f && error > 0) || (output < 0.0f && error < 0)) {
+        output = pTerm + loop.integral + dTerm;
+    }
+    else {
+        loop.integral = integral;
+    }
+
+    loop.output = constrain(output, 0.0f, 100.0f);
+}
+
+void ScheduleManager::setControlRelay(int loopIndex, bool on, unsigned long now) {
+    ControlLoop& loop = _controlLoops[loopIndex];
+
+    _hardwareManager.setOutputState(loop.outputRelay, on);
+    if (!_hardwareManager.writeOutputs()) {
+        Serial.println("ERROR: Failed to write outputs for control loop");
+        return;
+    }
+
+    loop.relayOn = on;
+    loop.lastSwitchTime = now;
+    loop.switchCount++;
+
+    Serial.printf("Control loop %d (%s): relay %d %s, PV %.2f, output %.0f%%\n",
+                 loopIndex, loop.name, loop.outputRelay + 1, on ? "ON" : "OFF",
+                 loop.processValue, loop.output);
+}
+
+void ScheduleManager::saveControlLoops() {
+    DynamicJsonDocument doc(3072);
+    JsonArray loopsArray = doc.createNestedArray("loops");
+
+    for (int i = 0; i < MAX_CONTROL_LOOPS; i++) {
+        JsonObject loopJson = loopsArray.createNestedObject();
+        controlLoopConfigToJson(_controlLoops[i], loopJson);
+    }
+
+    File file = SPIFFS.open(CONTROL_LOOPS_FILE, FILE_WRITE);
+    if (!file) {
+        Serial.println("Failed to open control loop file for writing");
+        return;
+    }
+
+    serializeJson(doc, file);
+    file.close();
+
+    Serial.println("Control loops saved to SPIFFS");
+}
+
+void ScheduleManager::loadControlLoops() {
+    if (!SPIFFS.exists(CONTROL_LOOPS_FILE)) {
+        Serial.println("No control loop configuration found, using defaults");
+        return;
+    }
+
+    File file = SPIFFS.open(CONTROL_LOOPS_FILE, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open control loop file");
+        return;
+    }
+
+    DynamicJsonDocument doc(3072);
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
+
+    if (error || !doc.containsKey("loops")) {
+        Serial.println("Failed to parse control loop configuration");
+        return;
+    }
+
+    JsonArray loopsArray = doc["loops"];
+    int index = 0;
+    for (JsonObject loopJson : loopsArray) {
+        if (index >= MAX_CONTROL_LOOPS) break;
+        controlLoopConfigFromJson(_controlLoops[index], loopJson);
+        resetControlLoop(index);
+        index++;
+    }
+
+    Serial.println("Control loops loaded from SPIFFS");
+}
+
+ControlLoop* ScheduleManager::getControlLoop(int index) {
+    if (index < 0 || index >= MAX_CONTROL_LOOPS) {
+        return nullptr;
+    }
+    return &_controlLoops[index];
+}
+
+void ScheduleManager::getControlLoopsJson(JsonArray& loopsArray) {
+    for (int i = 0; i < MAX_CONTROL_LOOPS; i++) {
+        JsonObject loopJson = loopsArray.createNestedObject();
+        loopJson["id"] = i;
+        controlLoopConfigToJson(_controlLoops[i], loopJson);
+
+        // Runtime state
+        if (!isnan(_controlLoops[i].processValue)) {
+            loopJson["processValue"] = _controlLoops[i].processValue;
+        }
+        loopJson["output"] = _controlLoops[i].output;
+        loopJson["relayOn"] = _controlLoops[i].relayOn;
+        loopJson["switchCount"] = _controlLoops[i].switchCount;
+    }
+}
+
+bool ScheduleManager::updateControlLoop(JsonObject& loopJson) {
+    int id = loopJson.containsKey("id") ? loopJson["id"].as<int>() : -1;
+
+    if (id < 0 || id >= MAX_CONTROL_LOOPS) {
+        return false;
+    }
+
+    // Release the old output before the loop is reconfigured
+    if (_controlLoops[id].enabled && _controlLoops[id].relayOn) {
+        setControlRelay(id, false, millis());
+    }
+
+    controlLoopConfigFromJson(_controlLoops[id], loopJson);
+    resetControlLoop(id);
+
+    saveControlLoops();
+    return true;
+}
@@ -11,13 +11,33 @@
 #include <ArduinoJson.h>
 #include "HardwareManager.h"
 #include "SensorManager.h"
+#include "CommManager.h"
 
 // Forward declarations
 class HardwareManager;
 class SensorManager;
+class CommManager;
 
 #define MAX_SCHEDULES 30
 #define MAX_ANALOG_TRIGGERS 16
+#define MAX_CONTROL_LOOPS 4
+
+// Control loop modes
+#define CONTROL_MODE_THERMOSTAT 0  // On/off with hysteresis
+#define CONTROL_MODE_PID        1  // PID with time-proportioning relay output
+
+// Control loop process value sources
+#define CONTROL_SOURCE_HT_TEMPERATURE 0  // HT sensor temperature
+#define CONTROL_SOURCE_HT_HUMIDITY    1  // HT sensor humidity
+#define CONTROL_SOURCE_ANALOG         2  // Analog input voltage (A1-A4)
+#define CONTROL_SOURCE_MODBUS         3  // Modbus master analog channel (raw register value)
+
+// Analog trigger inputs beyond A1-A4 read the Modbus master's virtual channels
+#define ANALOG_TRIGGER_MODBUS_ANALOG  4  // 4-35: Modbus analog channels (raw register value)
+#define ANALOG_TRIGGER_MODBUS_INPUT   64 // 64-127: Modbus virtual inputs (0 or 1)
+
+// Control loop configuration file on SPIFFS (EEPROM map is full)
+#define CONTROL_LOOPS_FILE "/control_loops.json"
 
 // Time schedule structure
 struct TimeSchedule {
@@ -42,11 +62,42 @@ struct TimeSchedule {
     float sensorThreshold;     // Temperature or humidity threshold value
 };
 
+// Control loop structure
+struct ControlLoop {
+    bool enabled;
+    uint8_t mode;               // 0=Thermostat, 1=PID
+    uint8_t sourceType;         // 0=HT temperature, 1=HT humidity, 2=Analog voltage
+    uint8_t sourceIndex;        // HT sensor (0-2), analog input (0-3) or Modbus analog channel
+    uint8_t outputRelay;        // Relay driven by the loop (0-15)
+    bool reverseActing;         // false=heating (on below setpoint), true=cooling (on above)
+    float setpoint;             // Target process value
+    float hysteresis;           // Thermostat dead band around the setpoint
+    unsigned long minOnTime;    // Minimum relay on time (ms)
+    unsigned long minOffTime;   // Minimum relay off time (ms)
+    float kp;                   // PID proportional gain (% output per unit error)
+    float ki;                   // PID integral gain (% output per unit error per second)
+    float kd;                   // PID derivative gain (% output per unit change per second)
+    unsigned long windowSize;   // Time-proportioning window (ms)
+    unsigned long sampleInterval; // Fixed loop execution period (ms)
+    char name[32];              // Name/description of the loop
+
+    // Runtime state (not persisted)
+    bool initialized;           // Runtime state has been primed
+    bool relayOn;               // Last state written to the relay
+    float processValue;         // Last process value
+    float output;               // Controller output (0-100%)
+    float integral;             // PID integral term (% output)
+    unsigned long lastRunTime;  // Last loop execution
+    unsigned long lastSwitchTime; // Last relay change
+    unsigned long windowStart;  // Start of the current time-proportioning window
+    unsigned long switchCount;  // Relay operations since boot
+};
+
 // Analog trigger structure
 struct AnalogTrigger {
     bool enabled;
-    uint8_t analogInput;    // 0-3 (A1-A4)
-    uint16_t threshold;     // Analog threshold value (0-4095)
+    uint8_t analogInput;    // 0-3 (A1-A4), or a Modbus channel (see ANALOG_TRIGGER_MODBUS_*)
+    uint16_t threshold;     // Analog threshold value (0-4095, or register value)
     uint8_t condition;      // 0=Above, 1=Below, 2=Equal
     uint8_t action;         // 0=OFF, 1=ON, 2=TOGGLE
     uint8_t targetType;     // 0=Output, 1=Multiple outputs
@@ -56,9 +107,11 @@ struct AnalogTrigger {
 
 class ScheduleManager {
 public:
-    ScheduleManager(HardwareManager& hardwareManager, SensorManager& sensorManager);
+    ScheduleManager(HardwareManager& hardwareManager, SensorManager& sensorManager, CommManager& commManager);
     
-    // Initialize schedules
+    // Load schedules, triggers and control loops and register the sensor
+    // thresholds of sensor-based schedules; without this call those
+    // schedules are never evaluated on a reading
     void begin();
     
     // Save schedules to EEPROM
@@ -85,6 +138,30 @@ public:
     // Check analog triggers
     void checkAnalogTriggers();
     
+    // Register sensor-based schedule thresholds with the sensor manager
+    void registerSensorThresholds();
+    
+    // Evaluate a single sensor-based schedule after a threshold crossing
+    void checkSensorSchedule(int scheduleIndex);
+    
+    // Run thermostat and PID control loops at their fixed rate
+    void runControlLoops();
+    
+    // Save control loops to SPIFFS
+    void saveControlLoops();
+    
+    // Load control loops from SPIFFS
+    void loadControlLoops();
+    
+    // Get control loop by index
+    ControlLoop* getControlLoop(int index);
+    
+    // Get control loops for JSON response
+    void getControlLoopsJson(JsonArray& loopsArray);
+    
+    // Update control loop from JSON
+    bool updateControlLoop(JsonObject& loopJson);
+    
     // Execute a schedule action
     void executeSchedule(int scheduleIndex);
     
@@ -103,6 +180,10 @@ public:
     // Get analog triggers for JSON response
     void getAnalogTriggersJson(JsonArray& triggersArray);
     
+    // Single entries, for responses streamed one element at a time
+    void getScheduleJson(int index, JsonObject& schedule);
+    void getAnalogTriggerJson(int index, JsonObject& trigger);
+    
     // Update schedule from JSON
     bool updateSchedule(JsonObject& scheduleJson);
     
@@ -113,6 +194,7 @@ private:
     // References to other managers
     HardwareManager& _hardwareManager;
     SensorManager& _sensorManager;
+    CommManager& _commManager;
     
     // Schedules array
     TimeSchedule _schedules[MAX_SCHEDULES];
@@ -120,11 +202,30 @@ private:
     // Analog triggers array
     AnalogTrigger _analogTriggers[MAX_ANALOG_TRIGGERS];
     
+    // Control loops array
+    ControlLoop _controlLoops[MAX_CONTROL_LOOPS];
+    
     // Calculate current input state mask
     uint32_t calculateInputStateMask();
     
     // Helper for original API
     void executeScheduleAction(int scheduleIndex);
+    
+    // Current value of an analog trigger input, false if it is unavailable
+    bool readTriggerInput(uint8_t analogInput, int& value);
+    
+    // Check whether a sensor-based schedule's condition is currently met
+    bool evaluateSensorCondition(int scheduleIndex);
+    
+    // Threshold-crossing callback registered with the sensor manager
+    static void onSensorThreshold(uint8_t ownerId, bool above, void* context);
+    
+    // Control loop helpers
+    void resetControlLoop(int loopIndex);
+    bool readControlInput(ControlLoop& loop, float& value);
+    void runThermostat(ControlLoop& loop);
+    void runPID(ControlLoop& loop, float previousValue, float dt);
+    void setControlRelay(int loopIndex, bool on, unsigned long now);
 };
 
 #endif // SCHEDULE_MANAGER_H
\ No newline at end of file
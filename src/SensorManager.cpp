@@ -9,8 +9,13 @@
 #include <ArduinoJson.h>
 #include <time.h>
 
-SensorManager::SensorManager() :
-    _rtcInitialized(false)
+SensorManager::SensorManager(I2CBusManager& i2cBus) :
+    _i2cBus(i2cBus),
+    _sht3x(i2cBus),
+    _bme280(i2cBus),
+    _rtcInitialized(false),
+    _thresholdCallback(NULL),
+    _thresholdContext(NULL)
 {
     // Initialize sensor configuration
     for (int i = 0; i < 3; i++) {
@@ -19,12 +24,15 @@ SensorManager::SensorManager() :
         _htSensorConfig[i].humidity = 0;
         _htSensorConfig[i].configured = false;
         _htSensorConfig[i].lastReadTime = 0;
+        resetSensorHealth(i);
 
         // Initialize sensor pointers to NULL
         _dhtSensors[i] = NULL;
         _oneWireBuses[i] = NULL;
         _ds18b20Sensors[i] = NULL;
     }
+
+    clearThresholds();
 }
 
 void SensorManager::begin() {
@@ -36,11 +44,22 @@ void SensorManager::begin() {
         initializeSensor(i);
     }
 
+    // Detect optional I2C environmental sensors
+    if (!_sht3x.begin()) {
+        Serial.println("No SHT3x sensor found");
+    }
+    if (!_bme280.begin()) {
+        Serial.println("No BME280 sensor found");
+    }
+
     Serial.println("Sensor manager initialized");
 }
 
 void SensorManager::initRTC() {
+    // RTClib talks to Wire directly, so hold the shared bus around each call
+    _i2cBus.acquire(I2C_PRIORITY_SENSOR);
     _rtcInitialized = _rtc.begin();
+    _i2cBus.release();
     if (!_rtcInitialized) {
         Serial.println("Couldn't find RTC, using ESP32 internal time");
         // Use NTP for time sync if RTC not available
@@ -50,15 +69,21 @@ void SensorManager::initRTC() {
     else {
         Serial.println("RTC found");
 
-        if (_rtc.lostPower()) {
-            Serial.println("RTC lost power, setting to compile time");
+        _i2cBus.acquire(I2C_PRIORITY_SENSOR);
+        bool lostPower = _rtc.lostPower();
+        if (lostPower) {
             // Set RTC to compile time if power was lost
             _rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
+        }
+        _i2cBus.release();
+
+        if (lostPower) {
+            Serial.println("RTC lost power, setting to compile time");
             syncTimeFromNTP();  // Also try to get more accurate time
         }
 
         // Print current time from RTC
-        DateTime now = _rtc.now();
+        DateTime now = getCurrentTime();
         String timeStr = String(now.year()) + "-" +
             String(now.month()) + "-" +
             String(now.day()) + " " +
@@ -100,8 +125,16 @@ void SensorManager::readSensor(int htIndex) {
         break;
     }
 
+    // Failing sensors are retried at their back-off interval instead
+    unsigned long readInterval = minInterval;
+    if (_htSensorConfig[htIndex].retryInterval > readInterval) {
+        readInterval = _htSensorConfig[htIndex].retryInterval;
+    }
+
     // Return if it's not time to read yet
-    if (currentMillis - _htSensorConfig[htIndex].lastReadTime < minInterval) {
+    if (currentMillis - _htSensorConfig[htIndex].lastReadTime < readInterval) {
+        // Still age out the last good reading while waiting
+        isSensorStale(htIndex);
         return;
     }
 
@@ -113,6 +146,7 @@ void SensorManager::readSensor(int htIndex) {
     case SENSOR_TYPE_DIGITAL:
         // For digital input, just read the pin value (hardware handles this)
         // _htSensorConfig[htIndex].value would be updated by hardware manager
+        recordReadSuccess(htIndex);
         break;
 
     case SENSOR_TYPE_DHT11:
@@ -126,14 +160,18 @@ void SensorManager::readSensor(int htIndex) {
             if (!isnan(newHumidity) && !isnan(newTemperature)) {
                 _htSensorConfig[htIndex].humidity = newHumidity;
                 _htSensorConfig[htIndex].temperature = newTemperature;
+                recordReadSuccess(htIndex);
                 Serial.println("HT" + String(htIndex + 1) + " DHT: " +
                     String(newTemperature, 1) + "C, " +
                     String(newHumidity, 1) + "%");
             }
             else {
-                Serial.println("HT" + String(htIndex + 1) + " DHT read error");
+                recordReadFailure(htIndex, minInterval);
             }
         }
+        else {
+            recordReadFailure(htIndex, minInterval);
+        }
         break;
 
     case SENSOR_TYPE_DS18B20:
@@ -147,17 +185,205 @@ void SensorManager::readSensor(int htIndex) {
             // Check if reading is valid
             if (newTemperature != DEVICE_DISCONNECTED_C) {
                 _htSensorConfig[htIndex].temperature = newTemperature;
+                recordReadSuccess(htIndex);
                 Serial.println("HT" + String(htIndex + 1) + " DS18B20: " +
                     String(newTemperature, 1) + "C");
             }
             else {
-                Serial.println("HT" + String(htIndex + 1) + " DS18B20 read error");
+                recordReadFailure(htIndex, minInterval);
             }
         }
+        else {
+            recordReadFailure(htIndex, minInterval);
+        }
         break;
     }
 }
 
+void SensorManager::resetSensorHealth(int htIndex) {
+    _htSensorConfig[htIndex].consecutiveFailures = 0;
+    _htSensorConfig[htIndex].lastGoodReadTime = 0;
+    _htSensorConfig[htIndex].retryInterval = 0;
+    // No valid reading has been taken yet
+    _htSensorConfig[htIndex].stale = (_htSensorConfig[htIndex].sensorType != SENSOR_TYPE_DIGITAL);
+}
+
+void SensorManager::recordReadSuccess(int htIndex) {
+    HTSensorConfig& config = _htSensorConfig[htIndex];
+
+    if (config.consecutiveFailures > 0) {
+        Serial.println("HT" + String(htIndex + 1) + " sensor recovered after " +
+            String(config.consecutiveFailures) + " failed reads");
+    }
+
+    config.consecutiveFailures = 0;
+    config.lastGoodReadTime = millis();
+    config.retryInterval = 0;
+    config.stale = false;
+
+    // A fresh reading may have crossed a registered threshold
+    if (config.sensorType != SENSOR_TYPE_DIGITAL) {
+        checkThresholds(htIndex);
+    }
+}
+
+void SensorManager::recordReadFailure(int htIndex, unsigned long baseInterval) {
+    HTSensorConfig& config = _htSensorConfig[htIndex];
+
+    if (config.consecutiveFailures < 255) {
+        config.consecutiveFailures++;
+    }
+
+    // Exponential back-off: double the retry interval up to the maximum
+    unsigned long nextInterval = (config.retryInterval > 0) ? config.retryInterval * 2 : baseInterval * 2;
+    if (nextInterval > SENSOR_BACKOFF_MAX_INTERVAL) {
+        nextInterval = SENSOR_BACKOFF_MAX_INTERVAL;
+    }
+    config.retryInterval = nextInterval;
+
+    // Only log the first failure and the transition to stale, not every retry
+    if (config.consecutiveFailures == 1) {
+        Serial.println("HT" + String(htIndex + 1) + " read error, retrying in " +
+            String(config.retryInterval) + "ms");
+    }
+
+    bool wasStale = config.stale;
+    if (isSensorStale(htIndex) && !wasStale) {
+        Serial.println("HT" + String(htIndex + 1) + " reading is stale after " +
+            String(config.consecutiveFailures) + " failed reads");
+    }
+}
+
+bool SensorManager::isSensorStale(int index) {
+    if (index < 0 || index >= 3) {
+        return true;
+    }
+
+    HTSensorConfig& config = _htSensorConfig[index];
+
+    // Digital inputs have no reading to go stale
+    if (config.sensorType == SENSOR_TYPE_DIGITAL) {
+        config.stale = false;
+        return false;
+    }
+
+    if (config.consecutiveFailures >= SENSOR_STALE_FAILURES ||
+        config.lastGoodReadTime == 0 ||
+        millis() - config.lastGoodReadTime > SENSOR_STALE_TIMEOUT) {
+        config.stale = true;
+    }
+
+    return config.stale;
+}
+
+uint8_t SensorManager::getFailureCount(int index) {
+    if (index >= 0 && index < 3) {
+        return _htSensorConfig[index].consecutiveFailures;
+    }
+    return 0;
+}
+
+void SensorManager::updateI2CSensors() {
+    // Each call queues at most one short transaction per sensor
+    _sht3x.update();
+    _bme280.update();
+}
+
+void SensorManager::getI2CSensorsJson(JsonArray& sensorsArray) {
+    if (_sht3x.isPresent()) {
+        JsonObject sensor = sensorsArray.createNestedObject();
+        sensor["type"] = "SHT3x";
+        sensor["address"] = "0x" + String(_sht3x.getAddress(), HEX);
+        if (_sht3x.hasReading()) {
+            sensor["temperature"] = _sht3x.getTemperature();
+            sensor["humidity"] = _sht3x.getHumidity();
+        }
+        sensor["stale"] = !_sht3x.hasReading() || millis() - _sht3x.getLastReadTime() > SENSOR_STALE_TIMEOUT;
+        sensor["errors"] = _sht3x.getErrorCount();
+    }
+
+    if (_bme280.isPresent()) {
+        JsonObject sensor = sensorsArray.createNestedObject();
+        sensor["type"] = _bme280.hasHumidity() ? "BME280" : "BMP280";
+        sensor["address"] = "0x" + String(_bme280.getAddress(), HEX);
+        if (_bme280.hasReading()) {
+            sensor["temperature"] = _bme280.getTemperature();
+            sensor["pressure"] = _bme280.getPressure();
+            if (_bme280.hasHumidity()) {
+                sensor["humidity"] = _bme280.getHumidity();
+            }
+        }
+        sensor["stale"] = !_bme280.hasReading() || millis() - _bme280.getLastReadTime() > SENSOR_STALE_TIMEOUT;
+        sensor["errors"] = _bme280.getErrorCount();
+    }
+}
+
+void SensorManager::setThresholdCallback(SensorThresholdCallback callback, void* context) {
+    _thresholdCallback = callback;
+    _thresholdContext = context;
+}
+
+bool SensorManager::registerThreshold(uint8_t ownerId, uint8_t sensorIndex, uint8_t measurement,
+    float riseLevel, float fallLevel) {
+    if (sensorIndex >= 3 || fallLevel > riseLevel) {
+        return false;
+    }
+
+    // Find a free slot
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        if (!_thresholds[i].active) {
+            _thresholds[i].active = true;
+            _thresholds[i].ownerId = ownerId;
+            _thresholds[i].sensorIndex = sensorIndex;
+            _thresholds[i].measurement = measurement;
+            _thresholds[i].riseLevel = riseLevel;
+            _thresholds[i].fallLevel = fallLevel;
+            _thresholds[i].known = false;
+            _thresholds[i].above = false;
+            return true;
+        }
+    }
+
+    Serial.println("No free sensor threshold slots");
+    return false;
+}
+
+void SensorManager::clearThresholds() {
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        _thresholds[i].active = false;
+    }
+}
+
+void SensorManager::checkThresholds(int htIndex) {
+    for (int i = 0; i < MAX_SENSOR_THRESHOLDS; i++) {
+        SensorThreshold& t = _thresholds[i];
+        if (!t.active || t.sensorIndex != htIndex) continue;
+
+        float value = (t.measurement == SENSOR_MEASURE_HUMIDITY) ?
+            _htSensorConfig[htIndex].humidity : _htSensorConfig[htIndex].temperature;
+
+        bool crossed = false;
+        if (!t.known) {
+            // First good reading establishes the side and is reported once
+            t.above = (value > t.riseLevel);
+            t.known = true;
+            crossed = true;
+        }
+        else if (!t.above && value > t.riseLevel) {
+            t.above = true;
+            crossed = true;
+        }
+        else if (t.above && value < t.fallLevel) {
+            t.above = false;
+            crossed = true;
+        }
+
+        if (crossed && _thresholdCallback != NULL) {
+            _thresholdCallback(t.ownerId, t.above, _thresholdContext);
+        }
+    }
+}
+
 HTSensorConfig* SensorManager::getSensorConfig(int index) {
     if (index >= 0 && index < 3) {
         return &_htSensorConfig[index];
@@ -201,6 +427,7 @@ bool SensorManager::updateSensorConfig(int index, uint8_t sensorType) {
         _htSensorConfig[index].humidity = 0;
         _htSensorConfig[index].configured = false;
         _htSensorConfig[index].lastReadTime = 0;
+        resetSensorHealth(index);
 
         // Initialize with new settings
         initializeSensor(index);
@@ -326,6 +553,7 @@ void SensorManager::initializeSensor(int htIndex) {
 
     _htSensorConfig[htIndex].configured = true;
     _htSensorConfig[htIndex].lastReadTime = 0;
+    resetSensorHealth(htIndex);
 
     Serial.println("HT" + String(htIndex + 1) + " sensor initialized as type " +
         String(_htSensorConfig[htIndex].sensorType));
@@ -333,7 +561,10 @@ void SensorManager::initializeSensor(int htIndex) {
 
 DateTime SensorManager::getCurrentTime() {
     if (_rtcInitialized) {
-        return _rtc.now();
+        _i2cBus.acquire(I2C_PRIORITY_SENSOR);
+        DateTime now = _rtc.now();
+        _i2cBus.release();
+        return now;
     }
 
     // Use ESP32 time if RTC not available
@@ -347,7 +578,9 @@ DateTime SensorManager::getCurrentTime() {
 
 bool SensorManager::setCurrentTime(int year, int month, int day, int hour, int minute, int second) {
     if (_rtcInitialized) {
+        _i2cBus.acquire(I2C_PRIORITY_SENSOR);
         _rtc.adjust(DateTime(year, month, day, hour, minute, second));
+        _i2cBus.release();
         Serial.println("Updated RTC with client time");
         return true;
     }
@@ -391,8 +624,10 @@ bool SensorManager::syncTimeFromNTP() {
 
         // If RTC available, update it with NTP time
         if (_rtcInitialized) {
+            _i2cBus.acquire(I2C_PRIORITY_SENSOR);
             _rtc.adjust(DateTime(timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday,
                 timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec));
+            _i2cBus.release();
             Serial.println("Updated RTC with NTP time");
         }
 
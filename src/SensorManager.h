@@ -12,7 +12,9 @@
 #include <DallasTemperature.h>
 #include <DHT.h>
 #include <RTClib.h>
-#include <Wire.h>
+#include <ArduinoJson.h>
+#include "I2CBusManager.h"
+#include "I2CSensors.h"
 
  // Sensor type definitions for HT1-HT3 pins
 #define SENSOR_TYPE_DIGITAL  0  // General digital input
@@ -25,6 +27,18 @@
 #define HT2_PIN              33
 #define HT3_PIN              14
 
+// Sensor read health tracking
+#define SENSOR_BACKOFF_MAX_INTERVAL  60000  // Longest retry interval for a failing sensor (ms)
+#define SENSOR_STALE_FAILURES        3      // Consecutive failures before a reading is stale
+#define SENSOR_STALE_TIMEOUT         30000  // Age of last good reading before it is stale (ms)
+
+// Sensor threshold-crossing events
+#define MAX_SENSOR_THRESHOLDS        60     // Registered threshold slots (two per schedule)
+#define SENSOR_MEASURE_TEMPERATURE   0      // Threshold watches temperature
+#define SENSOR_MEASURE_HUMIDITY      1      // Threshold watches humidity
+#define SENSOR_HYSTERESIS_TEMPERATURE 0.5f  // Default temperature hysteresis (C)
+#define SENSOR_HYSTERESIS_HUMIDITY    2.0f  // Default humidity hysteresis (%)
+
 // Structure for HT pin configuration
 struct HTSensorConfig {
     uint8_t sensorType;     // 0=Digital, 1=DHT11, 2=DHT22, 3=DS18B20
@@ -32,11 +46,32 @@ struct HTSensorConfig {
     float humidity;         // Last humidity reading (% - only for DHT sensors)
     bool configured;        // Whether sensor has been configured
     unsigned long lastReadTime; // Last time sensor was read
+    uint8_t consecutiveFailures;    // Failed reads since the last good one
+    unsigned long lastGoodReadTime; // Last time a valid reading was taken
+    unsigned long retryInterval;    // Current back-off interval (0 = normal rate)
+    bool stale;                     // Reading is too old to be trusted
+};
+
+// Registered threshold watched for crossings on a new reading.
+// The state goes high when the value rises above riseLevel and low when it
+// falls below fallLevel, so the gap between the two is the hysteresis band.
+struct SensorThreshold {
+    bool active;            // Slot in use
+    uint8_t ownerId;        // Caller-defined id (e.g. schedule index)
+    uint8_t sensorIndex;    // HT sensor index (0-2)
+    uint8_t measurement;    // SENSOR_MEASURE_TEMPERATURE or SENSOR_MEASURE_HUMIDITY
+    float riseLevel;        // Crossing upward past this level sets the state
+    float fallLevel;        // Crossing downward past this level clears the state
+    bool known;             // State has been established by a reading
+    bool above;             // Current side of the band
 };
 
+// Called when a registered threshold is crossed
+typedef void (*SensorThresholdCallback)(uint8_t ownerId, bool above, void* context);
+
 class SensorManager {
 public:
-    SensorManager();
+    SensorManager(I2CBusManager& i2cBus);
 
     // Initialize sensors
     void begin();
@@ -74,7 +109,30 @@ public:
     float getTemperature(int index);
     float getHumidity(int index);
 
+    // Sensor read health
+    bool isSensorStale(int index);
+    uint8_t getFailureCount(int index);
+
+    // I2C environmental sensors (SHT3x, BME280) on the shared bus
+    void updateI2CSensors();
+    void getI2CSensorsJson(JsonArray& sensorsArray);
+    SHT3xSensor& getSHT3x() { return _sht3x; }
+    BME280Sensor& getBME280() { return _bme280; }
+
+    // Threshold-crossing events
+    void setThresholdCallback(SensorThresholdCallback callback, void* context);
+    bool registerThreshold(uint8_t ownerId, uint8_t sensorIndex, uint8_t measurement,
+        float riseLevel, float fallLevel);
+    void clearThresholds();
+
 private:
+    // Shared I2C bus (RTC and environmental sensors)
+    I2CBusManager& _i2cBus;
+
+    // I2C environmental sensors
+    SHT3xSensor _sht3x;
+    BME280Sensor _bme280;
+
     // GPIO definitions for HT pins
     const uint8_t HT_PINS[3] = { HT1_PIN, HT2_PIN, HT3_PIN }; // HT1, HT2, HT3
 
@@ -90,11 +148,26 @@ private:
     RTC_DS3231 _rtc;
     bool _rtcInitialized;
 
+    // Registered thresholds and the listener for crossings
+    SensorThreshold _thresholds[MAX_SENSOR_THRESHOLDS];
+    SensorThresholdCallback _thresholdCallback;
+    void* _thresholdContext;
+
     // EEPROM address for sensor configurations
     static const int HT_CONFIG_ADDR = 3900;
 
     // Initialize a sensor based on its configuration
     void initializeSensor(int htIndex);
+
+    // Reset health tracking for a sensor
+    void resetSensorHealth(int htIndex);
+
+    // Update health tracking after a read attempt
+    void recordReadSuccess(int htIndex);
+    void recordReadFailure(int htIndex, unsigned long baseInterval);
+
+    // Compare a new reading against the registered thresholds
+    void checkThresholds(int htIndex);
 };
 
 #endif // SENSOR_MANAGER_H
\ No newline at end of file
@@ -19,7 +19,11 @@ WebServerManager::WebServerManager(HardwareManager& hardwareManager, KC868Networ
     _commManager(commManager),
     _interruptManager(interruptManager),
     _server(80),
-    _webSocket(81)
+    _webSocket(81),
+    _broadcastDirty(false),
+    _broadcastDirtySince(0),
+    _lastBroadcastTime(0),
+    _maxUpdateRate(WS_BROADCAST_MAX_RATE)
 {
     // Initialize WebSocket client array
     for (int i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
@@ -59,6 +63,8 @@ void WebServerManager::setupWebServer() {
     _server.on("/api/evaluate-input-schedules", HTTP_GET, [this]() { this->handleEvaluateInputSchedules(); });
     _server.on("/api/analog-triggers", HTTP_GET, [this]() { this->handleAnalogTriggers(); });
     _server.on("/api/analog-triggers", HTTP_POST, [this]() { this->handleUpdateAnalogTriggers(); });
+    _server.on("/api/control-loops", HTTP_GET, [this]() { this->handleControlLoops(); });
+    _server.on("/api/control-loops", HTTP_POST, [this]() { this->handleUpdateControlLoop(); });
     _server.on("/api/ht-sensors", HTTP_GET, [this]() { this->handleHTSensors(); });
     _server.on("/api/ht-sensors", HTTP_POST, [this]() { this->handleUpdateHTSensor(); });
     _server.on("/api/config", HTTP_GET, [this]() { this->handleConfig(); });
@@ -183,7 +189,7 @@ void WebServerManager::webSocketEvent(uint8_t num, WStype_t type, uint8_t* paylo
                         _webSocket.sendTXT(num, response);
 
                         // Broadcast update to all subscribed clients
-                        broadcastUpdate();
+                        requestBroadcast();
                     }
                     else {
                         // Send error response
@@ -206,7 +212,7 @@ void WebServerManager::webSocketEvent(uint8_t num, WStype_t type, uint8_t* paylo
                 // Get protocol-specific configuration
                 String protocol = doc["protocol"];
 
-                DynamicJsonDocument responseDoc(1024);
+                DynamicJsonDocument responseDoc(3072);
                 responseDoc["type"] = "protocol_config";
                 responseDoc["protocol"] = protocol;
 
@@ -226,6 +232,31 @@ void WebServerManager::webSocketEvent(uint8_t num, WStype_t type, uint8_t* paylo
     }
 }
 
+void WebServerManager::requestBroadcast() {
+    if (!_broadcastDirty) {
+        _broadcastDirtySince = millis();
+        _broadcastDirty = true;
+    }
+}
+
+void WebServerManager::serviceBroadcasts() {
+    unsigned long now = millis();
+
+    if (_broadcastDirty) {
+        // Hold briefly so changes from the same input edge coalesce, then respect the rate limit
+        if (now - _broadcastDirtySince >= WS_BROADCAST_HOLDOFF &&
+            now - _lastBroadcastTime >= 1000UL / _maxUpdateRate) {
+            _broadcastDirty = false;
+            _lastBroadcastTime = now;
+            broadcastUpdate();
+        }
+    }
+    else if (now - _lastBroadcastTime >= WS_BROADCAST_IDLE_TICK) {
+        _lastBroadcastTime = now;
+        broadcastUpdate();
+    }
+}
+
 void WebServerManager::broadcastUpdate() {
     DynamicJsonDocument doc(4096);
     doc["type"] = "status_update";
@@ -270,6 +301,8 @@ void WebServerManager::broadcastUpdate() {
                 "Digital Input", "DHT11", "DHT22", "DS18B20"
             };
             sensor["sensorTypeName"] = sensorTypeNames[config->sensorType];
+            sensor["stale"] = config->stale;
+            sensor["failures"] = config->consecutiveFailures;
 
             switch (config->sensorType) {
             case SENSOR_TYPE_DIGITAL:
@@ -289,6 +322,10 @@ void WebServerManager::broadcastUpdate() {
         }
     }
 
+    // Add I2C environmental sensors
+    JsonArray i2cSensors = doc.createNestedArray("i2cSensors");
+    _sensorManager.getI2CSensorsJson(i2cSensors);
+
     // Add analog inputs
     JsonArray analog = doc.createNestedArray("analog");
     for (int i = 0; i < 4; i++) {
@@ -443,7 +480,7 @@ void WebServerManager::handleRelayControl() {
                             ",\"state\":" + String(state ? "true" : "false") + "}";
 
                         // Broadcast update
-                        broadcastUpdate();
+                        requestBroadcast();
                     }
                     else {
                         Serial.println("Failed to write to relay");
@@ -459,7 +496,7 @@ void WebServerManager::handleRelayControl() {
                             String(state ? "true" : "false") + "}";
 
                         // Broadcast update
-                        broadcastUpdate();
+                        requestBroadcast();
                     }
                     else {
                         Serial.println("Failed to write to relays");
@@ -519,6 +556,8 @@ void WebServerManager::handleSystemStatus() {
         sensor["index"] = i;
         sensor["pin"] = "HT" + String(i + 1);
         sensor["type"] = _sensorManager.getSensorType(i);
+        sensor["stale"] = _sensorManager.isSensorStale(i);
+        sensor["failures"] = _sensorManager.getFailureCount(i);
 
         switch (_sensorManager.getSensorType(i)) {
         case 0: // Digital
@@ -545,6 +584,10 @@ void WebServerManager::handleSystemStatus() {
         }
     }
 
+    // Add I2C environmental sensors
+    JsonArray i2cSensors = doc.createNestedArray("i2cSensors");
+    _sensorManager.getI2CSensorsJson(i2cSensors);
+
     // Add analog inputs
     JsonArray analog = doc.createNestedArray("analog");
     for (int i = 0; i < 4; i++) {
@@ -618,6 +661,8 @@ void WebServerManager::handleHTSensors() {
         sensor["pin"] = "HT" + String(i + 1);
         sensor["sensorType"] = config->sensorType;
         sensor["sensorTypeName"] = sensorTypeNames[config->sensorType];
+        sensor["stale"] = config->stale;
+        sensor["failures"] = config->consecutiveFailures;
 
         // Add appropriate readings based on sensor type
         if (config->sensorType == SENSOR_TYPE_DIGITAL) {
@@ -10,15 +10,50 @@
 #include "WebServerManager.h"
 
 void WebServerManager::handleSchedules() {
-    DynamicJsonDocument doc(8192);
-    JsonArray schedulesArray = doc.createNestedArray("schedules");
+    streamJsonCollection("schedules", MAX_SCHEDULES, [this](int index, JsonObject& schedule) {
+        _scheduleManager.getScheduleJson(index, schedule);
+    });
+}
 
-    // Get schedules from scheduler
-    _scheduleManager.getSchedulesJson(schedulesArray);
+void WebServerManager::streamJsonCollection(const char* key, int total, JsonElementFunction element) {
+    int offset = _server.hasArg("offset") ? _server.arg("offset").toInt() : 0;
+    int limit = _server.hasArg("limit") ? _server.arg("limit").toInt() : total;
+    offset = constrain(offset, 0, total);
+    if (limit < 0 || limit > total - offset) {
+        limit = total - offset;
+    }
 
-    String jsonResponse;
-    serializeJson(doc, jsonResponse);
-    _server.send(200, "application/json", jsonResponse);
+    // One element document and one output buffer, reused for every entry
+    StaticJsonDocument<JSON_STREAM_DOC_SIZE> doc;
+    char buffer[JSON_STREAM_ELEMENT_SIZE];
+
+    snprintf(buffer, sizeof(buffer), "{\"total\":%d,\"offset\":%d,\"count\":%d,\"%s\":[",
+        total, offset, limit, key);
+    _server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    _server.send(200, "application/json", buffer);
+
+    for (int i = offset; i < offset + limit; i++) {
+        doc.clear();
+        JsonObject item = doc.to<JsonObject>();
+        element(i, item);
+
+        size_t length = 0;
+        if (i > offset) {
+            buffer[length++] = ',';
+        }
+
+        // Never send a cut-off object - the page stays valid JSON
+        if (doc.overflowed() || measureJson(doc) >= sizeof(buffer) - length) {
+            length += strlcpy(buffer + length, "null", sizeof(buffer) - length);
+        }
+        else {
+            length += serializeJson(doc, buffer + length, sizeof(buffer) - length);
+        }
+        _server.sendContent(buffer, length);
+    }
+
+    _server.sendContent("]}");
+    _server.sendContent("");  // Last chunk
 }
 
 void WebServerManager::handleUpdateSchedule() {
@@ -71,30 +106,21 @@ void WebServerManager::handleEvaluateInputSchedules() {
 }
 
 void WebServerManager::handleAnalogTriggers() {
-    DynamicJsonDocument doc(4096);
-
-    // Check if a specific trigger ID was requested
-    if (_server.hasArg("id")) {
-        int triggerId = _server.arg("id").toInt();
-        AnalogTrigger* trigger = _scheduleManager.getAnalogTrigger(triggerId);
-
-        if (trigger) {
-            JsonObject triggerJson = doc.createNestedObject("trigger");
-            triggerJson["id"] = triggerId;
-            triggerJson["enabled"] = trigger->enabled;
-            triggerJson["name"] = trigger->name;
-            triggerJson["analogInput"] = trigger->analogInput;
-            triggerJson["threshold"] = trigger->threshold;
-            triggerJson["condition"] = trigger->condition;
-            triggerJson["action"] = trigger->action;
-            triggerJson["targetType"] = trigger->targetType;
-            triggerJson["targetId"] = trigger->targetId;
-        }
+    // Without a specific trigger ID, return all triggers, streamed
+    if (!_server.hasArg("id")) {
+        streamJsonCollection("triggers", MAX_ANALOG_TRIGGERS, [this](int index, JsonObject& trigger) {
+            _scheduleManager.getAnalogTriggerJson(index, trigger);
+        });
+        return;
     }
-    else {
-        // Return all triggers
-        JsonArray triggersArray = doc.createNestedArray("triggers");
-        _scheduleManager.getAnalogTriggersJson(triggersArray);
+
+    DynamicJsonDocument doc(1024);
+    int triggerId = _server.arg("id").toInt();
+    AnalogTrigger* trigger = _scheduleManager.getAnalogTrigger(triggerId);
+
+    if (trigger) {
+        JsonObject triggerJson = doc.createNestedObject("trigger");
+        _scheduleManager.getAnalogTriggerJson(triggerId, triggerJson);
     }
 
     String jsonResponse;
@@ -145,6 +171,36 @@ void WebServerManager::handleUpdateAnalogTriggers() {
     _server.send(200, "application/json", response);
 }
 
+void WebServerManager::handleControlLoops() {
+    DynamicJsonDocument doc(4096);
+
+    JsonArray loopsArray = doc.createNestedArray("loops");
+    _scheduleManager.getControlLoopsJson(loopsArray);
+
+    String jsonResponse;
+    serializeJson(doc, jsonResponse);
+    _server.send(200, "application/json", jsonResponse);
+}
+
+void WebServerManager::handleUpdateControlLoop() {
+    String response = "{\"status\":\"error\",\"message\":\"Invalid request\"}";
+
+    if (_server.hasArg("plain")) {
+        String body = _server.arg("plain");
+        DynamicJsonDocument doc(1024);
+        DeserializationError error = deserializeJson(doc, body);
+
+        if (!error && doc.containsKey("loop")) {
+            JsonObject loopJson = doc["loop"];
+            if (_scheduleManager.updateControlLoop(loopJson)) {
+                response = "{\"status\":\"success\"}";
+            }
+        }
+    }
+
+    _server.send(200, "application/json", response);
+}
+
 void WebServerManager::handleHTSensors() {
     DynamicJsonDocument doc(1024);
     JsonArray sensorsArray = doc.createNestedArray("htSensors");
@@ -161,6 +217,8 @@ void WebServerManager::handleHTSensors() {
             sensor["pin"] = "HT" + String(i + 1);
             sensor["sensorType"] = config->sensorType;
             sensor["sensorTypeName"] = sensorTypeNames[config->sensorType];
+            sensor["stale"] = config->stale;
+            sensor["failures"] = config->consecutiveFailures;
 
             // Add appropriate readings based on sensor type
             if (config->sensorType == SENSOR_TYPE_DIGITAL) {
@@ -365,7 +423,7 @@ void WebServerManager::handleReboot() {
 }
 
 void WebServerManager::handleCommunicationStatus() {
-    DynamicJsonDocument doc(1024);
+    DynamicJsonDocument doc(8192);
 
     // Add active protocol
     doc["active_protocol"] = _commManager.getActiveProtocol();
@@ -385,6 +443,12 @@ void WebServerManager::handleCommunicationStatus() {
     // Add I2C status
     doc["i2c_error_count"] = _hardwareManager.getI2CErrorCount();
 
+    // Add Modbus master poll statistics and virtual channels
+    if (_commManager.isModbusMasterEnabled()) {
+        JsonObject master = doc.createNestedObject("modbus_master");
+        _commManager.getModbusMasterJson(master);
+    }
+
     String jsonResponse;
     serializeJson(doc, jsonResponse);
     _server.send(200, "application/json", jsonResponse);
@@ -419,7 +483,7 @@ void WebServerManager::handleCommunicationConfig() {
     if (_server.hasArg("protocol")) {
         String protocol = _server.arg("protocol");
 
-        DynamicJsonDocument doc(1024);
+        DynamicJsonDocument doc(3072);
         doc["protocol"] = protocol;
 
         // Get protocol-specific configuration
@@ -514,18 +578,42 @@ void WebServerManager::handleSetTime() {
     _server.send(200, "application/json", response);
 }
 
+// Starts a background scan unless ?job= asks about an existing one, and returns
+// straight away with the job id and the presence map as it stands
 void WebServerManager::handleI2CScan() {
-    DynamicJsonDocument doc(1024);
+    DynamicJsonDocument doc(2048);
+    I2CBusManager& bus = _hardwareManager.getI2CBus();
+
+    uint16_t jobId;
+    if (_server.hasArg("job")) {
+        jobId = _server.arg("job").toInt();
+    }
+    else {
+        jobId = bus.startScan();
+    }
+
+    doc["job"] = jobId;
+    doc["running"] = bus.isScanRunning() && jobId == bus.getScanJobId();
+    doc["progress"] = bus.getScanProgress();
+    if (jobId != bus.getScanJobId()) {
+        doc["error"] = "Unknown or superseded scan job";
+    }
+
     JsonArray devices = doc.createNestedArray("devices");
+    JsonArray missing = doc.createNestedArray("missing");
 
     int deviceCount = 0;
 
-    // Scan I2C bus
-    for (uint8_t address = 1; address < 127; address++) {
-        Wire.beginTransmission(address);
-        uint8_t error = Wire.endTransmission();
+    for (uint8_t address = I2C_FIRST_ADDRESS; address <= I2C_LAST_ADDRESS; address++) {
+        uint8_t state = bus.getDeviceState(address);
 
-        if (error == 0) {
+        if (state == I2C_DEVICE_ABSENT) {
+            JsonObject device = missing.createNestedObject();
+            device["address"] = "0x" + String(address, HEX);
+            device["failures"] = bus.getDeviceFailures(address);
+            device["retrying"] = bus.isDeviceAvailable(address);
+        }
+        else if (state == I2C_DEVICE_PRESENT) {
             JsonObject device = devices.createNestedObject();
             device["address"] = "0x" + String(address, HEX);
 
@@ -538,6 +626,7 @@ void WebServerManager::handleI2CScan() {
             else if (address == 0x25) name = "PCF8574 (Outputs 9-16)";
             else if (address == 0x68) name = "DS3231 RTC";
             else if (address == 0x3C || address == 0x3D) name = "OLED Display";
+            else if (address == 0x44 || address == 0x45) name = "SHT3x";
             else if (address == 0x76 || address == 0x77) name = "BMP280/BME280";
 
             device["name"] = name;
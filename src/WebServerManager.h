@@ -14,6 +14,7 @@
 #include <ESPmDNS.h>
 #include <Update.h>
 #include <ArduinoJson.h>
+#include <functional>
 #include "HardwareManager.h"
 #include "NetworkManager.h"
 #include "SensorManager.h"
@@ -22,6 +23,18 @@
 #include "CommManager.h"
 #include "InterruptManager.h"
 
+// Broadcast coalescing
+#define WS_BROADCAST_MAX_RATE  10    // Default maximum broadcasts per second
+#define WS_BROADCAST_HOLDOFF   10    // Delay after the first change so a burst goes out as one update (ms)
+#define WS_BROADCAST_IDLE_TICK 1000  // Periodic broadcast when nothing was marked dirty (ms)
+
+// Collection responses are streamed one element at a time
+#define JSON_STREAM_ELEMENT_SIZE 512  // Serialized element buffer (bytes)
+#define JSON_STREAM_DOC_SIZE     768  // Element document capacity (bytes)
+
+// Fills collection entry 'index' into an element object
+typedef std::function<void(int index, JsonObject& element)> JsonElementFunction;
+
  // Forward declarations
 class HardwareManager;
 class KC868NetworkManager;
@@ -57,6 +70,13 @@ public:
     // Broadcast update to all WebSocket clients
     void broadcastUpdate();
 
+    // Mark the state as changed; serviceBroadcasts() sends one update for
+    // everything changed since the last one, at most maxRate times per second
+    void requestBroadcast();
+    void serviceBroadcasts();
+    void setMaxUpdateRate(uint8_t rate) { _maxUpdateRate = (rate > 0) ? rate : 1; }
+    uint8_t getMaxUpdateRate() { return _maxUpdateRate; }
+
     // Get uptime string
     String getUptimeString();
 
@@ -87,6 +107,12 @@ private:
     // WebSocket client status
     bool _webSocketClients[WEBSOCKETS_SERVER_CLIENT_MAX];
 
+    // Broadcast coalescing state
+    volatile bool _broadcastDirty;
+    unsigned long _broadcastDirtySince;
+    unsigned long _lastBroadcastTime;
+    uint8_t _maxUpdateRate;
+
     // File upload
     File _fsUploadFile;
 
@@ -101,6 +127,8 @@ private:
     void handleEvaluateInputSchedules();
     void handleAnalogTriggers();
     void handleUpdateAnalogTriggers();
+    void handleControlLoops();
+    void handleUpdateControlLoop();
     void handleConfig();
     void handleUpdateConfig();
     void handleDebug();
@@ -118,6 +146,10 @@ private:
     void handleNetworkSettings();
     void handleUpdateNetworkSettings();
 
+    // Send {"total":n,"offset":o,"count":c,"<key>":[...]} with chunked
+    // encoding, honouring the ?offset= and ?limit= page parameters
+    void streamJsonCollection(const char* key, int total, JsonElementFunction element);
+
     // Process command received via WebSocket or API
     String processCommand(String command);
 
@@ -0,0 +1,412 @@
+#!/usr/bin/env python3
+"""
+binary_protocol_bench.py - Binary control protocol client and benchmark for
+the KC868-A16 controller
+
+Drives the controller's framed binary protocol over a serial port (USB or an
+RS485 adapter) and compares its command rate with the text protocol:
+
+    python3 tools/binary_protocol_bench.py --port /dev/ttyUSB0 --baud 115200
+    python3 tools/binary_protocol_bench.py --port /dev/ttyUSB0 --window 8 --count 5000
+    python3 tools/binary_protocol_bench.py --pty
+
+--window is the number of requests kept in flight; the firmware answers them
+in order and each response carries its request id. With --pty no hardware
+is needed: the benchmark talks to a built-in device emulator through a
+pseudo-terminal pair. The emulator is a Python model of the protocol, not
+the firmware: it models the loop() pass (--loop-time), one relay expander
+write per pass that changes relays (--write-time) and the time replies take
+on the wire at --baud. Its figures show how pipelining amortises those
+costs; only a run against the controller (--port) measures the firmware.
+
+Frame layout (both directions):
+
+    0xA5, body length, request id, opcode, payload..., CRC-16/MODBUS (low, high)
+
+The body length counts the id, opcode and payload; the CRC covers the length
+byte up to the end of the payload. Responses carry a status byte ahead of
+their payload. Only the Python standard library is used (POSIX termios).
+"""
+
+import argparse
+import os
+import select
+import struct
+import sys
+import termios
+import threading
+import time
+import tty
+
+FRAME_START = 0xA5
+PROTOCOL_VERSION = 1
+
+OP_PING = 0x01
+OP_SET_RELAYS = 0x10
+OP_CLEAR_RELAYS = 0x11
+OP_TOGGLE_RELAYS = 0x12
+OP_WRITE_RELAYS = 0x13
+OP_READ_RELAYS = 0x14
+OP_READ_INPUTS = 0x20
+OP_READ_ANALOG = 0x21
+OP_BATCH = 0x30
+
+STATUS_OK = 0
+STATUS_BAD_OPCODE = 1
+STATUS_BAD_LENGTH = 2
+STATUS_IO_ERROR = 3
+
+# Binary frames the firmware handles per port in one loop() pass
+FRAMES_PER_PASS = 16
+
+BAUD_RATES = {1200: termios.B1200, 2400: termios.B2400, 4800: termios.B4800, 9600: termios.B9600,
+              19200: termios.B19200, 38400: termios.B38400, 57600: termios.B57600,
+              115200: termios.B115200, 230400: termios.B230400}
+for _rate in (460800, 921600):
+    if hasattr(termios, 'B%d' % _rate):
+        BAUD_RATES[_rate] = getattr(termios, 'B%d' % _rate)
+
+
+def _crc_table():
+    table = []
+    for value in range(256):
+        crc = value
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+
+CRC_TABLE = _crc_table()
+
+
+def crc16(data):
+    """CRC-16/MODBUS, as used by the firmware."""
+    crc = 0xFFFF
+    for byte in data:
+        crc = (crc >> 8) ^ CRC_TABLE[(crc ^ byte) & 0xFF]
+    return crc
+
+
+def build_frame(request_id, opcode, payload=b''):
+    body = bytes([2 + len(payload), request_id & 0xFF, opcode]) + payload
+    return bytes([FRAME_START]) + body + struct.pack('<H', crc16(body))
+
+
+class FrameParser:
+    """Splits a byte stream into frames; yields (id, opcode, payload)."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.errors = 0
+
+    def feed(self, data):
+        self.buffer += data
+        frames = []
+        while True:
+            start = self.buffer.find(bytes([FRAME_START]))
+            if start < 0:
+                self.buffer.clear()
+                break
+            del self.buffer[:start]
+            if len(self.buffer) < 2:
+                break
+            length = self.buffer[1]
+            if length < 2:
+                del self.buffer[:1]
+                self.errors += 1
+                continue
+            if len(self.buffer) < length + 4:
+                break
+            body = bytes(self.buffer[1:length + 2])
+            crc = struct.unpack('<H', bytes(self.buffer[length + 2:length + 4]))[0]
+            if crc != crc16(body):
+                # Resynchronise on the next start byte
+                del self.buffer[:1]
+                self.errors += 1
+                continue
+            del self.buffer[:length + 4]
+            frames.append((body[1], body[2], body[3:]))
+        return frames
+
+
+def open_port(path, baud):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    configure_raw(fd, baud)
+    return fd
+
+
+def configure_raw(fd, baud):
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    attrs[2] |= termios.CLOCAL | termios.CREAD
+    if baud is not None:
+        attrs[4] = attrs[5] = BAUD_RATES[baud]
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+
+
+def read_available(fd, timeout):
+    ready, _, _ = select.select([fd], [], [], timeout)
+    if not ready:
+        return b''
+    try:
+        return os.read(fd, 4096)
+    except BlockingIOError:
+        return b''
+
+
+def write_all(fd, data):
+    while data:
+        try:
+            written = os.write(fd, data)
+            data = data[written:]
+        except BlockingIOError:
+            select.select([], [fd], [], 1.0)
+
+
+class Emulator(threading.Thread):
+    """Device side of the protocol for --pty runs: relays are a mask, inputs
+    and analog values are fixed, text commands get a one-line reply. Loop
+    time, the expander write and line speed are simulated, as a pty
+    transfers instantly."""
+
+    def __init__(self, fd, baud, loop_time, write_time):
+        super().__init__(daemon=True)
+        self.fd = fd
+        self.baud = baud
+        self.loop_time = loop_time
+        self.write_time = write_time
+        self.relays = 0
+        self.running = True
+
+    def handle(self, opcode, payload):
+        relay_ops = (OP_SET_RELAYS, OP_CLEAR_RELAYS, OP_TOGGLE_RELAYS, OP_WRITE_RELAYS)
+
+        def apply(op, mask, value):
+            return {OP_SET_RELAYS: mask | value, OP_CLEAR_RELAYS: mask & ~value,
+                    OP_TOGGLE_RELAYS: mask ^ value}.get(op, value) & 0xFFFF
+
+        if opcode == OP_PING:
+            return STATUS_OK, bytes([PROTOCOL_VERSION])
+        if opcode in relay_ops:
+            if len(payload) != 2:
+                return STATUS_BAD_LENGTH, b''
+            self.relays = apply(opcode, self.relays, struct.unpack('<H', payload)[0])
+        elif opcode == OP_BATCH:
+            if not payload or len(payload) % 3:
+                return STATUS_BAD_LENGTH, b''
+            mask = self.relays
+            for i in range(0, len(payload), 3):
+                if payload[i] not in relay_ops:
+                    return STATUS_BAD_OPCODE, b''
+                mask = apply(payload[i], mask, struct.unpack('<H', payload[i + 1:i + 3])[0])
+            self.relays = mask
+        elif opcode == OP_READ_INPUTS:
+            return STATUS_OK, struct.pack('<HB', 0x00FF, 0)
+        elif opcode == OP_READ_ANALOG:
+            return STATUS_OK, struct.pack('<8H', 0, 1024, 2048, 4095, 0, 1250, 2500, 5000)
+        elif opcode != OP_READ_RELAYS:
+            return STATUS_BAD_OPCODE, b''
+        return STATUS_OK, struct.pack('<H', self.relays)
+
+    def frame_reply(self, body):
+        status, reply = self.handle(body[2], body[3:])
+        response = bytes([3 + len(reply), body[1], body[2], status]) + reply
+        return bytes([FRAME_START]) + response + struct.pack('<H', crc16(response))
+
+    def run(self):
+        # Like the firmware, each loop() pass takes one text line or up to
+        # FRAMES_PER_PASS binary frames, whose relay changes share a single
+        # expander write; replies then take their time on the wire
+        buffer = bytearray()
+        while self.running:
+            time.sleep(self.loop_time)
+            buffer += read_available(self.fd, 0)
+            out = bytearray()
+            frames = 0
+            relays = self.relays
+            text_write = False
+            while buffer and frames < FRAMES_PER_PASS:
+                if buffer[0] == FRAME_START:
+                    if len(buffer) < 2 or len(buffer) < buffer[1] + 4:
+                        break
+                    length = buffer[1]
+                    body = bytes(buffer[1:length + 2])
+                    crc = struct.unpack('<H', bytes(buffer[length + 2:length + 4]))[0]
+                    del buffer[:length + 4]
+                    if crc == crc16(body):
+                        out += self.frame_reply(body)
+                        frames += 1
+                    continue
+
+                end = buffer.find(b'\n')
+                if end < 0:
+                    break
+                line = bytes(buffer[:end]).strip()
+                del buffer[:end + 1]
+                if line:
+                    text_write = line.upper().startswith(b'RELAY')
+                    out += b'OK ' + line + b'\r\n'
+                    break
+            if (text_write or self.relays != relays) and self.write_time > 0:
+                time.sleep(self.write_time)
+            if out:
+                time.sleep(len(out) * 10.0 / self.baud)
+                write_all(self.fd, bytes(out))
+
+
+class Client:
+    def __init__(self, fd, timeout):
+        self.fd = fd
+        self.timeout = timeout
+        self.parser = FrameParser()
+        self.next_id = 0
+        self.pending = []
+        self.frames = []
+
+    def send(self, opcode, payload=b''):
+        request_id = self.next_id
+        self.next_id = (self.next_id + 1) & 0xFF
+        write_all(self.fd, build_frame(request_id, opcode, payload))
+        self.pending.append((request_id, opcode))
+        return request_id
+
+    def receive(self):
+        """Wait for the oldest outstanding response; returns (status, payload)."""
+        deadline = time.monotonic() + self.timeout
+        while True:
+            if self.frames:
+                request_id, opcode, payload = self.frames.pop(0)
+                expected_id, expected_opcode = self.pending.pop(0)
+                if request_id != expected_id or opcode != expected_opcode:
+                    raise RuntimeError('response %d/0x%02x does not match request %d/0x%02x' %
+                                       (request_id, opcode, expected_id, expected_opcode))
+                return payload[0], payload[1:]
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise TimeoutError('no response to request %d' % self.pending[0][0])
+            self.frames.extend(self.parser.feed(read_available(self.fd, remaining)))
+
+    def request(self, opcode, payload=b''):
+        self.send(opcode, payload)
+        return self.receive()
+
+    def text(self, line):
+        """Send a text command and wait for the first line of its reply."""
+        write_all(self.fd, line.encode('ascii') + b'\r\n')
+        buffer = bytearray()
+        deadline = time.monotonic() + self.timeout
+        while b'\n' not in buffer:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise TimeoutError('no reply to %r' % line)
+            buffer += read_available(self.fd, remaining)
+        return bytes(buffer).split(b'\n', 1)[0].strip().decode('latin-1')
+
+
+def check_protocol(client):
+    status, payload = client.request(OP_PING)
+    if status != STATUS_OK or payload[:1] != bytes([PROTOCOL_VERSION]):
+        raise RuntimeError('unexpected PING reply: status %d, %r' % (status, payload))
+
+    saved = struct.unpack('<H', client.request(OP_READ_RELAYS)[1])[0]
+    assert client.request(OP_WRITE_RELAYS, struct.pack('<H', 0x0000)) == (STATUS_OK, b'\x00\x00')
+    assert client.request(OP_SET_RELAYS, struct.pack('<H', 0x0005)) == (STATUS_OK, b'\x05\x00')
+    assert client.request(OP_TOGGLE_RELAYS, struct.pack('<H', 0x0003)) == (STATUS_OK, b'\x06\x00')
+    assert client.request(OP_CLEAR_RELAYS, struct.pack('<H', 0x0002)) == (STATUS_OK, b'\x04\x00')
+    batch = bytes([OP_SET_RELAYS, 0xF0, 0x00, OP_CLEAR_RELAYS, 0x04, 0x00, OP_TOGGLE_RELAYS, 0x00, 0x80])
+    assert client.request(OP_BATCH, batch) == (STATUS_OK, b'\xf0\x80')
+    assert client.request(OP_BATCH, b'\x77\x00\x00')[0] == STATUS_BAD_OPCODE
+    assert client.request(OP_SET_RELAYS, b'\x01')[0] == STATUS_BAD_LENGTH
+    assert client.request(0x7F)[0] == STATUS_BAD_OPCODE
+
+    status, inputs = client.request(OP_READ_INPUTS)
+    assert status == STATUS_OK and len(inputs) == 3
+    status, analog = client.request(OP_READ_ANALOG)
+    assert status == STATUS_OK and len(analog) == 16
+
+    client.request(OP_WRITE_RELAYS, struct.pack('<H', saved))
+    print('protocol check passed (inputs 0x%04x, analog raw %s mV %s)' % (
+        struct.unpack('<H', inputs[:2])[0], list(struct.unpack('<4H', analog[:8])),
+        list(struct.unpack('<4H', analog[8:]))))
+
+
+def bench_text(client, count):
+    start = time.monotonic()
+    for i in range(count):
+        client.text('RELAY %d %s' % (i % 16 + 1, 'ON' if (i // 16) % 2 == 0 else 'OFF'))
+    return count / (time.monotonic() - start)
+
+
+def bench_binary(client, count, window):
+    start = time.monotonic()
+    sent = 0
+    received = 0
+    while received < count:
+        while sent < count and sent - received < window:
+            client.send(OP_TOGGLE_RELAYS, struct.pack('<H', 1 << (sent % 16)))
+            sent += 1
+        status, _ = client.receive()
+        if status != STATUS_OK:
+            raise RuntimeError('request failed with status %d' % status)
+        received += 1
+    return count / (time.monotonic() - start)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the binary control protocol against the text one')
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('--port', help='serial device of the controller')
+    target.add_argument('--pty', action='store_true', help='use the built-in emulator over a pty pair')
+    parser.add_argument('--baud', type=int, default=115200, choices=sorted(BAUD_RATES),
+                        help='line speed, as configured on the controller (default: 115200)')
+    parser.add_argument('--count', type=int, default=2000, help='commands per run (default: 2000)')
+    parser.add_argument('--window', type=int, default=4, help='binary requests in flight (default: 4)')
+    parser.add_argument('--timeout', type=float, default=1.0, help='response timeout in seconds (default: 1.0)')
+    parser.add_argument('--loop-time', type=float, default=1.0,
+                        help='emulated loop() pass in ms, --pty only (default: 1.0)')
+    parser.add_argument('--write-time', type=float, default=0.0,
+                        help='emulated relay expander write in ms, --pty only (default: 0)')
+    parser.add_argument('--skip-text', action='store_true', help='only run the binary benchmark')
+    args = parser.parse_args()
+
+    emulator = None
+    if args.pty:
+        master, slave = os.openpty()
+        configure_raw(slave, None)
+        os.set_blocking(slave, False)
+        emulator = Emulator(slave, args.baud, args.loop_time / 1000.0, args.write_time / 1000.0)
+        emulator.start()
+        fd = master
+        configure_raw(fd, None)
+        os.set_blocking(fd, False)
+    else:
+        fd = open_port(args.port, args.baud)
+
+    client = Client(fd, args.timeout)
+    try:
+        check_protocol(client)
+
+        results = []
+        if not args.skip_text:
+            results.append(('text', bench_text(client, args.count)))
+        results.append(('binary, 1 in flight', bench_binary(client, args.count, 1)))
+        if args.window > 1:
+            results.append(('binary, %d in flight' % args.window, bench_binary(client, args.count, args.window)))
+
+        print('%-24s %12s' % ('protocol', 'commands/s'))
+        for name, rate in results:
+            print('%-24s %12.0f' % (name, rate))
+        if not args.skip_text:
+            print('binary is %.1fx faster than text' % (results[-1][1] / results[0][1]))
+        if client.parser.errors:
+            print('%d corrupt response frames' % client.parser.errors, file=sys.stderr)
+    finally:
+        if emulator:
+            emulator.running = False
+        os.close(fd)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,344 @@
+#!/usr/bin/env python3
+"""
+build_web_assets.py - Web asset pipeline for the KC868-A16 controller
+
+Minifies and gzips the dashboard in data/ and gives the script and style
+sheet content-hashed names, so the firmware can serve them with
+Content-Encoding: gzip and cache them in the browser forever:
+
+    data/index.html  ->  index.html.gz              (no-cache, ETag / 304)
+    data/script.js   ->  script.<hash>.js.gz        (immutable)
+    data/style.css   ->  style.<hash>.css.gz        (immutable)
+
+index.html is rewritten to reference the hashed names. Run it after editing
+anything in data/ and before uploading the SPIFFS image:
+
+    python3 tools/build_web_assets.py               # writes next to the sources
+    python3 tools/build_web_assets.py --out www     # separate image folder
+    python3 tools/build_web_assets.py --embed       # web_assets.h for the firmware
+
+With --embed the same packed assets are written as constant byte arrays to
+web_assets.h in the sketch folder instead; building with WEB_ASSETS_EMBEDDED
+set to 1 serves them straight from flash, so the UI always matches the
+firmware and no SPIFFS image is needed.
+
+The firmware serves a .gz file in place of the plain one whenever both are
+present, so the plain sources can stay in the image as a fallback or be left
+out by building into a separate folder. Only index.html, script.js and
+style.css (and their hashed/.gz forms) are served; anything else in the
+image is ignored, so keep the firmware's webAssetNames in step with
+ENTRY_PAGE and HASHED_ASSETS. Only the Python standard library is
+used. Minification is deliberately conservative (comments and indentation
+only, line breaks are kept); gzip does most of the work.
+"""
+
+import argparse
+import gzip
+import hashlib
+import io
+import os
+import re
+import sys
+
+# Assets referenced from index.html that get hashed names
+HASHED_ASSETS = ['script.js', 'style.css']
+ENTRY_PAGE = 'index.html'
+HASH_LENGTH = 8
+
+CONTENT_TYPES = {'.html': 'text/html', '.js': 'application/javascript', '.css': 'text/css'}
+
+# Characters and keywords after which a '/' starts a regular expression
+REGEX_PREFIX_CHARS = set('(,=:[!&|?{};+-*%<>~^')
+REGEX_PREFIX_WORDS = {'return', 'typeof', 'case', 'do', 'else', 'in', 'of',
+                      'new', 'delete', 'void', 'throw', 'instanceof', 'yield', 'await'}
+
+
+def minify_js(source):
+    """Drop comments, indentation and blank lines; strings, template literals
+    and regular expressions are copied untouched."""
+    out = []
+    i = 0
+    n = len(source)
+    # One entry per open template literal: brace depth of its ${ } expression
+    template_stack = []
+
+    def last_significant():
+        for ch in reversed(out):
+            if ch not in ' \n':
+                return ch
+        return ''
+
+    def trailing_word():
+        j = len(out)
+        while j > 0 and out[j - 1] == ' ':
+            j -= 1
+        k = j
+        while k > 0 and (out[k - 1].isalnum() or out[k - 1] in '_$'):
+            k -= 1
+        return ''.join(out[k:j])
+
+    def copy_template():
+        # Copy template text up to the closing backtick or the next ${
+        nonlocal i
+        while i < n:
+            ch = source[i]
+            if ch == '\\':
+                out.append(source[i:i + 2])
+                i += 2
+            elif ch == '`':
+                out.append(ch)
+                i += 1
+                return False
+            elif source.startswith('${', i):
+                out.append('${')
+                i += 2
+                return True
+            else:
+                out.append(ch)
+                i += 1
+        return False
+
+    while i < n:
+        ch = source[i]
+
+        if source.startswith('//', i):
+            while i < n and source[i] != '\n':
+                i += 1
+            continue
+
+        if source.startswith('/*', i):
+            end = source.find('*/', i + 2)
+            end = n if end < 0 else end + 2
+            # A comment spanning lines still separates statements
+            if '\n' in source[i:end]:
+                out.append('\n')
+            i = end
+            continue
+
+        if ch in ' \t\r':
+            if out and out[-1] not in ' \n':
+                out.append(' ')
+            i += 1
+            continue
+
+        if ch == '\n':
+            while out and out[-1] == ' ':
+                out.pop()
+            if out and out[-1] != '\n':
+                out.append('\n')
+            i += 1
+            continue
+
+        if ch in '\'"':
+            j = i + 1
+            while j < n and source[j] != ch:
+                j += 2 if source[j] == '\\' else 1
+            out.append(source[i:j + 1])
+            i = j + 1
+            continue
+
+        if ch == '`':
+            out.append(ch)
+            i += 1
+            if copy_template():
+                template_stack.append(0)
+            continue
+
+        if template_stack and ch == '{':
+            template_stack[-1] += 1
+        elif template_stack and ch == '}':
+            if template_stack[-1] == 0:
+                # End of a ${ } expression - back into the template text
+                template_stack.pop()
+                out.append(ch)
+                i += 1
+                if copy_template():
+                    template_stack.append(0)
+                continue
+            template_stack[-1] -= 1
+
+        if ch == '/':
+            prev = last_significant()
+            if prev == '' or prev in REGEX_PREFIX_CHARS or prev == '}' or trailing_word() in REGEX_PREFIX_WORDS:
+                j = i + 1
+                in_class = False
+                while j < n and source[j] != '\n':
+                    if source[j] == '\\':
+                        j += 2
+                        continue
+                    if source[j] == '[':
+                        in_class = True
+                    elif source[j] == ']':
+                        in_class = False
+                    elif source[j] == '/' and not in_class:
+                        break
+                    j += 1
+                j += 1
+                while j < n and (source[j].isalpha()):
+                    j += 1
+                out.append(source[i:j])
+                i = j
+                continue
+
+        out.append(ch)
+        i += 1
+
+    return ''.join(out).strip() + '\n'
+
+
+def minify_css(source):
+    """Drop comments and collapse whitespace around block punctuation."""
+    source = re.sub(r'/\*.*?\*/', '', source, flags=re.S)
+    source = re.sub(r'\s+', ' ', source)
+    source = re.sub(r'\s*([{};,>])\s*', r'\1', source)
+    source = source.replace(';}', '}')
+    return source.strip() + '\n'
+
+
+def minify_html(source):
+    """Drop comments, indentation and blank lines."""
+    source = re.sub(r'<!--(?!\[if).*?-->', '', source, flags=re.S)
+    lines = (line.strip() for line in source.splitlines())
+    return '\n'.join(line for line in lines if line) + '\n'
+
+
+def gzip_bytes(data):
+    # Fixed mtime and no file name so unchanged input gives identical output
+    buffer = io.BytesIO()
+    with gzip.GzipFile(filename='', mode='wb', compresslevel=9, fileobj=buffer, mtime=0) as f:
+        f.write(data)
+    return buffer.getvalue()
+
+
+def content_hash(data):
+    return hashlib.sha256(data).hexdigest()[:HASH_LENGTH]
+
+
+def hashed_name(name, digest):
+    base, ext = os.path.splitext(name)
+    return '%s.%s%s' % (base, digest, ext)
+
+
+def remove_stale(out_dir, name):
+    # Earlier builds of the same asset under other hashes
+    base, ext = os.path.splitext(name)
+    pattern = re.compile(r'^%s\.[0-9a-f]{%d}%s\.gz$' % (re.escape(base), HASH_LENGTH, re.escape(ext)))
+    for existing in os.listdir(out_dir):
+        if pattern.match(existing):
+            os.remove(os.path.join(out_dir, existing))
+
+
+def write_embedded_header(path, assets):
+    """Write the packed assets as PROGMEM arrays plus a lookup table."""
+    lines = [
+        '// web_assets.h - generated by tools/build_web_assets.py from data/, do not edit',
+        '',
+        '#ifndef WEB_ASSETS_H',
+        '#define WEB_ASSETS_H',
+        '',
+        '#include <Arduino.h>',
+        '',
+        '// Gzipped web asset compiled into the firmware image',
+        'struct EmbeddedWebAsset {',
+        '    const char* url;',
+        '    const char* contentType;',
+        '    const uint8_t* data;',
+        '    size_t length;',
+        '    bool immutable;                 // Content-hashed name',
+        '    const char* etag;',
+        '};',
+        '',
+    ]
+
+    for index, (url, content_type, data, immutable, etag) in enumerate(assets):
+        lines.append('// %s' % url)
+        lines.append('static const uint8_t webAssetData%d[] PROGMEM = {' % index)
+        for offset in range(0, len(data), 16):
+            chunk = data[offset:offset + 16]
+            lines.append('    ' + ', '.join('0x%02x' % b for b in chunk) + ',')
+        lines.append('};')
+        lines.append('')
+
+    lines.append('static const EmbeddedWebAsset embeddedWebAssets[] = {')
+    for index, (url, content_type, data, immutable, etag) in enumerate(assets):
+        lines.append('    { "%s", "%s", webAssetData%d, %d, %s, "\\"%s\\"" },' % (
+            url, content_type, index, len(data), 'true' if immutable else 'false', etag))
+    lines.append('};')
+    lines.append('#define EMBEDDED_WEB_ASSET_COUNT %d' % len(assets))
+    lines.append('')
+    lines.append('#endif // WEB_ASSETS_H')
+
+    with open(path, 'w', newline='\r\n') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Minify, gzip and hash the web assets')
+    parser.add_argument('--src', default='data', help='source folder (default: data)')
+    parser.add_argument('--out', help='output folder (default: same as --src)')
+    parser.add_argument('--no-minify', action='store_true', help='only gzip and hash')
+    parser.add_argument('--embed', nargs='?', const='web_assets.h', metavar='HEADER',
+                        help='write the assets to a C header (default: web_assets.h); '
+                             'the .gz files are then only written when --out is given')
+    args = parser.parse_args()
+
+    out_dir = args.out or args.src
+    write_files = args.embed is None or args.out is not None
+    if write_files:
+        os.makedirs(out_dir, exist_ok=True)
+
+    minifiers = {'.js': minify_js, '.css': minify_css, '.html': minify_html}
+    report = []
+
+    def build(name):
+        with open(os.path.join(args.src, name), encoding='utf-8') as f:
+            source = f.read()
+        text = source if args.no_minify else minifiers[os.path.splitext(name)[1]](source)
+        return source, text.encode('utf-8')
+
+    # Hashed assets first - the page needs their final names
+    renames = {}
+    embedded = []
+    for name in HASHED_ASSETS:
+        source, data = build(name)
+        target = hashed_name(name, content_hash(data))
+        renames[name] = target
+
+        packed = gzip_bytes(data)
+        if write_files:
+            remove_stale(out_dir, name)
+            with open(os.path.join(out_dir, target + '.gz'), 'wb') as f:
+                f.write(packed)
+        embedded.append(('/' + target, CONTENT_TYPES[os.path.splitext(name)[1]], packed, True,
+                         target.split('.')[-2]))
+        report.append((target + '.gz', len(source.encode('utf-8')), len(data), len(packed)))
+
+    source, data = build(ENTRY_PAGE)
+    page = data.decode('utf-8')
+    for name, target in renames.items():
+        page, count = re.subn(r'(\b(?:src|href)=["\'])/?%s(["\'])' % re.escape(name), r'\g<1>%s\2' % target, page)
+        if count == 0:
+            print('warning: %s does not reference %s' % (ENTRY_PAGE, name), file=sys.stderr)
+    data = page.encode('utf-8')
+    packed = gzip_bytes(data)
+    if write_files:
+        with open(os.path.join(out_dir, ENTRY_PAGE + '.gz'), 'wb') as f:
+            f.write(packed)
+    embedded.insert(0, ('/' + ENTRY_PAGE, CONTENT_TYPES['.html'], packed, False, content_hash(data)))
+    report.append((ENTRY_PAGE + '.gz', len(source.encode('utf-8')), len(data), len(packed)))
+
+    if args.embed:
+        write_embedded_header(args.embed, embedded)
+        print('wrote %s (%d assets)' % (args.embed, len(embedded)))
+
+    total_source = sum(r[1] for r in report)
+    total_packed = sum(r[3] for r in report)
+    print('%-28s %10s %10s %10s' % ('asset', 'source', 'minified', 'gzip'))
+    for name, raw, minified, compressed in report:
+        print('%-28s %10d %10d %10d' % (name, raw, minified, compressed))
+    print('%-28s %10d %10s %10d  (%.1fx smaller)' % ('total', total_source, '', total_packed,
+                                                    total_source / float(total_packed)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+"""
+http_load.py - HTTP load tool for the KC868-A16 controller
+
+Drives the web server with several concurrent keep-alive clients and reports
+the request rate and latency percentiles, to go with the counters the
+firmware keeps itself (HTTP STATUS on the serial console):
+
+    python3 tools/http_load.py --host 192.168.1.50
+    python3 tools/http_load.py --host 192.168.1.50 --clients 8 --duration 30
+    python3 tools/http_load.py --host 192.168.1.50 --path /api/status --path /
+    python3 tools/http_load.py --emulate
+
+Every client opens one connection and sends GET requests back to back,
+cycling through the --path list (default: the status endpoint, the page and
+a schedules page). With --etag a client sends back the ETag it got for a
+path, so the run measures 304 revalidation the way a browser does. The run
+reports, overall and per path:
+
+  * requests per second over the whole run
+  * min / p50 / p95 / p99 / max latency, from sending the request to the
+    last byte of the body
+  * status codes, connection errors and reconnects
+
+Only GET is used, so a run changes nothing on the controller. With
+--emulate the same run goes to a built-in server on 127.0.0.1 that hands
+API requests to a single worker (as the firmware's loop() does), which
+measures this machine only. Only the Python standard library is used.
+"""
+
+import argparse
+import http.client
+import http.server
+import queue
+import socket
+import sys
+import threading
+import time
+
+DEFAULT_PATHS = ['/api/status', '/', '/api/schedules?limit=10']
+
+
+def percentile(samples, fraction):
+    return samples[min(len(samples) - 1, int(len(samples) * fraction))]
+
+
+class Result:
+    def __init__(self):
+        self.latencies = {}
+        self.statuses = {}
+        self.errors = 0
+        self.reconnects = 0
+        self.lock = threading.Lock()
+
+    def add(self, path, status, latency):
+        with self.lock:
+            self.latencies.setdefault(path, []).append(latency)
+            self.statuses[status] = self.statuses.get(status, 0) + 1
+
+
+def client_loop(host, port, paths, deadline, count, timeout, use_etag, result, offset):
+    """One keep-alive connection; reconnects after an error"""
+    etags = {}
+    connection = None
+    sent = 0
+    index = offset
+    while time.monotonic() < deadline and (count == 0 or sent < count):
+        path = paths[index % len(paths)]
+        index += 1
+        sent += 1
+        headers = {'Connection': 'keep-alive'}
+        if use_etag and path in etags:
+            headers['If-None-Match'] = etags[path]
+        try:
+            if connection is None:
+                connection = http.client.HTTPConnection(host, port, timeout=timeout)
+            start = time.perf_counter()
+            connection.request('GET', path, headers=headers)
+            response = connection.getresponse()
+            response.read()
+            latency = time.perf_counter() - start
+            if response.getheader('ETag'):
+                etags[path] = response.getheader('ETag')
+            result.add(path, response.status, latency)
+            if response.getheader('Connection', '').lower() == 'close':
+                connection.close()
+                connection = None
+                with result.lock:
+                    result.reconnects += 1
+        except (OSError, http.client.HTTPException):
+            with result.lock:
+                result.errors += 1
+            if connection is not None:
+                connection.close()
+                connection = None
+    if connection is not None:
+        connection.close()
+
+
+class EmulatedHandler(http.server.BaseHTTPRequestHandler):
+    """Static files are answered in the connection thread; API requests wait
+    for the single worker, like the firmware's queue to loop()"""
+
+    protocol_version = 'HTTP/1.1'
+    disable_nagle_algorithm = True
+    jobs = None
+    handler_time = 0.0
+    body = b'{"status":"ok"}'
+    etag = '"emulated-1"'
+
+    def do_GET(self):
+        if self.path.startswith('/api/'):
+            done = threading.Event()
+            self.jobs.put(done)
+            done.wait()
+        if self.headers.get('If-None-Match') == self.etag:
+            self.send_response(304)
+            self.send_header('ETag', self.etag)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('ETag', self.etag)
+        self.send_header('Content-Length', str(len(self.body)))
+        self.end_headers()
+        self.wfile.write(self.body)
+
+    def log_message(self, *args):
+        pass
+
+
+def start_emulator(handler_time):
+    jobs = queue.Queue()
+
+    def worker():
+        while True:
+            done = jobs.get()
+            time.sleep(handler_time)
+            done.set()
+
+    EmulatedHandler.jobs = jobs
+    EmulatedHandler.handler_time = handler_time
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), EmulatedHandler)
+    server.daemon_threads = True
+    threading.Thread(target=worker, daemon=True).start()
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server.server_address[1]
+
+
+def report(name, samples):
+    samples = sorted(samples)
+    print('%-28s %7d  %8.2f %8.2f %8.2f %8.2f %8.2f' % (
+        name, len(samples), samples[0] * 1000, percentile(samples, 0.50) * 1000,
+        percentile(samples, 0.95) * 1000, percentile(samples, 0.99) * 1000, samples[-1] * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure request rate and latency of the controller web server')
+    parser.add_argument('--host', default='127.0.0.1', help='controller address')
+    parser.add_argument('--port', type=int, default=80, help='HTTP port (default: 80)')
+    parser.add_argument('--path', action='append', help='path to request, repeatable (default: %s)' %
+                        ', '.join(DEFAULT_PATHS))
+    parser.add_argument('--clients', type=int, default=4, help='concurrent connections (default: 4)')
+    parser.add_argument('--duration', type=float, default=10.0, help='run time in seconds (default: 10)')
+    parser.add_argument('--count', type=int, default=0,
+                        help='requests per client, 0 for the whole --duration (default: 0)')
+    parser.add_argument('--timeout', type=float, default=5.0, help='request timeout in seconds (default: 5.0)')
+    parser.add_argument('--etag', action='store_true', help='revalidate with If-None-Match like a browser')
+    parser.add_argument('--emulate', action='store_true', help='run against a built-in server on 127.0.0.1')
+    parser.add_argument('--handler-time', type=float, default=2.0,
+                        help='emulated API handler time in ms, --emulate only (default: 2.0)')
+    args = parser.parse_args()
+
+    paths = args.path or DEFAULT_PATHS
+    host, port = args.host, args.port
+    if args.emulate:
+        host, port = '127.0.0.1', start_emulator(args.handler_time / 1000.0)
+
+    try:
+        socket.create_connection((host, port), timeout=args.timeout).close()
+    except OSError as error:
+        print('cannot connect to %s:%d: %s' % (host, port, error), file=sys.stderr)
+        sys.exit(1)
+
+    result = Result()
+    deadline = time.monotonic() + args.duration
+    threads = [threading.Thread(target=client_loop, args=(host, port, paths, deadline, args.count, args.timeout,
+                                                          args.etag, result, i))
+               for i in range(args.clients)]
+    start = time.monotonic()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    everything = [latency for samples in result.latencies.values() for latency in samples]
+    if not everything:
+        print('no request completed (%d errors)' % result.errors, file=sys.stderr)
+        sys.exit(1)
+
+    print('%d clients, %.1f s: %.1f requests/s' % (args.clients, elapsed, len(everything) / elapsed))
+    print('%-28s %7s  %8s %8s %8s %8s %8s' % ('path', 'count', 'min ms', 'p50', 'p95', 'p99', 'max'))
+    for path in paths:
+        if path in result.latencies:
+            report(path, result.latencies[path])
+    report('all', everything)
+    print('status codes: %s' % ', '.join('%d x%d' % (status, n) for status, n in sorted(result.statuses.items())))
+    if result.errors or result.reconnects:
+        print('%d connection errors, %d reconnects' % (result.errors, result.reconnects))
+
+
+if __name__ == '__main__':
+    main()
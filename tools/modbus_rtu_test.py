@@ -0,0 +1,619 @@
+#!/usr/bin/env python3
+"""
+modbus_rtu_test.py - Modbus RTU slave test and benchmark for the KC868-A16
+controller
+
+Checks the controller's Modbus RTU slave on RS485 through a USB adapter and
+measures its request rate and latency:
+
+    python3 tools/modbus_rtu_test.py --port /dev/ttyUSB0 --baud 9600 --address 1
+    python3 tools/modbus_rtu_test.py --port /dev/ttyUSB0 --baud 19200 --parity even --count 1000
+    python3 tools/modbus_rtu_test.py --pty
+
+The controller must be in Modbus RTU mode (rs485 protocol "Modbus RTU") with
+the same line settings. The run:
+
+  * reads and writes with every supported function: FC1/FC2 (coils, discrete
+    inputs), FC3/FC4 (holding, input registers), FC5/FC6 (single coil and
+    register) and FC15/FC16 (multiple coils and registers), and checks each
+    reply byte for byte
+  * checks the exception codes: illegal function (1), illegal address (2)
+    and illegal value (3), and that a rejected FC16 or FC15 changes nothing
+  * checks framing: a frame with a bad CRC, one for another slave address and
+    a broadcast get no reply, a frame split by a gap between t1.5 and t3.5 is
+    dropped, and the next frame after each of them is answered again
+  * times --count FC3 reads and FC6 relay writes, one at a time as RTU
+    allows, and reports requests per second and min / p50 / p95 / p99 / max
+    latency from the first request byte to the last reply byte
+
+Relays and the debug register end as they started; the serial settings
+(address, baud, parity, stop bits) are only read. With --pty no hardware is
+needed: the run goes to a built-in slave emulator over a pseudo-terminal
+pair. It is a Python model of the register map and the firmware's framing
+(t1.5 / t3.5 from the line settings, writes answered after a loop() pass of
+--loop-time, replies taking their time on the wire); its figures measure
+this machine, only --port measures the firmware. Only the Python standard
+library is used (POSIX termios); the pty harness and the CRC come from
+binary_protocol_bench.py.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import termios
+import threading
+import time
+
+from binary_protocol_bench import BAUD_RATES, configure_raw, crc16, open_port, read_available, write_all
+
+FC_READ_COILS = 0x01
+FC_READ_DISCRETE_INPUTS = 0x02
+FC_READ_HOLDING = 0x03
+FC_READ_INPUT = 0x04
+FC_WRITE_COIL = 0x05
+FC_WRITE_REGISTER = 0x06
+FC_WRITE_COILS = 0x0F
+FC_WRITE_REGISTERS = 0x10
+
+EX_ILLEGAL_FUNCTION = 0x01
+EX_ILLEGAL_ADDRESS = 0x02
+EX_ILLEGAL_VALUE = 0x03
+EX_DEVICE_FAILURE = 0x04
+
+BROADCAST_ADDRESS = 0
+
+# Register map, as documented in the firmware
+COIL_COUNT = 16
+DISCRETE_INPUT_COUNT = 19
+INPUT_REGISTER_COUNT = 20
+HOLDING_REGISTER_COUNT = 6
+HR_RELAY_MASK = 0
+HR_ADDRESS = 1
+HR_BAUD = 2
+HR_PARITY = 3
+HR_STOP_BITS = 4
+HR_DEBUG = 5
+
+PARITIES = {'none': 0, 'odd': 1, 'even': 2}
+
+
+def line_timers(baud, parity, stop_bits):
+    """Character time, t1.5 and t3.5 in seconds, as the firmware derives them"""
+    bits = 1 + 8 + (1 if parity else 0) + stop_bits
+    char_time = bits / float(baud)
+    if baud > 19200:
+        return char_time, 0.00075, 0.00175
+    return char_time, char_time * 1.5, char_time * 3.5
+
+
+def rtu_frame(address, pdu):
+    body = bytes([address]) + pdu
+    return body + struct.pack('<H', crc16(body))
+
+
+def percentile(samples, fraction):
+    return samples[min(len(samples) - 1, int(len(samples) * fraction))]
+
+
+class ModbusDevice:
+    """Python model of the firmware's register map and processModbusPdu():
+    relays are the coils and holding register 0, inputs and analog values
+    are fixed, the serial settings registers hold the line settings"""
+
+    def __init__(self, address=1, baud=9600, parity=0, stop_bits=1):
+        self.relays = 0
+        self.inputs = 0x00A5
+        self.ht_inputs = 0x2
+        self.analog_raw = [0, 1024, 2048, 4095]
+        self.analog_mv = [0, 1250, 2500, 5000]
+        self.holding = [0, address, baud // 100, parity, stop_bits, 0]
+        self.lock = threading.Lock()
+
+    def discrete_input(self, index):
+        if index < 16:
+            return (self.inputs >> index) & 1
+        return (self.ht_inputs >> (index - 16)) & 1
+
+    def input_register(self, index):
+        uptime = int(time.monotonic()) & 0xFFFFFFFF
+        values = self.analog_raw + self.analog_mv + [215, 0xFFCE, 0, 450, 0, 0, self.inputs, self.ht_inputs,
+                                                     uptime >> 16, uptime & 0xFFFF, 180, 0]
+        return values[index]
+
+    def check_holding(self, address, value):
+        """0 or the exception code a write would get; changes nothing"""
+        if address == HR_RELAY_MASK:
+            return 0
+        if address == HR_ADDRESS:
+            return 0 if 1 <= value <= 247 else EX_ILLEGAL_VALUE
+        if address == HR_BAUD:
+            return 0 if value in (12, 24, 48, 96, 192, 384, 576, 1152) else EX_ILLEGAL_VALUE
+        if address == HR_PARITY:
+            return 0 if value <= 2 else EX_ILLEGAL_VALUE
+        if address == HR_STOP_BITS:
+            return 0 if 1 <= value <= 2 else EX_ILLEGAL_VALUE
+        if address == HR_DEBUG:
+            return 0 if value <= 1 else EX_ILLEGAL_VALUE
+        return EX_ILLEGAL_ADDRESS
+
+    def set_holding(self, address, value):
+        if address == HR_RELAY_MASK:
+            self.relays = value
+        else:
+            self.holding[address] = value
+
+    @staticmethod
+    def is_write(pdu):
+        return pdu[:1] in (bytes([FC_WRITE_COIL]), bytes([FC_WRITE_REGISTER]), bytes([FC_WRITE_COILS]),
+                           bytes([FC_WRITE_REGISTERS]))
+
+    def process(self, pdu):
+        """Response PDU for a request PDU (function code onwards)"""
+        with self.lock:
+            return self._process(pdu)
+
+    def _process(self, pdu):
+        def exception(code):
+            return bytes([function | 0x80, code])
+
+        function = pdu[0]
+        start = struct.unpack('>H', pdu[1:3])[0] if len(pdu) >= 3 else 0
+        quantity = struct.unpack('>H', pdu[3:5])[0] if len(pdu) >= 5 else 0
+
+        if function in (FC_READ_COILS, FC_READ_DISCRETE_INPUTS):
+            count = COIL_COUNT if function == FC_READ_COILS else DISCRETE_INPUT_COUNT
+            if len(pdu) != 5 or not 1 <= quantity <= 2000:
+                return exception(EX_ILLEGAL_VALUE)
+            if start + quantity > count:
+                return exception(EX_ILLEGAL_ADDRESS)
+            data = bytearray((quantity + 7) // 8)
+            for i in range(quantity):
+                bit = (self.relays >> (start + i)) & 1 if function == FC_READ_COILS else \
+                    self.discrete_input(start + i)
+                if bit:
+                    data[i // 8] |= 1 << (i % 8)
+            return bytes([function, len(data)]) + bytes(data)
+
+        if function in (FC_READ_HOLDING, FC_READ_INPUT):
+            count = HOLDING_REGISTER_COUNT if function == FC_READ_HOLDING else INPUT_REGISTER_COUNT
+            if len(pdu) != 5 or not 1 <= quantity <= 125:
+                return exception(EX_ILLEGAL_VALUE)
+            if start + quantity > count:
+                return exception(EX_ILLEGAL_ADDRESS)
+            if function == FC_READ_HOLDING:
+                values = [self.relays] + self.holding[1:]
+            else:
+                values = [self.input_register(i) for i in range(INPUT_REGISTER_COUNT)]
+            return bytes([function, quantity * 2]) + struct.pack('>%dH' % quantity,
+                                                                 *values[start:start + quantity])
+
+        if function == FC_WRITE_COIL:
+            if len(pdu) != 5 or quantity not in (0xFF00, 0x0000):
+                return exception(EX_ILLEGAL_VALUE)
+            if start >= COIL_COUNT:
+                return exception(EX_ILLEGAL_ADDRESS)
+            self.relays = self.relays | (1 << start) if quantity == 0xFF00 else self.relays & ~(1 << start)
+            return pdu[:5]
+
+        if function == FC_WRITE_REGISTER:
+            if len(pdu) != 5:
+                return exception(EX_ILLEGAL_VALUE)
+            if start >= HOLDING_REGISTER_COUNT:
+                return exception(EX_ILLEGAL_ADDRESS)
+            error = self.check_holding(start, quantity)
+            if error:
+                return exception(error)
+            self.set_holding(start, quantity)
+            return pdu[:5]
+
+        if function == FC_WRITE_COILS:
+            if len(pdu) < 6 or not 1 <= quantity <= 0x07B0 or pdu[5] != (quantity + 7) // 8 or \
+                    len(pdu) != 6 + pdu[5]:
+                return exception(EX_ILLEGAL_VALUE)
+            if start + quantity > COIL_COUNT:
+                return exception(EX_ILLEGAL_ADDRESS)
+            relays = self.relays
+            for i in range(quantity):
+                bit = 1 << (start + i)
+                relays = relays | bit if pdu[6 + i // 8] & (1 << (i % 8)) else relays & ~bit
+            self.relays = relays
+            return pdu[:5]
+
+        if function == FC_WRITE_REGISTERS:
+            if len(pdu) < 6 or not 1 <= quantity <= 123 or pdu[5] != quantity * 2 or len(pdu) != 6 + pdu[5]:
+                return exception(EX_ILLEGAL_VALUE)
+            if start + quantity > HOLDING_REGISTER_COUNT:
+                return exception(EX_ILLEGAL_ADDRESS)
+            values = struct.unpack('>%dH' % quantity, pdu[6:6 + quantity * 2])
+            for i, value in enumerate(values):
+                error = self.check_holding(start + i, value)
+                if error:
+                    return exception(error)
+            for i, value in enumerate(values):
+                self.set_holding(start + i, value)
+            return pdu[:5]
+
+        return exception(EX_ILLEGAL_FUNCTION)
+
+
+class RtuEmulator(threading.Thread):
+    """Slave side for --pty runs. Bytes are timed on arrival: a frame ends
+    after t3.5 of silence, a gap between t1.5 and t3.5 inside a frame drops
+    it, like the firmware's comm task. A pty transfers instantly, so the
+    request's and the reply's time on the wire are added as delays."""
+
+    def __init__(self, fd, device, address, baud, parity, stop_bits, loop_time):
+        super().__init__(daemon=True)
+        self.fd = fd
+        self.device = device
+        self.address = address
+        self.char_time, self.t15, self.t35 = line_timers(baud, parity, stop_bits)
+        self.loop_time = loop_time
+        self.framing_errors = 0
+        self.running = True
+
+    def answer(self, frame):
+        if len(frame) < 4 or struct.unpack('<H', frame[-2:])[0] != crc16(frame[:-2]):
+            return
+        if frame[0] not in (self.address, BROADCAST_ADDRESS):
+            return
+        pdu = frame[1:-2]
+        if ModbusDevice.is_write(pdu):
+            # Writes wait for loop(); reads are answered by the comm task
+            time.sleep(self.loop_time)
+        response = self.device.process(pdu)
+        if frame[0] == BROADCAST_ADDRESS:
+            return
+        reply = rtu_frame(self.address, response)
+        time.sleep(len(reply) * self.char_time)
+        write_all(self.fd, reply)
+
+    def run(self):
+        frame = bytearray()
+        discard = False
+        last = 0.0
+        while self.running:
+            data = read_available(self.fd, self.t35 if (frame or discard) else 0.05)
+            now = time.perf_counter()
+            if data:
+                if frame or discard:
+                    gap = now - last
+                    if gap >= self.t35:
+                        if not discard:
+                            self.answer(bytes(frame))
+                        frame.clear()
+                        discard = False
+                    elif gap >= self.t15 and not discard:
+                        self.framing_errors += 1
+                        discard = True
+                        frame.clear()
+                if not discard:
+                    frame += data
+                last = now
+            elif (frame or discard) and now - last >= self.t35:
+                # Quiet for t3.5: the frame is complete; its own bytes took
+                # their time on the wire before that
+                if not discard:
+                    time.sleep(len(frame) * self.char_time)
+                    self.answer(bytes(frame))
+                frame.clear()
+                discard = False
+
+
+class ModbusError(Exception):
+    pass
+
+
+class Master:
+    """One request at a time, t3.5 of silence between frames"""
+
+    def __init__(self, fd, address, baud, parity, stop_bits, timeout):
+        self.fd = fd
+        self.address = address
+        self.char_time, self.t15, self.t35 = line_timers(baud, parity, stop_bits)
+        self.timeout = timeout
+        self.last_reply = 0.0
+        self.last_byte = 0.0
+
+    def send_raw(self, data):
+        quiet = self.last_reply + self.t35 - time.perf_counter()
+        if quiet > 0:
+            time.sleep(quiet)
+        write_all(self.fd, data)
+
+    def receive_raw(self, timeout=None):
+        """Bytes of one reply (ended by t3.5 of silence), or b'' on timeout"""
+        deadline = time.perf_counter() + (self.timeout if timeout is None else timeout)
+        buffer = bytearray()
+        while True:
+            wait = self.t35 + 0.002 if buffer else deadline - time.perf_counter()
+            if wait <= 0:
+                break
+            data = read_available(self.fd, wait)
+            if not data:
+                if buffer:
+                    break
+                continue
+            buffer += data
+            self.last_byte = time.perf_counter()
+        self.last_reply = time.perf_counter()
+        return bytes(buffer)
+
+    def transact(self, pdu, address=None):
+        """Response PDU; raises ModbusError for an exception reply"""
+        address = self.address if address is None else address
+        self.send_raw(rtu_frame(address, pdu))
+        reply = self.receive_raw()
+        if not reply:
+            raise TimeoutError('no reply to function 0x%02x' % pdu[0])
+        if len(reply) < 5 or struct.unpack('<H', reply[-2:])[0] != crc16(reply[:-2]):
+            raise RuntimeError('corrupt reply %s' % reply.hex())
+        if reply[0] != address:
+            raise RuntimeError('reply from address %d, expected %d' % (reply[0], address))
+        response = reply[1:-2]
+        if response[0] == pdu[0] | 0x80:
+            raise ModbusError(response[1])
+        if response[0] != pdu[0]:
+            raise RuntimeError('reply to function 0x%02x for request 0x%02x' % (response[0], pdu[0]))
+        return response
+
+    def expect_exception(self, pdu, code):
+        try:
+            self.transact(pdu)
+        except ModbusError as error:
+            if error.args[0] != code:
+                raise RuntimeError('function 0x%02x: exception %d, expected %d' % (pdu[0], error.args[0], code))
+            return
+        raise RuntimeError('function 0x%02x: no exception, expected %d' % (pdu[0], code))
+
+    def expect_silence(self, frame, what):
+        self.send_raw(frame)
+        reply = self.receive_raw(max(0.1, self.timeout / 4))
+        if reply:
+            raise RuntimeError('%s was answered: %s' % (what, reply.hex()))
+
+    def read_bits(self, function, start, quantity):
+        response = self.transact(struct.pack('>BHH', function, start, quantity))
+        if response[1] != (quantity + 7) // 8 or len(response) != 2 + response[1]:
+            raise RuntimeError('function 0x%02x: byte count %d for %d bits' % (function, response[1], quantity))
+        return sum(((response[2 + i // 8] >> (i % 8)) & 1) << i for i in range(quantity))
+
+    def read_registers(self, function, start, quantity):
+        response = self.transact(struct.pack('>BHH', function, start, quantity))
+        if response[1] != quantity * 2 or len(response) != 2 + quantity * 2:
+            raise RuntimeError('function 0x%02x: byte count %d for %d registers' % (function, response[1], quantity))
+        return list(struct.unpack('>%dH' % quantity, response[2:]))
+
+    def write(self, pdu):
+        response = self.transact(pdu)
+        if response != pdu[:5]:
+            raise RuntimeError('function 0x%02x: echo %s, sent %s' % (pdu[0], response.hex(), pdu[:5].hex()))
+
+
+def write_coils_pdu(start, bits, quantity):
+    data = bytes(((bits >> (8 * i)) & 0xFF) for i in range((quantity + 7) // 8))
+    return struct.pack('>BHHB', FC_WRITE_COILS, start, quantity, len(data)) + data
+
+
+def write_registers_pdu(start, values):
+    return struct.pack('>BHHB%dH' % len(values), FC_WRITE_REGISTERS, start, len(values), len(values) * 2, *values)
+
+
+def check_functions(master, address):
+    holding = master.read_registers(FC_READ_HOLDING, 0, HOLDING_REGISTER_COUNT)
+    if holding[HR_ADDRESS] != address:
+        raise RuntimeError('holding register %d reads %d, the slave address is %d' %
+                           (HR_ADDRESS, holding[HR_ADDRESS], address))
+    relays = holding[HR_RELAY_MASK]
+
+    # FC6 and FC3/FC1 agree on the relay mask
+    master.write(struct.pack('>BHH', FC_WRITE_REGISTER, HR_RELAY_MASK, 0x8421))
+    assert master.read_registers(FC_READ_HOLDING, HR_RELAY_MASK, 1) == [0x8421]
+    assert master.read_bits(FC_READ_COILS, 0, COIL_COUNT) == 0x8421
+    assert master.read_bits(FC_READ_COILS, 4, 9) == (0x8421 >> 4) & 0x1FF
+
+    # FC5 single coils
+    master.write(struct.pack('>BHH', FC_WRITE_COIL, 1, 0xFF00))
+    master.write(struct.pack('>BHH', FC_WRITE_COIL, 0, 0x0000))
+    assert master.read_bits(FC_READ_COILS, 0, COIL_COUNT) == 0x8422
+
+    # FC15 multiple coils, not byte aligned
+    master.write(write_coils_pdu(3, 0b1010101011, 10))
+    expected = (0x8422 & ~(0x3FF << 3)) | (0b1010101011 << 3)
+    assert master.read_bits(FC_READ_COILS, 0, COIL_COUNT) == expected
+
+    # FC16 over the relay mask and the debug register
+    master.write(write_registers_pdu(HR_RELAY_MASK, [0x00F0]))
+    master.write(write_registers_pdu(HR_DEBUG, [holding[HR_DEBUG]]))
+    assert master.read_registers(FC_READ_HOLDING, 0, HOLDING_REGISTER_COUNT) == [0x00F0] + holding[1:]
+
+    # FC2 and FC4
+    inputs = master.read_bits(FC_READ_DISCRETE_INPUTS, 0, DISCRETE_INPUT_COUNT)
+    registers = master.read_registers(FC_READ_INPUT, 0, INPUT_REGISTER_COUNT)
+    if registers[14] != inputs & 0xFFFF or registers[15] != inputs >> 16:
+        raise RuntimeError('input registers 14/15 (0x%04x/0x%x) do not match the discrete inputs 0x%05x' %
+                           (registers[14], registers[15], inputs))
+    if any(value > 4095 for value in registers[0:4]):
+        raise RuntimeError('analog raw values out of range: %s' % registers[0:4])
+
+    print('functions: FC1 FC2 FC3 FC4 FC5 FC6 FC15 FC16 passed '
+          '(inputs 0x%05x, analog raw %s mV %s)' % (inputs, registers[0:4], registers[4:8]))
+    return relays, holding[HR_DEBUG]
+
+
+def check_exceptions(master):
+    master.expect_exception(bytes([0x07]), EX_ILLEGAL_FUNCTION)
+    master.expect_exception(bytes([0x2B, 0x0E, 0x01, 0x00]), EX_ILLEGAL_FUNCTION)
+
+    master.expect_exception(struct.pack('>BHH', FC_READ_COILS, 0, 17), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(struct.pack('>BHH', FC_READ_DISCRETE_INPUTS, 18, 2), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(struct.pack('>BHH', FC_READ_HOLDING, HOLDING_REGISTER_COUNT, 1), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(struct.pack('>BHH', FC_READ_INPUT, 19, 2), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(struct.pack('>BHH', FC_WRITE_COIL, COIL_COUNT, 0xFF00), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(struct.pack('>BHH', FC_WRITE_REGISTER, HOLDING_REGISTER_COUNT, 0), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(write_coils_pdu(15, 0b11, 2), EX_ILLEGAL_ADDRESS)
+    master.expect_exception(write_registers_pdu(5, [0, 0]), EX_ILLEGAL_ADDRESS)
+
+    master.expect_exception(struct.pack('>BHH', FC_READ_COILS, 0, 0), EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHH', FC_READ_HOLDING, 0, 126), EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHH', FC_WRITE_COIL, 0, 0x1234), EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHH', FC_WRITE_REGISTER, HR_DEBUG, 2), EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHH', FC_WRITE_REGISTER, HR_BAUD, 100), EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHHB', FC_WRITE_COILS, 0, 9, 1) + b'\xff', EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHHBH', FC_WRITE_REGISTERS, 0, 2, 2, 0), EX_ILLEGAL_VALUE)
+
+    # A rejected multi-register write changes nothing, not even the
+    # registers ahead of the bad value
+    before = master.read_registers(FC_READ_HOLDING, 0, HOLDING_REGISTER_COUNT)
+    master.expect_exception(write_registers_pdu(HR_STOP_BITS, [before[HR_STOP_BITS], 7]), EX_ILLEGAL_VALUE)
+    master.expect_exception(write_registers_pdu(HR_RELAY_MASK, [before[0] ^ 0xFFFF, before[1], 0]), EX_ILLEGAL_VALUE)
+    master.expect_exception(struct.pack('>BHHB', FC_WRITE_COILS, 0, COIL_COUNT, 1) + b'\xff', EX_ILLEGAL_VALUE)
+    after = master.read_registers(FC_READ_HOLDING, 0, HOLDING_REGISTER_COUNT)
+    if after != before:
+        raise RuntimeError('a rejected write changed the holding registers: %s -> %s' % (before, after))
+
+    print('exceptions: illegal function, address and value passed; rejected writes change nothing')
+
+
+def check_framing(master, address):
+    read = struct.pack('>BHH', FC_READ_HOLDING, HR_ADDRESS, 1)
+    frame = rtu_frame(address, read)
+
+    master.expect_silence(frame[:-1] + bytes([frame[-1] ^ 0x5A]), 'a frame with a bad CRC')
+    assert master.read_registers(FC_READ_HOLDING, HR_ADDRESS, 1) == [address]
+
+    other = address % 247 + 1
+    master.expect_silence(rtu_frame(other, read), 'a frame for address %d' % other)
+    assert master.read_registers(FC_READ_HOLDING, HR_ADDRESS, 1) == [address]
+
+    relays = master.read_registers(FC_READ_HOLDING, HR_RELAY_MASK, 1)[0]
+    master.expect_silence(rtu_frame(BROADCAST_ADDRESS, struct.pack('>BHH', FC_WRITE_REGISTER, HR_RELAY_MASK,
+                                                                     relays ^ 0x0001)), 'a broadcast')
+    if master.read_registers(FC_READ_HOLDING, HR_RELAY_MASK, 1)[0] != relays ^ 0x0001:
+        raise RuntimeError('the broadcast write was not carried out')
+    master.write(struct.pack('>BHH', FC_WRITE_REGISTER, HR_RELAY_MASK, relays))
+
+    # Two halves with a gap between t1.5 and t3.5: one frame with a hole in
+    # it, which the slave must drop
+    master.send_raw(frame[:4])
+    time.sleep((master.t15 + master.t35) / 2)
+    write_all(master.fd, frame[4:])
+    reply = master.receive_raw(max(0.1, master.timeout / 4))
+    if reply:
+        raise RuntimeError('a frame with a gap between t1.5 and t3.5 was answered: %s' % reply.hex())
+    assert master.read_registers(FC_READ_HOLDING, HR_ADDRESS, 1) == [address]
+
+    # Back to back with just over t3.5 in between: two frames, two replies
+    for _ in range(2):
+        master.read_registers(FC_READ_HOLDING, HR_ADDRESS, 1)
+
+    print('framing: bad CRC, other address, broadcast and t1.5-t3.5 gap passed '
+          '(t1.5 %.0f us, t3.5 %.0f us)' % (master.t15 * 1e6, master.t35 * 1e6))
+
+
+def bench(master, count, pdu_for):
+    samples = []
+    start = time.perf_counter()
+    for i in range(count):
+        pdu = pdu_for(i)
+        begin = time.perf_counter()
+        master.transact(pdu)
+        samples.append((master.last_byte - begin) * 1000.0)
+    elapsed = time.perf_counter() - start
+    return count / elapsed, sorted(samples)
+
+
+def report(name, rate, samples):
+    print('%-26s %8.1f  %7.2f %7.2f %7.2f %7.2f %7.2f' % (
+        name, rate, samples[0], percentile(samples, 0.5), percentile(samples, 0.95), percentile(samples, 0.99),
+        samples[-1]))
+
+
+def configure_line(fd, parity, stop_bits):
+    attrs = termios.tcgetattr(fd)
+    attrs[2] &= ~(termios.PARENB | termios.PARODD | termios.CSTOPB)
+    if parity:
+        attrs[2] |= termios.PARENB | (termios.PARODD if parity == 1 else 0)
+    if stop_bits == 2:
+        attrs[2] |= termios.CSTOPB
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Test and benchmark the KC868-A16 Modbus RTU slave')
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('--port', help='serial device of the RS485 adapter')
+    target.add_argument('--pty', action='store_true', help='use the built-in slave emulator over a pty pair')
+    parser.add_argument('--baud', type=int, default=9600, choices=sorted(BAUD_RATES),
+                        help='line speed, as configured on the controller (default: 9600)')
+    parser.add_argument('--parity', default='none', choices=sorted(PARITIES), help='parity (default: none)')
+    parser.add_argument('--stop-bits', type=int, default=1, choices=(1, 2), help='stop bits (default: 1)')
+    parser.add_argument('--address', type=int, default=1, help='slave address, 1-247 (default: 1)')
+    parser.add_argument('--count', type=int, default=500, help='timed requests per function (default: 500)')
+    parser.add_argument('--timeout', type=float, default=0.5, help='reply timeout in seconds (default: 0.5)')
+    parser.add_argument('--loop-time', type=float, default=1.0,
+                        help='emulated loop() pass before a write is answered in ms, --pty only (default: 1.0)')
+    parser.add_argument('--skip-framing', action='store_true',
+                        help='skip the framing checks (USB adapters with coarse latency timers blur the gaps)')
+    args = parser.parse_args()
+
+    if not 1 <= args.address <= 247:
+        parser.error('--address must be between 1 and 247')
+    parity = PARITIES[args.parity]
+
+    emulator = None
+    if args.pty:
+        master_fd, slave_fd = os.openpty()
+        configure_raw(slave_fd, None)
+        os.set_blocking(slave_fd, False)
+        device = ModbusDevice(args.address, args.baud, parity, args.stop_bits)
+        emulator = RtuEmulator(slave_fd, device, args.address, args.baud, parity, args.stop_bits,
+                               args.loop_time / 1000.0)
+        emulator.start()
+        fd = master_fd
+        configure_raw(fd, None)
+        os.set_blocking(fd, False)
+    else:
+        fd = open_port(args.port, args.baud)
+        configure_line(fd, parity, args.stop_bits)
+
+    master = Master(fd, args.address, args.baud, parity, args.stop_bits, args.timeout)
+    relays = debug = None
+    try:
+        relays, debug = check_functions(master, args.address)
+        check_exceptions(master)
+        if not args.skip_framing:
+            check_framing(master, args.address)
+
+        results = [
+            ('FC3 read 6 registers', bench(master, args.count,
+                                           lambda i: struct.pack('>BHH', FC_READ_HOLDING, 0, HOLDING_REGISTER_COUNT))),
+            ('FC4 read 20 registers', bench(master, args.count,
+                                            lambda i: struct.pack('>BHH', FC_READ_INPUT, 0, INPUT_REGISTER_COUNT))),
+            ('FC6 write relay mask', bench(master, args.count,
+                                           lambda i: struct.pack('>BHH', FC_WRITE_REGISTER, HR_RELAY_MASK,
+                                                                 1 << (i % 16)))),
+        ]
+        print('%-26s %8s  %7s %7s %7s %7s %7s' % ('request', 'req/s', 'min ms', 'p50', 'p95', 'p99', 'max'))
+        for name, (rate, samples) in results:
+            report(name, rate, samples)
+        if emulator and emulator.framing_errors:
+            print('emulator framing errors: %d' % emulator.framing_errors)
+    except (RuntimeError, TimeoutError, ModbusError, AssertionError) as error:
+        print('error: %s' % (error or 'reply did not match'), file=sys.stderr)
+        sys.exit(1)
+    finally:
+        try:
+            if relays is not None:
+                master.write(struct.pack('>BHH', FC_WRITE_REGISTER, HR_RELAY_MASK, relays))
+                master.write(struct.pack('>BHH', FC_WRITE_REGISTER, HR_DEBUG, debug))
+        except (RuntimeError, TimeoutError, ModbusError):
+            print('could not restore the relays and the debug register', file=sys.stderr)
+        if emulator:
+            emulator.running = False
+        os.close(fd)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,363 @@
+#!/usr/bin/env python3
+"""
+modbus_tcp_bench.py - Modbus TCP benchmark for the KC868-A16 controller
+
+Drives the controller's Modbus TCP server with several masters, each keeping
+a window of requests in flight on its connection, and reports the request
+rate and latency percentiles per connection and overall:
+
+    python3 tools/modbus_tcp_bench.py --host 192.168.1.50
+    python3 tools/modbus_tcp_bench.py --host 192.168.1.50 --connections 4 --window 2 --mode read
+    python3 tools/modbus_tcp_bench.py --emulate --window 8
+
+The server is off by default: enable it first with MODBUS TCP ON on the
+serial console (or the modbus_tcp comm config), which is saved. Every
+connection sends --count requests, keeping --window of them unanswered.
+--mode picks the requests:
+
+  * read: FC4 reads of the 20 input registers, which the firmware answers
+    in the AsyncTCP task
+  * write: FC5 writes of one coil per connection, which wait for loop()
+  * mixed (default): FC5 writes alternating with FC1 reads of the coils; the
+    read must see the connection's own write before it, which checks that a
+    read queued behind a write is not answered ahead of it
+
+The run reports requests per second, min / p50 / p95 / p99 / max latency
+(from sending a request to its reply, so it includes the wait behind the
+rest of the window), busy replies (exception 6, the loop() queue was full)
+and replies out of transaction order. The firmware holds 8 queued requests
+across all masters and 4 masters; a larger --connections x --window gets
+busy replies or dropped connections, which the run counts. Relays touched
+by write or mixed runs are set back at the end. With --emulate the run goes
+to a built-in server on 127.0.0.1 that answers reads in the connection
+thread and hands writes to a single worker taking --loop-time per pass, as
+the firmware's loop() does; it measures this machine only. Only the Python
+standard library is used.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import threading
+import time
+
+from modbus_rtu_test import (FC_READ_COILS, FC_READ_HOLDING, FC_READ_INPUT, FC_WRITE_COIL, FC_WRITE_REGISTER,
+                             HR_RELAY_MASK, INPUT_REGISTER_COUNT, ModbusDevice, percentile)
+
+MODBUS_TCP_PORT = 502
+MBAP_SIZE = 7
+EX_DEVICE_BUSY = 0x06
+
+# Firmware limits: masters, and requests waiting for loop()
+MAX_CLIENTS = 4
+QUEUE_DEPTH = 8
+
+
+def mbap(transaction, unit, pdu):
+    return struct.pack('>HHHB', transaction, 0, len(pdu) + 1, unit) + pdu
+
+
+def receive_adu(sock, buffer):
+    """One ADU from the stream; buffer keeps what arrived past it"""
+    while True:
+        if len(buffer) >= 6:
+            length = 6 + struct.unpack('>H', buffer[4:6])[0]
+            if len(buffer) >= length:
+                adu = bytes(buffer[:length])
+                del buffer[:length]
+                return adu
+        data = sock.recv(4096)
+        if not data:
+            raise ConnectionError('connection closed by the server')
+        buffer += data
+
+
+def connect(host, port, timeout):
+    sock = socket.create_connection((host, port), timeout=timeout)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return sock
+
+
+def transact(sock, unit, pdu):
+    """One request with nothing else in flight; response PDU"""
+    sock.sendall(mbap(1, unit, pdu))
+    adu = receive_adu(sock, bytearray())
+    response = adu[MBAP_SIZE:]
+    if response[0] & 0x80:
+        raise RuntimeError('function 0x%02x: exception %d' % (pdu[0], response[1]))
+    return response
+
+
+class Connection:
+    """One master: --count requests, --window of them in flight"""
+
+    def __init__(self, index, host, port, unit, mode, count, window, timeout):
+        self.index = index
+        self.host = host
+        self.port = port
+        self.unit = unit
+        self.mode = mode
+        self.count = count
+        self.window = window
+        self.timeout = timeout
+        self.coil = index % 16
+        self.latencies = []
+        self.busy = 0
+        self.out_of_order = 0
+        self.stale_reads = 0
+        self.error = None
+        self.elapsed = 0.0
+
+    def request(self, n, coil_state):
+        """Request PDU number n and the coil state after it, if it is a write"""
+        if self.mode == 'read':
+            return struct.pack('>BHH', FC_READ_INPUT, 0, INPUT_REGISTER_COUNT), coil_state
+        if self.mode == 'write' or n % 2 == 0:
+            coil_state = not coil_state
+            return struct.pack('>BHH', FC_WRITE_COIL, self.coil, 0xFF00 if coil_state else 0), coil_state
+        return struct.pack('>BHH', FC_READ_COILS, 0, 16), coil_state
+
+    def run(self):
+        try:
+            sock = connect(self.host, self.port, self.timeout)
+        except OSError as error:
+            self.error = str(error)
+            return
+        buffer = bytearray()
+        pending = []  # (transaction, function, sent at, coil state a write sets)
+        sent = 0
+        coil_state = False
+        coil_applied = None  # Unknown until a write of this run is answered
+        start = time.perf_counter()
+        try:
+            while sent < self.count or pending:
+                while sent < self.count and len(pending) < self.window:
+                    pdu, coil_state = self.request(sent, coil_state)
+                    transaction = (sent + 1) & 0xFFFF
+                    pending.append((transaction, pdu[0], time.perf_counter(), coil_state))
+                    sock.sendall(mbap(transaction, self.unit, pdu))
+                    sent += 1
+                adu = receive_adu(sock, buffer)
+                now = time.perf_counter()
+                transaction = struct.unpack('>H', adu[0:2])[0]
+                expected, function, sent_at, state = pending.pop(0)
+                if transaction != expected:
+                    # Modbus TCP masters may match by id, but this server
+                    # promises request order
+                    self.out_of_order += 1
+                    for i, entry in enumerate(pending):
+                        if entry[0] == transaction:
+                            pending[i] = (expected, function, sent_at, state)
+                            expected, function, sent_at, state = entry
+                            break
+                response = adu[MBAP_SIZE:]
+                self.latencies.append(now - sent_at)
+                if response[0] == function | 0x80:
+                    if response[1] != EX_DEVICE_BUSY:
+                        raise RuntimeError('function 0x%02x: exception %d' % (function, response[1]))
+                    # Not carried out, so coil_applied stays as it was
+                    self.busy += 1
+                elif function == FC_WRITE_COIL:
+                    coil_applied = state
+                elif function == FC_READ_COILS and coil_applied is not None and \
+                        bool(response[2 + self.coil // 8] & (1 << (self.coil % 8))) != coil_applied:
+                    # Replies come in request order, so every write sent
+                    # ahead of this read has been answered by now
+                    self.stale_reads += 1
+        except (OSError, ConnectionError, RuntimeError) as error:
+            self.error = str(error) or type(error).__name__
+        finally:
+            self.elapsed = time.perf_counter() - start
+            sock.close()
+
+
+class EmulatedServer:
+    """Reads are answered in the connection thread unless the connection
+    has requests queued; everything else waits for the single worker, which
+    drains the queue once per --loop-time pass. A full queue gets a busy
+    reply, or drops the master when a reply would overtake its queue"""
+
+    def __init__(self, loop_time):
+        self.device = ModbusDevice()
+        self.loop_time = loop_time
+        self.queue = []
+        self.queued = {}
+        self.lock = threading.Lock()
+        self.wake = threading.Condition(self.lock)
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(MAX_CLIENTS)
+        self.port = self.listener.getsockname()[1]
+        self.clients = 0
+        threading.Thread(target=self.accept, daemon=True).start()
+        threading.Thread(target=self.worker, daemon=True).start()
+
+    @staticmethod
+    def reply(master, adu, response):
+        sock, send_lock = master
+        with send_lock:
+            try:
+                sock.sendall(adu[0:4] + struct.pack('>H', len(response) + 1) + adu[6:7] + response)
+            except OSError:
+                pass
+
+    def accept(self):
+        while True:
+            sock, _ = self.listener.accept()
+            with self.lock:
+                if self.clients >= MAX_CLIENTS:
+                    sock.close()
+                    continue
+                self.clients += 1
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self.serve, args=((sock, threading.Lock()),), daemon=True).start()
+
+    def serve(self, master):
+        sock = master[0]
+        buffer = bytearray()
+        self.queued[master] = 0
+        try:
+            while True:
+                adu = receive_adu(sock, buffer)
+                pdu = adu[MBAP_SIZE:]
+                read = not ModbusDevice.is_write(pdu)
+                with self.lock:
+                    behind = self.queued[master] > 0
+                    if not read or behind:
+                        if len(self.queue) < QUEUE_DEPTH:
+                            self.queue.append((master, adu))
+                            self.queued[master] += 1
+                            self.wake.notify()
+                            continue
+                        if behind:
+                            raise ConnectionError('queue full behind queued requests')
+                if read:
+                    self.reply(master, adu, self.device.process(pdu))
+                else:
+                    self.reply(master, adu, bytes([pdu[0] | 0x80, EX_DEVICE_BUSY]))
+        except (OSError, ConnectionError):
+            pass
+        finally:
+            with self.lock:
+                self.clients -= 1
+            sock.close()
+
+    def worker(self):
+        while True:
+            with self.lock:
+                while not self.queue:
+                    self.wake.wait()
+            time.sleep(self.loop_time)
+            with self.lock:
+                batch, self.queue = self.queue, []
+            for master, adu in batch:
+                self.reply(master, adu, self.device.process(adu[MBAP_SIZE:]))
+                with self.lock:
+                    self.queued[master] -= 1
+
+
+def restore_relays(host, port, unit, relays, timeout):
+    """Set the relay mask back; retried while the queue still drains"""
+    error = None
+    for _ in range(5):
+        try:
+            with connect(host, port, timeout) as sock:
+                transact(sock, unit, struct.pack('>BHH', FC_WRITE_REGISTER, HR_RELAY_MASK, relays))
+            return
+        except (OSError, ConnectionError, RuntimeError) as failure:
+            error = failure
+            time.sleep(0.2)
+    print('could not restore the relays: %s' % error, file=sys.stderr)
+
+
+def report(name, count, elapsed, samples, busy, out_of_order):
+    samples = sorted(samples)
+    print('%-12s %7d %9.1f  %8.2f %8.2f %8.2f %8.2f %8.2f %6d %6d' % (
+        name, count, count / elapsed if elapsed else 0.0, samples[0] * 1000, percentile(samples, 0.50) * 1000,
+        percentile(samples, 0.95) * 1000, percentile(samples, 0.99) * 1000, samples[-1] * 1000, busy,
+        out_of_order))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure request rate and latency of the Modbus TCP server')
+    parser.add_argument('--host', default='127.0.0.1', help='controller address')
+    parser.add_argument('--port', type=int, default=MODBUS_TCP_PORT, help='Modbus TCP port (default: 502)')
+    parser.add_argument('--unit', type=int, default=1, help='unit id (default: 1)')
+    parser.add_argument('--connections', type=int, default=2, help='concurrent masters (default: 2)')
+    parser.add_argument('--window', type=int, default=4, help='requests in flight per connection (default: 4)')
+    parser.add_argument('--count', type=int, default=1000, help='requests per connection (default: 1000)')
+    parser.add_argument('--mode', default='mixed', choices=('read', 'write', 'mixed'),
+                        help='requests to send (default: mixed)')
+    parser.add_argument('--timeout', type=float, default=5.0, help='reply timeout in seconds (default: 5.0)')
+    parser.add_argument('--emulate', action='store_true', help='run against a built-in server on 127.0.0.1')
+    parser.add_argument('--loop-time', type=float, default=1.0,
+                        help='emulated loop() pass in ms, --emulate only (default: 1.0)')
+    args = parser.parse_args()
+
+    if args.window < 1 or args.connections < 1 or args.count < 1:
+        parser.error('--connections, --window and --count must be at least 1')
+    host, port = args.host, args.port
+    if args.emulate:
+        host, port = '127.0.0.1', EmulatedServer(args.loop_time / 1000.0).port
+    if args.connections * args.window > QUEUE_DEPTH and args.mode != 'read':
+        print('note: %d connections x window %d exceeds the firmware queue of %d; expect busy replies' %
+              (args.connections, args.window, QUEUE_DEPTH))
+
+    # The query connection is closed before the run, so it does not take
+    # one of the server's master slots
+    try:
+        with connect(host, port, args.timeout) as sock:
+            relays = transact(sock, args.unit, struct.pack('>BHH', FC_READ_HOLDING, HR_RELAY_MASK, 1))
+        relays = struct.unpack('>H', relays[2:4])[0]
+    except (OSError, ConnectionError, RuntimeError) as error:
+        print('cannot query %s:%d: %s (is the server enabled with MODBUS TCP ON?)' % (host, port, error),
+              file=sys.stderr)
+        sys.exit(1)
+
+    connections = [Connection(i, host, port, args.unit, args.mode, args.count, args.window, args.timeout)
+                   for i in range(args.connections)]
+    threads = [threading.Thread(target=connection.run) for connection in connections]
+    start = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+
+    if args.mode != 'read':
+        restore_relays(host, port, args.unit, relays, args.timeout)
+
+    everything = [latency for connection in connections for latency in connection.latencies]
+    if not everything:
+        print('no request completed', file=sys.stderr)
+        sys.exit(1)
+
+    print('%d connections, window %d, %s: %.1f requests/s' % (args.connections, args.window, args.mode,
+                                                            len(everything) / elapsed))
+    print('%-12s %7s %9s  %8s %8s %8s %8s %8s %6s %6s' % ('connection', 'count', 'req/s', 'min ms', 'p50', 'p95',
+                                                          'p99', 'max', 'busy', 'order'))
+    for connection in connections:
+        if connection.latencies:
+            report('#%d' % connection.index, len(connection.latencies), connection.elapsed, connection.latencies,
+                   connection.busy, connection.out_of_order)
+    report('all', len(everything), elapsed, everything, sum(c.busy for c in connections),
+           sum(c.out_of_order for c in connections))
+
+    failed = False
+    for connection in connections:
+        if connection.error:
+            print('connection #%d: %s after %d replies' % (connection.index, connection.error,
+                                                          len(connection.latencies)))
+            failed = True
+        if connection.stale_reads:
+            print('connection #%d: %d reads missed the write before them' % (connection.index,
+                                                                             connection.stale_reads))
+            failed = True
+    if failed or any(connection.out_of_order for connection in connections):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
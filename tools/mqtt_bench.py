@@ -0,0 +1,321 @@
+#!/usr/bin/env python3
+"""
+mqtt_bench.py - MQTT topic check and benchmark for the KC868-A16 controller
+
+Talks to the controller through an MQTT broker, for example a local
+mosquitto the board is configured to use (POST /api/mqtt):
+
+    mosquitto -p 1883 -v
+    python3 tools/mqtt_bench.py --host 127.0.0.1 --base kc868-a16/a1b2c3
+    python3 tools/mqtt_bench.py --host 127.0.0.1 --base kc868-a16/a1b2c3 --count 2000 --window 8
+    python3 tools/mqtt_bench.py --host 127.0.0.1 --emulate
+
+The run first checks that the board is online and has published a retained
+state for every relay, then measures:
+
+  * command latency - a TOGGLE on <base>/relay/<n>/set until the new state
+    arrives on <base>/relay/<n>, one command at a time (min / avg / p95 / max)
+  * throughput - commands kept --window deep in flight on different relays;
+    messages/s counts the commands and their state echoes through the broker
+
+Relays are toggled an even number of times per relay, so the board ends in
+the state it started in. With --emulate no board is needed: a built-in
+emulator serves the same topics through the broker, which measures the
+broker and this script. Only the Python standard library is used.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import threading
+import time
+
+CONNECT = 0x10
+CONNACK = 0x20
+PUBLISH = 0x30
+SUBSCRIBE = 0x82
+SUBACK = 0x90
+PINGREQ = 0xC0
+PINGRESP = 0xD0
+DISCONNECT = 0xE0
+
+RELAY_COUNT = 16
+
+
+def encode_length(length):
+    out = bytearray()
+    while True:
+        digit = length % 128
+        length //= 128
+        out.append(digit | (0x80 if length else 0))
+        if not length:
+            return bytes(out)
+
+
+def encode_string(text):
+    data = text.encode() if isinstance(text, str) else text
+    return struct.pack('>H', len(data)) + data
+
+
+class Connection:
+    """Minimal MQTT 3.1.1 client, QoS 0; messages go to on_message(topic, payload)
+    from a reader thread"""
+
+    def __init__(self, host, port, client_id, on_message, will=None, keep_alive=60):
+        self.sock = socket.create_connection((host, port), timeout=5)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.on_message = on_message
+        self.send_lock = threading.Lock()
+        self.packet_id = 0
+        self.subacks = threading.Semaphore(0)
+        self.running = True
+
+        flags = 0x02
+        payload = encode_string(client_id)
+        if will:
+            flags |= 0x04 | 0x20
+            payload += encode_string(will[0]) + encode_string(will[1])
+        body = encode_string('MQTT') + bytes([4, flags]) + struct.pack('>H', keep_alive) + payload
+        self.sock.sendall(bytes([CONNECT]) + encode_length(len(body)) + body)
+
+        header, body = self.read_packet()
+        if header & 0xF0 != CONNACK or len(body) < 2 or body[1] != 0:
+            raise RuntimeError('broker refused the connection')
+
+        self.sock.settimeout(None)
+        self.reader = threading.Thread(target=self.read_loop, daemon=True)
+        self.reader.start()
+        self.pinger = threading.Thread(target=self.ping_loop, args=(keep_alive,), daemon=True)
+        self.pinger.start()
+
+    def read_exact(self, length):
+        data = bytearray()
+        while len(data) < length:
+            chunk = self.sock.recv(length - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return bytes(data)
+
+    def read_packet(self):
+        header = self.read_exact(1)[0]
+        length = 0
+        shift = 0
+        while True:
+            digit = self.read_exact(1)[0]
+            length |= (digit & 0x7F) << shift
+            shift += 7
+            if not digit & 0x80:
+                break
+        return header, self.read_exact(length)
+
+    def read_loop(self):
+        try:
+            while self.running:
+                header, body = self.read_packet()
+                kind = header & 0xF0
+                if kind == PUBLISH:
+                    topic_length = struct.unpack('>H', body[:2])[0]
+                    offset = 2 + topic_length + (2 if (header >> 1) & 3 else 0)
+                    self.on_message(body[2:2 + topic_length].decode(), body[offset:])
+                elif kind == SUBACK:
+                    self.subacks.release()
+        except (EOFError, OSError):
+            pass
+
+    def ping_loop(self, keep_alive):
+        while self.running:
+            time.sleep(keep_alive / 2)
+            if self.running:
+                self.send(bytes([PINGREQ, 0]))
+
+    def send(self, packet):
+        with self.send_lock:
+            self.sock.sendall(packet)
+
+    def publish(self, topic, payload, retain=False):
+        data = payload.encode() if isinstance(payload, str) else payload
+        body = encode_string(topic) + data
+        self.send(bytes([PUBLISH | (1 if retain else 0)]) + encode_length(len(body)) + body)
+
+    def subscribe(self, topic_filter, timeout=5.0):
+        self.packet_id = self.packet_id % 0xFFFF + 1
+        body = struct.pack('>H', self.packet_id) + encode_string(topic_filter) + b'\x00'
+        self.send(bytes([SUBSCRIBE]) + encode_length(len(body)) + body)
+        if not self.subacks.acquire(timeout=timeout):
+            raise RuntimeError('no SUBACK for ' + topic_filter)
+
+    def close(self):
+        self.running = False
+        try:
+            self.send(bytes([DISCONNECT, 0]))
+            self.sock.close()
+        except OSError:
+            pass
+
+
+class Emulator:
+    """Stands in for the board: relay set topics in, retained relay states out"""
+
+    def __init__(self, host, port, base):
+        self.base = base
+        self.relays = [False] * RELAY_COUNT
+        self.conn = Connection(host, port, 'kc868-a16-emulator', self.on_message,
+                               will=(base + '/status', 'offline'))
+        self.conn.subscribe(base + '/relay/+/set')
+        self.conn.subscribe(base + '/relays/set')
+        self.conn.publish(base + '/status', 'online', retain=True)
+        for relay in range(RELAY_COUNT):
+            self.publish_relay(relay)
+
+    def publish_relay(self, relay):
+        self.conn.publish('%s/relay/%d' % (self.base, relay + 1), 'ON' if self.relays[relay] else 'OFF', retain=True)
+
+    def on_message(self, topic, payload):
+        value = payload.decode(errors='replace').strip().upper()
+        parts = topic[len(self.base) + 1:].split('/')
+        if parts == ['relays', 'set']:
+            mask = int(value, 0)
+            changed = [r for r in range(RELAY_COUNT) if self.relays[r] != bool(mask & (1 << r))]
+            for relay in changed:
+                self.relays[relay] = not self.relays[relay]
+                self.publish_relay(relay)
+        elif len(parts) == 3 and parts[0] == 'relay' and parts[2] == 'set':
+            relay = int(parts[1]) - 1
+            if 0 <= relay < RELAY_COUNT:
+                state = {'ON': True, '1': True, 'TRUE': True, 'OFF': False, '0': False, 'FALSE': False}
+                new_state = not self.relays[relay] if value == 'TOGGLE' else state.get(value)
+                if new_state is not None and new_state != self.relays[relay]:
+                    self.relays[relay] = new_state
+                    self.publish_relay(relay)
+
+
+class Bench:
+    """Subscribes to the board's status and relay state topics and pairs state
+    updates with the commands that caused them"""
+
+    def __init__(self, host, port, base, timeout):
+        self.base = base
+        self.timeout = timeout
+        self.cond = threading.Condition()
+        self.status = None
+        self.relays = {}
+        self.updates = [0] * RELAY_COUNT
+        self.received = 0
+        self.conn = Connection(host, port, 'kc868-a16-bench-%d' % (time.time() * 1000 % 100000), self.on_message)
+
+    def on_message(self, topic, payload):
+        sub = topic[len(self.base) + 1:]
+        with self.cond:
+            self.received += 1
+            if sub == 'status':
+                self.status = payload.decode(errors='replace')
+            elif sub.startswith('relay/') and sub.count('/') == 1:
+                relay = int(sub[6:]) - 1
+                if 0 <= relay < RELAY_COUNT:
+                    self.relays[relay] = payload.decode(errors='replace')
+                    self.updates[relay] += 1
+            self.cond.notify_all()
+
+    def wait_for(self, predicate, timeout=None):
+        with self.cond:
+            return self.cond.wait_for(predicate, timeout or self.timeout)
+
+    def check_topics(self):
+        # Both subscriptions deliver the retained state at once
+        self.conn.subscribe(self.base + '/status')
+        self.conn.subscribe(self.base + '/relay/+')
+        if not self.wait_for(lambda: self.status is not None):
+            raise RuntimeError('nothing retained on %s/status - is the board connected to this broker?' % self.base)
+        if self.status != 'online':
+            raise RuntimeError('%s/status is "%s"' % (self.base, self.status))
+        if not self.wait_for(lambda: len(self.relays) == RELAY_COUNT):
+            raise RuntimeError('retained state for relays %s missing' %
+                               [r + 1 for r in range(RELAY_COUNT) if r not in self.relays])
+        print('board online, retained relay states: %s' %
+              ''.join('1' if self.relays[r] == 'ON' else '0' for r in range(RELAY_COUNT)))
+
+    def toggle(self, relay):
+        self.conn.publish('%s/relay/%d/set' % (self.base, relay + 1), 'TOGGLE')
+
+    def bench_latency(self, count, relay):
+        samples = []
+        for _ in range(count + count % 2):
+            with self.cond:
+                expected = self.updates[relay] + 1
+            start = time.perf_counter()
+            self.toggle(relay)
+            if not self.wait_for(lambda: self.updates[relay] >= expected):
+                raise RuntimeError('no state update for relay %d within %.1f s' % (relay + 1, self.timeout))
+            samples.append((time.perf_counter() - start) * 1000.0)
+        samples.sort()
+        return samples
+
+    def bench_throughput(self, count, window):
+        # An even number of toggles on each relay
+        per_relay = -(-count // window)
+        per_relay += per_relay % 2
+        count = per_relay * window
+        with self.cond:
+            start_updates = list(self.updates)
+        outstanding = [0] * window
+        start = time.perf_counter()
+
+        # Keep one command per relay in flight, refilling a slot once its echo arrives
+        while True:
+            with self.cond:
+                for slot in range(window):
+                    done = self.updates[slot] - start_updates[slot]
+                    if outstanding[slot] == done and outstanding[slot] < per_relay:
+                        outstanding[slot] += 1
+                        self.toggle(slot)
+                if all(self.updates[s] - start_updates[s] == per_relay for s in range(window)):
+                    break
+                if not self.cond.wait(self.timeout):
+                    raise RuntimeError('state updates stopped after %d of %d commands' % (sum(
+                        self.updates[s] - start_updates[s] for s in range(window)), count))
+        elapsed = time.perf_counter() - start
+        return count / elapsed, 2 * count / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check the MQTT topics of the KC868-A16 and benchmark them')
+    parser.add_argument('--host', default='127.0.0.1', help='broker address (default: 127.0.0.1)')
+    parser.add_argument('--port', type=int, default=1883, help='broker port (default: 1883)')
+    parser.add_argument('--base', default='kc868-a16/emulator',
+                        help='base topic of the board, see GET /api/mqtt (default: kc868-a16/emulator)')
+    parser.add_argument('--count', type=int, default=500, help='commands per run (default: 500)')
+    parser.add_argument('--window', type=int, default=8,
+                        help='commands in flight for the throughput run, one per relay (default: 8)')
+    parser.add_argument('--relay', type=int, default=1, help='relay toggled by the latency run (default: 1)')
+    parser.add_argument('--timeout', type=float, default=2.0, help='state update timeout in seconds (default: 2.0)')
+    parser.add_argument('--emulate', action='store_true', help='serve the topics from a built-in board emulator')
+    args = parser.parse_args()
+
+    if not 1 <= args.window <= RELAY_COUNT or not 1 <= args.relay <= RELAY_COUNT:
+        parser.error('--window and --relay must be between 1 and %d' % RELAY_COUNT)
+
+    emulator = Emulator(args.host, args.port, args.base) if args.emulate else None
+    bench = Bench(args.host, args.port, args.base, args.timeout)
+    try:
+        bench.check_topics()
+
+        samples = bench.bench_latency(args.count, args.relay - 1)
+        p95 = samples[min(len(samples) - 1, int(len(samples) * 0.95))]
+        print('command latency over %d toggles (ms): min %.2f  avg %.2f  p95 %.2f  max %.2f' % (
+            len(samples), samples[0], sum(samples) / len(samples), p95, samples[-1]))
+
+        commands, messages = bench.bench_throughput(args.count, args.window)
+        print('throughput, %d in flight: %.0f commands/s, %.0f messages/s' % (args.window, commands, messages))
+    except RuntimeError as error:
+        print('error: %s' % error, file=sys.stderr)
+        sys.exit(1)
+    finally:
+        bench.conn.close()
+        if emulator:
+            emulator.conn.close()
+
+
+if __name__ == '__main__':
+    main()
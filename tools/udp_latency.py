@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+"""
+udp_latency.py - UDP control port latency tool for the KC868-A16 controller
+
+Measures the UDP control path the firmware offers for LAN interlocks. Enable
+it first with POST /api/udp {"enabled": true, "beacon": true}, then:
+
+    python3 tools/udp_latency.py --host 192.168.1.50
+    python3 tools/udp_latency.py --host 192.168.1.50 --count 5000 --relay 16
+    python3 tools/udp_latency.py --emulate
+
+Each datagram holds one frame of the binary control protocol (see
+binary_protocol_bench.py for the layout and opcodes). The run:
+
+  * checks the port with PING
+  * checks idempotency: a TOGGLE sent twice with the same request id must
+    switch the relay once (the second copy is answered from the replay cache)
+  * times --count TOGGLE requests from send to acknowledgement, retrying a
+    lost datagram with the same request id, and reports min / p50 / p95 /
+    p99 / max plus the number of retries
+  * listens to the multicast state beacon (--group, --beacon-port) during the
+    run and reports how long a relay change took to show up in a beacon and
+    how many beacons were lost (sequence gaps)
+
+The relay ends in the state it started in. With --emulate the same checks run
+against a built-in emulator on 127.0.0.1, which measures this machine only.
+Only the Python standard library is used.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import threading
+import time
+
+from binary_protocol_bench import (Emulator as SerialEmulator, FrameParser, build_frame, OP_PING,
+                                   OP_READ_RELAYS, OP_TOGGLE_RELAYS, PROTOCOL_VERSION, STATUS_OK)
+
+DEFAULT_PORT = 5020
+DEFAULT_GROUP = '239.255.68.16'
+DEFAULT_BEACON_PORT = 5021
+
+# Beacon: the firmware's binary state frame
+STATE_TYPE = 0x01
+STATE_SIZE = 66
+REPLAY_DEPTH = 8
+
+
+def percentile(samples, fraction):
+    return samples[min(len(samples) - 1, int(len(samples) * fraction))]
+
+
+class Emulator(threading.Thread):
+    """Device side for --emulate: the serial emulator's request handling, with
+    the firmware's per-peer replay cache and the state beacon"""
+
+    def __init__(self, port, group, beacon_port, interval):
+        super().__init__(daemon=True)
+        self.device = SerialEmulator(None, 115200, 0)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(('127.0.0.1', port))
+        self.sock.settimeout(0.01)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton('127.0.0.1'))
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        self.beacon = (group, beacon_port)
+        self.interval = interval
+        self.replays = {}
+        self.sequence = 0
+        self.last_beacon = 0.0
+        self.beacon_relays = None
+        self.running = True
+
+    def send_beacon(self):
+        self.sequence += 1
+        frame = bytearray(STATE_SIZE)
+        frame[0] = STATE_TYPE
+        frame[1] = 1
+        struct.pack_into('<IH', frame, 2, self.sequence, self.device.relays)
+        self.sock.sendto(bytes(frame), self.beacon)
+        self.last_beacon = time.monotonic()
+        self.beacon_relays = self.device.relays
+
+    def run(self):
+        while self.running:
+            try:
+                data, peer = self.sock.recvfrom(512)
+                if FrameParser().feed(data):
+                    key = (data[2], data[-2:])
+                    cache = self.replays.setdefault(peer, [])
+                    response = next((r for k, r in cache if k == key), None)
+                    if response is None:
+                        response = self.device.frame_reply(data[1:-2])
+                        cache.append((key, response))
+                        del cache[:-REPLAY_DEPTH]
+                    self.sock.sendto(response, peer)
+            except socket.timeout:
+                pass
+            if self.device.relays != self.beacon_relays or time.monotonic() - self.last_beacon >= self.interval:
+                self.send_beacon()
+
+
+class BeaconListener(threading.Thread):
+    """Records (arrival time, sequence, relay mask) of every beacon"""
+
+    def __init__(self, group, port, interface):
+        super().__init__(daemon=True)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(('', port))
+        membership = socket.inet_aton(group) + socket.inet_aton(interface)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+        self.sock.settimeout(0.2)
+        self.cond = threading.Condition()
+        self.beacons = []
+        self.running = True
+
+    def run(self):
+        while self.running:
+            try:
+                data = self.sock.recv(512)
+            except socket.timeout:
+                continue
+            if len(data) != STATE_SIZE or data[0] != STATE_TYPE:
+                continue
+            sequence, relays = struct.unpack_from('<IH', data, 2)
+            with self.cond:
+                self.beacons.append((time.perf_counter(), sequence, relays))
+                self.cond.notify_all()
+
+    def wait_for_relays(self, mask, since, timeout):
+        """Arrival time of the first beacon after 'since' showing the mask"""
+        deadline = time.perf_counter() + timeout
+        with self.cond:
+            while True:
+                for arrival, _, relays in self.beacons:
+                    if arrival >= since and relays == mask:
+                        return arrival
+                remaining = deadline - time.perf_counter()
+                if remaining <= 0 or not self.cond.wait(remaining):
+                    return None
+
+    def lost(self):
+        with self.cond:
+            sequences = [s for _, s, _ in self.beacons]
+        return sum(b - a - 1 for a, b in zip(sequences, sequences[1:]) if b > a), len(sequences)
+
+
+class Client:
+    def __init__(self, host, port, timeout, retries):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.connect((host, port))
+        self.timeout = timeout
+        self.retries = retries
+        self.next_id = 0
+        self.retried = 0
+
+    def request(self, opcode, payload=b'', request_id=None):
+        """Send until acknowledged; returns (status, payload, request id)"""
+        if request_id is None:
+            request_id = self.next_id
+            self.next_id = (self.next_id + 1) & 0xFF
+        frame = build_frame(request_id, opcode, payload)
+
+        for attempt in range(self.retries + 1):
+            if attempt:
+                self.retried += 1
+            self.sock.send(frame)
+            deadline = time.monotonic() + self.timeout
+            while True:
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    break
+                self.sock.settimeout(remaining)
+                try:
+                    data = self.sock.recv(512)
+                except socket.timeout:
+                    break
+                except ConnectionRefusedError:
+                    raise RuntimeError('port closed - is UDP control enabled (POST /api/udp)?')
+                for response_id, response_opcode, body in FrameParser().feed(data):
+                    if response_id == request_id and response_opcode == opcode:
+                        return body[0], body[1:], request_id
+        raise RuntimeError('no answer to request %d after %d tries' % (request_id, self.retries + 1))
+
+    def relays(self):
+        status, payload, _ = self.request(OP_READ_RELAYS)
+        return struct.unpack('<H', payload)[0]
+
+
+def check_idempotent(client, bit):
+    before = client.relays()
+    _, payload, request_id = client.request(OP_TOGGLE_RELAYS, struct.pack('<H', bit))
+    status, repeat, _ = client.request(OP_TOGGLE_RELAYS, struct.pack('<H', bit), request_id)
+    after = client.relays()
+    client.request(OP_TOGGLE_RELAYS, struct.pack('<H', bit))
+    if after != before ^ bit or repeat != payload:
+        raise RuntimeError('repeated request %d was carried out twice' % request_id)
+    print('idempotency: repeated TOGGLE answered from the replay cache')
+
+
+def bench(client, count, bit, beacons, timeout):
+    samples = []
+    beacon_samples = []
+    for _ in range(count + count % 2):
+        start = time.perf_counter()
+        status, payload, _ = client.request(OP_TOGGLE_RELAYS, struct.pack('<H', bit))
+        samples.append((time.perf_counter() - start) * 1000.0)
+        if status != STATUS_OK:
+            raise RuntimeError('TOGGLE failed with status %d' % status)
+        if beacons:
+            arrival = beacons.wait_for_relays(struct.unpack('<H', payload)[0], start, timeout)
+            if arrival is not None:
+                beacon_samples.append((arrival - start) * 1000.0)
+    return sorted(samples), sorted(beacon_samples)
+
+
+def report(name, samples):
+    print('%-22s min %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f ms' % (
+        name, samples[0], percentile(samples, 0.5), percentile(samples, 0.95), percentile(samples, 0.99),
+        samples[-1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure the KC868-A16 UDP control port latency')
+    parser.add_argument('--host', default='127.0.0.1', help='controller address')
+    parser.add_argument('--port', type=int, default=DEFAULT_PORT, help='command port (default: %d)' % DEFAULT_PORT)
+    parser.add_argument('--group', default=DEFAULT_GROUP, help='beacon group (default: %s)' % DEFAULT_GROUP)
+    parser.add_argument('--beacon-port', type=int, default=DEFAULT_BEACON_PORT,
+                        help='beacon port (default: %d)' % DEFAULT_BEACON_PORT)
+    parser.add_argument('--interface', default='0.0.0.0',
+                        help='local address to receive the beacon on (default: any)')
+    parser.add_argument('--no-beacon', action='store_true', help='do not listen to the beacon')
+    parser.add_argument('--count', type=int, default=1000, help='timed TOGGLE requests (default: 1000)')
+    parser.add_argument('--relay', type=int, default=1, help='relay to toggle, 1-16 (default: 1)')
+    parser.add_argument('--timeout', type=float, default=0.1, help='retry timeout in seconds (default: 0.1)')
+    parser.add_argument('--retries', type=int, default=5, help='retries per request (default: 5)')
+    parser.add_argument('--emulate', action='store_true', help='run against a built-in emulator on 127.0.0.1')
+    args = parser.parse_args()
+
+    if not 1 <= args.relay <= 16:
+        parser.error('--relay must be between 1 and 16')
+    bit = 1 << (args.relay - 1)
+
+    emulator = None
+    if args.emulate:
+        args.host = '127.0.0.1'
+        args.interface = '127.0.0.1'
+        emulator = Emulator(args.port, args.group, args.beacon_port, 1.0)
+        emulator.start()
+
+    beacons = None
+    if not args.no_beacon:
+        beacons = BeaconListener(args.group, args.beacon_port, args.interface)
+        beacons.start()
+
+    client = Client(args.host, args.port, args.timeout, args.retries)
+    try:
+        status, payload, _ = client.request(OP_PING)
+        if status != STATUS_OK or payload[:1] != bytes([PROTOCOL_VERSION]):
+            raise RuntimeError('unexpected PING reply: status %d, %r' % (status, payload))
+
+        check_idempotent(client, bit)
+
+        client.retried = 0
+        samples, beacon_samples = bench(client, args.count, bit, beacons, max(args.timeout, 0.05))
+        report('command -> ack', samples)
+        print('%d requests, %d retried' % (len(samples), client.retried))
+
+        if beacons:
+            lost, received = beacons.lost()
+            if beacon_samples:
+                report('command -> beacon', beacon_samples)
+            print('%d beacons received, %d lost (sequence gaps), %d changes not seen in a beacon' % (
+                received, lost, len(samples) - len(beacon_samples)))
+    except RuntimeError as error:
+        print('error: %s' % error, file=sys.stderr)
+        sys.exit(1)
+    finally:
+        if beacons:
+            beacons.running = False
+        if emulator:
+            emulator.running = False
+
+
+if __name__ == '__main__':
+    main()